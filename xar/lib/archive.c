@@ -48,6 +48,12 @@
 #include <errno.h>
 #include <limits.h>
 #include <sys/stat.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 #include <arpa/inet.h> /* for ntoh{l,s} */
 #include <inttypes.h>  /* for PRIu64 */
 #include <libxml/xmlwriter.h>
@@ -63,6 +69,16 @@
 #include "signature.h"
 #include "arcmod.h"
 #include "io.h"
+#include "workers.h"
+#include "buffers.h"
+#include "pathindex.h"
+#include "arena.h"
+#include "tocwalk.h"
+#include "toccache.h"
+#include "repack.h"
+#include "heaporder.h"
+#include "intern.h"
+#include "heap.h"
 #include "util.h"
 #include "subdoc.h"
 #include "darwinattr.h"
@@ -89,8 +105,21 @@
 #define xmlDictCleanup()	/* function doesn't exist in older API */
 #endif
 
-static int32_t xar_unserialize(xar_t x);
-void xar_serialize(xar_t x, const char *file);
+/* Where xar_toc_serialize sends the TOC: it is deflated, with the zstream of
+ * the archive, and checksummed as the writer produces it. */
+struct __xar_tocout_t {
+	xar_t x;
+	int fd;                 /* file the compressed TOC is written to */
+	unsigned char *buf;     /* output of deflate */
+	size_t size;            /* size of buf */
+	uint64_t ungztoc;       /* bytes of xml */
+	uint64_t gztoc;         /* bytes written to fd */
+	int align;              /* gztoc modulo 4 wanted, or -1 */
+	int err;
+};
+
+static int32_t xar_unserialize(xar_t x, struct __xar_walk_t *w);
+static int32_t xar_toc_serialize(xar_t x, struct __xar_tocout_t *out);
 
 /* xar_new
  * Returns: newly allocated xar_t structure
@@ -102,13 +131,20 @@ static xar_t xar_new() {
 	ret = malloc(sizeof(struct __xar_t));
 	if(!ret) return NULL;
 	memset(XAR(ret), 0, sizeof(struct __xar_t));
+	XAR(ret)->owner = XAR_OWNER_ARCHIVE;
 	XAR(ret)->readbuf_len = XAR_DEFAULT_BUFFER_SIZE;
 	XAR(ret)->readbuf = malloc(XAR(ret)->readbuf_len);
 	if(!XAR(ret)->readbuf) {
 		free((void *)ret);
 		return NULL;
 	}
+	if( xar_intern_retain() != 0 ) {
+		free(XAR(ret)->readbuf);
+		free((void *)ret);
+		return NULL;
+	}
 	XAR(ret)->offset = 0;
+	XAR(ret)->append_fd = -1;
 
 	XAR(ret)->zs.zalloc = Z_NULL;
 	XAR(ret)->zs.zfree = Z_NULL;
@@ -116,13 +152,20 @@ static xar_t xar_new() {
 	XAR(ret)->ino_hash = xmlHashCreate(0);
 	XAR(ret)->link_hash = xmlHashCreate(0);
 	XAR(ret)->csum_hash = xmlHashCreate(0);
+	XAR(ret)->xsum_hash = xmlHashCreate(0);
+	XAR(ret)->prekey_hash = xmlHashCreate(0);
 	XAR(ret)->subdocs = NULL;
 	XAR(ret)->toc_ctx = EVP_MD_CTX_create();
 	if(!XAR(ret)->toc_ctx) {
+		xar_intern_release();
 		free(XAR(ret)->readbuf);
 		free((void *)ret);
 		return NULL;
 	}
+	/* without a pool the buffers are simply malloc'd and freed */
+	XAR(ret)->buffers = xar_buffers_new();
+	/* without it XAR_OPT_AUTOBUDGET is judged on each file alone */
+	XAR(ret)->trials = calloc(1, sizeof(struct __xar_trials_t));
 
 	return ret;
 }
@@ -203,18 +246,191 @@ static int32_t xar_parse_header(xar_t x) {
 	return 0;
 }
 
+/* xar_map
+ * x: archive opened for reading
+ * Summary: maps the archive into memory for XAR_OPEN_MMAP.  Leaves map
+ * unset when the archive is not a regular file or cannot be mapped, so
+ * it is simply read from the descriptor.
+ */
+static void xar_map(xar_t x) {
+#ifdef HAVE_MMAP
+	struct stat sb;
+	void *map;
+
+	if( fstat(XAR(x)->fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size <= 0 )
+		return;
+	if( (uint64_t)sb.st_size != (uint64_t)(size_t)sb.st_size )
+		return;
+	map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, XAR(x)->fd, 0);
+	if( map == MAP_FAILED )
+		return;
+	XAR(x)->map = map;
+	XAR(x)->maplen = (size_t)sb.st_size;
+#else
+	(void)x;
+#endif
+}
+
+/* xar_toc_skip
+ * x: archive whose TOC has been read up to its files
+ * Returns: 0 or -1 if the TOC could not be read
+ * Summary: when xar_unserialize left the files for xar_toc_load, reads
+ * the rest of the compressed TOC into the checksum without inflating it.
+ */
+static int32_t xar_toc_skip(xar_t x) {
+	ssize_t r;
+	size_t len;
+
+	if( XAR(x)->toclazy != XAR_TOC_PENDING ) {
+		XAR(x)->toclazy = XAR_TOC_LOADED;
+		return 0;
+	}
+	/* a mapped TOC is checksummed whole by toc_read_callback */
+	if( XAR(x)->map )
+		return 0;
+	while( XAR(x)->toc_count < XAR(x)->header.toc_length_compressed ) {
+		len = XAR_DEFAULT_BUFFER_SIZE;
+		if( len > XAR(x)->header.toc_length_compressed - XAR(x)->toc_count )
+			len = (size_t)(XAR(x)->header.toc_length_compressed - XAR(x)->toc_count);
+		r = xar_read_fd(XAR(x)->fd, XAR(x)->readbuf, len);
+		if( r <= 0 )
+			return -1;
+		if( XAR(x)->docksum )
+			EVP_DigestUpdate(XAR(x)->toc_ctx, XAR(x)->readbuf, r);
+		XAR(x)->toc_count += r;
+	}
+	return 0;
+}
+
+/* xar_toc_check
+ * x: archive whose TOC has just been read
+ * Returns: 0 if the TOC is consistent with the header and its checksum
+ * matches, -1 otherwise
+ * Summary: the checks xar_open makes once the TOC has been read.  Leaves
+ * the archive positioned at the start of the heap.
+ */
+static int32_t xar_toc_check(xar_t x) {
+	unsigned char toccksum[HASH_MAX_MD_SIZE];
+	unsigned char cval[HASH_MAX_MD_SIZE];
+	unsigned int tlen;
+	int cksum_match;
+	const char *cksum_style;
+	const char *value;
+	uint64_t offset;
+	uint64_t length;
+
+	/* check for inconsistency between checksum style in header, 
+	 * and the one described in the TOC; otherwise, you can flip 
+	 * the header bit to XAR_CKSUM_NONE, and nothing will ever 
+	 * verify that the TOC matches the checksum stored in the 
+	 * heap, and the signature check will pass on a modified 
+	 * file! <rdar://problem/6134714>
+	 */
+	cksum_match = 0;
+	cksum_style = xar_attr_get(XAR_FILE(x), "checksum", "style");
+	switch(XAR(x)->header.cksum_alg) {
+		case XAR_CKSUM_NONE:
+			cksum_match = (cksum_style == NULL || strcmp(cksum_style, XAR_OPT_VAL_NONE) == 0);
+			break;
+		case XAR_CKSUM_MD5:
+		case XAR_CKSUM_SHA1:
+		case XAR_CKSUM_OTHER:
+			cksum_match = (cksum_style != NULL && strcmp(cksum_style, XAR(x)->header.toc_cksum_name) == 0);
+			break;
+		default:
+			cksum_match = 0;
+			break;
+	}
+	if( !cksum_match ) {
+		fprintf(stderr, "Checksum style mismatch!\n");
+		return -1;
+	}
+	
+	/* also check for consistency between the checksum style and 
+	 * the existence (or not) of signatures: since the signature 
+	 * is signing the checksum, we must have a checksum to verify 
+	 * that the TOC has not been modified <rdar://problem/6134714>
+	 */
+	if( xar_signature_first(x) != NULL && XAR(x)->header.cksum_alg == XAR_CKSUM_NONE ) {
+		fprintf(stderr, "Checksum/signature mismatch!\n");
+		return -1;
+	}
+		
+	if( !XAR(x)->docksum )
+		return 0;
+
+	EVP_DigestFinal_ex(XAR(x)->toc_ctx, toccksum, &tlen);
+
+	offset = 0;
+	length = tlen;
+	if( xar_prop_get( XAR_FILE(x) , "checksum/offset", &value) == 0 ) {
+		errno = 0;
+		offset = (uint64_t)strtoull(value, (char **)NULL, 10);
+		if( errno != 0 ) {
+			return -1;
+		}
+	} else if( xar_signature_first(x) != NULL ) {
+		/* All archives that have a signature also specify the location
+		 * of the checksum.  If the location isn't specified, error out.
+		 */
+		return -1;
+	}
+
+	XAR(x)->heap_offset = (off_t)(xar_get_heap_offset(x) + offset);
+	if( lseek(XAR(x)->fd, XAR(x)->heap_offset, SEEK_SET) == -1 ) {
+		return -1;
+	}
+	if( xar_prop_get( XAR_FILE(x) , "checksum/size", &value) == 0 ) {
+		errno = 0;
+		length = (uint64_t)strtoull(value, (char **)NULL, 10);
+		if( errno != 0 ) {
+			return -1;
+		}
+	} else if( xar_signature_first(x) != NULL ) {
+		return -1;
+	}
+	if( length != tlen ) {
+		return -1;
+	}
+
+	xar_read_fd(XAR(x)->fd, cval, tlen);
+	XAR(x)->heap_offset += tlen;
+	if( memcmp(cval, toccksum, tlen) != 0 ) {
+		fprintf(stderr, "Checksums do not match!\n");
+		return -1;
+	}
+	memcpy(XAR(x)->toc_digest, cval, tlen);
+	XAR(x)->toc_digest_len = tlen;
+	return 0;
+}
+
+static xar_t xar_open_append(const char *file);
+static void xar_opt_push(xar_t x, const char *option, const char *value);
+
 /* xar_open
  * file: filename to open
- * flags: flags on how to open the file.  0 for readonly, !0 for read/write
+ * flags: flags on how to open the file.  0 for readonly, !0 for read/write,
+ * XAR_OPEN_MMAP may be or'ed into 0 to read from a mapping of the file,
+ * XAR_OPEN_TOCWALK to leave the TOC to xar_toc_walk, XAR_OPEN_LAZY to
+ * leave the files of the TOC to xar_toc_load, XAR_OPEN_APPEND may be
+ * or'ed into !0 to add to the files of an existing archive
  * Returns: allocated and initialized xar structure with an open
  * file descriptor to the target xar file.  If the xarchive is opened
  * for writing, the file is created, and a heap file is opened.
  */
 xar_t xar_open(const char *file, int32_t flags) {
 	xar_t ret;
-
+	int32_t mapped = flags & XAR_OPEN_MMAP;
+	int32_t tocwalk = flags & XAR_OPEN_TOCWALK;
+	int32_t lazy = flags & (XAR_OPEN_LAZY | XAR_OPEN_TOCCACHE);
+	int32_t append = flags & XAR_OPEN_APPEND;
+
+	flags &= ~(XAR_OPEN_MMAP | XAR_OPEN_TOCWALK | XAR_OPEN_LAZY | XAR_OPEN_TOCCACHE | XAR_OPEN_APPEND);
+	if( flags && append )
+		return xar_open_append(file);
 	ret = xar_new();
 	if( !ret ) return NULL;
+	XAR(ret)->toccache = (lazy & XAR_OPEN_TOCCACHE) != 0;
 	if( !file )
 		file = "-";
 	XAR(ret)->filename = strdup(file);
@@ -235,6 +451,7 @@ xar_t xar_open(const char *file, int32_t flags) {
 			free(XAR(ret)->dirname);
 			free((void *)XAR(ret)->filename);
 			free(XAR(ret));
+			xar_intern_release();
 			return NULL;
 		}
 		free(tmp1);
@@ -252,6 +469,7 @@ xar_t xar_open(const char *file, int32_t flags) {
 			free(XAR(ret)->dirname);
 			free((void *)XAR(ret)->filename);
 			free(XAR(ret));
+			xar_intern_release();
 			return NULL;
 		}
 		unlink(tmp4);
@@ -264,6 +482,7 @@ xar_t xar_open(const char *file, int32_t flags) {
 			free(XAR(ret)->dirname);
 			free((void *)XAR(ret)->filename);
 			free(XAR(ret));
+			xar_intern_release();
 			return NULL;
 		}
 
@@ -276,15 +495,7 @@ xar_t xar_open(const char *file, int32_t flags) {
 		xar_opt_set(ret, XAR_OPT_COMPRESSION, XAR_OPT_VAL_GZIP);
 		xar_opt_set(ret, XAR_OPT_FILECKSUM, XAR_OPT_VAL_SHA1);
 	} else {
-		unsigned char toccksum[HASH_MAX_MD_SIZE];
-		unsigned char cval[HASH_MAX_MD_SIZE];
-		unsigned int tlen;
 		const EVP_MD *md;
-		int cksum_match;
-		const char *cksum_style;
-		const char *value;
-		uint64_t offset;
-		uint64_t length;
 
 		if( strcmp(file, "-") == 0 )
 			XAR(ret)->fd = 0;
@@ -302,6 +513,8 @@ xar_t xar_open(const char *file, int32_t flags) {
 			xar_close(ret);
 			return NULL;
 		}
+		if( mapped )
+			xar_map(ret);
 
 		if( xar_parse_header(ret) != 0 ) {
 			xar_close(ret);
@@ -337,103 +550,133 @@ xar_t xar_open(const char *file, int32_t flags) {
 			break;
 		};
 
-		if( xar_unserialize(ret) != 0 ) {
-			xar_close(ret);
-			return NULL;
-		}
-
-		/* check for inconsistency between checksum style in header, 
-		 * and the one described in the TOC; otherwise, you can flip 
-		 * the header bit to XAR_CKSUM_NONE, and nothing will ever 
-		 * verify that the TOC matches the checksum stored in the 
-		 * heap, and the signature check will pass on a modified 
-		 * file! <rdar://problem/6134714>
-		 */
-		cksum_match = 0;
-		cksum_style = xar_attr_get(XAR_FILE(ret), "checksum", "style");
-		switch(XAR(ret)->header.cksum_alg) {
-			case XAR_CKSUM_NONE:
-				cksum_match = (cksum_style == NULL || strcmp(cksum_style, XAR_OPT_VAL_NONE) == 0);
-				break;
-			case XAR_CKSUM_MD5:
-			case XAR_CKSUM_SHA1:
-			case XAR_CKSUM_OTHER:
-				cksum_match = (cksum_style != NULL && strcmp(cksum_style, XAR(ret)->header.toc_cksum_name) == 0);
-				break;
-			default:
-				cksum_match = 0;
-				break;
-		}
-		if( !cksum_match ) {
-			fprintf(stderr, "Checksum style mismatch!\n");
-			xar_close(ret);
-			return NULL;
-		}
-		
-		/* also check for consistency between the checksum style and 
-		 * the existence (or not) of signatures: since the signature 
-		 * is signing the checksum, we must have a checksum to verify 
-		 * that the TOC has not been modified <rdar://problem/6134714>
-		 */
-		if( xar_signature_first(ret) != NULL && XAR(ret)->header.cksum_alg == XAR_CKSUM_NONE ) {
-			fprintf(stderr, "Checksum/signature mismatch!\n");
-			xar_close(ret);
-			return NULL;
-		}
-			
-		if( !XAR(ret)->docksum )
+		/* xar_toc_walk reads the TOC later */
+		if( tocwalk ) {
+			XAR(ret)->tocwalk = 1;
 			return ret;
+		}
 
-		EVP_DigestFinal_ex(XAR(ret)->toc_ctx, toccksum, &tlen);
+		/* the files are read by xar_toc_load, which reads the TOC
+		 * again and so needs an archive that can be rewound */
+		if( lazy && (XAR(ret)->map || (lseek(XAR(ret)->fd, 0, SEEK_CUR) != -1)) )
+			XAR(ret)->toclazy = XAR_TOC_OPENING;
 
-		offset = 0;
-		length = tlen;
-		if( xar_prop_get( XAR_FILE(ret) , "checksum/offset", &value) == 0 ) {
-			errno = 0;
-			offset = (uint64_t)strtoull(value, (char **)NULL, 10);
-			if( errno != 0 ) {
-				xar_close(ret);
-				return NULL;
-			}
-		} else if( xar_signature_first(ret) != NULL ) {
-			/* All archives that have a signature also specify the location
-			 * of the checksum.  If the location isn't specified, error out.
-			 */
+		/* the TOC is freed all at once when the archive is closed */
+		XAR(ret)->arena = xar_arena_new();
+		if( (xar_unserialize(ret, NULL) != 0) || (xar_toc_skip(ret) != 0) || (xar_toc_check(ret) != 0) ) {
 			xar_close(ret);
 			return NULL;
 		}
+		if( XAR(ret)->toccache && (XAR(ret)->toclazy == XAR_TOC_LOADED) )
+			xar_toccache_save(ret);
+	}
 
-		XAR(ret)->heap_offset = (off_t)(xar_get_heap_offset(ret) + offset);
-		if( lseek(XAR(ret)->fd, XAR(ret)->heap_offset, SEEK_SET) == -1 ) {
-			xar_close(ret);
-			return NULL;
-		}
-		if( xar_prop_get( XAR_FILE(ret) , "checksum/size", &value) == 0 ) {
-			errno = 0;
-			length = (uint64_t)strtoull(value, (char **)NULL, 10);
-			if( errno != 0 ) {
-				xar_close(ret);
-				return NULL;
-			}
-		} else if( xar_signature_first(ret) != NULL ) {
-			xar_close(ret);
-			return NULL;
-		}
-		if( length != tlen ) {
-			xar_close(ret);
-			return NULL;
-		}
+	return ret;
+}
 
-		xar_read_fd(XAR(ret)->fd, cval, tlen);
-		XAR(ret)->heap_offset += tlen;
-		if( memcmp(cval, toccksum, tlen) != 0 ) {
-			fprintf(stderr, "Checksums do not match!\n");
-			xar_close(ret);
-			return NULL;
+/* xar_append_ids
+ * Summary: makes the ids of files added to an archive opened with
+ * XAR_OPEN_APPEND follow those of the files read from it.
+ */
+static void xar_append_ids(xar_t x, xar_file_t f) {
+	const char *id;
+	uint64_t n;
+
+	for( ; f; f = XAR_FILE(f)->next ) {
+		id = xar_attr_get(f, NULL, "id");
+		if( id ) {
+			n = strtoull(id, NULL, 10);
+			if( n > XAR(x)->last_fileid )
+				XAR(x)->last_fileid = n;
 		}
+		xar_append_ids(x, XAR_FILE(f)->children);
 	}
+}
+
+/* xar_open_append
+ * file: archive to add files to
+ * Returns: the archive read from file, opened for writing, or NULL
+ * Summary: for XAR_OPEN_APPEND.  The files of the archive are read as
+ * for READ, and its heap becomes the start of the heap of a new archive
+ * that xar_close renames over it, see heap.c.  Only the TOC and the data
+ * of the files added are written, at the cost of the space of any data
+ * they replace.  The signatures of the archive sign its old TOC, so they
+ * are dropped, and the TOC keeps its checksum algorithm so that the data
+ * of the files keep their offsets.
+ */
+static xar_t xar_open_append(const char *file) {
+	xar_t ret;
+	struct stat sb;
+	const char *value;
+	char *tmp1, *tmp2;
+	off_t start;
+	int fd = -1;
+
+	if( !file || !*file || (strcmp(file, "-") == 0) )
+		return NULL;
+	ret = xar_open(file, READ);
+	if( !ret )
+		return NULL;
 
+	/* the TOC checksum has to start the heap, which is how it is written */
+	start = (off_t)xar_get_heap_offset(ret);
+	if( (XAR(ret)->header.cksum_alg != XAR_CKSUM_NONE) && !XAR(ret)->docksum )
+		goto FAIL;
+	if( (xar_prop_get(XAR_FILE(ret), "checksum/offset", &value) == 0) && (strtoull(value, NULL, 10) != 0) )
+		goto FAIL;
+	if( (fstat(XAR(ret)->fd, &sb) != 0) || !S_ISREG(sb.st_mode) || (sb.st_size < start + (off_t)XAR(ret)->toc_digest_len) )
+		goto FAIL;
+
+	tmp1 = strdup(file);
+	if( !tmp1 )
+		goto FAIL;
+	XAR(ret)->dirname = strdup(dirname(tmp1));
+	free(tmp1);
+	if( !XAR(ret)->dirname )
+		goto FAIL;
+	if( asprintf(&XAR(ret)->append_path, "%s/xar.append.XXXXXX", XAR(ret)->dirname) == -1 ) {
+		XAR(ret)->append_path = NULL;
+		goto FAIL;
+	}
+	fd = mkstemp(XAR(ret)->append_path);
+	if( fd < 0 )
+		goto FAIL;
+	XAR(ret)->append_fd = XAR(ret)->fd;
+	XAR(ret)->fd = fd;
+	fchmod(fd, sb.st_mode & 07777);
+	if( asprintf(&tmp2, "%s/xar.heap.XXXXXX", XAR(ret)->dirname) == -1 )
+		goto FAIL;
+	fd = mkstemp(tmp2);
+	if( fd >= 0 )
+		unlink(tmp2);
+	free(tmp2);
+	if( fd < 0 )
+		goto FAIL;
+
+	if( XAR(ret)->signatures ) {
+		xar_signature_remove(XAR(ret)->signatures);
+		XAR(ret)->signatures = NULL;
+		xar_prop_unset(XAR_FILE(ret), "signature-creation-time");
+	}
+	XAR(ret)->append_off = start + (off_t)XAR(ret)->toc_digest_len;
+	XAR(ret)->append_len = sb.st_size - XAR(ret)->append_off;
+	XAR(ret)->heap_offset = sb.st_size - start;
+	XAR(ret)->heap_len = sb.st_size - start;
+	XAR(ret)->rfcformat = XAR(ret)->header.cksum_alg == XAR_CKSUM_OTHER;
+	xar_append_ids(ret, XAR(ret)->files);
+
+	/* from here on xar_close writes the archive */
+	inflateEnd(&XAR(ret)->zs);
+	deflateInit(&XAR(ret)->zs, Z_BEST_COMPRESSION);
+	XAR(ret)->heap_fd = fd;
+	xar_opt_push(ret, XAR_OPT_TOCCKSUM, XAR(ret)->docksum ? XAR(ret)->header.toc_cksum_name : XAR_OPT_VAL_NONE);
+	xar_opt_push(ret, XAR_OPT_COMPRESSION, XAR_OPT_VAL_GZIP);
+	xar_opt_push(ret, XAR_OPT_FILECKSUM, XAR_OPT_VAL_SHA1);
 	return ret;
+
+FAIL:
+	xar_close(ret);
+	return NULL;
 }
 
 /* xar_check_force_rfc6713
@@ -466,7 +709,7 @@ static void xar_check_force_rfc6713(xar_t x)
 int xar_close(xar_t x) {
 	xar_attr_t a;
 	xar_file_t f;
-	int ret, retval = 0;
+	int retval = 0;
 
 	if (XAR(x)->heap_fd == -2)
 		goto CLOSE_BAIL;
@@ -474,13 +717,12 @@ int xar_close(xar_t x) {
 	/* If we're creating an archive */
 	if( XAR(x)->heap_fd != -1 ) {
 		char *tmpser;
-		void *rbuf, *wbuf = NULL;
-		int fd, r, off, wbytes, rbytes;
-		long rsize, wsize;
-		z_stream zs;
-		uint64_t ungztoc, gztoc;
+		void *rbuf;
+		int r, off, rbytes;
+		long rsize;
+		struct __xar_tocout_t out;
 		unsigned char chkstr[HASH_MAX_MD_SIZE];
-		int tocfd;
+		int tocfd = -1;
 		char timestr[128];
 		struct tm tmptm;
 		time_t t;
@@ -488,6 +730,16 @@ int xar_close(xar_t x) {
 		const char *opt;
 		size_t cnt;
 		ssize_t wcnt;
+		off_t blk;
+		int cloned = 0;
+
+		/* all queued file data must be in the heap before the toc is written */
+		xar_workers_free(x);
+		xar_repack_free(x);
+		if( XAR(x)->repack_failed || (xar_heap_order(x) != 0) ) {
+			retval = -1;
+			goto CLOSE_BAIL;
+		}
 
 		tmpser = (char *)xar_opt_get(x, XAR_OPT_TOCCKSUM);
 		/* If no checksum type is specified, default to sha1 */
@@ -531,33 +783,12 @@ int xar_close(xar_t x) {
 		strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%SZ", &tmptm);
 		xar_prop_set(XAR_FILE(x), "creation-time", timestr);
 
-		/* serialize the toc to a tmp file */
-		if (asprintf(&tmpser, "%s/xar.toc.XXXXXX", XAR(x)->dirname) == -1) {
-			retval = -1;
-			goto CLOSE_BAIL;
-		}
-		fd = mkstemp(tmpser);
-		xar_serialize(x, tmpser);
-		unlink(tmpser);
-		free(tmpser);
-		if (asprintf(&tmpser, "%s/xar.toc.XXXXXX", XAR(x)->dirname) == -1) {
-			retval = -1;
-			goto CLOSE_BAIL;
-		}
-		tocfd = mkstemp(tmpser);
-		unlink(tmpser);
-		free(tmpser);
-		
-	
-		/* read the toc from the tmp file, compress it, and write it
-	 	* out to the archive.
-	 	*/
-		rsize = wsize = XAR_DEFAULT_BUFFER_SIZE;
+		rsize = XAR_DEFAULT_BUFFER_SIZE;
 		opt = xar_opt_get(x, XAR_OPT_RSIZE);
 		if ( opt ) {
 		  rsize = strtol(opt, NULL, 0);
 		  if ( ((rsize == LONG_MAX) || (rsize == LONG_MIN)) && (errno == ERANGE) ) {
-		    rsize = wsize;
+		    rsize = XAR_DEFAULT_BUFFER_SIZE;
 		  }
 		  if (rsize < XAR_MINIMUM_BUFFER_SIZE)
 		    rsize = XAR_MINIMUM_BUFFER_SIZE;
@@ -568,73 +799,64 @@ int xar_close(xar_t x) {
 			retval = -1;
 			goto CLOSE_BAIL;
 		}
-		zs.zalloc = Z_NULL;
-		zs.zfree = Z_NULL;
-		zs.opaque = Z_NULL;
-		deflateInit(&zs, Z_BEST_COMPRESSION);
-	
-		ungztoc = gztoc = 0;
-	
-		while(1) {
-			r = (int)read(fd, rbuf, rsize);
-			if( (r < 0) && (errno == EINTR) )
-				continue;
-			if( r == 0 )
-				break;
-	
-			ungztoc += r;
-	
-			zs.avail_in = r;
-			zs.next_in = (void *)rbuf;
-			zs.next_out = NULL;
-			zs.avail_out = 0;
-
-			wsize = rsize/2;
-	
-			off = 0;
-			while( zs.avail_in != 0 ) {
-				wsize *= 2;
-				wbuf = realloc(wbuf, wsize);
-
-				zs.next_out = ((unsigned char *)wbuf) + off;
-				zs.avail_out = (unsigned)wsize - off;
 
-				ret = deflate(&zs, Z_SYNC_FLUSH);
-				off = (int)(wsize - zs.avail_out);
+		/* The header, which records the lengths of the toc, goes in
+		 * front of it.  Leave room for it and compress the toc
+		 * straight into the archive, or into a tmp file when the
+		 * archive cannot be rewound, such as stdout, or when the heap
+		 * is in the archive already and room has to be made for it,
+		 * or will be cloned into it and the header padded to a block.
+		 */
+		cnt = cksum_alg == XAR_CKSUM_OTHER ? sizeof(xar_header_ex_t) : sizeof(xar_header_t);
+		if( XAR(x)->append_path )
+			blk = xar_heap_append_cloneable(x);
+		else
+			blk = XAR(x)->heap_plan ? 0 : xar_heap_cloneable(x);
+		if( XAR(x)->heap_start || blk || (lseek(XAR(x)->fd, (off_t)cnt, SEEK_SET) == -1) ) {
+			if (asprintf(&tmpser, "%s/xar.toc.XXXXXX", XAR(x)->dirname) == -1) {
+				retval = -1;
+				goto CLOSEEND;
+			}
+			tocfd = mkstemp(tmpser);
+			if( tocfd >= 0 )
+				unlink(tmpser);
+			free(tmpser);
+			if( tocfd < 0 ) {
+				xar_err_new(x);
+				xar_err_set_string(x, "Error creating temporary toc file");
+				retval = -1;
+				goto CLOSEEND;
 			}
-	
-			wbytes = off;
-			off = 0;
-			do {
-				r = (int)write(tocfd, ((char *)wbuf)+off, wbytes-off);
-				if( (r < 0) && (errno == EINTR) )
-					continue;
-				if( r < 0 ) {
-					xar_err_new(x);
-					xar_err_set_string(x, "Error closing xar archive");
-					retval = -1;
-					goto CLOSEEND;
-				}
-				if( XAR(x)->docksum )
-					EVP_DigestUpdate(XAR(x)->toc_ctx, ((char*)wbuf)+off, r);
-				off += r;
-				gztoc += r;
-			} while( off < wbytes );
-
 		}
 
-		zs.next_in = NULL;
-		zs.avail_in = 0;
-		zs.next_out = wbuf;
-		zs.avail_out = (unsigned)wsize;
-
-		deflate(&zs, Z_FINISH);
-		r = (int)write(tocfd, wbuf, wsize - zs.avail_out);
-		gztoc += r;
-		if( XAR(x)->docksum )
-			EVP_DigestUpdate(XAR(x)->toc_ctx, wbuf, r);
-		
-		deflateEnd(&zs);
+		memset(&out, 0, sizeof(out));
+		out.x = x;
+		out.fd = tocfd >= 0 ? tocfd : XAR(x)->fd;
+		out.buf = rbuf;
+		out.size = (size_t)rsize;
+		out.align = -1;
+		if( XAR(x)->heap_start ) {
+			off_t room = xar_heap_room(x);
+			if( room != -1 )
+				out.align = (int)(((room - (off_t)cnt) % XAR_HEAP_HEADER_ALIGN + XAR_HEAP_HEADER_ALIGN) % XAR_HEAP_HEADER_ALIGN);
+		} else if( blk && XAR(x)->append_path ) {
+			/* the old heap lines up with its place in the old archive */
+			off_t pre = xar_heap_prefix(x);
+			if( pre != -1 ) {
+				pre -= XAR(x)->append_len;
+				out.align = (int)(((XAR(x)->append_off - (off_t)cnt - pre) % XAR_HEAP_HEADER_ALIGN + XAR_HEAP_HEADER_ALIGN) % XAR_HEAP_HEADER_ALIGN);
+			}
+		} else if( blk ) {
+			off_t pre = xar_heap_prefix(x);
+			if( pre != -1 )
+				out.align = (int)((XAR_HEAP_HEADER_ALIGN - pre % XAR_HEAP_HEADER_ALIGN) % XAR_HEAP_HEADER_ALIGN);
+		}
+		if( xar_toc_serialize(x, &out) != 0 ) {
+			xar_err_new(x);
+			xar_err_set_string(x, "Error closing xar archive");
+			retval = -1;
+			goto CLOSEEND;
+		}
 
 		/* populate the header and write it out */
 		XAR(x)->header.magic = htonl(XAR_HEADER_MAGIC);
@@ -643,11 +865,53 @@ int xar_close(xar_t x) {
 		else
 			XAR(x)->header.size = ntohs(sizeof(xar_header_t));
 		XAR(x)->header.version = ntohs(1);
-		XAR(x)->header.toc_length_uncompressed = xar_ntoh64(ungztoc);
-		XAR(x)->header.toc_length_compressed = xar_ntoh64(gztoc);
+		XAR(x)->header.toc_length_uncompressed = xar_ntoh64(out.ungztoc);
+		XAR(x)->header.toc_length_compressed = xar_ntoh64(out.gztoc);
 
-		cnt = cksum_alg == XAR_CKSUM_OTHER ? sizeof(xar_header_ex_t) : sizeof(xar_header_t);
-		wcnt = write(XAR(x)->fd, &XAR(x)->header, cnt);
+		/* the header is padded up to the heap written by xar_heap_inplace */
+		if( XAR(x)->heap_start ) {
+			off_t start;
+			if( xar_heap_place(x, (off_t)(cnt + out.gztoc), (off_t)(XAR_HEAP_MAX_HEADER - cnt), &start) != 0 ) {
+				xar_err_new(x);
+				xar_err_set_string(x, "Error making room for the toc in front of the heap");
+				retval = -1;
+				goto CLOSEEND;
+			}
+			XAR(x)->header.size = htons((uint16_t)(start - out.gztoc));
+		}
+
+		/* or padded so that the blocks of the old heap are cloned */
+		if( blk && XAR(x)->append_path ) {
+			off_t at = (off_t)(cnt + out.gztoc) + xar_heap_prefix(x) - XAR(x)->append_len;
+			off_t pad = ((XAR(x)->append_off - at) % blk + blk) % blk;
+			if( (out.align >= 0) && (pad % XAR_HEAP_HEADER_ALIGN == 0) && ((off_t)cnt + pad <= XAR_HEAP_MAX_HEADER) )
+				XAR(x)->header.size = htons((uint16_t)(cnt + pad));
+			else
+				blk = 0;
+		}
+
+		/* or padded so that the cloned heap data starts on a block */
+		else if( blk && (out.align >= 0) ) {
+			off_t at = (off_t)(cnt + out.gztoc) + xar_heap_prefix(x);
+			off_t pad = (blk - at % blk) % blk;
+			if( (pad % XAR_HEAP_HEADER_ALIGN == 0) && ((off_t)cnt + pad <= XAR_HEAP_MAX_HEADER) && (xar_heap_clone(x, at + pad) == 0) ) {
+				XAR(x)->header.size = htons((uint16_t)(cnt + pad));
+				cloned = 1;
+			}
+		}
+
+		if( (tocfd < 0 || XAR(x)->heap_start || cloned) && (lseek(XAR(x)->fd, (off_t)0, SEEK_SET) == -1) )
+			wcnt = -1;
+		else
+			wcnt = write(XAR(x)->fd, &XAR(x)->header, cnt);
+		for( off = (int)cnt; (wcnt == (ssize_t)cnt) && (off < ntohs(XAR(x)->header.size)); off += r ) {
+			r = ntohs(XAR(x)->header.size) - off;
+			if( r > rsize )
+				r = (int)rsize;
+			memset(rbuf, 0, r);
+			if( xar_write_fd(XAR(x)->fd, rbuf, r) < 0 )
+				wcnt = -1;
+		}
 		if (wcnt < 0 || wcnt != (ssize_t)cnt) {
 			xar_err_new(x);
 			xar_err_set_string(x, "Error writing xar archive header");
@@ -655,37 +919,38 @@ int xar_close(xar_t x) {
 			goto CLOSEEND;
 		}
 
-		/* Copy the temp compressed toc file into the file */
-		lseek(tocfd, (off_t)0, SEEK_SET);
-		while(1) {
-			r = (int)read(tocfd, rbuf, rsize);
-			if( (r < 0) && (errno == EINTR) )
-				continue;
-			if( r == 0 )
-				break;
-
-			wbytes = r;
-			off = 0;
-			do {
-				r = (int)write(XAR(x)->fd, ((char *)rbuf)+off, wbytes-off);
+		if( tocfd < 0 ) {
+			/* the toc is in place already */
+			if( lseek(XAR(x)->fd, (off_t)(cnt + out.gztoc), SEEK_SET) == -1 ) {
+				xar_err_new(x);
+				xar_err_set_string(x, "Error closing xar archive");
+				retval = -1;
+				goto CLOSEEND;
+			}
+		} else {
+			/* Copy the temp compressed toc file into the file */
+			lseek(tocfd, (off_t)0, SEEK_SET);
+			while(1) {
+				r = (int)read(tocfd, rbuf, rsize);
 				if( (r < 0) && (errno == EINTR) )
 					continue;
-				if( r < 0 ) {
+				if( r <= 0 )
+					break;
+
+				if( xar_write_fd(XAR(x)->fd, rbuf, r) < 0 ) {
 					xar_err_new(x);
 					xar_err_set_string(x, "Error closing xar archive");
 					retval = -1;
 					goto CLOSEEND;
 				}
-					
-				off += r;
-			} while( off < wbytes );
+			}
 		}
 
 		/* start counting any digest/signature bytes written */
 		rbytes = 0;
 
 		if( XAR(x)->docksum ) {
-			unsigned int l = r;
+			unsigned int l = 0;
 			
 			memset(chkstr, 0, sizeof(chkstr));
 			EVP_DigestFinal_ex(XAR(x)->toc_ctx, chkstr, &l);
@@ -741,49 +1006,65 @@ int xar_close(xar_t x) {
 			XAR(x)->signatures = NULL;
 		}
 
-		/* copy the heap from the temporary heap into the archive */
-		if( lseek(XAR(x)->heap_fd, (off_t)0, SEEK_SET) < 0 ) {
-			fprintf(stderr, "Error lseeking to offset 0: %s\n", strerror(errno));
-			exit(1);
+		/* the heap of the archive appended to comes first */
+		if( XAR(x)->append_path && (xar_heap_append_old(x, blk, rbuf, (size_t)rsize) != 0) ) {
+			xar_err_new(x);
+			xar_err_set_string(x, "Error copying the heap of the archive appended to");
+			retval = -1;
+			goto CLOSEEND;
 		}
-		/* XAR(x)->heap_len includes any digest/signatures but the heap file does not and at this
-                 * point rbytes reflects the total byte count of any digest/signatures that are present */
-		while(1) {
-			if( (XAR(x)->heap_len - rbytes) < rsize )
-				rsize = (long)(XAR(x)->heap_len - rbytes);
 
-			r = (int)read(XAR(x)->heap_fd, rbuf, rsize);
-			if( (r < 0 ) && (errno == EINTR) )
-				continue;
-			if( r == 0 )
-				break;
-	
-			rbytes += r;
-			wbytes = r;
-			off = 0;
-			do {
-				r = (int)write(XAR(x)->fd, ((char *)rbuf)+off, wbytes);
-				if( (r < 0 ) && (errno == EINTR) )
-					continue;
-				if( r < 0 ) {
-					retval = -1;
-					goto CLOSEEND;
-				}
-				off += r;
-			} while( off < wbytes );
+		/* the heap written by xar_heap_inplace or cloned follows */
+		if( XAR(x)->heap_start || cloned )
+			goto CLOSEEND;
 
-			if( rbytes >= XAR(x)->heap_len )
-				break;
+		/* copy the heap from the temporary heap into the archive.
+		 * XAR(x)->heap_len includes any digest/signatures but the heap file does not and at this
+		 * point rbytes reflects the total byte count of any digest/signatures that are present,
+		 * and append_len that of the heap of the archive appended to */
+		if( XAR(x)->heap_plan )
+			r = xar_heap_order_copy(x, rbuf, (size_t)rsize);
+		else
+			r = xar_heap_copy(x, (off_t)0, (off_t)(XAR(x)->heap_len - rbytes - XAR(x)->append_len), rbuf, (size_t)rsize);
+		if( r != 0 ) {
+			xar_err_new(x);
+			xar_err_set_string(x, "Error copying the heap into the xar archive");
+			retval = -1;
+			goto CLOSEEND;
 		}
 CLOSEEND:
+		if( tocfd >= 0 )
+			close(tocfd);
 		free(rbuf);
-		free(wbuf);
 		deflateEnd(&XAR(x)->zs);
+		if( XAR(x)->append_path && (retval == 0) ) {
+			if( rename(XAR(x)->append_path, XAR(x)->filename) == 0 ) {
+				free(XAR(x)->append_path);
+				XAR(x)->append_path = NULL;
+			} else {
+				xar_err_new(x);
+				xar_err_set_string(x, "Error replacing the archive appended to");
+				xar_err_set_errno(x, errno);
+				retval = -1;
+			}
+		}
 	} else {
 		inflateEnd(&XAR(x)->zs);
 	}
 		
 CLOSE_BAIL:
+	/* copies pending from or to another archive are made first */
+	xar_repack_free(x);
+	xar_heap_order_free(x);
+
+	/* the archive appended to is left as it was */
+	if( XAR(x)->append_path ) {
+		unlink(XAR(x)->append_path);
+		free(XAR(x)->append_path);
+	}
+	if( XAR(x)->append_fd >= 0 )
+		close(XAR(x)->append_fd);
+
 	/* continue deallocating the archive and return */
 	while(XAR(x)->subdocs) {
 		xar_subdoc_remove(XAR(x)->subdocs);
@@ -811,6 +1092,13 @@ CLOSE_BAIL:
 	xmlHashFree(XAR(x)->ino_hash, NULL);
 	xmlHashFree(XAR(x)->link_hash, NULL);
 	xmlHashFree(XAR(x)->csum_hash, NULL);
+	xmlHashFree(XAR(x)->xsum_hash, NULL);
+	xmlHashFree(XAR(x)->prekey_hash, NULL);
+	xar_path_index_free(x);
+#ifdef HAVE_MMAP
+	if( XAR(x)->map )
+		munmap((void *)XAR(x)->map, XAR(x)->maplen);
+#endif
 	if (XAR(x)->fd >= 0)
 		close(XAR(x)->fd);
 	if( XAR(x)->heap_fd >= 0 )
@@ -818,8 +1106,13 @@ CLOSE_BAIL:
 	free((char *)XAR(x)->filename);
 	free((char *)XAR(x)->dirname);
 	free(XAR(x)->readbuf);
+	xar_buffers_free(XAR(x)->buffers);
+	free(XAR(x)->trials);
+	xar_arena_free(XAR(x)->arena);
+	xar_toccache_close(x);
 	EVP_MD_CTX_destroy(XAR(x)->toc_ctx);
 	free((void *)x);
+	xar_intern_release();
 
 	return retval;
 }
@@ -853,8 +1146,6 @@ const char *xar_opt_get(xar_t x, const char *option) {
  * Returns: 0 for sucess, -1 for failure
  */
 int32_t xar_opt_set(xar_t x, const char *option, const char *value) {
-	xar_attr_t a;
-
 	if (!x || !option)
 		return -1;
 	if (!value)
@@ -862,8 +1153,9 @@ int32_t xar_opt_set(xar_t x, const char *option, const char *value) {
 	if( (strcmp(option, XAR_OPT_TOCCKSUM) == 0) ) {
 		xar_signature_t sig;
 
-		/* Cannot change XAR_OPT_TOCCKSUM after adding any files */
-		if (XAR(x)->files != NULL) {
+		/* Cannot change XAR_OPT_TOCCKSUM after adding any files, or
+		 * of an archive appended to, whose heap starts with its own */
+		if (XAR(x)->files != NULL || XAR(x)->append_path) {
 			xar_err_new(x);
 			xar_err_set_string(x, "XAR_OPT_TOCCKSUM must be set before files are added");
 			xar_err_callback(x, XAR_SEVERITY_WARNING, XAR_ERR_ARCHIVE_CREATION);
@@ -891,6 +1183,16 @@ int32_t xar_opt_set(xar_t x, const char *option, const char *value) {
 			sig = XAR_SIGNATURE(sig)->next;
 		}
 	}
+	if( (strcmp(option, XAR_OPT_TOCSPACE) == 0) ) {
+		/* The heap cannot move once data has been written to it */
+		if (XAR(x)->files != NULL || XAR(x)->append_path) {
+			xar_err_new(x);
+			xar_err_set_string(x, "XAR_OPT_TOCSPACE must be set before files are added");
+			xar_err_callback(x, XAR_SEVERITY_WARNING, XAR_ERR_ARCHIVE_CREATION);
+			return -1;
+		}
+		xar_heap_inplace(x, value);
+	}
 	if( (strcmp(option, XAR_OPT_FILECKSUM) == 0) ) {
 		if( strcmp(value, XAR_OPT_VAL_NONE) != 0 ) {
 			const EVP_MD *md;
@@ -898,6 +1200,10 @@ int32_t xar_opt_set(xar_t x, const char *option, const char *value) {
 			if( md == NULL || EVP_MD_size(md) > HASH_MAX_MD_SIZE ) return -1;
 		}
 	}
+	if( (strcmp(option, XAR_OPT_HEAPORDER) == 0) ) {
+		if( *value && (strcmp(value, XAR_OPT_VAL_PATH) != 0) && (strcmp(value, XAR_OPT_VAL_SIZE) != 0) && (strcmp(value, XAR_OPT_VAL_EXTENSION) != 0) )
+			return -1;
+	}
 	if ((strcmp(option, XAR_OPT_STRIPCOMPONENTS) == 0)) {
 		long comps;
 		char *endptr;
@@ -912,12 +1218,22 @@ int32_t xar_opt_set(xar_t x, const char *option, const char *value) {
 	if ((XAR(x)->files == NULL && strcmp(option, XAR_OPT_RFC6713FORMAT) == 0)) {
 		XAR(x)->rfcformat = strcmp(value, XAR_OPT_VAL_TRUE) == 0;
 	}
+	xar_opt_push(x, option, value);
+	return 0;
+}
+
+/* xar_opt_push
+ * Summary: records the option without the checks of xar_opt_set, for
+ * options whose effect has already been seen to.
+ */
+static void xar_opt_push(xar_t x, const char *option, const char *value) {
+	xar_attr_t a;
+
 	a = xar_attr_new();
-	XAR_ATTR(a)->key = strdup(option);
+	xar_attr_setkey(a, option);
 	XAR_ATTR(a)->value = strdup(value);
 	XAR_ATTR(a)->next = XAR(x)->attrs;
 	XAR(x)->attrs = a;
-	return 0;
 }
 
 /* xar_opt_unset
@@ -1019,9 +1335,11 @@ static xar_file_t xar_add_node(xar_t x, xar_file_t f, const char *name, const ch
 	}
 
 	xar_prop_set(ret, "name", name);
+	xar_path_index_add(x, ret);
 
 	if( xar_arcmod_archive(x, ret, XAR_FILE(ret)->fspath, NULL, 0) < 0 ) {
 		xar_file_t i = NULL;
+		xar_path_index_remove(x, ret);
 		if( f ) {
 			if( ret == XAR_FILE(f)->children )
 				XAR_FILE(f)->children = XAR_FILE(ret)->next;
@@ -1114,19 +1432,67 @@ static xar_file_t xar_add_pseudodir(xar_t x, xar_file_t f, const char *name, con
 	}
 	xar_prop_set(ret, "name", name);
 	xar_prop_set(ret, "type", "directory");
+	xar_path_index_add(x, ret);
 
 	return ret;
 }
 
+/* xar_add_replaces
+ * Returns: whether file i, named name under f, is to be replaced by the
+ * file it names on disk rather than kept
+ * Summary: files read from an archive opened with XAR_OPEN_APPEND are
+ * replaced once their mtime or size no longer matches those of the file
+ * on disk.  Directories are kept, as are hardlinks, which other files
+ * may refer to.
+ */
+static int xar_add_replaces(xar_t x, xar_file_t f, xar_file_t i, const char *name, const char *prefix) {
+	struct stat sb;
+	struct tm t;
+	char timestr[128];
+	const char *value;
+	char *path;
+	int err;
+
+	if( !XAR(x)->append_path || !(XAR_FILE(i)->pool & XAR_POOL_NODE) )
+		return 0;
+	if( (xar_prop_get(i, "type", &value) == 0) && (strcmp(value, "directory") == 0) )
+		return 0;
+	if( xar_attr_get(i, "type", "link") )
+		return 0;
+	if( f )
+		err = asprintf(&path, "%s/%s%s", XAR_FILE(f)->fspath, prefix, name);
+	else
+		err = asprintf(&path, "%s%s%s", XAR(x)->path_prefix, prefix, name);
+	if( err == -1 )
+		return 0;
+	err = lstat(path, &sb);
+	free(path);
+	if( err != 0 )
+		return 0;
+	if( xar_prop_get(i, "mtime", &value) != 0 )
+		return 1;
+	gmtime_r(&sb.st_mtime, &t);
+	memset(timestr, 0, sizeof(timestr));
+	strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%SZ", &t);
+	if( strcmp(value, timestr) != 0 )
+		return 1;
+	if( !S_ISREG(sb.st_mode) )
+		return 0;
+	if( xar_prop_get(i, "data/size", &value) != 0 )
+		return sb.st_size != 0;
+	return strtoull(value, NULL, 10) != (unsigned long long)sb.st_size;
+}
+
 /* xar_add_r
  * Summary: a recursive helper function for adding a node to the
- * tree.  This will search all children of node f, looking for
- * the path component.  If found, will recurse into it.  If not,
- * will add the path component to the tree, and recurse into it.
+ * tree.  This will look the path component up among the children
+ * of node f in the archive's path index.  If found, will recurse
+ * into it.  If not, will add the path component to the tree, and
+ * recurse into it.
  * If f is NULL, will start with x->files.
  */
 static xar_file_t xar_add_r(xar_t x, xar_file_t f, const char *path, const char *prefix) {
-	xar_file_t i = NULL, ret, ret2, start = NULL;
+	xar_file_t i = NULL, ret, ret2;
 	char *tmp1, *tmp2, *tmp3;
 
 	if( path && (path[0] == '\0') ) {
@@ -1170,29 +1536,36 @@ static xar_file_t xar_add_r(xar_t x, xar_file_t f, const char *path, const char
 		return ret2;
 	}
 
-	if( !f ) {
-		start = XAR(x)->files;
-	} else {
-		start = XAR_FILE(f)->children;
-	}
-
-	/* Search all the siblings */
-	for( i = start; i; i = XAR_FILE(i)->next ) {
-		const char *n;
-		xar_prop_get(i, "name", &n);
-		if( strcmp(n, tmp3) == 0 ) {
-			if( !tmp2 ) {
-				/* Node already exists, and it is i */
-				free(tmp1);
-				return i;
-			}
-			ret2 = xar_add_r(x, i, tmp2, "");
+	/* Look for tmp3 among the children of f */
+	i = xar_path_index_lookup(x, f, tmp3);
+	if( i && !tmp2 && xar_add_replaces(x, f, i, tmp3, prefix) ) {
+		xar_file_t j = NULL;
+		xar_path_index_remove(x, i);
+		if( i == (f ? XAR_FILE(f)->children : XAR(x)->files) ) {
+			if( f )
+				XAR_FILE(f)->children = XAR_FILE(i)->next;
+			else
+				XAR(x)->files = XAR_FILE(i)->next;
+		} else
+			for( j = f ? XAR_FILE(f)->children : XAR(x)->files; j && (XAR_FILE(j)->next != i); j = XAR_FILE(j)->next );
+		if( j )
+			XAR_FILE(j)->next = XAR_FILE(i)->next;
+		XAR_FILE(i)->next = NULL;
+		xar_file_free(i);
+		i = NULL;
+	}
+	if( i ) {
+		if( !tmp2 ) {
+			/* Node already exists, and it is i */
 			free(tmp1);
-			return ret2;
+			return i;
 		}
+		ret2 = xar_add_r(x, i, tmp2, "");
+		free(tmp1);
+		return ret2;
 	}
 
-	/* tmp3 was not found in children of start, so we add it */
+	/* tmp3 was not found in children of f, so we add it */
 	if( tmp2 ) {
 		/*ret = xar_add_node(x, f, tmp3, prefix, NULL,  1);*/
 		ret = xar_add_pseudodir(x, f, tmp3, prefix, NULL);
@@ -1287,10 +1660,12 @@ xar_file_t xar_add_frombuffer(xar_t x, xar_file_t parent, const char *name, char
 	}
 	
 	xar_prop_set(ret, "name", name);
+	xar_path_index_add(x, ret);
 		
 	/*int32_t xar_arcmod_archive(xar_t x, xar_file_t f, const char *file, const char *buffer, size_t len) */
 	if( xar_arcmod_archive(x, ret, NULL , buffer , length) < 0 ) {
 		xar_file_t i;
+		xar_path_index_remove(x, ret);
 		if( parent ) {
 			for( i = XAR_FILE(parent)->children; i && (XAR_FILE(i)->next != ret); i = XAR_FILE(i)->next );
 		} else {
@@ -1336,9 +1711,11 @@ xar_file_t xar_add_folder(xar_t x, xar_file_t f, const char *name, struct stat *
 	}
 	
 	xar_prop_set(ret, "name", name);
+	xar_path_index_add(x, ret);
 
 	if( xar_arcmod_archive(x, ret, XAR_FILE(ret)->fspath, NULL, 0) < 0 ) {
 		xar_file_t i;
+		xar_path_index_remove(x, ret);
 		if( f ) {
 			for( i = XAR_FILE(f)->children; i && (XAR_FILE(i)->next != ret); i = XAR_FILE(i)->next );
 		} else {
@@ -1388,16 +1765,15 @@ xar_file_t xar_add_from_archive(xar_t x, xar_file_t parent, const char *name, xa
 	}
 		
 	xar_prop_set(ret, "name", name);
+	xar_path_index_add(x, ret);
 		
 	/* iterate through all the properties, see if any of them have an offset */
 	p = xar_prop_pfirst(ret);
 
 	do{
-		xar_prop_t tmpp;
-		
-		tmpp = xar_prop_pget(p, "offset");
-		if(tmpp) {
+		if( xar_data_offset(p) >= 0 ) {
 			if( 0 != xar_attrcopy_from_heap_to_heap(sourcearchive, sourcefile, p, x, ret)){			
+				xar_path_index_remove(x, ret);
 				xar_file_free(ret);
 				ret = NULL;
 				break;
@@ -1448,23 +1824,22 @@ int32_t xar_extract_tobuffer(xar_t x, xar_file_t f, char **buffer) {
 * Example: xar_extract_tobuffer(x, "foo/bar/blah",&buffer)
 */
 int32_t xar_extract_tobuffersz(xar_t x, xar_file_t f, char **buffer, size_t *size) {
-	const char *sizestring = NULL;
+	const struct __xar_file_cache_t *c;
 	int32_t ret;
 
 	if (!buffer || !size)
 		return -1;
 
-	if(0 != xar_prop_get(f,"data/size",&sizestring)){
-		if(0 != xar_prop_get(f, "type", &sizestring))
-			return -1;
-		if(strcmp(sizestring, "file") == 0) {
+	c = xar_file_cache(f);
+	if( !(c->flags & XAR_FCACHE_SIZE) ){
+		if( c->ftype == XAR_FTYPE_FILE ) {
 			*size = 0;
 			return 0;
 		}
 		return -1;
 	}
 
-	*size = strtoull(sizestring, (char **)NULL, 10);
+	*size = c->size;
 	*buffer = malloc(*size);
 	
 	if(!(*buffer)){
@@ -1522,6 +1897,35 @@ const char *xar_strip_components(const char *path, int components)
 	return path;
 }
 
+/* xar_extract_parent
+ * x: archive to extract from
+ * f: file about to be extracted to fspath
+ * Returns 0 on success, -1 if the parent is not in the archive.
+ * Summary: extracts the directory f lives in when fspath cannot be
+ * found on disk, once per file.
+ */
+static int32_t xar_extract_parent(xar_t x, xar_file_t f, const char *fspath) {
+	struct stat sb;
+	char *tmp1, *dname;
+	xar_file_t tmpf;
+
+	if( (strstr(fspath, "/") != NULL) && (stat(fspath, &sb)) && (XAR_FILE(f)->parent_extracted == 0) ) {
+		tmp1 = strdup(XAR_FILE(f)->fspath);
+		dname = dirname(tmp1);
+		tmpf = xar_path_find(x, dname);
+		if( !tmpf ) {
+			xar_err_set_string(x, "Unable to find file");
+			xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+			free(tmp1);
+			return -1;
+		}
+		free(tmp1);
+		XAR_FILE(f)->parent_extracted++;
+		xar_extract(x, tmpf);
+	}
+	return 0;
+}
+
 /* xar_extract
  * x: archive to extract from
  * path: path to file to extract
@@ -1535,9 +1939,6 @@ const char *xar_strip_components(const char *path, int components)
  * Total extractions will be "foo", "foo/bar", and "foo/bar/blah".
  */
 int32_t xar_extract(xar_t x, xar_file_t f) {
-	struct stat sb;
-	char *tmp1, *dname;
-	xar_file_t tmpf;
 	const char *fspath;
 
 	fspath = XAR_FILE(f)->fspath;
@@ -1555,24 +1956,133 @@ int32_t xar_extract(xar_t x, xar_file_t f) {
 		return result;
 	}
 	else {
-		if( (strstr(fspath, "/") != NULL) && (stat(fspath, &sb)) && (XAR_FILE(f)->parent_extracted == 0) ) {
-			tmp1 = strdup(XAR_FILE(f)->fspath);
-			dname = dirname(tmp1);
-			tmpf = xar_file_find(XAR(x)->files, dname);
-			if( !tmpf ) {
-				xar_err_set_string(x, "Unable to find file");
-				xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_EXTRACTION);
-				return -1;
-			}
-			free(tmp1);
-			XAR_FILE(f)->parent_extracted++;
-			xar_extract(x, tmpf);
-		}
+		if( xar_extract_parent(x, f, fspath) != 0 )
+			return -1;
 
 		return xar_extract_tofile(x, f, fspath);
 	}
 }
 
+/* Extracts one file for xar_extract_all, returns 1 if it was extracted */
+static int32_t xar_extract_one(xar_t x, xar_file_t f) {
+	if( xar_extract(x, f) == 0 )
+		return 1;
+	if( !XAR(x)->tostdout ) {
+		xar_err_new(x);
+		xar_err_set_file(x, f);
+		xar_err_set_string(x, "Unable to extract file");
+		xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+	}
+	return 0;
+}
+
+/* Appends f to a growing array of files */
+static int32_t xar_files_push(xar_file_t **files, size_t *count, size_t *size, xar_file_t f) {
+	xar_file_t *tmp;
+
+	if( *count == *size ) {
+		tmp = realloc(*files, (*size ? 2 * *size : 64) * sizeof(xar_file_t));
+		if( !tmp )
+			return -1;
+		*files = tmp;
+		*size = *size ? 2 * *size : 64;
+	}
+	(*files)[(*count)++] = f;
+	return 0;
+}
+
+/* Returns non-zero for hardlinks to a file extracted elsewhere */
+static int xar_is_hardlink(xar_file_t f) {
+	const char *opt;
+
+	if( xar_file_cache(f)->ftype != XAR_FTYPE_HARDLINK )
+		return 0;
+	opt = xar_attr_get(f, "type", "link");
+	return !opt || (strcmp(opt, "original") != 0);
+}
+
+/* xar_extract_all
+ * x: archive to extract from
+ * nthreads: number of threads extracting files, 0 means one per cpu
+ * filter: called for every file in archive order, returns non-zero for
+ * the files to extract.  If NULL, every file is extracted.
+ * context: passed through to filter
+ * Returns the number of files extracted, -1 on failure.
+ * Summary: Extracts the selected files as xar_extract would.  Directories
+ * are extracted last, deepest first, so their permissions and times
+ * survive the extraction of their contents.  With more than one thread,
+ * the missing parent directories are created up front and the files are
+ * then extracted concurrently, hardlinks last.  Files that cannot be
+ * extracted are reported through the error callback.
+ */
+int32_t xar_extract_all(xar_t x, int32_t nthreads, xar_extract_filter filter, void *context) {
+	xar_iter_t i;
+	xar_file_t f;
+	xar_file_t *dirs = NULL, *files = NULL, *links = NULL;
+	size_t ndirs = 0, nfiles = 0, nlinks = 0, dirsize = 0, filesize = 0, linksize = 0, j;
+	int32_t extracted = 0, ret = 0;
+	const char *fspath;
+	int parallel;
+
+	/* workers read the heap with pread, which needs a seekable archive */
+	parallel = !XAR(x)->tostdout && (xar_workers_nthreads(nthreads) > 1) &&
+	           (lseek(XAR(x)->fd, 0, SEEK_CUR) != -1);
+
+	i = xar_iter_new();
+	if( !i )
+		return -1;
+	for( f = xar_file_first(x, i); f && (ret == 0); f = xar_file_next(i) ) {
+		if( filter && !filter(x, f, context) )
+			continue;
+		if( xar_file_cache(f)->ftype == XAR_FTYPE_DIRECTORY ) {
+			if( !XAR(x)->tostdout )
+				ret = xar_files_push(&dirs, &ndirs, &dirsize, f);
+		} else if( parallel && xar_is_hardlink(f) ) {
+			ret = xar_files_push(&links, &nlinks, &linksize, f);
+		} else if( parallel ) {
+			ret = xar_files_push(&files, &nfiles, &filesize, f);
+		} else {
+			extracted += xar_extract_one(x, f);
+		}
+	}
+	xar_iter_free(i);
+	if( ret != 0 ) {
+		free(dirs);
+		free(files);
+		free(links);
+		return -1;
+	}
+
+	if( nfiles > 0 ) {
+		/* the workers leave directories alone */
+		for( j = 0; j < nfiles; j++ ) {
+			fspath = XAR_FILE(files[j])->fspath;
+			if( XAR(x)->stripcomps )
+				fspath = xar_strip_components(fspath, XAR(x)->stripcomps);
+			if( fspath )
+				xar_extract_parent(x, files[j], fspath);
+		}
+		ret = xar_workers_extract(x, files, nfiles, nthreads);
+		if( ret >= 0 ) {
+			extracted += ret;
+		} else {
+			for( j = 0; j < nfiles; j++ )
+				extracted += xar_extract_one(x, files[j]);
+		}
+	}
+	for( j = 0; j < nlinks; j++ )
+		extracted += xar_extract_one(x, links[j]);
+	for( j = ndirs; j > 0; j-- ) {
+		xar_extract(x, dirs[j-1]);
+		extracted++;
+	}
+
+	free(dirs);
+	free(files);
+	free(links);
+	return extracted;
+}
+
 /* xar_verify
 * x: archive to extract from
 * f: file to verify
@@ -1585,6 +2095,41 @@ int32_t xar_verify(xar_t x, xar_file_t f) {
 	return xar_arcmod_verify(x,f);
 }
 
+/* xar_toc_walk
+ * x: archive to list
+ * cb: called for each file
+ * context: passed through to cb
+ * Returns: 0 once every file has been reported, what cb returned if it
+ * stopped the walk, or -1 on error
+ * Summary: lists the files of the archive, see tocwalk.c.  If the archive
+ * was opened with XAR_OPEN_TOCWALK the TOC is read here, and can only be
+ * walked once.
+ */
+int32_t xar_toc_walk(xar_t x, xar_toc_callback cb, void *context) {
+	struct __xar_walk_t w;
+	int32_t ret;
+
+	if( XAR(x)->tocwalk > 1 ) {
+		xar_err_new(x);
+		xar_err_set_string(x, "The TOC has already been walked");
+		xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+		return -1;
+	}
+
+	xar_walk_init(&w, cb, context);
+	if( XAR(x)->tocwalk ) {
+		XAR(x)->tocwalk = 2;
+		ret = xar_unserialize(x, &w);
+		if( (ret == 0) && (w.ret == 0) )
+			ret = xar_toc_check(x);
+		else if( ret == 0 )
+			ret = w.ret;
+	} else
+		ret = xar_tree_walk(x, &w);
+	xar_walk_done(&w);
+	return ret;
+}
+
 /* toc_read_callback
  * context: context passed through from the reader
  * buffer: buffer to read into
@@ -1596,6 +2141,33 @@ static int toc_read_callback(void *context, char *buffer, int len) {
 	xar_t x = (xar_t)context;
 	int ret, off = 0;
 
+	/* a mapped archive is inflated in place, offset counts the
+	 * compressed bytes consumed so far */
+	if( XAR(x)->map ) {
+		uint64_t avail;
+
+		if( XAR(x)->header.size + XAR(x)->header.toc_length_compressed > XAR(x)->maplen )
+			return -1;
+		if( XAR(x)->toc_count != XAR(x)->header.toc_length_compressed ) {
+			if ( XAR(x)->docksum )
+				EVP_DigestUpdate(XAR(x)->toc_ctx, XAR(x)->map + XAR(x)->header.size, (size_t)XAR(x)->header.toc_length_compressed);
+			XAR(x)->toc_count = XAR(x)->header.toc_length_compressed;
+		}
+		avail = XAR(x)->header.toc_length_compressed - XAR(x)->offset;
+		XAR(x)->zs.next_in = (unsigned char *)XAR(x)->map + XAR(x)->header.size + XAR(x)->offset;
+		XAR(x)->zs.avail_in = avail > UINT_MAX ? UINT_MAX : (unsigned)avail;
+		XAR(x)->zs.next_out = (void *)buffer;
+		XAR(x)->zs.avail_out = len;
+
+		avail = XAR(x)->zs.avail_in;
+		ret = inflate(&XAR(x)->zs, Z_SYNC_FLUSH);
+		if( ret < 0 )
+			return -1;
+
+		XAR(x)->offset += (size_t)(avail - XAR(x)->zs.avail_in);
+		return len - XAR(x)->zs.avail_out;
+	}
+
 	if ( ((!XAR(x)->offset) || (XAR(x)->offset == XAR(x)->readbuf_len)) && (XAR(x)->toc_count != XAR(x)->header.toc_length_compressed) ) {
 		XAR(x)->offset = 0;
 		if( (XAR(x)->readbuf_len - off) + XAR(x)->toc_count > XAR(x)->header.toc_length_compressed )
@@ -1629,27 +2201,88 @@ static int toc_read_callback(void *context, char *buffer, int len) {
 }
 
 /* close_callback
- * context: this will be a xar_t
+ * context: this will be a xar_t, or a struct __xar_tocout_t
  * Returns: 0 or -1 in case of error
- * Summary: this is the callback for xmlTextReaderForIO to close the IO
+ * Summary: this is the callback for xmlTextReaderForIO and for the
+ * xmlOutputBuffer of xar_toc_serialize to close the IO
  */
 static int close_callback(void *context) {
 	(void)context;
 	return 0;
 }
 
-/* xar_serialize
+/* xar_toc_output
+ * out: where the TOC goes
+ * Returns: 0 or -1 in case of error
+ * Summary: writes and checksums what deflate left in out->buf.
+ */
+static int32_t xar_toc_output(struct __xar_tocout_t *out) {
+	size_t n = out->size - XAR(out->x)->zs.avail_out;
+
+	if( !n )
+		return 0;
+	if( xar_write_fd(out->fd, out->buf, n) < 0 )
+		return -1;
+	if( XAR(out->x)->docksum )
+		EVP_DigestUpdate(XAR(out->x)->toc_ctx, out->buf, n);
+	out->gztoc += n;
+	return 0;
+}
+
+/* xar_toc_deflate
+ * out: where the TOC goes
+ * flush: Z_NO_FLUSH, or Z_FINISH at the end of the TOC
+ * Returns: 0 or -1 in case of error
+ * Summary: deflates what is in the zstream of the archive, and writes and
+ * checksums the result.
+ */
+static int32_t xar_toc_deflate(struct __xar_tocout_t *out, int flush) {
+	xar_t x = out->x;
+	int ret;
+
+	do {
+		XAR(x)->zs.next_out = out->buf;
+		XAR(x)->zs.avail_out = (unsigned)out->size;
+		ret = deflate(&XAR(x)->zs, flush);
+		if( ret == Z_STREAM_ERROR )
+			return -1;
+		if( xar_toc_output(out) != 0 )
+			return -1;
+	} while( (XAR(x)->zs.avail_out == 0) || ((flush == Z_FINISH) && (ret != Z_STREAM_END)) );
+	return 0;
+}
+
+/* toc_write_callback
+ * context: the struct __xar_tocout_t being written to
+ * buffer: xml to write
+ * len: length of buffer
+ * Returns: len or -1 in case of error
+ * Summary: internal callback for the xmlOutputBuffer of xar_toc_serialize.
+ */
+static int toc_write_callback(void *context, const char *buffer, int len) {
+	struct __xar_tocout_t *out = context;
+
+	if( out->err )
+		return -1;
+	XAR(out->x)->zs.next_in = (unsigned char *)buffer;
+	XAR(out->x)->zs.avail_in = len;
+	if( xar_toc_deflate(out, Z_NO_FLUSH) != 0 ) {
+		out->err = 1;
+		return -1;
+	}
+	out->ungztoc += len;
+	return len;
+}
+
+/* xar_serialize_doc
  * x: xar to serialize
- * file: file to serialize to
- * Summary: serializes the archive out to xml.
+ * writer: writer to serialize to
+ * Summary: writes the xml document of the archive.
  */
-void xar_serialize(xar_t x, const char *file) {
-	xmlTextWriterPtr writer;
+static void xar_serialize_doc(xar_t x, xmlTextWriterPtr writer) {
 	xar_subdoc_t i;
 
-	writer = xmlNewTextWriterFilename(file, 0);
 	xmlTextWriterStartDocument(writer, "1.0", "UTF-8", NULL);
-	xmlTextWriterSetIndent(writer, 4);
 	xmlTextWriterStartElement(writer, BAD_CAST("xar"));
 
 	for( i = XAR(x)->subdocs; i; i = xar_subdoc_next(i) )
@@ -1663,25 +2296,92 @@ void xar_serialize(xar_t x, const char *file) {
 	if( XAR(x)->signatures )
 		xar_signature_serialize(XAR(x)->signatures,writer);
 
+	xar_toc_load(x);
 	if( XAR(x)->files )
 		xar_file_serialize(XAR(x)->files, writer);
 
 	xmlTextWriterEndDocument(writer);
+}
+
+/* xar_serialize
+ * x: xar to serialize
+ * file: file to serialize to
+ * Summary: serializes the archive out to xml.
+ */
+void xar_serialize(xar_t x, const char *file) {
+	xmlTextWriterPtr writer;
+
+	writer = xmlNewTextWriterFilename(file, 0);
+	xmlTextWriterSetIndent(writer, 4);
+	xar_serialize_doc(x, writer);
 	xmlFreeTextWriter(writer);
 	return;
 }
 
+/* xar_toc_serialize
+ * x: xar to serialize
+ * out: where to write the compressed TOC
+ * Returns: 0 or -1 in case of error
+ * Summary: xar_serialize for xar_close, which compresses and checksums
+ * the xml as it is produced instead of going through a file.  The xml is
+ * not indented.
+ */
+static int32_t xar_toc_serialize(xar_t x, struct __xar_tocout_t *out) {
+	xmlOutputBufferPtr buf;
+	xmlTextWriterPtr writer;
+
+	buf = xmlOutputBufferCreateIO(toc_write_callback, close_callback, out, NULL);
+	if( !buf )
+		return -1;
+	writer = xmlNewTextWriter(buf);
+	if( !writer ) {
+		xmlOutputBufferClose(buf);
+		return -1;
+	}
+	xar_serialize_doc(x, writer);
+	/* flushes the rest of the xml through toc_write_callback */
+	xmlFreeTextWriter(writer);
+	if( out->err )
+		return -1;
+
+	XAR(x)->zs.next_in = NULL;
+	XAR(x)->zs.avail_in = 0;
+	if( out->align >= 0 ) {
+		/* Pad the xml with up to 3 newlines so that the compressed
+		 * length comes out as out->align modulo 4.  Once flushed, the
+		 * final stored block takes 5 bytes plus the newlines, and the
+		 * adler32 4.  Should zlib do otherwise, xar_heap_place moves
+		 * the heap instead of padding the header. */
+		static char pad[] = "\n\n\n";
+		int ret;
+		if( xar_toc_deflate(out, Z_SYNC_FLUSH) != 0 )
+			return -1;
+		XAR(x)->zs.next_out = out->buf;
+		XAR(x)->zs.avail_out = (unsigned)out->size;
+		ret = deflateParams(&XAR(x)->zs, 0, Z_DEFAULT_STRATEGY);
+		if( xar_toc_output(out) != 0 )
+			return -1;
+		if( ret == Z_OK ) {
+			XAR(x)->zs.next_in = (unsigned char *)pad;
+			XAR(x)->zs.avail_in = (unsigned)((out->align - (int)((out->gztoc + 9) % 4) + 4) % 4);
+			out->ungztoc += XAR(x)->zs.avail_in;
+		}
+	}
+	return xar_toc_deflate(out, Z_FINISH);
+}
+
 /* xar_unserialize
  * x: xar archive to unserialize to.  Must have been allocated with xar_open
- * file: the xml filename to unserialize from
+ * w: walk to report the files to instead of building the tree, or NULL
  * Summary: Takes the TOC representation from file and creates the
  * corresponding in-memory representation.
  */
-static int32_t xar_unserialize(xar_t x) {
+static int32_t xar_unserialize(xar_t x, struct __xar_walk_t *w) {
 	xmlTextReaderPtr reader;
 	xar_file_t f = NULL;
 	const xmlChar *name, *prefix, *uri;
 	int type, noattr, ret;
+	int infiles = 0;
 
 	reader = xmlReaderForIO(toc_read_callback, close_callback, XAR(x), NULL, NULL, 0);
 	if( !reader ) return -1;
@@ -1705,10 +2405,24 @@ static int32_t xar_unserialize(xar_t x) {
 						noattr = xmlTextReaderAttributeCount(reader);
 						name = xmlTextReaderConstLocalName(reader);
 						if( type == XML_READER_TYPE_ELEMENT ) {
-							if(strcmp((const char*)name, "file") == 0) {
+							if( w && (strcmp((const char*)name, "file") == 0) ) {
+								if( xar_file_walk(x, w, reader, 0) != 0 )
+									goto STOPPED;
+							} else if( (XAR(x)->toclazy == XAR_TOC_OPENING) && (strcmp((const char*)name, "file") == 0) && (xar_prop_get(XAR_FILE(x), "checksum", NULL) == 0) ) {
+								/* xar_toc_load reads the files, the
+								 * checksum is all xar_open needs */
+								XAR(x)->toclazy = XAR_TOC_PENDING;
+								goto STOPPED;
+							} else if(strcmp((const char*)name, "file") == 0) {
+								infiles = 1;
 								f = xar_file_unserialize(x, NULL, reader);
-								XAR_FILE(f)->next = XAR(x)->files;
-								XAR(x)->files = f;
+								if( f ) {
+									XAR_FILE(f)->next = XAR(x)->files;
+									XAR(x)->files = f;
+								}
+							} else if( (XAR(x)->toclazy == XAR_TOC_LOADING) && !infiles ) {
+								/* read by xar_open already */
+								xar_walk_skip(reader);
 							} else if( strcmp((const char*)name, "signature") == 0 ){
 								xar_signature_t sig = NULL;			
 								sig = xar_signature_unserialize(x, reader );
@@ -1736,6 +2450,8 @@ static int32_t xar_unserialize(xar_t x) {
 						xmlCleanupCharEncodingHandlers();
 						return -1;
 					}
+				} else if( XAR(x)->toclazy == XAR_TOC_LOADING ) {
+					xar_walk_skip(reader);
 				} else {
 					xar_subdoc_t s;
 					int i;
@@ -1755,7 +2471,7 @@ static int32_t xar_unserialize(xar_t x) {
 								name = (const unsigned char *)avalue;
 							} else {
 								a = xar_attr_new();
-								XAR_ATTR(a)->key = strdup(aname);
+								xar_attr_setkey(a, aname);
 								XAR_ATTR(a)->value = strdup(avalue);
 								XAR_ATTR(a)->next = attrs;
 								attrs = XAR_ATTR(a);
@@ -1787,8 +2503,96 @@ static int32_t xar_unserialize(xar_t x) {
 		return -1;
 	}
 		
+STOPPED:
 	xmlFreeTextReader(reader);
 	xmlDictCleanup();
 	xmlCleanupCharEncodingHandlers();
 	return 0;
 }
+
+/* toclazy is read without the lock to see whether the files are loaded */
+#ifdef __ATOMIC_ACQUIRE
+#define TOC_STATE(x) __atomic_load_n(&XAR(x)->toclazy, __ATOMIC_ACQUIRE)
+#define TOC_SET_STATE(x, s) __atomic_store_n(&XAR(x)->toclazy, (s), __ATOMIC_RELEASE)
+#else
+#define TOC_STATE(x) (XAR(x)->toclazy)
+#define TOC_SET_STATE(x, s) (XAR(x)->toclazy = (s))
+#endif
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t xar_toc_load_lock = PTHREAD_MUTEX_INITIALIZER;
+#define TOC_LOAD_LOCK() pthread_mutex_lock(&xar_toc_load_lock)
+#define TOC_LOAD_UNLOCK() pthread_mutex_unlock(&xar_toc_load_lock)
+#else
+#define TOC_LOAD_LOCK() do { } while(0)
+#define TOC_LOAD_UNLOCK() do { } while(0)
+#endif
+
+static int32_t xar_toc_load_files(xar_t x);
+
+/* xar_toc_load
+ * x: archive to read the files of
+ * Returns: 0 or -1 if the files could not be read
+ * Summary: reads the files of an archive opened with XAR_OPEN_LAZY the
+ * first time they are needed.  The calls that need the files may be made
+ * from several threads, so the first one reads them under a lock and the
+ * others wait for it; once the files are read this is a single check.
+ */
+int32_t xar_toc_load(xar_t x) {
+	int32_t ret = 0;
+
+	if( TOC_STATE(x) == XAR_TOC_LOADED )
+		return 0;
+	TOC_LOAD_LOCK();
+	if( XAR(x)->toclazy == XAR_TOC_PENDING )
+		ret = xar_toc_load_files(x);
+	TOC_LOAD_UNLOCK();
+	return ret;
+}
+
+/* xar_toc_load_files
+ * Summary: does the work of xar_toc_load.  A deflate stream cannot be
+ * entered in the middle, so the TOC is inflated again from the start;
+ * what xar_open read already is skipped and the checksum is not computed
+ * again.
+ */
+static int32_t xar_toc_load_files(xar_t x) {
+	off_t pos = 0;
+	size_t toc_count;
+	int docksum;
+	int32_t ret;
+
+	if( XAR(x)->toccache && (xar_toccache_load(x) == 0) ) {
+		TOC_SET_STATE(x, XAR_TOC_LOADED);
+		return 0;
+	}
+
+	toc_count = XAR(x)->toc_count;
+	docksum = XAR(x)->docksum;
+	if( !XAR(x)->map ) {
+		pos = lseek(XAR(x)->fd, 0, SEEK_CUR);
+		if( (pos == -1) || (lseek(XAR(x)->fd, (off_t)XAR(x)->header.size, SEEK_SET) == -1) )
+			return -1;
+		XAR(x)->toc_count = 0;
+		XAR(x)->readbuf_len = XAR_DEFAULT_BUFFER_SIZE;
+	}
+	XAR(x)->offset = 0;
+	XAR(x)->docksum = 0;
+	inflateReset(&XAR(x)->zs);
+
+	TOC_SET_STATE(x, XAR_TOC_LOADING);
+	ret = xar_unserialize(x, NULL);
+
+	XAR(x)->docksum = docksum;
+	XAR(x)->toc_count = toc_count;
+	if( !XAR(x)->map && (lseek(XAR(x)->fd, pos, SEEK_SET) == -1) )
+		ret = -1;
+	TOC_SET_STATE(x, XAR_TOC_LOADED);
+	if( ret != 0 ) {
+		xar_err_new(x);
+		xar_err_set_string(x, "Error reading the files of the TOC");
+		xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+	} else if( XAR(x)->toccache )
+		xar_toccache_save(x);
+	return ret;
+}
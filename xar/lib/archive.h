@@ -62,6 +62,7 @@ struct __xar_t {
 	xar_attr_t attrs;      /* archive options, such as rsize */
 	const char *prefix;
 	const char *ns;
+	int32_t owner;          /* XAR_OWNER_ARCHIVE, see filetree.h */
 	const char *filler1;
 	const char *filler2;
 	xar_file_t files;       /* file forest */
@@ -71,6 +72,19 @@ struct __xar_t {
 	int heap_fd;            /* fd for tmp heap archive, used in creation */
 	off_t heap_offset;      /* current offset within the heap */
 	off_t heap_len;         /* current length of the heap */
+	off_t heap_start;       /* where the heap file starts in the archive
+	                         * when it is written in place, see heap.c */
+	char *append_path;      /* file written for XAR_OPEN_APPEND, renamed
+	                         * over the archive on close */
+	int append_fd;          /* the archive appended to */
+	off_t append_off;       /* its heap, less the TOC checksum, which */
+	off_t append_len;       /* starts the heap of the new archive */
+	struct __xar_repack_t *repack; /* data to copy from another archive,
+	                         * see repack.c */
+	int repack_failed;      /* a copy of it failed */
+	xar_t repack_dest;      /* archive with data to copy from this one */
+	struct __xar_heap_plan_t *heap_plan; /* order to copy the heap file
+	                         * in, see heaporder.c */
 	xar_header_ex_t header; /* header of the xar archive */
 	void *readbuf;          /* buffer for reading/writing compressed toc */
 	size_t readbuf_len;     /* length of readbuf */
@@ -87,6 +101,8 @@ struct __xar_t {
 	xmlHashTablePtr ino_hash;   /* Hash for looking up hardlinked files (add)*/
 	xmlHashTablePtr link_hash;  /* Hash for looking up hardlinked files (extract)*/
 	xmlHashTablePtr csum_hash;  /* Hash for looking up checksums of files */
+	xmlHashTablePtr xsum_hash;  /* files by extracted-checksum of their data */
+	xmlHashTablePtr prekey_hash; /* prekeys of the data archived, see xar_attrcopy_dedup */
 	EVP_MD_CTX *toc_ctx;
 	int docksum;
 	int skipwarn;
@@ -94,8 +110,34 @@ struct __xar_t {
 	int tostdout;
 	int rfcformat;
 	struct stat sbcache;
+	struct __xar_workers_t *workers; /* parallel data encoding (creation) */
+	const char *map;        /* archive mapped by XAR_OPEN_MMAP, or NULL */
+	size_t maplen;          /* length of map */
+	struct __xar_buffers_t *buffers; /* idle datamod buffers, see buffers.c */
+	const char *compression; /* codec picked for the data being encoded */
+	struct __xar_trials_t *trials; /* timing of XAR_OPT_VAL_AUTO, see io.c */
+	size_t datalen;         /* length of the data being encoded, 0 if
+	                         * not known up front */
+	xmlHashTablePtr path_index; /* files by parent and name, see pathindex.c */
+	uint64_t path_index_ids; /* last indexid handed out */
+	struct __xar_arena_t *arena; /* TOC read by xar_open, see arena.c */
+	int tocwalk;            /* XAR_OPEN_TOCWALK, 2 once the TOC is walked */
+	int toclazy;            /* XAR_OPEN_LAZY, see xar_toc_load */
+	int toccache;           /* XAR_OPEN_TOCCACHE, see toccache.c */
+	const char *toccache_map; /* cache the files were read from, or NULL */
+	size_t toccache_len;    /* length of toccache_map */
+	unsigned char toc_digest[EVP_MAX_MD_SIZE]; /* checksum of the TOC, */
+	unsigned int toc_digest_len;               /* once it is verified */
 };
 
 #define XAR(x) ((struct __xar_t *)(x))
 
+/* How far the files of the TOC have been read, see xar_toc_load */
+#define XAR_TOC_LOADED  0       /* all read, or not opened lazily */
+#define XAR_TOC_OPENING 1       /* xar_open stops at the first file */
+#define XAR_TOC_PENDING 2       /* files not read yet */
+#define XAR_TOC_LOADING 3       /* reading the files */
+
+int32_t xar_toc_load(xar_t x);
+
 #endif /* _XAR_ARCHIVE_H_ */
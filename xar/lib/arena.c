@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Arena for the in-memory TOC of an archive being read.
+ *
+ * Unserializing a TOC used to malloc every file, property and attribute
+ * and strdup every key and value, and xar_close freed them again one at a
+ * time.  Nodes and strings read from the TOC are now carved out of large
+ * blocks owned by the archive and released together when it is closed.
+ * The nodes record which of their parts came from the arena (XAR_POOL_*
+ * in filetree.h), so the tree can still be edited afterwards: anything
+ * replaced or added later is malloc'd and freed as before.
+ *
+ * An arena is only used by the thread opening the archive and is not
+ * locked.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "arena.h"
+
+/* alignment of every allocation */
+#define XAR_ARENA_ALIGN 16
+#define XAR_ARENA_ROUND(n) (((n) + XAR_ARENA_ALIGN - 1) & ~(size_t)(XAR_ARENA_ALIGN - 1))
+
+struct __xar_arena_block_t {
+	struct __xar_arena_block_t *next;  /* previously filled block */
+	size_t size;                       /* usable bytes after the header */
+	size_t used;                       /* bytes handed out */
+};
+
+#define XAR_ARENA_HEADER XAR_ARENA_ROUND(sizeof(struct __xar_arena_block_t))
+
+struct __xar_arena_t {
+	struct __xar_arena_block_t *blocks; /* current block first */
+	size_t next;                        /* size of the next block */
+};
+
+/* xar_arena_new
+ * Returns: an empty arena, or NULL if out of memory
+ */
+struct __xar_arena_t *xar_arena_new(void) {
+	struct __xar_arena_t *a;
+
+	a = calloc(1, sizeof(struct __xar_arena_t));
+	if( !a )
+		return NULL;
+	a->next = XAR_ARENA_BLOCK;
+	return a;
+}
+
+/* xar_arena_free
+ * a: arena to release, may be NULL
+ * Summary: frees every block, and with them everything allocated from a.
+ */
+void xar_arena_free(struct __xar_arena_t *a) {
+	struct __xar_arena_block_t *b;
+
+	if( !a )
+		return;
+	while( (b = a->blocks) ) {
+		a->blocks = b->next;
+		free(b);
+	}
+	free(a);
+}
+
+/* xar_arena_carve
+ * Summary: hands out size bytes of uninitialized memory, aligned to
+ * XAR_ARENA_ALIGN if align is set.  Requests too large for a block get
+ * a block of their own, which goes behind the current one so its free
+ * space is not lost.
+ */
+static void *xar_arena_carve(struct __xar_arena_t *a, size_t size, int align) {
+	struct __xar_arena_block_t *b = a->blocks;
+	size_t off = 0;
+
+	if( b )
+		off = align ? XAR_ARENA_ROUND(b->used) : b->used;
+	if( !b || (off > b->size) || (b->size - off < size) ) {
+		int own = size > a->next / 4;
+		size_t bsize = own ? XAR_ARENA_ROUND(size) : a->next;
+
+		b = malloc(XAR_ARENA_HEADER + bsize);
+		if( !b )
+			return NULL;
+		b->size = bsize;
+		off = 0;
+		if( own && a->blocks ) {
+			b->next = a->blocks->next;
+			a->blocks->next = b;
+		} else {
+			b->next = a->blocks;
+			a->blocks = b;
+			if( !own && (a->next < XAR_ARENA_MAX_BLOCK) )
+				a->next *= 2;
+		}
+	}
+
+	b->used = off + size;
+	return (char *)b + XAR_ARENA_HEADER + off;
+}
+
+/* xar_arena_alloc
+ * a: arena to allocate from
+ * size: number of bytes needed
+ * Returns: zeroed memory that lives until the arena is freed, or NULL
+ */
+void *xar_arena_alloc(struct __xar_arena_t *a, size_t size) {
+	void *ret;
+
+	ret = xar_arena_carve(a, size, 1);
+	if( ret )
+		memset(ret, 0, size);
+	return ret;
+}
+
+/* xar_arena_strdup
+ * a: arena to allocate from
+ * s: string to copy
+ * Returns: a copy of s that lives until the arena is freed, or NULL
+ */
+char *xar_arena_strdup(struct __xar_arena_t *a, const char *s) {
+	size_t len = strlen(s) + 1;
+	char *ret;
+
+	ret = xar_arena_carve(a, len, 0);
+	if( ret )
+		memcpy(ret, s, len);
+	return ret;
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reusable data buffers for the datamod pipeline.
+ *
+ * Every block of file data read from disk or from the heap used to live
+ * in a freshly malloc'd buffer, and each compression module handed back a
+ * freshly realloc'd one, so archiving or extracting a large tree spent a
+ * good part of its time in the allocator.  Buffers are now taken from a
+ * pool hanging off the archive and returned to it when the block is done
+ * with.  The datamod calling convention is unchanged: a module that
+ * replaces *in gets its output from xar_buffer_grow and gives the old
+ * input back with xar_buffer_put.
+ *
+ * Each buffer carries its capacity in a small header in front of the
+ * data, so modules can use all of a recycled buffer rather than the size
+ * they asked for.  The pool is shared by the worker and extractor copies
+ * of an archive handle and is locked when pthreads are available.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include "xar.h"
+#include "archive.h"
+#include "buffers.h"
+
+struct __xar_buffer_t {
+	struct __xar_buffer_t *next;  /* next idle buffer in the pool */
+	size_t size;                  /* usable bytes following the header */
+};
+
+struct __xar_buffers_t {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+	struct __xar_buffer_t *spare; /* idle buffers */
+	int count;
+};
+
+#define BUFFER(b) ((struct __xar_buffer_t *)(b) - 1)
+
+#ifdef HAVE_PTHREAD
+#define POOL_LOCK(b) pthread_mutex_lock(&(b)->lock)
+#define POOL_UNLOCK(b) pthread_mutex_unlock(&(b)->lock)
+#else
+#define POOL_LOCK(b) do { } while(0)
+#define POOL_UNLOCK(b) do { } while(0)
+#endif
+
+static void *buffer_alloc(size_t size) {
+	struct __xar_buffer_t *b;
+
+	b = malloc(sizeof(struct __xar_buffer_t) + size);
+	if( !b )
+		return NULL;
+	b->next = NULL;
+	b->size = size;
+	return b + 1;
+}
+
+struct __xar_buffers_t *xar_buffers_new(void) {
+	struct __xar_buffers_t *b;
+
+	b = calloc(1, sizeof(struct __xar_buffers_t));
+	if( !b )
+		return NULL;
+#ifdef HAVE_PTHREAD
+	if( pthread_mutex_init(&b->lock, NULL) != 0 ) {
+		free(b);
+		return NULL;
+	}
+#endif
+	return b;
+}
+
+void xar_buffers_free(struct __xar_buffers_t *b) {
+	struct __xar_buffer_t *s;
+
+	if( !b )
+		return;
+	while( (s = b->spare) ) {
+		b->spare = s->next;
+		free(s);
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&b->lock);
+#endif
+	free(b);
+}
+
+/* xar_buffer_get
+ * x: archive whose pool the buffer comes from
+ * size: minimum number of bytes needed
+ * Returns: a buffer of at least size bytes, or NULL if out of memory.
+ * Summary: the buffer must be released with xar_buffer_put, never with
+ * free().
+ */
+void *xar_buffer_get(xar_t x, size_t size) {
+	struct __xar_buffers_t *b = XAR(x)->buffers;
+	struct __xar_buffer_t *s, **sp;
+
+	if( !b )
+		return buffer_alloc(size);
+
+	POOL_LOCK(b);
+	for( sp = &b->spare; (s = *sp); sp = &s->next ) {
+		if( s->size >= size ) {
+			*sp = s->next;
+			b->count--;
+			POOL_UNLOCK(b);
+			s->next = NULL;
+			return s + 1;
+		}
+	}
+	/* nothing fits: retire the oldest idle buffer to make room for a
+	 * bigger one, so the pool follows the sizes actually in use.
+	 */
+	s = NULL;
+	if( b->count == XAR_BUFFERS_SPARE ) {
+		for( sp = &b->spare; (*sp)->next; sp = &(*sp)->next )
+			;
+		s = *sp;
+		*sp = NULL;
+		b->count--;
+	}
+	POOL_UNLOCK(b);
+	free(s);
+	return buffer_alloc(size);
+}
+
+/* xar_buffer_grow
+ * x: archive whose pool the buffer comes from
+ * buf: buffer from xar_buffer_get, or NULL
+ * size: minimum number of bytes needed
+ * Returns: buf, or a bigger buffer holding its contents, or NULL if out
+ * of memory, in which case buf is left alone.
+ * Summary: like realloc(), but keeps the buffer's capacity when it is
+ * already big enough.  Use xar_buffer_size for the actual capacity.
+ */
+void *xar_buffer_grow(xar_t x, void *buf, size_t size) {
+	struct __xar_buffer_t *s;
+
+	if( !buf )
+		return xar_buffer_get(x, size);
+	if( BUFFER(buf)->size >= size )
+		return buf;
+	s = realloc(BUFFER(buf), sizeof(struct __xar_buffer_t) + size);
+	if( !s )
+		return NULL;
+	s->size = size;
+	return s + 1;
+}
+
+size_t xar_buffer_size(const void *buf) {
+	return ((const struct __xar_buffer_t *)buf - 1)->size;
+}
+
+/* xar_buffer_put
+ * x: archive whose pool the buffer goes back to
+ * buf: buffer from xar_buffer_get or xar_buffer_grow, may be NULL
+ * Summary: keeps buf for reuse, or frees it when the pool is full.
+ */
+void xar_buffer_put(xar_t x, void *buf) {
+	struct __xar_buffers_t *b = XAR(x)->buffers;
+	struct __xar_buffer_t *s;
+
+	if( !buf )
+		return;
+	s = BUFFER(buf);
+	if( b && (s->size <= XAR_BUFFERS_MAX_SPARE) ) {
+		POOL_LOCK(b);
+		if( b->count < XAR_BUFFERS_SPARE ) {
+			s->next = b->spare;
+			b->spare = s;
+			b->count++;
+			s = NULL;
+		}
+		POOL_UNLOCK(b);
+	}
+	free(s);
+}
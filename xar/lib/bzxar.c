@@ -51,6 +51,7 @@
 #include "xar.h"
 #include "filetree.h"
 #include "io.h"
+#include "buffers.h"
 
 #ifdef HAVE_LIBBZ2
 
@@ -122,9 +123,9 @@ int xar_bzip_fromheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t
 	BZIP2_CONTEXT(context)->bz.avail_out = 0;
 
 	while( BZIP2_CONTEXT(context)->bz.avail_in != 0 ) {
-		outlen = outlen * 2;
-		out = realloc(out, outlen);
+		out = xar_buffer_grow(x, out, outlen * 2);
 		if( out == NULL ) abort();
+		outlen = xar_buffer_size(out);
 
 		BZIP2_CONTEXT(context)->bz.next_out = ((char *)out) + offset;
 		BZIP2_CONTEXT(context)->bz.avail_out = (unsigned)(outlen - offset);
@@ -142,7 +143,7 @@ int xar_bzip_fromheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t
 			break;
 	}
 
-	free(*in);
+	xar_buffer_put(x, *in);
 	*in = out;
 	*inlen = offset;
 #else
@@ -198,7 +199,7 @@ int32_t xar_bzip_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		int level = 9;
 		*context = calloc(1,sizeof(struct _bzip_context));
 		
-		opt = xar_opt_get(x, XAR_OPT_COMPRESSION);
+		opt = xar_compression(x);
 		if( !opt )
 			return 0;
 		
@@ -208,7 +209,7 @@ int32_t xar_bzip_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		if( xar_prevent_recompress(x, *in, *inlen) )
 			return 0;
 
-		opt = xar_opt_get(x, XAR_OPT_COMPRESSIONARG);
+		opt = xar_compression_arg(x);
 		if( opt ) {
 			int tmp;
 			errno = 0;
@@ -237,9 +238,9 @@ int32_t xar_bzip_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 
 	if( *inlen != 0 ) {
 		do {
-			outlen *= 2;
-			out = realloc(out, outlen);
+			out = xar_buffer_grow(x, out, outlen * 2);
 			if( out == NULL ) abort();
+			outlen = xar_buffer_size(out);
 
 			BZIP2_CONTEXT(context)->bz.next_out = ((char *)out) + offset;
 			BZIP2_CONTEXT(context)->bz.avail_out = (unsigned)(outlen - offset);
@@ -249,9 +250,9 @@ int32_t xar_bzip_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		} while( r == BZ_RUN_OK && BZIP2_CONTEXT(context)->bz.avail_in != 0 );
 	} else {
 		do {
-			outlen *= 2;
-			out = realloc(out, outlen);
+			out = xar_buffer_grow(x, out, outlen * 2);
 			if( out == NULL ) abort();
+			outlen = xar_buffer_size(out);
 
 			BZIP2_CONTEXT(context)->bz.next_out = ((char *)out) + offset;
 			BZIP2_CONTEXT(context)->bz.avail_out = (unsigned)(outlen - offset);
@@ -270,12 +271,12 @@ int32_t xar_bzip_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		return -1;
 	}
 	
-	free(*in);
+	xar_buffer_put(x, *in);
 	*in = out;
 	*inlen = offset;
 #else
 	(void)p; (void)in; (void)inlen; (void)context;
-	opt = xar_opt_get(x, XAR_OPT_COMPRESSION);
+	opt = xar_compression(x);
 	if( !opt )
 		return 0;
 	if( strcmp(opt, XAR_OPT_VAL_BZIP) != 0 )
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Content-defined chunking for XAR_OPT_DEDUPCHUNKS.
+ *
+ * Data is cut where a rolling hash of the last 64 bytes has its top bits
+ * clear, so the cuts follow the contents: inserting or removing bytes
+ * only moves the cuts around the change, and the chunks elsewhere come
+ * out the same as in other copies of the data.  The hash is a gear hash,
+ * shifted one bit per byte with a random value added for the byte, as
+ * used by FastCDC.
+ */
+
+#include "config.h"
+#include <string.h>
+
+#include "cdc.h"
+
+/* xar_cdc_init
+ * cdc: chunker to set up
+ * avg: average chunk size wanted, rounded down to a power of two
+ * Summary: the gear values come from a fixed seed, so that the same data
+ * is always cut in the same places.
+ */
+void xar_cdc_init(struct __xar_cdc_t *cdc, size_t avg) {
+	uint64_t s = 0x9e3779b97f4a7c15ULL;
+	int bits, i;
+
+	for( i = 0; i < 256; i++ ) {
+		uint64_t z;
+
+		/* splitmix64 */
+		s += 0x9e3779b97f4a7c15ULL;
+		z = s;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		cdc->gear[i] = z ^ (z >> 31);
+	}
+
+	if( avg < XAR_CDC_MINIMUM )
+		avg = XAR_CDC_MINIMUM;
+	for( bits = 0; ((size_t)2 << bits) <= avg; bits++ );
+	cdc->avg = (size_t)1 << bits;
+	/* the top bits of the hash depend on the most bytes */
+	cdc->mask = ((1ULL << bits) - 1) << (64 - bits);
+	cdc->min = cdc->avg / XAR_CDC_SPREAD;
+	cdc->max = cdc->avg * XAR_CDC_SPREAD;
+}
+
+/* xar_cdc_cut
+ * cdc: chunker set up by xar_cdc_init
+ * buf, len: data from the start of a chunk
+ * Returns: the length of the chunk, which is len if the data ends before
+ * a cut is found.  Callers must pass at least cdc->max bytes, unless the
+ * data ends within them.
+ */
+size_t xar_cdc_cut(const struct __xar_cdc_t *cdc, const unsigned char *buf, size_t len) {
+	uint64_t h = 0;
+	size_t i;
+
+	if( len <= cdc->min )
+		return len;
+	if( len > cdc->max )
+		len = cdc->max;
+	for( i = cdc->min; i < len; i++ ) {
+		h = (h << 1) + cdc->gear[buf[i]];
+		if( !(h & cdc->mask) )
+			return i + 1;
+	}
+	return len;
+}
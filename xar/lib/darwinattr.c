@@ -56,6 +56,7 @@
 #include "appledouble.h"
 #include "stat.h"
 #include "archive.h"
+#include "pathindex.h"
 
 #if defined(HAVE_SYS_XATTR_H)
 #include <sys/xattr.h>
@@ -458,7 +459,7 @@ xar_file_t xar_underbar_check(xar_t x, xar_file_t f, const char* file, void *con
 		 */
 		if( stat(tmp2, &sb) ) {
 			xar_file_t tmpf;
-			tmpf = xar_file_find(XAR(x)->files, nupath);
+			tmpf = xar_path_find(x, nupath);
 			if( !tmpf ) {
 				tmpf = xar_add(x, nupath);
 			}
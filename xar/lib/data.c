@@ -40,12 +40,14 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include "xar.h"
 #include "filetree.h"
 #include "archive.h"
 #include "io.h"
 #include "arcmod.h"
+#include "workers.h"
 
 #ifndef O_EXLOCK
 #define O_EXLOCK 0
@@ -142,6 +144,7 @@ int32_t xar_data_archive(xar_t x, xar_file_t f, const char *file, const char *bu
 	const char *opt;
 	int32_t retval = 0;
 	struct _data_context context;
+	struct stat sb;
 	xar_prop_t tmpp;
 	
 	memset(&context,0,sizeof(struct _data_context));
@@ -183,7 +186,27 @@ int32_t xar_data_archive(xar_t x, xar_file_t f, const char *file, const char *bu
 #endif
 
 	tmpp = xar_prop_pset(f, NULL, "data", NULL);
+
+	/* data archived already need not be encoded again */
+	if( 0 == len ) {
+		retval = xar_attrcopy_dedup(x, f, tmpp, context.fd);
+		if( retval <= 0 ) {
+			close(context.fd);
+			return retval;
+		}
+		retval = 0;
+	}
+
+	/* hand the file to the worker pool, if there is one; it now owns the fd */
+	if( (0 == len) && (xar_workers_submit_fd(x, f, tmpp, context.fd) == 0) )
+		return 0;
+
+	/* only a hint for the codecs, the file may still change */
+	XAR(x)->datalen = len;
+	if( (0 == len) && (fstat(context.fd, &sb) == 0) && S_ISREG(sb.st_mode) )
+		XAR(x)->datalen = (size_t)sb.st_size;
 	retval = xar_attrcopy_to_heap(x, f, tmpp, xar_data_read,(void *)(&context));
+	XAR(x)->datalen = 0;
 	if( context.total == 0 )
 		xar_prop_unset(f, "data");
 
@@ -204,10 +227,8 @@ int32_t xar_data_extract(xar_t x, xar_file_t f, const char *file, char *buffer,
 	memset(&context,0,sizeof(struct _data_context));
 	
 	/* Only regular files are copied in and out of the heap here */
-	xar_prop_get(f, "type", &opt);
-	if( !opt ) return 0;
-	if( strcmp(opt, "file") != 0 ) {
-		if( strcmp(opt, "hardlink") == 0 ) {
+	if( xar_file_cache(f)->ftype != XAR_FTYPE_FILE ) {
+		if( xar_file_cache(f)->ftype == XAR_FTYPE_HARDLINK ) {
 			opt = xar_attr_get(f, "type", "link");
 			if( !opt )
 				return 0;
@@ -237,14 +258,16 @@ int32_t xar_data_extract(xar_t x, xar_file_t f, const char *file, char *buffer,
 		
 	}
 	
-	tmpp = xar_prop_pfirst(f);
-	if( tmpp )
-		tmpp = xar_prop_find(tmpp, "data");
+	tmpp = xar_file_cache(f)->data;
 	if( !tmpp ) {
 		close(context.fd);
 		return 0;
 	}
-	retval = xar_attrcopy_from_heap(x, f, tmpp, xar_data_write, (void *)(&context));
+	retval = 1;
+	if( !len )
+		retval = xar_attrcopy_from_heap_to_fd(x, f, tmpp, context.fd);
+	if( retval > 0 )
+		retval = xar_attrcopy_from_heap(x, f, tmpp, xar_data_write, (void *)(&context));
 	
 	if( context.fd > 0 ){		
 		close(context.fd);
@@ -256,21 +279,17 @@ int32_t xar_data_extract(xar_t x, xar_file_t f, const char *file, char *buffer,
 
 int32_t xar_data_verify(xar_t x, xar_file_t f)
 {
-	const char *opt;
 	struct _data_context context;
 	xar_prop_t tmpp;
 	
 	memset(&context,0,sizeof(struct _data_context));
 
 	/* Only regular files are copied in and out of the heap here */
-	xar_prop_get(f, "type", &opt);
-	if( !opt ) return 0;
-	if( strcmp(opt, "directory") == 0 ) {
+	if( xar_file_cache(f)->ftype == XAR_FTYPE_NONE ) return 0;
+	if( xar_file_cache(f)->ftype == XAR_FTYPE_DIRECTORY ) {
 		return 0;
 	}
 	
-	tmpp = xar_prop_pfirst(f);
-	if( tmpp )
-		tmpp = xar_prop_find(tmpp, "data");
+	tmpp = xar_file_cache(f)->data;
 	return xar_attrcopy_from_heap(x, f, tmpp, NULL , (void *)(&context));
 }
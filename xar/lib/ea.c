@@ -77,7 +77,7 @@ xar_ea_t xar_ea_new(xar_file_t f, const char *name)
 	xar_prop_setkey(XAR_EA(ret)->prop, "ea");
 	xar_prop_setvalue(XAR_EA(ret)->prop, NULL);
 	XAR_PROP(XAR_EA(ret)->prop)->attrs = xar_attr_new();
-	XAR_ATTR(XAR_PROP(XAR_EA(ret)->prop)->attrs)->key = strdup("id");
+	xar_attr_setkey(XAR_PROP(XAR_EA(ret)->prop)->attrs, "id");
 	XAR_ATTR(XAR_PROP(XAR_EA(ret)->prop)->attrs)->value = newidvalue;
 
 	xar_prop_pset(f, XAR_EA(ret)->prop, "name", name);
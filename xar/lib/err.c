@@ -80,7 +80,10 @@ void  xar_err_set_errno(xar_t x, int e) {
 }
 
 void xar_err_new(xar_t x) {
+	void *usrctx = XAR(x)->errctx.usrctx;
+
 	memset(&XAR(x)->errctx, 0, sizeof(struct errctx));
+	XAR(x)->errctx.usrctx = usrctx;
 	XAR(x)->errctx.saved_errno = errno;
 	return;
 }
@@ -41,8 +41,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 #include <libgen.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <libxml/xmlwriter.h>
 #include <libxml/xmlreader.h>
 #include <libxml/xmlstring.h>
@@ -55,6 +59,13 @@
 #include "archive.h"
 #include "b64.h"
 #include "ea.h"
+#include "arena.h"
+#include "subdoc.h"
+#include "intern.h"
+
+/* XAR_FILE_CHANGED reads owner through a xar_t or xar_subdoc_t too */
+typedef char xar_owner_shared[((offsetof(struct __xar_t, owner) == offsetof(struct __xar_file_t, owner)) &&
+                               (offsetof(struct __xar_subdoc_t, owner) == offsetof(struct __xar_file_t, owner))) ? 1 : -1];
 
 /* Overview:
  * xar_file_t's exist within a xar_archive_t.  xar_prop_t's exist
@@ -95,11 +106,60 @@ xar_attr_t xar_attr_new(void) {
 	XAR_ATTR(ret)->value = NULL;
 	XAR_ATTR(ret)->next = NULL;
 	XAR_ATTR(ret)->ns = NULL;
+	XAR_ATTR(ret)->pool = 0;
 	return ret;
 }
 
+/* xar_attr_setkey
+ * a: attribute to name
+ * key: its name
+ * Summary: sets the name of a new attribute to the interned copy of key.
+ */
+void xar_attr_setkey(xar_attr_t a, const char *key) {
+	const char *k = xar_intern(key);
+
+	if( k ) {
+		XAR_ATTR(a)->key = k;
+		XAR_ATTR(a)->pool |= XAR_POOL_KEY;
+	} else {
+		XAR_ATTR(a)->key = strdup(key);
+	}
+}
+
+/* xar_attr_unserialize
+ * arena: arena to allocate from, NULL to use malloc
+ * withns: keep the namespace prefix of the attribute
+ * Returns: a new attribute holding the attribute the reader is on
+ */
+static xar_attr_t xar_attr_unserialize(struct __xar_arena_t *arena, xmlTextReaderPtr reader, int withns) {
+	xar_attr_t a;
+	const char *name = (const char *)xmlTextReaderConstLocalName(reader);
+	const char *value = (const char *)xmlTextReaderConstValue(reader);
+	const char *ns = withns ? (const char *)xmlTextReaderConstPrefix(reader) : NULL;
+
+	if( !arena ) {
+		a = xar_attr_new();
+		if( !a ) return NULL;
+		xar_attr_setkey(a, name);
+		XAR_ATTR(a)->value = strdup(value);
+		if(ns) XAR_ATTR(a)->ns = strdup(ns);
+		return a;
+	}
+
+	a = xar_arena_alloc(arena, sizeof(struct __xar_attr_t));
+	if( !a ) return NULL;
+	XAR_ATTR(a)->pool = XAR_POOL_NODE | XAR_POOL_VALUE;
+	xar_attr_setkey(a, name);
+	XAR_ATTR(a)->value = xar_arena_strdup(arena, value);
+	if(ns) XAR_ATTR(a)->ns = xar_arena_strdup(arena, ns);
+	return a;
+}
+
 int32_t xar_attr_pset(xar_file_t f, xar_prop_t p, const char *key, const char *value) {
 	xar_attr_t a, i;
+	const char *k;
+	size_t len;
+	XAR_FILE_CHANGED(f);
 	if( !p ) {
 		a = XAR_FILE(f)->attrs;
 	} else {
@@ -112,14 +172,18 @@ int32_t xar_attr_pset(xar_file_t f, xar_prop_t p, const char *key, const char *v
 			XAR_FILE(f)->attrs = a;
 		else
 			XAR_PROP(p)->attrs = a;
-		XAR_ATTR(a)->key = strdup(key);
+		xar_attr_setkey(a, key);
 		XAR_ATTR(a)->value = strdup(value);
 		return 0;
 	}
 
-	for(i = a; i && XAR_ATTR(i)->next; i = XAR_ATTR(i)->next) {
-		if(strcmp(XAR_ATTR(i)->key, key)==0) {
-			free((char*)XAR_ATTR(i)->value);
+	len = strlen(key);
+	k = xar_intern_find(key, len);
+	for(i = a; i; i = XAR_ATTR(i)->next) {
+		if( xar_key_match(XAR_ATTR(i)->key, XAR_ATTR(i)->pool & XAR_POOL_KEY, k, key, len) ) {
+			if( !(XAR_ATTR(i)->pool & XAR_POOL_VALUE) )
+				free((char*)XAR_ATTR(i)->value);
+			XAR_ATTR(i)->pool &= ~XAR_POOL_VALUE;
 			XAR_ATTR(i)->value = strdup(value);
 			return 0;
 		}
@@ -132,7 +196,7 @@ int32_t xar_attr_pset(xar_file_t f, xar_prop_t p, const char *key, const char *v
 		XAR_ATTR(a)->next = XAR_ATTR(XAR_PROP(p)->attrs);
 		XAR_PROP(p)->attrs = a;
 	}
-	XAR_ATTR(a)->key = strdup(key);
+	xar_attr_setkey(a, key);
 	XAR_ATTR(a)->value = strdup(value);
 	return 0;
 }
@@ -161,6 +225,8 @@ int32_t xar_attr_set(xar_file_t f, const char *prop, const char *key, const char
 
 const char *xar_attr_pget(xar_file_t f, xar_prop_t p, const char *key) {
 	xar_attr_t a, i;
+	const char *k;
+	size_t len;
 
 	if( !p )
 		a = XAR_FILE(f)->attrs;
@@ -169,13 +235,12 @@ const char *xar_attr_pget(xar_file_t f, xar_prop_t p, const char *key) {
 
 	if( !a ) return NULL;
 
-	for(i = a; i && XAR_ATTR(i)->next; i = XAR_ATTR(i)->next) {
-		if(strcmp(XAR_ATTR(i)->key, key)==0) {
+	len = strlen(key);
+	k = xar_intern_find(key, len);
+	for(i = a; i; i = XAR_ATTR(i)->next) {
+		if( xar_key_match(XAR_ATTR(i)->key, XAR_ATTR(i)->pool & XAR_POOL_KEY, k, key, len) )
 			return XAR_ATTR(i)->value;
-		}
 	}
-	if( i && (strcmp(XAR_ATTR(i)->key, key)==0))
-		return XAR_ATTR(i)->value;
 	return NULL;
 }
 
@@ -206,9 +271,12 @@ const char *xar_attr_get(xar_file_t f, const char *prop, const char *key) {
  */
 void xar_attr_free(xar_attr_t a) {
 	if(!a) return;
-	free((char*)XAR_ATTR(a)->key);
-	free((char*)XAR_ATTR(a)->value);
-	free(XAR_ATTR(a));
+	if( !(XAR_ATTR(a)->pool & XAR_POOL_KEY) )
+		free((char*)XAR_ATTR(a)->key);
+	if( !(XAR_ATTR(a)->pool & XAR_POOL_VALUE) )
+		free((char*)XAR_ATTR(a)->value);
+	if( !(XAR_ATTR(a)->pool & XAR_POOL_NODE) )
+		free(XAR_ATTR(a));
 	return;
 }
 
@@ -291,13 +359,28 @@ const char *xar_prop_getvalue(xar_prop_t p) {
 	return XAR_PROP(p)->value;
 }
 int32_t xar_prop_setkey(xar_prop_t p, const char *key) {
-	free((char *)XAR_PROP(p)->key);
-	if(key)
-		XAR_PROP(p)->key = strdup(key);
+	if( XAR_PROP(p)->file )
+		XAR_FILE_CHANGED(XAR_PROP(p)->file);
+	if( !(XAR_PROP(p)->pool & XAR_POOL_KEY) )
+		free((char *)XAR_PROP(p)->key);
+	XAR_PROP(p)->pool &= ~XAR_POOL_KEY;
+	XAR_PROP(p)->key = NULL;
+	if(key) {
+		XAR_PROP(p)->key = xar_intern(key);
+		if( XAR_PROP(p)->key )
+			XAR_PROP(p)->pool |= XAR_POOL_KEY;
+		else
+			XAR_PROP(p)->key = strdup(key);
+	}
 	return 0;
 }
 int32_t xar_prop_setvalue(xar_prop_t p, const char *value) {
-	free((char *)XAR_PROP(p)->value);
+	if( XAR_PROP(p)->file )
+		XAR_FILE_CHANGED(XAR_PROP(p)->file);
+	if( !(XAR_PROP(p)->pool & XAR_POOL_VALUE) )
+		free((char *)XAR_PROP(p)->value);
+	XAR_PROP(p)->pool &= ~XAR_POOL_VALUE;
+	XAR_PROP(p)->value = NULL;
 	if(value)
 		XAR_PROP(p)->value = strdup(value);
 	return 0;
@@ -406,19 +489,21 @@ SUCCESS:
 	return XAR_ITER(i)->node;
 }
 
-/* xar_prop_new
- * f: file to associate the new file with.  May not be NULL
- * parent: the parent property of the new property.  May be NULL
- * Returns: a newly allocated and initialized property.  
- * Summary: in addition to allocating the new property, it
- * will be inserted into the parent node's list of children,
- * and/or added to the file's list of properties, as appropriate.
+/* xar_prop_anew
+ * Summary: xar_prop_new, taking the property from arena unless it is NULL.
  */
-xar_prop_t xar_prop_new(xar_file_t f, xar_prop_t parent) {
+static xar_prop_t xar_prop_anew(struct __xar_arena_t *arena, xar_file_t f, xar_prop_t parent) {
 	xar_prop_t p;
 
-	p = malloc(sizeof(struct __xar_prop_t));
-	if( !p ) return NULL;
+	if( arena ) {
+		p = xar_arena_alloc(arena, sizeof(struct __xar_prop_t));
+		if( !p ) return NULL;
+		XAR_PROP(p)->pool = XAR_POOL_NODE;
+	} else {
+		p = malloc(sizeof(struct __xar_prop_t));
+		if( !p ) return NULL;
+		XAR_PROP(p)->pool = 0;
+	}
 
 	XAR_PROP(p)->key = NULL;
 	XAR_PROP(p)->value = NULL;
@@ -428,6 +513,7 @@ xar_prop_t xar_prop_new(xar_file_t f, xar_prop_t parent) {
 	XAR_PROP(p)->parent = parent;
 	XAR_PROP(p)->file = f;
 	XAR_PROP(p)->prefix = XAR_FILE(f)->prefix;
+	XAR_FILE_CHANGED(f);
 	XAR_PROP(p)->ns = NULL;
 	if(parent) {
 		if( !XAR_PROP(parent)->children ) {
@@ -448,6 +534,18 @@ xar_prop_t xar_prop_new(xar_file_t f, xar_prop_t parent) {
 	return p;
 }
 
+/* xar_prop_new
+ * f: file to associate the new file with.  May not be NULL
+ * parent: the parent property of the new property.  May be NULL
+ * Returns: a newly allocated and initialized property.  
+ * Summary: in addition to allocating the new property, it
+ * will be inserted into the parent node's list of children,
+ * and/or added to the file's list of properties, as appropriate.
+ */
+xar_prop_t xar_prop_new(xar_file_t f, xar_prop_t parent) {
+	return xar_prop_anew(NULL, f, parent);
+}
+
 /* xar_prop_find
  * p: property to check
  * key: name of property to find.
@@ -457,26 +555,21 @@ xar_prop_t xar_prop_new(xar_file_t f, xar_prop_t parent) {
  * "/" separator.  
  */
 xar_prop_t xar_prop_find(xar_prop_t p, const char *key) {
-	xar_prop_t i, ret;
-	char *tmp1, *tmp2, *tmp3;
+	xar_prop_t i;
+	const char *end, *k;
+	size_t len;
 
 	if( !p ) return NULL;
-	tmp2 = tmp1 = strdup(key);
-	tmp3 = strsep(&tmp2, "/");
-	i = p;
-	do {
-		if( strcmp(tmp3, XAR_PROP(i)->key) == 0 ) {
-			if( tmp2 == NULL ) {
-				free(tmp1);
+	end = strchr(key, '/');
+	len = end ? (size_t)(end - key) : strlen(key);
+	k = xar_intern_find(key, len);
+	for( i = p; i; i = XAR_PROP(i)->next ) {
+		if( xar_key_match(XAR_PROP(i)->key, XAR_PROP(i)->pool & XAR_POOL_KEY, k, key, len) ) {
+			if( end == NULL )
 				return i;
-			}
-			ret = xar_prop_find(XAR_PROP(i)->children, tmp2);
-			free(tmp1);
-			return ret;
+			return xar_prop_find(XAR_PROP(i)->children, end+1);
 		}
-		i = XAR_PROP(i)->next;
-	} while(i);
-	free(tmp1);
+	}
 	return NULL;
 }
 
@@ -614,15 +707,8 @@ int32_t xar_prop_get(xar_file_t f, const char *key, const char **value) {
 }
 
 xar_prop_t xar_prop_pget(xar_prop_t p, const char *key) {
-	char *tmp;
-	const char *k;
-	xar_prop_t ret;
-	k = XAR_PROP(p)->key;
-	if (asprintf(&tmp, "%s/%s", k, key) == -1)
-		return NULL;
-	ret = xar_prop_find(p, tmp);
-	free(tmp);
-	return ret;
+	/* the same as finding "<key of p>/key" starting at p */
+	return xar_prop_find(XAR_PROP(p)->children, key);
 }
 
 /* xar_prop_replicate_r
@@ -643,7 +729,7 @@ void xar_prop_replicate_r(xar_file_t f, xar_prop_t p, xar_prop_t parent )
 		xar_attr_t last;
 		
 		/* copy the key value for the property */
-		XAR_PROP(newprop)->key = strdup(property->key);
+		xar_prop_setkey(newprop, property->key);
 		if(property->value)
 			XAR_PROP(newprop)->value = strdup(property->value);
 		
@@ -661,7 +747,7 @@ void xar_prop_replicate_r(xar_file_t f, xar_prop_t p, xar_prop_t parent )
 				last = XAR_ATTR(last)->next;
 			}
 			
-			XAR_ATTR(last)->key = strdup(a->key);
+			xar_attr_setkey(last, a->key);
 			if(a->value)
 				XAR_ATTR(last)->value = strdup(a->value);
 		}
@@ -691,9 +777,12 @@ void xar_prop_free(xar_prop_t p) {
 		XAR_PROP(p)->attrs = XAR_ATTR(a)->next;
 		xar_attr_free(a);
 	}
-	free((char*)XAR_PROP(p)->key);
-	free((char*)XAR_PROP(p)->value);
-	free(XAR_PROP(p));
+	if( !(XAR_PROP(p)->pool & XAR_POOL_KEY) )
+		free((char*)XAR_PROP(p)->key);
+	if( !(XAR_PROP(p)->pool & XAR_POOL_VALUE) )
+		free((char*)XAR_PROP(p)->value);
+	if( !(XAR_PROP(p)->pool & XAR_POOL_NODE) )
+		free(XAR_PROP(p));
 }
 
 void xar_prop_punset(xar_file_t f, xar_prop_t p) {
@@ -701,6 +790,7 @@ void xar_prop_punset(xar_file_t f, xar_prop_t p) {
 	if( !p ) {
 		return;
 	}
+	XAR_FILE_CHANGED(f);
 	if( XAR_PROP(p)->parent ) {
 		i = XAR_PROP(p)->parent->children;
 		if( i == p ) {
@@ -744,6 +834,7 @@ xar_file_t xar_file_new(xar_file_t f) {
 	ret = calloc(1, sizeof(struct __xar_file_t));
 	if(!ret) return NULL;
 
+	XAR_FILE(ret)->owner = XAR_OWNER_FILE;
 	XAR_FILE(ret)->parent = f;
 	XAR_FILE(ret)->next = NULL;
 	XAR_FILE(ret)->children = NULL;
@@ -766,6 +857,117 @@ xar_file_t xar_file_new(xar_file_t f) {
 	return ret;
 }
 
+/* xar_file_ftype
+ * type: value of a type property
+ * Returns: the XAR_FTYPE_* for type
+ */
+static int32_t xar_file_ftype(const char *type) {
+	static const struct {
+		const char *name;
+		int32_t ftype;
+	} ftypes[] = {
+		{ "file", XAR_FTYPE_FILE },
+		{ "directory", XAR_FTYPE_DIRECTORY },
+		{ "hardlink", XAR_FTYPE_HARDLINK },
+		{ "symlink", XAR_FTYPE_SYMLINK },
+		{ "fifo", XAR_FTYPE_FIFO },
+		{ "character special", XAR_FTYPE_CHAR },
+		{ "block special", XAR_FTYPE_BLOCK },
+		{ "socket", XAR_FTYPE_SOCKET },
+		{ "whiteout", XAR_FTYPE_WHITEOUT },
+		{ NULL, XAR_FTYPE_UNKNOWN }
+	};
+	int i;
+
+	if( !type )
+		return XAR_FTYPE_NONE;
+	for( i = 0; ftypes[i].name; i++ )
+		if( strcmp(type, ftypes[i].name) == 0 )
+			break;
+	return ftypes[i].ftype;
+}
+
+/* Whether the cache of a file is valid.  Files read from a TOC have it
+ * filled by xar_file_loaded, so readers only ever load the flag, but a
+ * file changed after that is filled again by whichever thread reads it
+ * first, under xar_file_cache_lock.
+ */
+#ifdef __ATOMIC_ACQUIRE
+#define CACHE_VALID(f) __atomic_load_n(&XAR_FILE(f)->cached, __ATOMIC_ACQUIRE)
+#define CACHE_SET_VALID(f) __atomic_store_n(&XAR_FILE(f)->cached, 1, __ATOMIC_RELEASE)
+#else
+#define CACHE_VALID(f) (XAR_FILE(f)->cached)
+#define CACHE_SET_VALID(f) (XAR_FILE(f)->cached = 1)
+#endif
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t xar_file_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CACHE_LOCK() pthread_mutex_lock(&xar_file_cache_lock)
+#define CACHE_UNLOCK() pthread_mutex_unlock(&xar_file_cache_lock)
+#else
+#define CACHE_LOCK() do { } while(0)
+#define CACHE_UNLOCK() do { } while(0)
+#endif
+
+/* xar_file_cache
+ * f: file to get the common properties of
+ * Returns: the decoded name, type and data properties of f
+ * Summary: the properties are decoded in one pass over the property
+ * list when the file is loaded or first asked for, and again after any
+ * property or attribute of f has changed.  Where a key appears more than
+ * once, the same property as xar_prop_get would return is used.
+ */
+const struct __xar_file_cache_t *xar_file_cache(xar_file_t f) {
+	struct __xar_file_cache_t *c = &XAR_FILE(f)->cache;
+	xar_prop_t p, d;
+	const char *k;
+
+	if( CACHE_VALID(f) )
+		return c;
+
+	CACHE_LOCK();
+	if( XAR_FILE(f)->cached ) {
+		CACHE_UNLOCK();
+		return c;
+	}
+	memset(c, 0, sizeof(*c));
+	for( p = XAR_FILE(f)->props; p; p = XAR_PROP(p)->next ) {
+		k = XAR_PROP(p)->key;
+		if( !k )
+			continue;
+		if( !c->name && (strcmp(k, "name") == 0) ) {
+			c->name = XAR_PROP(p)->value;
+		} else if( !c->type && (strcmp(k, "type") == 0) ) {
+			c->type = XAR_PROP(p)->value;
+		} else if( !c->data && (strcmp(k, "data") == 0) ) {
+			c->data = p;
+		}
+	}
+	c->ftype = xar_file_ftype(c->type);
+
+	for( d = c->data ? XAR_PROP(c->data)->children : NULL; d; d = XAR_PROP(d)->next ) {
+		k = XAR_PROP(d)->key;
+		if( !k )
+			continue;
+		if( !(c->flags & XAR_FCACHE_OFFSET) && (strcmp(k, "offset") == 0) && XAR_PROP(d)->value ) {
+			c->offset = strtoull(XAR_PROP(d)->value, NULL, 0);
+			c->flags |= XAR_FCACHE_OFFSET;
+		} else if( !(c->flags & XAR_FCACHE_LENGTH) && (strcmp(k, "length") == 0) && XAR_PROP(d)->value ) {
+			c->length = strtoull(XAR_PROP(d)->value, NULL, 10);
+			c->flags |= XAR_FCACHE_LENGTH;
+		} else if( !(c->flags & XAR_FCACHE_SIZE) && (strcmp(k, "size") == 0) && XAR_PROP(d)->value ) {
+			c->size = strtoull(XAR_PROP(d)->value, NULL, 10);
+			c->flags |= XAR_FCACHE_SIZE;
+		} else if( !c->encoding && (strcmp(k, "encoding") == 0) ) {
+			c->encoding = xar_attr_pget(f, d, "style");
+		}
+	}
+
+	CACHE_SET_VALID(f);
+	CACHE_UNLOCK();
+	return c;
+}
+
 xar_file_t xar_file_replicate(xar_file_t original, xar_file_t newparent)
 {
 	xar_file_t ret = xar_file_new(newparent);	
@@ -810,8 +1012,10 @@ void xar_file_free(xar_file_t f) {
 		XAR_FILE(f)->attrs = XAR_ATTR(a)->next;
 		xar_attr_free(a);
 	}
-	free((char *)XAR_FILE(f)->fspath);
-	free(XAR_FILE(f));
+	if( !(XAR_FILE(f)->pool & XAR_POOL_FSPATH) )
+		free((char *)XAR_FILE(f)->fspath);
+	if( !(XAR_FILE(f)->pool & XAR_POOL_NODE) )
+		free(XAR_FILE(f));
 }
 
 /* xar_file_first
@@ -825,6 +1029,7 @@ void xar_file_free(xar_file_t f) {
  * before xar_file_next.
  */
 xar_file_t xar_file_first(xar_t x, xar_iter_t i) {
+	xar_toc_load(x);
 	XAR_ITER(i)->iter = XAR(x)->files;
 	free(XAR_ITER(i)->node);
 	return XAR_ITER(i)->iter;
@@ -845,7 +1050,7 @@ xar_file_t xar_file_next(xar_iter_t i) {
 	const char *name;
 	if( !(XAR_ITER(i)->nochild) && XAR_FILE(f)->children ) {
 		char *tmp = XAR_ITER(i)->path;
-		xar_prop_get(f, "name", &name);
+		name = xar_file_cache(f)->name;
 		if( tmp ) {
 			int err;
 			err = asprintf(&XAR_ITER(i)->path, "%s/%s", tmp, name);
@@ -885,7 +1090,6 @@ xar_file_t xar_file_next(xar_iter_t i) {
 
 	return NULL;
 FSUCCESS:
-	xar_prop_get(f, "name", &name);
 	XAR_ITER(i)->iter = (void *)f;
 
 	return XAR_ITER(i)->iter;
@@ -905,8 +1109,7 @@ xar_file_t xar_file_find(xar_file_t f, const char *path) {
 	tmp3 = strsep(&tmp2, "/");
 	i = f;
 	do {
-		const char *name;
-		xar_prop_get(i, "name", &name);
+		const char *name = xar_file_cache(i)->name;
 		if( name == NULL ) continue;
 		if( strcmp(tmp3, name) == 0 ) {
 			if( tmp2 == NULL ) {
@@ -999,25 +1202,29 @@ void xar_file_serialize(xar_file_t f, xmlTextWriterPtr writer) {
 	return;
 }
 
-/* xar_prop_unserialize
+/* xar_prop_aunserialize
+ * arena: arena to read the property into, NULL to use malloc.  Only
+ * the properties of files are read into the arena.
  * f: file the property is to belong to
  * p: parent property, may be NULL
  * reader: xmlTextReaderPtr already allocated
  */
-int32_t xar_prop_unserialize(xar_file_t f, xar_prop_t parent, xmlTextReaderPtr reader) {
+static int32_t xar_prop_aunserialize(struct __xar_arena_t *arena, xar_file_t f, xar_prop_t parent, xmlTextReaderPtr reader) {
 	const char *name, *value, *ns;
 	int type, i, isempty = 0;
 	int isname = 0, isencoded = 0;
 	xar_prop_t p;
 
-	p = xar_prop_new(f, parent);
+	p = xar_prop_anew(arena, f, parent);
+	if( !p )
+		return -1;
 	if( xmlTextReaderIsEmptyElement(reader) )
 		isempty = 1;
 	i = xmlTextReaderAttributeCount(reader);
 	name = (const char *)xmlTextReaderConstLocalName(reader);
-	XAR_PROP(p)->key = strdup(name);
 	ns = (const char *)xmlTextReaderConstPrefix(reader);
-	if( ns ) XAR_PROP(p)->prefix = strdup(ns);
+	xar_prop_setkey(p, name);
+	if( ns ) XAR_PROP(p)->prefix = arena ? xar_arena_strdup(arena, ns) : strdup(ns);
 	if( strcmp(name, "name") == 0 )
 		isname = 1;
 	if( i > 0 ) {
@@ -1025,14 +1232,12 @@ int32_t xar_prop_unserialize(xar_file_t f, xar_prop_t parent, xmlTextReaderPtr r
 			xar_attr_t a;
 			const char *name = (const char *)xmlTextReaderConstLocalName(reader);
 			const char *value = (const char *)xmlTextReaderConstValue(reader);
-			const char *ns = (const char *)xmlTextReaderConstPrefix(reader);
 			if( isname && (strcmp(name, "enctype") == 0) && (strcmp(value, "base64") == 0) ) {
 				isencoded = 1;
 			} else {
-				a = xar_attr_new();
-				XAR_ATTR(a)->key = strdup(name);
-				XAR_ATTR(a)->value = strdup(value);
-				if(ns) XAR_ATTR(a)->ns = strdup(ns);
+				a = xar_attr_unserialize(arena, reader, 1);
+				if( !a )
+					return -1;
 				XAR_ATTR(a)->next = XAR_PROP(p)->attrs;
 				XAR_PROP(p)->attrs = a;
 			}
@@ -1044,16 +1249,35 @@ int32_t xar_prop_unserialize(xar_file_t f, xar_prop_t parent, xmlTextReaderPtr r
 		type = xmlTextReaderNodeType(reader);
 		switch(type) {
 		case XML_READER_TYPE_ELEMENT:
-			xar_prop_unserialize(f, p, reader);
+			xar_prop_aunserialize(arena, f, p, reader);
 			break;
 		case XML_READER_TYPE_TEXT:
 			value = (const char *)xmlTextReaderConstValue(reader);
-			free((char*)XAR_PROP(p)->value);
-			if( isencoded )
+			if( !(XAR_PROP(p)->pool & XAR_POOL_VALUE) )
+				free((char*)XAR_PROP(p)->value);
+			XAR_PROP(p)->pool &= ~XAR_POOL_VALUE;
+			if( isencoded ) {
 				XAR_PROP(p)->value = (const char *)xar_from_base64(BAD_CAST(value), (unsigned)strlen(value), NULL);
-			else
+			} else if( arena ) {
+				XAR_PROP(p)->value = xar_arena_strdup(arena, value);
+				XAR_PROP(p)->pool |= XAR_POOL_VALUE;
+			} else
 				XAR_PROP(p)->value = strdup(value);
-			if( isname ) {
+			if( isname && arena ) {
+				/* only files are read into the arena */
+				const char *dir = XAR_FILE(f)->parent ? XAR_FILE(XAR_FILE(f)->parent)->fspath : NULL;
+				size_t len = (dir ? strlen(dir) + 1 : 0) + strlen(XAR_PROP(p)->value) + 1;
+				char *path;
+				if( !(XAR_FILE(f)->pool & XAR_POOL_FSPATH) )
+					free((char *)XAR_FILE(f)->fspath);
+				path = xar_arena_alloc(arena, len);
+				if( path )
+					snprintf(path, len, "%s%s%s", dir ? dir : "", dir ? "/" : "", XAR_PROP(p)->value);
+				XAR_FILE(f)->fspath = path;
+				XAR_FILE(f)->pool |= XAR_POOL_FSPATH;
+				if (!XAR_FILE(f)->fspath)
+					return -1;
+			} else if( isname ) {
 				if( XAR_FILE(f)->parent ) {
 					int err;
 					err = asprintf((char **)&XAR_FILE(f)->fspath, "%s/%s", XAR_FILE(XAR_FILE(f)->parent)->fspath, XAR_PROP(p)->value);
@@ -1074,29 +1298,62 @@ int32_t xar_prop_unserialize(xar_file_t f, xar_prop_t parent, xmlTextReaderPtr r
 	return 0;
 }
 
+/* xar_prop_unserialize
+ * Summary: reads a property of the archive or of a subdoc, see
+ * xar_prop_aunserialize.
+ */
+int32_t xar_prop_unserialize(xar_file_t f, xar_prop_t parent, xmlTextReaderPtr reader) {
+	return xar_prop_aunserialize(NULL, f, parent, reader);
+}
+
+/* xar_file_loaded
+ * x: archive the file was read into
+ * f: file of the TOC, complete with its properties and children
+ * Summary: decodes the common properties of f while they are hot, and
+ * registers it if it is the original of hardlinks.
+ */
+void xar_file_loaded(xar_t x, xar_file_t f) {
+	const char *opt;
+
+	if( xar_file_cache(f)->ftype == XAR_FTYPE_HARDLINK ) {
+		opt = xar_attr_get(f, "type", "link");
+		if( opt && (strcmp(opt, "original") == 0) ) {
+			opt = xar_attr_get(f, NULL, "id");
+			xmlHashAddEntry(XAR(x)->link_hash, BAD_CAST(opt), XAR_FILE(f));
+		}
+	}
+}
+
 /* xar_file_unserialize
  * x: archive we're unserializing to
  * parent: The parent file of the file to be unserialized.  May be NULL
  * reader: The xmlTextReaderPtr we are reading the xml from.
  * Summary: Takes a <file> node, and adds all attributes, child properties,
- * and child files.
+ * and child files.  The new file is not linked into the list of children
+ * of parent, the caller does that.
  */
 xar_file_t xar_file_unserialize(xar_t x, xar_file_t parent, xmlTextReaderPtr reader) {
-	xar_file_t ret;
+	xar_file_t ret, child, last = NULL;
 	const char *name;
 	int type, i;
 
-	ret = xar_file_new(parent);
+	if( XAR(x)->arena ) {
+		ret = xar_arena_alloc(XAR(x)->arena, sizeof(struct __xar_file_t));
+		if( !ret ) return NULL;
+		XAR_FILE(ret)->pool = XAR_POOL_NODE;
+	} else {
+		ret = calloc(1, sizeof(struct __xar_file_t));
+		if( !ret ) return NULL;
+	}
+	XAR_FILE(ret)->owner = XAR_OWNER_FILE;
+	XAR_FILE(ret)->parent = parent;
 
 	i = xmlTextReaderAttributeCount(reader);
 	if( i > 0 ) {
 		for(i = xmlTextReaderMoveToFirstAttribute(reader); i == 1; i = xmlTextReaderMoveToNextAttribute(reader)) {
 			xar_attr_t a;
-			const char *name = (const char *)xmlTextReaderConstLocalName(reader);
-			const char *value = (const char *)xmlTextReaderConstValue(reader);
-			a = xar_attr_new();
-			XAR_ATTR(a)->key = strdup(name);
-			XAR_ATTR(a)->value = strdup(value);
+			a = xar_attr_unserialize(XAR(x)->arena, reader, 0);
+			if( !a ) break;
 			XAR_ATTR(a)->next = XAR_FILE(ret)->attrs;
 			XAR_FILE(ret)->attrs = a;
 		}
@@ -1106,23 +1363,23 @@ xar_file_t xar_file_unserialize(xar_t x, xar_file_t parent, xmlTextReaderPtr rea
 		type = xmlTextReaderNodeType(reader);
 		name = (const char *)xmlTextReaderConstLocalName(reader);
 		if( (type == XML_READER_TYPE_END_ELEMENT) && (strcmp(name, "file")==0) ) {
-			const char *opt;
-			xar_prop_get(ret, "type", &opt);
-			if( opt && (strcmp(opt, "hardlink") == 0) ) {
-				opt = xar_attr_get(ret, "type", "link");
-				if( opt && (strcmp(opt, "original") == 0) ) {
-					opt = xar_attr_get(ret, NULL, "id");
-					xmlHashAddEntry(XAR(x)->link_hash, BAD_CAST(opt), XAR_FILE(ret));
-				}
-			}
+			xar_file_loaded(x, ret);
 			return ret;
 		}
 
 		if( type == XML_READER_TYPE_ELEMENT ) {
 			if( strcmp(name, "file")==0 ) {
-				xar_file_unserialize(x, ret, reader);
+				/* append children without walking the list each time */
+				child = xar_file_unserialize(x, ret, reader);
+				if( !child )
+					continue;
+				if( last )
+					XAR_FILE(last)->next = child;
+				else
+					XAR_FILE(ret)->children = child;
+				last = child;
 			} else
-				xar_prop_unserialize(ret, NULL, reader);
+				xar_prop_aunserialize(XAR(x)->arena, ret, NULL, reader);
 		}
 	}
 
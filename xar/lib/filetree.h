@@ -45,11 +45,19 @@
 #include <libxml/xmlwriter.h>
 #include <libxml/xmlreader.h>
 
+/* Parts of a node that live in the archive's arena (see arena.c) or
+ * elsewhere, and must not be freed on their own */
+#define XAR_POOL_NODE   0x1     /* the structure itself */
+#define XAR_POOL_KEY    0x2     /* key, which is interned (see intern.c) */
+#define XAR_POOL_VALUE  0x4     /* value */
+#define XAR_POOL_FSPATH 0x8     /* fspath of a file */
+
 struct __xar_attr_t {
 	const char *key;
 	const char *value;
 	const char *ns;
 	const struct __xar_attr_t *next;
+	char pool;      /* XAR_POOL_* */
 };
 typedef const struct __xar_attr_t *xar_attr_t;
 
@@ -63,29 +71,81 @@ struct __xar_prop_t {
         const struct __xar_file_t *file;
 	const char *prefix;
 	const char *ns;
+	char pool;      /* XAR_POOL_* */
 };
 typedef const struct __xar_prop_t *xar_prop_t;
 
 #include "ea.h"
 
+/* Decoded type property of a file */
+#define XAR_FTYPE_NONE      0   /* no type property */
+#define XAR_FTYPE_UNKNOWN   1   /* a type not listed here */
+#define XAR_FTYPE_FILE      2
+#define XAR_FTYPE_HARDLINK  3
+#define XAR_FTYPE_DIRECTORY 4
+#define XAR_FTYPE_SYMLINK   5
+#define XAR_FTYPE_FIFO      6
+#define XAR_FTYPE_CHAR      7   /* character special */
+#define XAR_FTYPE_BLOCK     8   /* block special */
+#define XAR_FTYPE_SOCKET    9
+#define XAR_FTYPE_WHITEOUT  10
+
+/* Which of the numeric data fields of the cache are present */
+#define XAR_FCACHE_OFFSET   0x1
+#define XAR_FCACHE_LENGTH   0x2
+#define XAR_FCACHE_SIZE     0x4
+
+/* Commonly used properties of a file, decoded once by xar_file_cache.
+ * The strings point into the property tree. */
+struct __xar_file_cache_t {
+	const char *name;               /* name */
+	const char *type;               /* type */
+	const char *encoding;           /* style attribute of data/encoding */
+	const struct __xar_prop_t *data; /* data */
+	int32_t ftype;                  /* type as XAR_FTYPE_* */
+	int32_t flags;                  /* XAR_FCACHE_* */
+	uint64_t offset;                /* data/offset */
+	uint64_t length;                /* data/length */
+	uint64_t size;                  /* data/size */
+};
+
+/* What owns a set of properties.  The property functions take xar_t and
+ * xar_subdoc_t as well as xar_file_t, so all three start with props,
+ * attrs, prefix, ns and owner, and only files have a cache to invalidate.
+ */
+#define XAR_OWNER_ARCHIVE 0
+#define XAR_OWNER_SUBDOC  1
+#define XAR_OWNER_FILE    2
+
 struct __xar_file_t {
 	const struct __xar_prop_t *props;
 	const struct __xar_attr_t *attrs;
 	const char *prefix;
 	const char *ns;
+	int32_t owner;  /* XAR_OWNER_FILE */
 	const char *fspath;
 	char parent_extracted;
+	char cached;    /* cache is valid; cleared by any property change */
 	const struct __xar_file_t *parent;
 	const struct __xar_file_t *children;
 	const struct __xar_file_t *next;
 	xar_ea_t eas;
 	uint64_t nexteaid;
+	struct __xar_file_cache_t cache;
+	uint64_t indexid;       /* names its children in the path index, 0 until indexed */
+	char pool;      /* XAR_POOL_* */
 };
 
 #define XAR_ATTR(x) ((struct __xar_attr_t *)(x))
 #define XAR_FILE(x) ((struct __xar_file_t *)(x))
 #define XAR_PROP(x) ((struct __xar_prop_t *)(x))
 
+/* Invalidates the cache of f, which may be any owner of properties */
+#define XAR_FILE_CHANGED(f) do { \
+	if( XAR_FILE(f)->owner == XAR_OWNER_FILE ) \
+		XAR_FILE(f)->cached = 0; \
+} while(0)
+
 void xar_file_free(xar_file_t f);
 xar_attr_t xar_attr_new(void);
 int32_t xar_attr_set(xar_file_t f, const char *prop, const char *key, const char *value);
@@ -93,17 +153,21 @@ int32_t xar_attr_pset(xar_file_t f, xar_prop_t p, const char *key, const char *v
 const char *xar_attr_get(xar_file_t f, const char *prop, const char *key);
 const char *xar_attr_pget(xar_file_t f, xar_prop_t p, const char *key);
 void xar_attr_free(xar_attr_t a);
+void xar_attr_setkey(xar_attr_t a, const char *key);
 void xar_file_serialize(xar_file_t f, xmlTextWriterPtr writer);
 xar_file_t xar_file_unserialize(xar_t x, xar_file_t parent, xmlTextReaderPtr reader);
+void xar_file_loaded(xar_t x, xar_file_t f);
 xar_file_t xar_file_find(xar_file_t f, const char *path);
 xar_file_t xar_file_new(xar_file_t f);
 xar_file_t xar_file_replicate(xar_file_t original, xar_file_t newparent);
+const struct __xar_file_cache_t *xar_file_cache(xar_file_t f);
 void xar_file_free(xar_file_t f);
 
 void xar_prop_serialize(xar_prop_t p, xmlTextWriterPtr writer);
 int32_t xar_prop_unserialize(xar_file_t f, xar_prop_t parent, xmlTextReaderPtr reader);
 void xar_prop_free(xar_prop_t p);
 xar_prop_t xar_prop_new(xar_file_t f, xar_prop_t parent);
+void xar_prop_replicate_r(xar_file_t f, xar_prop_t p, xar_prop_t parent);
 xar_prop_t xar_prop_pset(xar_file_t f, xar_prop_t p, const char *key, const char *value);
 xar_prop_t xar_prop_find(xar_prop_t p, const char *key);
 xar_prop_t xar_prop_pget(xar_prop_t p, const char *key);
@@ -287,3 +287,56 @@ int32_t xar_hash_out_done(xar_t x, xar_file_t f, xar_prop_t p, void **context) {
 
 	return err;
 }
+
+/* xar_hash_check_archived
+ * x: archive being extracted
+ * f, p: file and data property the archived data belongs to
+ * buf, len: the archived data in its entirety, or NULL to only find out
+ * whether there is a checksum to verify
+ * Returns: 0 if the archived-checksum matches, -1 if it does not, or 1
+ * if the data has no checksum that extraction would verify.
+ * Summary: the same check xar_hash_out_done makes, for callers that
+ * have the whole of the data at hand instead of streaming it.
+ */
+int32_t xar_hash_check_archived(xar_t x, xar_file_t f, xar_prop_t p, const void *buf, size_t len) {
+	const char *uncomp = NULL, *uncompstyle = NULL;
+	unsigned char hashstr[HASH_MAX_MD_SIZE];
+	unsigned int hlen;
+	const EVP_MD *md = NULL;
+	EVP_MD_CTX *ctx;
+	char *str;
+	int32_t err = 0;
+	xar_prop_t tmpp;
+
+	tmpp = xar_prop_pget(p, "archived-checksum");
+	if( tmpp ) {
+		uncompstyle = xar_attr_pget(f, tmpp, "style");
+		uncomp = xar_prop_getvalue(tmpp);
+	}
+	if( uncompstyle )
+		md = EVP_get_digestbyname(uncompstyle);
+	if( !uncomp || !md )
+		return 1;
+	if( !buf )
+		return 0;
+
+	ctx = EVP_MD_CTX_create();
+	if( !ctx )
+		return -1;
+	EVP_DigestInit_ex(ctx, md, NULL);
+	EVP_DigestUpdate(ctx, buf, len);
+	memset(hashstr, 0, sizeof(hashstr));
+	EVP_DigestFinal_ex(ctx, hashstr, &hlen);
+	EVP_MD_CTX_destroy(ctx);
+
+	str = xar_format_hash(hashstr, hlen);
+	if( strcmp(uncomp, str) != 0 ) {
+		xar_err_new(x);
+		xar_err_set_file(x, f);
+		xar_err_set_string(x, "archived-checksum message digest hash values do not match");
+		xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+		err = -1;
+	}
+	free(str);
+	return err;
+}
@@ -52,4 +52,6 @@ int32_t xar_hash_unarchived_out(xar_t x, xar_file_t f, xar_prop_t p, void *in, s
 int32_t xar_hash_done(xar_t x, xar_file_t f, xar_prop_t p, void **context);
 int32_t xar_hash_out_done(xar_t x, xar_file_t f, xar_prop_t p, void **context);
 
+int32_t xar_hash_check_archived(xar_t x, xar_file_t f, xar_prop_t p, const void *buf, size_t len);
+
 #endif /* _XAR_HASH_H_ */
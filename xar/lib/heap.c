@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Writing the heap of an archive being created straight into the archive.
+ *
+ * The header and the TOC come first in an archive, and are only known
+ * once every file has been added, so the heap is normally written to a
+ * temporary file that xar_close copies into the archive behind them.  For
+ * large archives that doubles the I/O and the disk space needed.
+ *
+ * With XAR_OPT_TOCSPACE the heap is written into the archive itself,
+ * behind a gap of that many bytes, and xar_close fits the header, the TOC
+ * and the TOC checksum and signatures into the gap:
+ *  - leftover room goes into the header, which readers skip over up to the
+ *    size it records, as long as that stays within XAR_HEAP_MAX_HEADER and
+ *    a multiple of XAR_HEAP_HEADER_ALIGN.  xar_close pads the TOC so that
+ *    its length leaves such a header;
+ *  - otherwise the gap is grown or shrunk by whole blocks with
+ *    FALLOC_FL_INSERT_RANGE or FALLOC_FL_COLLAPSE_RANGE, which move no
+ *    data on filesystems that support them;
+ *  - otherwise the heap is moved within the archive, which costs a copy
+ *    but no extra space.
+ * Archives that are not regular files, such as stdout, use the temporary
+ * heap file.
+ *
+ * The temporary heap file is copied into the archive by the kernel where
+ * it can be.  When both are on a filesystem that shares blocks between
+ * files, such as XFS or btrfs, xar_close pads the header so that the heap
+ * starts on a block boundary and clones it with FICLONERANGE, which copies
+ * no data at all.  Otherwise copy_file_range or sendfile copy it without
+ * going through user space, and read and write are the last resort.
+ *
+ * An archive opened with XAR_OPEN_APPEND is written to a new file that
+ * starts its heap with the heap of the archive appended to, so the data
+ * already in it keeps its offsets.  That heap is cloned or copied in the
+ * same way, with the header padded so that its blocks line up with those
+ * of the old archive, and the temporary heap file only holds the new data.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
+#include "xar.h"
+#include "archive.h"
+#include "heap.h"
+#include "util.h"
+
+/* how much of the heap xar_heap_move moves at a time */
+#define XAR_HEAP_MOVE_SIZE (1024*1024)
+
+/* xar_heap_inplace
+ * x: archive being created, before any file is added
+ * space: value of XAR_OPT_TOCSPACE, the bytes to leave in front of the heap
+ * Returns: 0 if the heap is written into the archive, -1 if it stays in
+ * the temporary heap file
+ * Summary: switches the heap of x from its temporary file to the archive.
+ */
+int32_t xar_heap_inplace(xar_t x, const char *space) {
+	struct stat sb;
+	long long len;
+	char *endptr;
+	int fd;
+
+	len = strtoll(space, &endptr, 0);
+	if( !*space || *endptr || (len <= 0) || XAR(x)->heap_start )
+		return -1;
+	if( (XAR(x)->heap_fd < 0) || (XAR(x)->fd < 0) || (strcmp(XAR(x)->filename, "-") == 0) )
+		return -1;
+	if( (fstat(XAR(x)->fd, &sb) != 0) || !S_ISREG(sb.st_mode) )
+		return -1;
+
+	/* the archive is open write only, moving the heap reads it */
+	fd = open(XAR(x)->filename, O_RDWR);
+	if( fd < 0 )
+		return -1;
+	if( lseek(fd, (off_t)len, SEEK_SET) == -1 ) {
+		close(fd);
+		return -1;
+	}
+	close(XAR(x)->heap_fd);
+	XAR(x)->heap_fd = fd;
+	XAR(x)->heap_start = (off_t)len;
+	return 0;
+}
+
+/* xar_heap_move
+ * Returns: 0 or -1 on error
+ * Summary: moves len bytes of fd from from to to, which may overlap.
+ */
+static int32_t xar_heap_move(int fd, off_t from, off_t to, off_t len) {
+	char *buf;
+	off_t done = 0;
+	size_t n;
+	ssize_t r;
+
+	if( (from == to) || (len == 0) )
+		return 0;
+	buf = malloc(XAR_HEAP_MOVE_SIZE);
+	if( !buf )
+		return -1;
+	while( done < len ) {
+		off_t src, dst;
+		n = XAR_HEAP_MOVE_SIZE;
+		if( (off_t)n > len - done )
+			n = (size_t)(len - done);
+		/* moving up, start from the end so as not to overwrite
+		 * what has not been moved yet */
+		if( to > from ) {
+			src = from + len - done - (off_t)n;
+			dst = to + len - done - (off_t)n;
+		} else {
+			src = from + done;
+			dst = to + done;
+		}
+		r = pread(fd, buf, n, src);
+		if( (r < 0) && (errno == EINTR) )
+			continue;
+		if( r != (ssize_t)n )
+			break;
+		r = pwrite(fd, buf, n, dst);
+		if( (r < 0) && (errno == EINTR) )
+			continue;
+		if( r != (ssize_t)n )
+			break;
+		done += (off_t)n;
+	}
+	free(buf);
+	return (done == len) ? 0 : -1;
+}
+
+/* xar_heap_prefix
+ * x: archive being closed
+ * Returns: the bytes of the TOC checksum and signatures, or -1 on error
+ * Summary: the heap starts with the TOC checksum and signatures, which
+ * xar_close writes in front of the data in the heap file, followed by
+ * the heap of the archive appended to, if any.  The heap file must be
+ * positioned at the end of the data.
+ */
+off_t xar_heap_prefix(xar_t x) {
+	off_t len, pre;
+
+	len = lseek(XAR(x)->heap_fd, 0, SEEK_CUR);
+	if( (len == -1) || (len < XAR(x)->heap_start) )
+		return -1;
+	len -= XAR(x)->heap_start;
+	pre = XAR(x)->heap_len - len;
+	if( pre < 0 )
+		return -1;
+	return pre;
+}
+
+/* xar_heap_room
+ * x: archive being closed, whose heap was written by xar_heap_inplace
+ * Returns: the bytes left in front of the heap for the header and the TOC,
+ * which may be negative, or -1 on error
+ * Summary: see xar_heap_prefix.
+ */
+off_t xar_heap_room(xar_t x) {
+	off_t pre;
+
+	pre = xar_heap_prefix(x);
+	if( pre == -1 )
+		return -1;
+	return XAR(x)->heap_start - pre;
+}
+
+/* xar_heap_place
+ * x: archive being closed, whose heap was written by xar_heap_inplace
+ * need: bytes the header and the TOC take
+ * maxpad: most bytes the header may be padded with
+ * start: set to where the heap now starts, between need and need + maxpad
+ * Returns: 0 or -1 on error
+ * Summary: makes room for need bytes in front of the heap, see
+ * xar_heap_room.
+ */
+int32_t xar_heap_place(xar_t x, off_t need, off_t maxpad, off_t *start) {
+	off_t gap = XAR(x)->heap_start;
+	off_t len, pre, room;
+	int fd = XAR(x)->heap_fd;
+
+	room = xar_heap_room(x);
+	len = lseek(fd, 0, SEEK_CUR);
+	if( (room == -1) || (len == -1) )
+		return -1;
+	len -= gap;
+	pre = gap - room;
+	/* drop data written past the end of the heap and then taken back */
+	if( ftruncate(fd, gap + len) != 0 )
+		return -1;
+
+	if( (need <= room) && (room - need <= maxpad) && ((room - need) % XAR_HEAP_HEADER_ALIGN == 0) ) {
+		*start = room;
+		return 0;
+	}
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_INSERT_RANGE) && defined(FALLOC_FL_COLLAPSE_RANGE)
+	{
+		struct stat sb;
+		off_t blk, n;
+
+		if( (fstat(fd, &sb) == 0) && (sb.st_blksize > 0) && ((room - need) % XAR_HEAP_HEADER_ALIGN == 0) && (sb.st_blksize % XAR_HEAP_HEADER_ALIGN == 0) ) {
+			blk = (off_t)sb.st_blksize;
+			if( need > room ) {
+				n = ((need - room) + blk - 1) / blk * blk;
+				if( (room + n - need <= maxpad) && (fallocate(fd, FALLOC_FL_INSERT_RANGE, 0, n) == 0) ) {
+					*start = room + n;
+					return 0;
+				}
+			} else {
+				n = (room - need) / blk * blk;
+				if( (n > 0) && (room - n - need <= maxpad) && (fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, 0, n) == 0) ) {
+					*start = room - n;
+					return 0;
+				}
+			}
+		}
+	}
+#endif
+
+	if( xar_heap_move(fd, gap, need + pre, len) != 0 )
+		return -1;
+	if( ftruncate(fd, need + pre + len) != 0 )
+		return -1;
+	*start = need;
+	return 0;
+}
+
+/* xar_heap_trim
+ * Returns: the length of the temporary heap file, or -1 on error
+ * Summary: drops data written past the end of the heap and then taken
+ * back, so that the heap ends where the file does.
+ */
+static off_t xar_heap_trim(xar_t x) {
+	off_t len;
+
+	len = lseek(XAR(x)->heap_fd, 0, SEEK_CUR);
+	if( (len == -1) || (ftruncate(XAR(x)->heap_fd, len) != 0) )
+		return -1;
+	return len;
+}
+
+/* xar_heap_clone_range
+ * Returns: 0 or -1 on error
+ * Summary: shares len bytes of from at src with to at dst, which must be
+ * block aligned, as must len unless it reaches the end of from.
+ */
+static int32_t xar_heap_clone_range(int from, off_t src, off_t len, int to, off_t dst) {
+#ifdef FICLONERANGE
+	struct file_clone_range r;
+
+	memset(&r, 0, sizeof(r));
+	r.src_fd = from;
+	r.src_offset = (uint64_t)src;
+	r.src_length = (uint64_t)len;
+	r.dest_offset = (uint64_t)dst;
+	return (ioctl(to, FICLONERANGE, &r) == 0) ? 0 : -1;
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/* xar_heap_cloneable
+ * x: archive being closed, before anything is written to it
+ * Returns: the block size to align the heap in the archive to, or 0 if
+ * the temporary heap file cannot be cloned into it
+ * Summary: tries cloning the start of the heap into the archive, and
+ * truncates the archive again.
+ */
+off_t xar_heap_cloneable(xar_t x) {
+	struct stat sb;
+	off_t blk, len;
+
+	if( XAR(x)->heap_start || (XAR(x)->heap_fd < 0) || (XAR(x)->fd < 0) )
+		return 0;
+	if( (fstat(XAR(x)->fd, &sb) != 0) || !S_ISREG(sb.st_mode) || (sb.st_size != 0) )
+		return 0;
+	blk = (off_t)sb.st_blksize;
+	/* the header is padded by up to a block */
+	if( (blk <= 0) || (blk % XAR_HEAP_HEADER_ALIGN != 0) || (blk > XAR_HEAP_MAX_HEADER / 2) )
+		return 0;
+	len = xar_heap_trim(x);
+	if( len <= 0 )
+		return 0;
+	if( xar_heap_clone_range(XAR(x)->heap_fd, 0, (len < blk) ? len : blk, XAR(x)->fd, 0) != 0 )
+		return 0;
+	if( ftruncate(XAR(x)->fd, 0) != 0 )
+		return 0;
+	return blk;
+}
+
+/* xar_heap_clone
+ * x: archive being closed, for which xar_heap_cloneable succeeded
+ * dst: block aligned offset of the heap data in the archive
+ * Returns: 0 or -1 on error
+ * Summary: clones the temporary heap file into the archive.
+ */
+int32_t xar_heap_clone(xar_t x, off_t dst) {
+	off_t len;
+
+	len = xar_heap_trim(x);
+	if( len <= 0 )
+		return -1;
+	return xar_heap_clone_range(XAR(x)->heap_fd, 0, len, XAR(x)->fd, dst);
+}
+
+/* xar_heap_copy_fd
+ * Returns: 0 or -1 on error
+ * Summary: appends len bytes of fd at pos to the archive at its current
+ * offset, see xar_heap_copy.
+ */
+static int32_t xar_heap_copy_fd(xar_t x, int fd, off_t pos, off_t len, void *buf, size_t size) {
+	off_t end = pos + len;
+	ssize_t r;
+	size_t n;
+
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SYS_SENDFILE_H)
+	{
+		off_t start = pos;
+
+		while( pos < end ) {
+			n = (end - pos > (1 << 30)) ? (1 << 30) : (size_t)(end - pos);
+			r = xar_copy_range(fd, &pos, XAR(x)->fd, n);
+			if( (r < 0) && (errno == EINTR) )
+				continue;
+			/* not between these files, copy through buf */
+			if( (r <= 0) && (pos == start) )
+				break;
+			if( r <= 0 )
+				return -1;
+		}
+	}
+#endif
+
+	while( pos < end ) {
+		n = size;
+		if( (off_t)n > end - pos )
+			n = (size_t)(end - pos);
+		r = pread(fd, buf, n, pos);
+		if( (r < 0) && (errno == EINTR) )
+			continue;
+		if( r <= 0 )
+			return -1;
+		if( xar_write_fd(XAR(x)->fd, buf, (size_t)r) < 0 )
+			return -1;
+		pos += r;
+	}
+	return 0;
+}
+
+/* xar_heap_copy
+ * x: archive being closed
+ * pos, len: range of the temporary heap file to copy
+ * buf, size: buffer to copy through if the kernel cannot copy
+ * Returns: 0 or -1 on error
+ * Summary: appends the range to the archive at its current offset.
+ */
+int32_t xar_heap_copy(xar_t x, off_t pos, off_t len, void *buf, size_t size) {
+	return xar_heap_copy_fd(x, XAR(x)->heap_fd, pos, len, buf, size);
+}
+
+/* xar_heap_append_cloneable
+ * x: archive opened with XAR_OPEN_APPEND being closed, before anything
+ * is written to it
+ * Returns: the block size to line the old heap up to in the new archive,
+ * or 0 if the old archive cannot be cloned into it
+ * Summary: tries cloning a block of the old heap into the new archive,
+ * and truncates the new archive again.  Not worth padding the header for
+ * unless the old heap has whole blocks to share.
+ */
+off_t xar_heap_append_cloneable(xar_t x) {
+	struct stat sb;
+	off_t blk, src;
+
+	if( !XAR(x)->append_path || (XAR(x)->fd < 0) )
+		return 0;
+	if( (fstat(XAR(x)->fd, &sb) != 0) || !S_ISREG(sb.st_mode) || (sb.st_size != 0) )
+		return 0;
+	blk = (off_t)sb.st_blksize;
+	if( (blk <= 0) || (blk % XAR_HEAP_HEADER_ALIGN != 0) || (blk > XAR_HEAP_MAX_HEADER / 2) )
+		return 0;
+	if( XAR(x)->append_len < 2 * blk )
+		return 0;
+	src = XAR(x)->append_off / blk * blk;
+	if( xar_heap_clone_range(XAR(x)->append_fd, src, blk, XAR(x)->fd, 0) != 0 )
+		return 0;
+	if( ftruncate(XAR(x)->fd, 0) != 0 )
+		return 0;
+	return blk;
+}
+
+/* xar_heap_append_old
+ * x: archive opened with XAR_OPEN_APPEND being closed
+ * blk: block size returned by xar_heap_append_cloneable, or 0
+ * buf, size: buffer to copy through if the kernel cannot copy
+ * Returns: 0 or -1 on error
+ * Summary: appends the heap of the archive appended to, less its TOC
+ * checksum, to the new archive at its current offset.  If that offset
+ * lines up with the old heap, everything past the first partial block
+ * is cloned; the old heap ends the old archive, so its last block may be
+ * partial too.
+ */
+int32_t xar_heap_append_old(xar_t x, off_t blk, void *buf, size_t size) {
+	off_t pos = XAR(x)->append_off;
+	off_t end = pos + XAR(x)->append_len;
+	off_t dst, head;
+
+	dst = lseek(XAR(x)->fd, 0, SEEK_CUR);
+	if( blk && (dst != -1) && (dst % blk == pos % blk) ) {
+		head = (blk - pos % blk) % blk;
+		if( head > end - pos )
+			head = end - pos;
+		if( xar_heap_copy_fd(x, XAR(x)->append_fd, pos, head, buf, size) != 0 )
+			return -1;
+		pos += head;
+		dst += head;
+		if( (pos < end) && (xar_heap_clone_range(XAR(x)->append_fd, pos, end - pos, XAR(x)->fd, dst) == 0) )
+			return (lseek(XAR(x)->fd, dst + (end - pos), SEEK_SET) == -1) ? -1 : 0;
+	}
+	return xar_heap_copy_fd(x, XAR(x)->append_fd, pos, end - pos, buf, size);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _XAR_HEAP_H_
+#define _XAR_HEAP_H_
+
+/* Largest header a reader skips to the TOC of, see xar_heap_place */
+#define XAR_HEAP_MAX_HEADER 0xfffc
+
+/* Readers require extended headers to be a multiple of this long */
+#define XAR_HEAP_HEADER_ALIGN 4
+
+int32_t xar_heap_inplace(xar_t x, const char *space);
+off_t xar_heap_prefix(xar_t x);
+off_t xar_heap_room(xar_t x);
+int32_t xar_heap_place(xar_t x, off_t need, off_t maxpad, off_t *start);
+off_t xar_heap_cloneable(xar_t x);
+int32_t xar_heap_clone(xar_t x, off_t dst);
+int32_t xar_heap_copy(xar_t x, off_t pos, off_t len, void *buf, size_t size);
+off_t xar_heap_append_cloneable(xar_t x);
+int32_t xar_heap_append_old(xar_t x, off_t blk, void *buf, size_t size);
+
+#endif /* _XAR_HEAP_H_ */
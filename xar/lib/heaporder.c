@@ -0,0 +1,559 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Laying out the heap of an archive being closed.
+ *
+ * The data of the files is stored in the order they were added, which
+ * for the xar tool is the order fts walks the tree in.  With
+ * XAR_OPT_HEAPORDER or XAR_OPT_HEAPPROFILE, xar_close decides another
+ * order before the TOC is written, rewrites the offsets (and extents) of
+ * the data of the files to match, and copies the temporary heap file into
+ * the archive range by range in that order, so the data is moved only by
+ * the copy that is made anyway:
+ *  - "path" sorts the files by path, a directory's files together;
+ *  - "size" puts small files first;
+ *  - "extension" groups the files by file name extension;
+ *  - a profile lists paths, one per line, whose data goes first, in the
+ *    order listed, such as the files needed at startup.
+ * Files sort by the order they were added otherwise.  Data shared between
+ * files, by XAR_OPT_COALESCE or XAR_OPT_DEDUPCHUNKS, goes with the first
+ * file to need it, and bytes no file refers to go last.
+ *
+ * The heap written in place by XAR_OPT_TOCSPACE is left alone, as is the
+ * heap of an archive opened with XAR_OPEN_APPEND, only the data added to
+ * it is reordered.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <libxml/hash.h>
+
+#include "xar.h"
+#include "filetree.h"
+#include "archive.h"
+#include "io.h"
+#include "heap.h"
+#include "heaporder.h"
+
+/* a range of the heap holding data of one or more files */
+struct __xar_heap_range_t {
+	off_t pos;              /* heap offset */
+	off_t len;
+	off_t dst;              /* heap offset once reordered, or -1 */
+};
+
+/* a range of the heap file to copy, in order */
+struct __xar_heap_piece_t {
+	off_t pos;
+	off_t len;
+};
+
+struct __xar_heap_plan_t {
+	struct __xar_heap_piece_t *pieces;
+	size_t count;
+};
+
+static void xar_heap_order_free_plan(struct __xar_heap_plan_t *plan) {
+	free(plan->pieces);
+	free(plan);
+}
+
+/* a data property whose offset is rewritten */
+struct __xar_heap_prop_t {
+	xar_file_t f;
+	xar_prop_t p;
+};
+
+/* a file with data, and where its ranges are in the list of uses */
+struct __xar_heap_user_t {
+	char *path;
+	const char *ext;        /* file name extension, in path */
+	uint64_t size;
+	long rank;              /* line of the profile, or LONG_MAX */
+	size_t seq;             /* order the file was found in */
+	size_t first, count;
+};
+
+struct __xar_heap_walk_t {
+	off_t prefix;           /* heap offset of the heap file */
+	off_t end;
+	xmlHashTablePtr profile;
+	struct __xar_heap_user_t *users;
+	size_t nusers, susers;
+	struct __xar_heap_range_t *uses;
+	size_t nuses, suses;
+	struct __xar_heap_prop_t *props;
+	size_t nprops, sprops;
+	struct __xar_heap_range_t *ranges;
+	size_t nranges;
+	struct __xar_heap_plan_t *plan;
+	size_t splan;
+	int failed;
+};
+
+/* xar_heap_grow
+ * Summary: makes room for one more of the count elements of size at *list.
+ */
+static int32_t xar_heap_grow(void **list, size_t count, size_t *alloc, size_t size) {
+	void *l;
+	size_t n;
+
+	if( count < *alloc )
+		return 0;
+	n = *alloc ? *alloc * 2 : 64;
+	l = realloc(*list, n * size);
+	if( !l )
+		return -1;
+	*list = l;
+	*alloc = n;
+	return 0;
+}
+
+static int xar_heap_cmp_seq(const struct __xar_heap_user_t *a, const struct __xar_heap_user_t *b) {
+	if( a->rank != b->rank )
+		return (a->rank < b->rank) ? -1 : 1;
+	if( a->seq != b->seq )
+		return (a->seq < b->seq) ? -1 : 1;
+	return 0;
+}
+
+/* paths compare with '/' before any other character, so that the files
+ * of a directory stay together */
+static int xar_heap_cmp_paths(const char *a, const char *b) {
+	int ca, cb;
+
+	for( ; *a && (*a == *b); a++, b++ );
+	ca = (*a == '/') ? 1 : (unsigned char)*a;
+	cb = (*b == '/') ? 1 : (unsigned char)*b;
+	return ca - cb;
+}
+
+static int xar_heap_cmp_added(const void *va, const void *vb) {
+	return xar_heap_cmp_seq(va, vb);
+}
+
+static int xar_heap_cmp_path(const void *va, const void *vb) {
+	const struct __xar_heap_user_t *a = va, *b = vb;
+	int r;
+
+	if( a->rank != b->rank )
+		return xar_heap_cmp_seq(a, b);
+	r = xar_heap_cmp_paths(a->path, b->path);
+	return r ? r : xar_heap_cmp_seq(a, b);
+}
+
+static int xar_heap_cmp_size(const void *va, const void *vb) {
+	const struct __xar_heap_user_t *a = va, *b = vb;
+
+	if( a->rank != b->rank )
+		return xar_heap_cmp_seq(a, b);
+	if( a->size != b->size )
+		return (a->size < b->size) ? -1 : 1;
+	return xar_heap_cmp_path(va, vb);
+}
+
+static int xar_heap_cmp_extension(const void *va, const void *vb) {
+	const struct __xar_heap_user_t *a = va, *b = vb;
+	int r;
+
+	if( a->rank != b->rank )
+		return xar_heap_cmp_seq(a, b);
+	r = strcmp(a->ext, b->ext);
+	return r ? r : xar_heap_cmp_path(va, vb);
+}
+
+static int xar_heap_cmp_range(const void *va, const void *vb) {
+	const struct __xar_heap_range_t *a = va, *b = vb;
+
+	if( a->pos != b->pos )
+		return (a->pos < b->pos) ? -1 : 1;
+	if( a->len != b->len )
+		return (a->len < b->len) ? -1 : 1;
+	return 0;
+}
+
+static struct __xar_heap_range_t *xar_heap_range_find(struct __xar_heap_walk_t *w, off_t pos) {
+	size_t lo = 0, hi = w->nranges, mid;
+
+	while( lo < hi ) {
+		mid = lo + (hi - lo) / 2;
+		if( w->ranges[mid].pos < pos )
+			lo = mid + 1;
+		else if( w->ranges[mid].pos > pos )
+			hi = mid;
+		else
+			return &w->ranges[mid];
+	}
+	return NULL;
+}
+
+/* xar_heap_use
+ * Summary: records that the file being walked uses len bytes at pos,
+ * unless they come before the heap file.
+ */
+static void xar_heap_use(struct __xar_heap_walk_t *w, off_t pos, off_t len) {
+	if( (pos < w->prefix) || (len <= 0) )
+		return;
+	if( xar_heap_grow((void **)&w->uses, w->nuses, &w->suses, sizeof(*w->uses)) != 0 ) {
+		w->failed = 1;
+		return;
+	}
+	w->uses[w->nuses].pos = pos;
+	w->uses[w->nuses].len = len;
+	w->uses[w->nuses].dst = -1;
+	w->nuses++;
+}
+
+/* xar_heap_walk
+ * Summary: records the files with data in the heap file, the ranges they
+ * use and the properties pointing at them.
+ */
+static void xar_heap_walk(struct __xar_heap_walk_t *w, xar_file_t f) {
+	struct __xar_heap_user_t *u;
+	xar_prop_t p, tmpp;
+	const char *value, *name;
+	int64_t *lengths, *extents;
+	int nlengths, nextents, i;
+	size_t first;
+	uint64_t size;
+	off_t off, len;
+	void *rank;
+
+	for( ; f && !w->failed; f = XAR_FILE(f)->next ) {
+		first = w->nuses;
+		size = 0;
+		for( p = xar_prop_pfirst(f); p && !w->failed; p = xar_prop_pnext(p) ) {
+			off = xar_data_offset(p);
+			if( off < 0 )
+				continue;
+			tmpp = xar_prop_pget(p, "length");
+			len = (tmpp && (value = xar_prop_getvalue(tmpp))) ? (off_t)strtoll(value, NULL, 10) : 0;
+			tmpp = xar_prop_pget(p, "size");
+			if( tmpp && (value = xar_prop_getvalue(tmpp)) )
+				size += strtoull(value, NULL, 10);
+
+			tmpp = xar_prop_pget(p, "extents");
+			if( tmpp && (value = xar_prop_getvalue(tmpp)) ) {
+				lengths = extents = NULL;
+				if( (xar_chunks_parse(value, &extents, &nextents) == 0)
+				 && (tmpp = xar_prop_pget(p, "chunks")) && (value = xar_prop_getvalue(tmpp))
+				 && (xar_chunks_parse(value, &lengths, &nlengths) == 0) && (nlengths == nextents) ) {
+					for( i = 0; i < nextents; i++ )
+						xar_heap_use(w, (off_t)extents[i], (off_t)lengths[i]);
+				} else {
+					w->failed = 1;
+				}
+				free(lengths);
+				free(extents);
+			} else {
+				xar_heap_use(w, off, len);
+			}
+			if( off < w->prefix )
+				continue;
+			if( xar_heap_grow((void **)&w->props, w->nprops, &w->sprops, sizeof(*w->props)) != 0 ) {
+				w->failed = 1;
+				break;
+			}
+			w->props[w->nprops].f = f;
+			w->props[w->nprops].p = p;
+			w->nprops++;
+		}
+
+		if( !w->failed && (w->nuses > first) ) {
+			if( xar_heap_grow((void **)&w->users, w->nusers, &w->susers, sizeof(*w->users)) != 0 ) {
+				w->failed = 1;
+				break;
+			}
+			u = &w->users[w->nusers];
+			u->path = xar_get_path(f);
+			if( !u->path ) {
+				w->failed = 1;
+				break;
+			}
+			name = strrchr(u->path, '/');
+			name = name ? name + 1 : u->path;
+			u->ext = strrchr(name, '.');
+			u->ext = (u->ext && (u->ext != name)) ? u->ext + 1 : "";
+			u->size = size;
+			rank = w->profile ? xmlHashLookup(w->profile, BAD_CAST(u->path)) : NULL;
+			u->rank = rank ? (long)(intptr_t)rank : LONG_MAX;
+			u->seq = w->nusers;
+			u->first = first;
+			u->count = w->nuses - first;
+			w->nusers++;
+		}
+		xar_heap_walk(w, XAR_FILE(f)->children);
+	}
+}
+
+/* xar_heap_piece
+ * Summary: appends len bytes of the heap file at pos to the plan.
+ */
+static void xar_heap_piece(struct __xar_heap_walk_t *w, off_t pos, off_t len) {
+	struct __xar_heap_plan_t *plan = w->plan;
+	struct __xar_heap_piece_t *last;
+
+	last = plan->count ? &plan->pieces[plan->count - 1] : NULL;
+	if( last && (last->pos + last->len == pos) ) {
+		last->len += len;
+		return;
+	}
+	if( xar_heap_grow((void **)&plan->pieces, plan->count, &w->splan, sizeof(*plan->pieces)) != 0 ) {
+		w->failed = 1;
+		return;
+	}
+	plan->pieces[plan->count].pos = pos;
+	plan->pieces[plan->count].len = len;
+	plan->count++;
+}
+
+/* xar_heap_profile
+ * Summary: reads the profile, the paths of the files to put first.
+ */
+static int32_t xar_heap_profile(struct __xar_heap_walk_t *w, const char *file) {
+	FILE *fp;
+	char line[4096];
+	char *s;
+	size_t len;
+	long n = 0;
+
+	fp = fopen(file, "r");
+	if( !fp )
+		return -1;
+	w->profile = xmlHashCreate(0);
+	while( w->profile && fgets(line, sizeof(line), fp) ) {
+		len = strlen(line);
+		while( len && ((line[len-1] == '\n') || (line[len-1] == '\r')) )
+			line[--len] = '\0';
+		for( s = line; (s[0] == '.') && (s[1] == '/'); s += 2 );
+		while( *s == '/' )
+			s++;
+		if( *s )
+			xmlHashAddEntry(w->profile, BAD_CAST(s), (void *)(intptr_t)(++n));
+	}
+	fclose(fp);
+	return w->profile ? 0 : -1;
+}
+
+/* xar_heap_rewrite
+ * Summary: points the data properties at where their ranges moved to.
+ */
+static void xar_heap_rewrite(struct __xar_heap_walk_t *w) {
+	struct __xar_heap_range_t *r;
+	xar_prop_t p, tmpp;
+	const char *value;
+	char numstr[32];
+	char *list;
+	int64_t *extents;
+	int n, i;
+	size_t l;
+	off_t off;
+	struct __xar_heap_prop_t *hp;
+
+	for( hp = w->props; hp < w->props + w->nprops; hp++ ) {
+		p = hp->p;
+		tmpp = xar_prop_pget(p, "offset");
+		off = xar_data_offset(p);
+		r = xar_heap_range_find(w, off);
+		if( tmpp && r ) {
+			snprintf(numstr, sizeof(numstr), "%"PRId64, (int64_t)r->dst);
+			xar_prop_pset(hp->f, p, "offset", numstr);
+		}
+
+		tmpp = xar_prop_pget(p, "extents");
+		if( !tmpp || !(value = xar_prop_getvalue(tmpp)) )
+			continue;
+		extents = NULL;
+		if( (xar_chunks_parse(value, &extents, &n) == 0) && (list = malloc((size_t)n * 21 + 1)) ) {
+			for( l = 0, i = 0; i < n; i++ ) {
+				r = xar_heap_range_find(w, (off_t)extents[i]);
+				l += (size_t)sprintf(list + l, "%s%"PRId64, i ? " " : "", r ? (int64_t)r->dst : extents[i]);
+			}
+			xar_prop_pset(hp->f, p, "extents", list);
+			free(list);
+		}
+		free(extents);
+	}
+}
+
+static void xar_heap_walk_free(struct __xar_heap_walk_t *w) {
+	size_t i;
+
+	for( i = 0; i < w->nusers; i++ )
+		free(w->users[i].path);
+	free(w->users);
+	free(w->uses);
+	free(w->props);
+	free(w->ranges);
+	if( w->profile )
+		xmlHashFree(w->profile, NULL);
+}
+
+/* xar_heap_order
+ * x: archive being closed, with all its data in the heap, before the TOC
+ * is written
+ * Returns: 0, or -1 if the profile cannot be read or memory runs out
+ * Summary: decides the order the heap file is copied into the archive in,
+ * see the comment at the top of the file, and moves the offsets of the
+ * data of the files to match.
+ */
+int32_t xar_heap_order(xar_t x) {
+	struct __xar_heap_walk_t w;
+	struct __xar_heap_user_t *u;
+	struct __xar_heap_range_t *r;
+	int (*cmp)(const void *, const void *) = xar_heap_cmp_added;
+	const char *order, *profile;
+	size_t i, j, n;
+	off_t pos, cursor;
+
+	order = xar_opt_get(x, XAR_OPT_HEAPORDER);
+	profile = xar_opt_get(x, XAR_OPT_HEAPPROFILE);
+	if( (!order || !*order) && (!profile || !*profile) )
+		return 0;
+	if( XAR(x)->heap_start || (XAR(x)->heap_fd < 0) )
+		return 0;
+	if( order && (strcmp(order, XAR_OPT_VAL_PATH) == 0) )
+		cmp = xar_heap_cmp_path;
+	else if( order && (strcmp(order, XAR_OPT_VAL_SIZE) == 0) )
+		cmp = xar_heap_cmp_size;
+	else if( order && (strcmp(order, XAR_OPT_VAL_EXTENSION) == 0) )
+		cmp = xar_heap_cmp_extension;
+
+	memset(&w, 0, sizeof(w));
+	w.prefix = xar_heap_prefix(x);
+	w.end = XAR(x)->heap_len;
+	if( w.prefix == -1 )
+		return -1;
+	if( profile && *profile && (xar_heap_profile(&w, profile) != 0) ) {
+		xar_heap_walk_free(&w);
+		xar_err_new(x);
+		xar_err_set_string(x, "Error reading the heap profile");
+		xar_err_set_errno(x, errno);
+		xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_CREATION);
+		return -1;
+	}
+	xar_heap_walk(&w, XAR(x)->files);
+	if( w.failed )
+		goto FAIL;
+
+	/* the ranges of the data, which are left in order should any overlap */
+	w.ranges = malloc((w.nuses ? w.nuses : 1) * sizeof(*w.ranges));
+	if( !w.ranges )
+		goto FAIL;
+	memcpy(w.ranges, w.uses, w.nuses * sizeof(*w.ranges));
+	qsort(w.ranges, w.nuses, sizeof(*w.ranges), xar_heap_cmp_range);
+	for( i = 0, n = 0; i < w.nuses; i++ ) {
+		if( n && (w.ranges[n-1].pos == w.ranges[i].pos) && (w.ranges[n-1].len == w.ranges[i].len) )
+			continue;
+		if( (n && (w.ranges[n-1].pos + w.ranges[n-1].len > w.ranges[i].pos)) || (w.ranges[i].pos + w.ranges[i].len > w.end) ) {
+			xar_heap_walk_free(&w);
+			return 0;
+		}
+		w.ranges[n++] = w.ranges[i];
+	}
+	w.nranges = n;
+
+	w.plan = calloc(1, sizeof(*w.plan));
+	if( !w.plan )
+		goto FAIL;
+	qsort(w.users, w.nusers, sizeof(*w.users), cmp);
+	cursor = w.prefix;
+	for( i = 0; i < w.nusers; i++ ) {
+		u = &w.users[i];
+		for( j = u->first; j < u->first + u->count; j++ ) {
+			r = xar_heap_range_find(&w, w.uses[j].pos);
+			if( !r || (r->dst != -1) )
+				continue;
+			r->dst = cursor;
+			cursor += r->len;
+			xar_heap_piece(&w, r->pos - w.prefix, r->len);
+		}
+	}
+	for( pos = w.prefix, i = 0; i < w.nranges; i++ ) {
+		if( w.ranges[i].pos > pos )
+			xar_heap_piece(&w, pos - w.prefix, w.ranges[i].pos - pos);
+		pos = w.ranges[i].pos + w.ranges[i].len;
+	}
+	if( pos < w.end )
+		xar_heap_piece(&w, pos - w.prefix, w.end - pos);
+	if( w.failed )
+		goto FAIL;
+
+	xar_heap_rewrite(&w);
+	if( (w.plan->count > 1) || (w.plan->count && w.plan->pieces[0].pos) )
+		XAR(x)->heap_plan = w.plan;
+	else
+		xar_heap_order_free_plan(w.plan);
+	xar_heap_walk_free(&w);
+	return 0;
+
+FAIL:
+	if( w.plan )
+		xar_heap_order_free_plan(w.plan);
+	xar_heap_walk_free(&w);
+	xar_err_new(x);
+	xar_err_set_string(x, "Error ordering the heap");
+	xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_CREATION);
+	return -1;
+}
+
+/* xar_heap_order_copy
+ * x: archive being closed, for which xar_heap_order made a plan
+ * buf, size: buffer to copy through if the kernel cannot copy
+ * Returns: 0 or -1 on error
+ * Summary: appends the heap file to the archive in the planned order.
+ */
+int32_t xar_heap_order_copy(xar_t x, void *buf, size_t size) {
+	struct __xar_heap_plan_t *plan = XAR(x)->heap_plan;
+	size_t i;
+
+	for( i = 0; i < plan->count; i++ ) {
+		if( xar_heap_copy(x, plan->pieces[i].pos, plan->pieces[i].len, buf, size) != 0 )
+			return -1;
+	}
+	return 0;
+}
+
+/* xar_heap_order_free
+ * x: archive being closed
+ */
+void xar_heap_order_free(xar_t x) {
+	if( XAR(x)->heap_plan ) {
+		xar_heap_order_free_plan(XAR(x)->heap_plan);
+		XAR(x)->heap_plan = NULL;
+	}
+}
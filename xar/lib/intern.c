@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Interned property keys and attribute names.
+ *
+ * Every property and attribute used to carry its own strdup'd key, so a
+ * large TOC held millions of copies of "name", "type", "data" and so on,
+ * and every lookup compared them with strcmp.  Keys are now stored once
+ * in a libxml2 dictionary, and a node whose key is interned says so with
+ * XAR_POOL_KEY.  A lookup interns nothing: it finds the dictionary entry
+ * for the key it wants once and then compares interned keys by pointer.
+ *
+ * The keys xar itself uses are put in a seed dictionary that is never
+ * changed afterwards, so looking them up takes no lock, even while
+ * archives are read from several threads.  Any other key goes into a
+ * sub-dictionary of the seed, behind a read/write lock.  Archives hold a
+ * reference on the dictionaries from xar_new to xar_close, and they are
+ * freed when the last archive is closed.  Without an open archive
+ * nothing is interned and callers keep their own copy of the key.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <stdint.h>
+#include <libxml/xmlstring.h>
+#include <libxml/dict.h>
+#include "intern.h"
+
+/* Keys xar reads and writes itself */
+static const char *xar_intern_seed[] = {
+	"name", "type", "data", "offset", "length", "size", "encoding",
+	"style", "archived-checksum", "extracted-checksum", "chunks",
+	"mode", "uid", "gid", "user", "group", "atime", "mtime", "ctime",
+	"inode", "deviceno", "link", "id", "ea", "fstype", "acl",
+	"access", "default", "device", "major", "minor", "hardlink",
+	"FinderCreateTime", "time", "nanoseconds", "contents", "script",
+	"interpreter", "file", "directory", "symlink", "original", "extents",
+	NULL
+};
+
+static xmlDictPtr xar_seed = NULL;   /* read only once created */
+static xmlDictPtr xar_dict = NULL;   /* every other key */
+static int xar_dict_users = 0;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t xar_dict_users_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t xar_dict_lock = PTHREAD_RWLOCK_INITIALIZER;
+#define USERS_LOCK() pthread_mutex_lock(&xar_dict_users_lock)
+#define USERS_UNLOCK() pthread_mutex_unlock(&xar_dict_users_lock)
+#define DICT_RDLOCK() pthread_rwlock_rdlock(&xar_dict_lock)
+#define DICT_WRLOCK() pthread_rwlock_wrlock(&xar_dict_lock)
+#define DICT_UNLOCK() pthread_rwlock_unlock(&xar_dict_lock)
+#else
+#define USERS_LOCK() do { } while(0)
+#define USERS_UNLOCK() do { } while(0)
+#define DICT_RDLOCK() do { } while(0)
+#define DICT_WRLOCK() do { } while(0)
+#define DICT_UNLOCK() do { } while(0)
+#endif
+
+/* xar_intern_retain
+ * Returns: 0 on success, -1 if out of memory
+ * Summary: takes a reference on the dictionaries, creating and seeding
+ * them for the first one.  Called by xar_new.
+ */
+int32_t xar_intern_retain(void) {
+	int i;
+
+	USERS_LOCK();
+	if( xar_dict_users == 0 ) {
+		xar_seed = xmlDictCreate();
+		if( xar_seed ) {
+			for( i = 0; xar_intern_seed[i]; i++ )
+				xmlDictLookup(xar_seed, BAD_CAST(xar_intern_seed[i]), -1);
+			xar_dict = xmlDictCreateSub(xar_seed);
+		}
+		if( !xar_dict ) {
+			if( xar_seed )
+				xmlDictFree(xar_seed);
+			xar_seed = NULL;
+			USERS_UNLOCK();
+			return -1;
+		}
+	}
+	xar_dict_users++;
+	USERS_UNLOCK();
+	return 0;
+}
+
+/* xar_intern_release
+ * Summary: drops a reference taken by xar_intern_retain, freeing the
+ * dictionaries with the last one.  Called by xar_close.
+ */
+void xar_intern_release(void) {
+	USERS_LOCK();
+	if( (xar_dict_users > 0) && (--xar_dict_users == 0) ) {
+		xmlDictFree(xar_dict);
+		xmlDictFree(xar_seed);
+		xar_dict = xar_seed = NULL;
+	}
+	USERS_UNLOCK();
+}
+
+/* xar_intern
+ * s: string to intern
+ * Returns: the interned copy of s, which must not be freed, or NULL if
+ * out of memory or no archive is open
+ */
+const char *xar_intern(const char *s) {
+	const xmlChar *ret;
+
+	if( !xar_seed )
+		return NULL;
+	ret = xmlDictExists(xar_seed, BAD_CAST(s), -1);
+	if( ret )
+		return (const char *)ret;
+
+	DICT_RDLOCK();
+	ret = xmlDictExists(xar_dict, BAD_CAST(s), -1);
+	DICT_UNLOCK();
+	if( !ret ) {
+		DICT_WRLOCK();
+		ret = xmlDictLookup(xar_dict, BAD_CAST(s), -1);
+		DICT_UNLOCK();
+	}
+	return (const char *)ret;
+}
+
+/* xar_intern_find
+ * s: string to look for, need not be NUL terminated
+ * len: length of s
+ * Returns: the interned copy of the first len bytes of s, or NULL if
+ * they have never been interned
+ */
+const char *xar_intern_find(const char *s, size_t len) {
+	const xmlChar *ret;
+
+	if( !xar_seed )
+		return NULL;
+	ret = xmlDictExists(xar_seed, BAD_CAST(s), (int)len);
+	if( ret )
+		return (const char *)ret;
+
+	DICT_RDLOCK();
+	ret = xmlDictExists(xar_dict, BAD_CAST(s), (int)len);
+	DICT_UNLOCK();
+	return (const char *)ret;
+}
+
+/* xar_key_match
+ * key: key of a node, may be NULL
+ * interned: non-zero if key is interned
+ * ikey: result of xar_intern_find(s, len)
+ * s, len: the key looked for
+ * Returns: non-zero if key is the same string as the first len bytes of s
+ */
+int xar_key_match(const char *key, int interned, const char *ikey, const char *s, size_t len) {
+	if( !key )
+		return 0;
+	if( interned )
+		return key == ikey;
+	return (strncmp(key, s, len) == 0) && (key[len] == '\0');
+}
@@ -47,7 +47,10 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <assert.h>
+#include <zlib.h>
 
 #ifndef HAVE_ASPRINTF
 #include "asprintf.h"
@@ -59,10 +62,16 @@
 #include "zxar.h"
 #include "bzxar.h"
 #include "lzmaxar.h"
+#include "zstdxar.h"
+#include "lz4xar.h"
 #include "hash.h"
 #include "script.h"
 #include "macho.h"
 #include "util.h"
+#include "workers.h"
+#include "buffers.h"
+#include "heap.h"
+#include "repack.h"
 
 #if !defined(LLONG_MAX) && defined(LONG_LONG_MAX)
 #define LLONG_MAX LONG_LONG_MAX
@@ -114,13 +123,29 @@ static const struct datamod xar_datamods[] = {
 	  xar_lzma_toheap_in,
 	  (toheap_out)NULL,
 	  xar_lzma_toheap_done
+	},
+	{ xar_zstd_fromheap_in,
+	  (fromheap_out)NULL,
+	  xar_zstd_fromheap_done,
+	  xar_zstd_toheap_in,
+	  (toheap_out)NULL,
+	  xar_zstd_toheap_done
+	},
+	{ xar_lz4_fromheap_in,
+	  (fromheap_out)NULL,
+	  xar_lz4_fromheap_done,
+	  xar_lz4_toheap_in,
+	  (toheap_out)NULL,
+	  xar_lz4_toheap_done
 	}
 };
 
 static const is_compressed xar_compresschecks[] = {
 	xar_gzip_is_compressed,
 	xar_bzip_is_compressed,
-	xar_lzma_is_compressed
+	xar_lzma_is_compressed,
+	xar_zstd_is_compressed,
+	xar_lz4_is_compressed
 };
 
 
@@ -143,30 +168,50 @@ static size_t get_rsize(xar_t x) {
 	return bsize;
 }
 	
-static off_t get_offset(xar_t x, xar_file_t f, xar_prop_t p) {
+/* xar_data_offset
+ * p: property that may have data in the heap
+ * Returns: heap offset of the data of p, or -1 if it has none
+ * Summary: data stored in chunks listed by "extents" has no "offset",
+ * see XAR_CHUNKED_STYLE, and starts at its first extent.
+ */
+off_t xar_data_offset(xar_prop_t p) {
 	off_t seekoff;
 	xar_prop_t tmpp;
 	const char *opt = NULL;
 
-	(void)x; (void)f;
 	tmpp = xar_prop_pget(p, "offset");
+	if( !tmpp )
+		tmpp = xar_prop_pget(p, "extents");
 	if( tmpp )
 		opt = xar_prop_getvalue(tmpp);
-	
+	if( !opt )
+		return -1;
+
+	errno = 0;
 	seekoff = strtoll(opt, NULL, 0);
-		
-	if( ((seekoff == LLONG_MAX) || (seekoff == LLONG_MIN)) && (errno == ERANGE) ) {
+	if( (errno != 0) || (seekoff < 0) )
 		return -1;
-	}
 
 	return seekoff;
 }
 
+static off_t get_offset(xar_t x, xar_file_t f, xar_prop_t p) {
+	(void)x;
+	if( (p == xar_file_cache(f)->data) && (xar_file_cache(f)->flags & XAR_FCACHE_OFFSET) )
+		return (off_t)xar_file_cache(f)->offset;
+	return xar_data_offset(p);
+}
+
 static int64_t get_length(xar_prop_t p) {
 	const char *opt = NULL;
 	int64_t fsize = 0;
 	xar_prop_t tmpp;
 
+	if( XAR_PROP(p)->file ) {
+		const struct __xar_file_cache_t *c = xar_file_cache(XAR_PROP(p)->file);
+		if( (p == c->data) && (c->flags & XAR_FCACHE_LENGTH) )
+			return (int64_t)c->length;
+	}
 	tmpp = xar_prop_pget(p, "length");
 	if( tmpp )
 		opt = xar_prop_getvalue(tmpp);
@@ -223,37 +268,116 @@ static void xar_io_seek(xar_t x, xar_file_t f, off_t seekoff) {
 	}
 }
 
-int32_t xar_attrcopy_to_heap(xar_t x, xar_file_t f, xar_prop_t p, read_callback rcb, void *context) {
+/* xar_heap_locate
+ * x: archive to read from
+ * f: file the data belongs to, for error reporting
+ * seekoff: archive offset of the data
+ * Returns: the offset to pass to xar_heap_read for the start of the data.
+ * Summary: seekable archives are read with explicit offsets and need no
+ * preparation.  For archives that cannot seek, such as pipes, the stream
+ * is advanced up to the data and -1 is returned.
+ */
+static off_t xar_heap_locate(xar_t x, xar_file_t f, off_t seekoff) {
+	if( lseek(XAR(x)->fd, 0, SEEK_CUR) != -1 )
+		return seekoff;
+	xar_io_seek(x, f, seekoff);
+	return -1;
+}
+
+/* xar_heap_read
+ * Reads heap data found at archive offset off with pread(), or from the
+ * mapping of an archive opened with XAR_OPEN_MMAP, leaving the
+ * descriptor's offset and the archive handle alone so several threads
+ * can read at once.  An offset of -1 reads from the current position of
+ * an archive that cannot seek and accounts for it in heap_offset.
+ */
+static ssize_t xar_heap_read(xar_t x, void *buf, size_t len, off_t off) {
+	ssize_t r;
+
+	if( XAR(x)->map && (off >= 0) ) {
+		if( (uint64_t)off >= XAR(x)->maplen )
+			return 0;
+		if( len > XAR(x)->maplen - (size_t)off )
+			len = XAR(x)->maplen - (size_t)off;
+		memcpy(buf, XAR(x)->map + off, len);
+		return (ssize_t)len;
+	}
+	if( off >= 0 )
+		return pread(XAR(x)->fd, buf, len, off);
+	r = read(XAR(x)->fd, buf, len);
+	if( r > 0 )
+		XAR(x)->heap_offset += r;
+	return r;
+}
+
+static int32_t xar_heap_write(xar_t x, xar_file_t f, void *buf, size_t len, void *context) {
+	size_t off = 0;
+	int r;
+
+	(void)f; (void)context;
+	while( off < len ) {
+		r = (int)write(XAR(x)->heap_fd, ((char *)buf)+off, len-off);
+		if( r < 0 ) {
+			if( errno == EINTR )
+				continue;
+			return -1;
+		}
+		off += r;
+	}
+	XAR(x)->heap_offset += off;
+	return (int32_t)off;
+}
+
+/* xar_attrcopy_encode
+ * x: archive whose options drive the data modules
+ * rcb/rcontext: source of the unencoded data
+ * wcb/wcontext: sink for the encoded data
+ * readsize/writesize: set to the number of bytes read and written
+ * Returns 0 on success, -1 on error
+ * Summary: runs the data through the toheap modules without touching the
+ * heap or the heap bookkeeping.  The module done callbacks are run, so
+ * p receives the checksums and encoding on success.  In adaptive mode
+ * the compression is picked from the first block read.
+ */
+int32_t xar_attrcopy_encode(xar_t x, xar_file_t f, xar_prop_t p, read_callback rcb, void *rcontext, write_callback wcb, void *wcontext, int64_t *readsize, int64_t *writesize) {
 	void	*modulecontext[sizeof(xar_datamods)/sizeof(struct datamod)];
 	int modulecount = (int)(sizeof(modulecontext)/sizeof(modulecontext[0]));
-	int r, off, i;
+	int r, i;
 	size_t bsize, rsize;
-	int64_t readsize=0, writesize=0, inc = 0;
 	void *inbuf;
-	char *tmpstr = NULL;
-	const char *opt = NULL, *csum = NULL;
-	off_t orig_heap_offset = XAR(x)->heap_offset;
-	xar_file_t tmpf = NULL;
-	xar_prop_t tmpp = NULL;
+	const char *saved = XAR(x)->compression;
+	const char *opt;
+	int choose;
 
 	memset(modulecontext, 0, sizeof(void*)*modulecount);
+	*readsize = *writesize = 0;
 
 	bsize = get_rsize(x);
+	opt = xar_opt_get(x, XAR_OPT_COMPRESSION);
+	choose = !saved && opt && (strcmp(opt, XAR_OPT_VAL_AUTO) == 0);
 
 	r = 1;
 	while(r != 0) {
-		inbuf = malloc(bsize);
-		if( !inbuf )
+		inbuf = xar_buffer_get(x, bsize);
+		if( !inbuf ) {
+			XAR(x)->compression = saved;
 			return -1;
+		}
 
-		r = rcb(x, f, inbuf, bsize, context);
+		r = rcb(x, f, inbuf, bsize, rcontext);
 		if( r < 0 ) {
-			free(inbuf);
+			xar_buffer_put(x, inbuf);
+			XAR(x)->compression = saved;
 			return -1;
 		}
 
-		readsize+=r;
-		inc += r;
+		/* the codec picked stays in use for the rest of the file */
+		if( choose ) {
+			XAR(x)->compression = xar_compression_choose(x, inbuf, r);
+			choose = 0;
+		}
+
+		*readsize += r;
 		rsize = r;
 
 		/* filter the data through the in modules */
@@ -269,37 +393,80 @@ int32_t xar_attrcopy_to_heap(xar_t x, xar_file_t f, xar_prop_t p, read_callback
 				xar_datamods[i].th_out(x, f, p, inbuf, rsize, &(modulecontext[i]));
 		}
 
-		off = 0;
 		if( rsize != 0 ) {
-			do {
-				r = (int)write(XAR(x)->heap_fd, ((char *)inbuf)+off, rsize-off);
-				if( (r < 0) && (errno != EINTR) )
-					return -1;
-				off += r;
-				writesize += r;
-			} while( (size_t)off < rsize );
+			if( wcb(x, f, inbuf, rsize, wcontext) < 0 ) {
+				xar_buffer_put(x, inbuf);
+				XAR(x)->compression = saved;
+				return -1;
+			}
+			*writesize += rsize;
 		}
-		XAR(x)->heap_offset += off;
-		free(inbuf);
-		
+		xar_buffer_put(x, inbuf);
+	}
+
+	/* finish up anything that still needs doing */
+	for( i = 0; i < modulecount; i++) {
+		if( xar_datamods[i].th_done )
+			xar_datamods[i].th_done(x, f, p, &(modulecontext[i]));
 	}
+	XAR(x)->compression = saved;
+
+	return 0;
+}
+
+/* Bytes at either end of a file that go into its prekey, see
+ * xar_attrcopy_dedup */
+#define XAR_DEDUP_PREKEY_BLOCK 65536
+
+/* xar_dedup_link
+ * Summary: makes f a hardlink to tmpf, which keeps the data, for
+ * XAR_OPT_LINKSAME.
+ */
+static void xar_dedup_link(xar_file_t f, xar_file_t tmpf) {
+	const char *id = xar_attr_pget(tmpf, NULL, "id");
+	xar_prop_t tmpp;
 
+	xar_prop_pset(f, NULL, "type", "hardlink");
+	tmpp = xar_prop_pfirst(f);
+	if( tmpp )
+		tmpp = xar_prop_find(tmpp, "type");
+	if( tmpp )
+		xar_attr_pset(f, tmpp, "link", id);
+
+	xar_prop_pset(tmpf, NULL, "type", "hardlink");
+	tmpp = xar_prop_pfirst(tmpf);
+	if( tmpp )
+		tmpp = xar_prop_find(tmpp, "type");
+	if( tmpp )
+		xar_attr_pset(tmpf, tmpp, "link", "original");
+
+	tmpp = xar_prop_pfirst(f);
+	if( tmpp )
+		tmpp = xar_prop_find(tmpp, "data");
+	xar_prop_punset(f, tmpp);
+}
+
+/* xar_attrcopy_commit
+ * x: archive being created
+ * orig_heap_offset: heap offset at which the encoded data was appended
+ * readsize/writesize: as returned by xar_attrcopy_encode
+ * Returns 0 on success, -1 on error
+ * Summary: does the heap bookkeeping for data that xar_attrcopy_encode
+ * produced and that has just been appended to the heap file: rolls
+ * back empty and duplicate data, and records size, offset, encoding
+ * and length in p.
+ */
+int32_t xar_attrcopy_commit(xar_t x, xar_file_t f, xar_prop_t p, off_t orig_heap_offset, int64_t readsize, int64_t writesize) {
+	const char *opt = NULL, *csum = NULL;
+	xar_file_t tmpf = NULL;
+	xar_prop_t tmpp = NULL;
 
 	/* If size is 0, don't bother having anything in the heap */
 	if( readsize == 0 ) {
 		XAR(x)->heap_offset = orig_heap_offset;
 		lseek(XAR(x)->heap_fd, -writesize, SEEK_CUR);
-		for( i = 0; i < modulecount; i++) {
-			if( xar_datamods[i].th_done )
-				xar_datamods[i].th_done(x, f, p, &(modulecontext[i]));
-		}
 		return 0;
 	}
-	/* finish up anything that still needs doing */
-	for( i = 0; i < modulecount; i++) {
-		if( xar_datamods[i].th_done )
-			xar_datamods[i].th_done(x, f, p, &(modulecontext[i]));
-	}
 
 	XAR(x)->heap_len += writesize;
 	tmpp = xar_prop_pget(p, "archived-checksum");
@@ -311,25 +478,7 @@ int32_t xar_attrcopy_to_heap(xar_t x, xar_file_t f, xar_prop_t p, read_callback
 		const char *attr = xar_prop_getkey(p);
 		opt = xar_opt_get(x, XAR_OPT_LINKSAME);
 		if( opt && (strcmp(attr, "data") == 0) ) {
-			const char *id = xar_attr_pget(tmpf, NULL, "id");
-			xar_prop_pset(f, NULL, "type", "hardlink");
-			tmpp = xar_prop_pfirst(f);
-			if( tmpp )
-				tmpp = xar_prop_find(tmpp, "type");
-			if( tmpp )
-				xar_attr_pset(f, tmpp, "link", id);
-
-			xar_prop_pset(tmpf, NULL, "type", "hardlink");
-			tmpp = xar_prop_pfirst(tmpf);
-			if( tmpp )
-				tmpp = xar_prop_find(tmpp, "type");
-			if( tmpp )
-				xar_attr_pset(tmpf, tmpp, "link", "original");
-			
-			tmpp = xar_prop_pfirst(f);
-			if( tmpp )
-				tmpp = xar_prop_find(tmpp, "data");
-			xar_prop_punset(f, tmpp);
+			xar_dedup_link(f, tmpf);
 
 			XAR(x)->heap_offset = orig_heap_offset;
 			lseek(XAR(x)->heap_fd, -writesize, SEEK_CUR);
@@ -346,21 +495,31 @@ int32_t xar_attrcopy_to_heap(xar_t x, xar_file_t f, xar_prop_t p, read_callback
 				key = xar_prop_getkey(p);
 				tmpp = xar_prop_find(tmpp, key);
 			}
+			/* chunks are shared through their extents */
 			if( tmpp )
-				tmpp = xar_prop_pget(tmpp, "offset");
+				tmpp = xar_prop_pget(tmpp, xar_prop_pget(p, "extents") ? "extents" : "offset");
 			if( tmpp )
 				offstr = xar_prop_getvalue(tmpp);
 			if( offstr ) {
-				tmpoff = strtoll(offstr, NULL, 10);
 				XAR(x)->heap_offset = orig_heap_offset;
 				lseek(XAR(x)->heap_fd, -writesize, SEEK_CUR);
-				orig_heap_offset = tmpoff;
 				XAR(x)->heap_len -= writesize;
+				if( xar_prop_pget(p, "extents") ) {
+					xar_prop_pset(f, p, "extents", offstr);
+				} else {
+					tmpoff = strtoll(offstr, NULL, 10);
+					orig_heap_offset = tmpoff;
+				}
 			}
 			
 		}
 	} else if( csum ) {
 		xmlHashAddEntry(XAR(x)->csum_hash, BAD_CAST(csum), XAR_FILE(f));
+		/* for xar_attrcopy_dedup */
+		tmpp = xar_prop_pget(p, "extracted-checksum");
+		if( tmpp && xar_prop_getvalue(tmpp) && (strcmp(xar_prop_getkey(p), "data") == 0) &&
+		    (xar_opt_get(x, XAR_OPT_COALESCE) || xar_opt_get(x, XAR_OPT_LINKSAME)) )
+			xmlHashAddEntry(XAR(x)->xsum_hash, BAD_CAST(xar_prop_getvalue(tmpp)), XAR_FILE(f));
 	} else {
 		xar_err_new(x);
 		xar_err_set_file(x, f);
@@ -368,15 +527,40 @@ int32_t xar_attrcopy_to_heap(xar_t x, xar_file_t f, xar_prop_t p, read_callback
 		xar_err_callback(x, XAR_SEVERITY_WARNING, XAR_ERR_ARCHIVE_CREATION);
 	}
 
+	return xar_attrcopy_record(x, f, p, orig_heap_offset, readsize, writesize);
+}
+
+/* xar_attrcopy_record
+ * x: archive being created
+ * offset: heap offset of the encoded data
+ * readsize/writesize: unencoded and encoded length of the data
+ * Returns 0 on success, -1 on error
+ * Summary: records size, offset, encoding and length in p.  Data whose
+ * chunks are listed in "extents" gets no offset.
+ */
+int32_t xar_attrcopy_record(xar_t x, xar_file_t f, xar_prop_t p, off_t offset, int64_t readsize, int64_t writesize) {
+	char *tmpstr = NULL;
+	const char *opt = NULL;
+	xar_prop_t tmpp = NULL;
+
+	(void)x;
 	if (asprintf(&tmpstr, "%"PRIu64, readsize) == -1)
 		return -1;
 	xar_prop_pset(f, p, "size", tmpstr);
 	free(tmpstr);
 
-	if (asprintf(&tmpstr, "%"PRIu64, (uint64_t)orig_heap_offset) == -1)
-		return -1;
-	xar_prop_pset(f, p, "offset", tmpstr);
-	free(tmpstr);
+	/* chunks listed in extents are found there, see XAR_CHUNKED_STYLE */
+	tmpp = xar_prop_pget(p, "extents");
+	if( tmpp ) {
+		tmpp = xar_prop_pget(p, "offset");
+		if( tmpp )
+			xar_prop_punset(f, tmpp);
+	} else {
+		if (asprintf(&tmpstr, "%"PRIu64, (uint64_t)offset) == -1)
+			return -1;
+		xar_prop_pset(f, p, "offset", tmpstr);
+		free(tmpstr);
+	}
 
 	tmpp = xar_prop_pget(p, "encoding");
 	if (!tmpp) {
@@ -396,6 +580,435 @@ int32_t xar_attrcopy_to_heap(xar_t x, xar_file_t f, xar_prop_t p, read_callback
 	return 0;
 }
 
+/* xar_attrcopy_dedup
+ * x: archive being created
+ * f, p: file and its data property, about to be archived
+ * fd: the file, read with pread so that its offset is left alone
+ * Returns: 0 if the data is in the heap already and f is done, 1 if it
+ * still has to be archived, or -1 on error
+ * Summary: xar_attrcopy_commit only recognizes duplicate data by its
+ * archived-checksum, once it has been encoded and written to the heap.
+ * With XAR_OPT_COALESCE or XAR_OPT_LINKSAME, data is recognized here by
+ * its extracted-checksum before it is encoded.  Every file is given a
+ * prekey of its size and of the crc32 of its first and last blocks, which
+ * costs two reads.  Only when that matches the prekey of an earlier file
+ * is the whole file read and hashed, and looked up among the data
+ * committed so far.
+ */
+int32_t xar_attrcopy_dedup(xar_t x, xar_file_t f, xar_prop_t p, int fd) {
+	struct stat sb;
+	char key[64];
+	char *buf;
+	size_t bsize;
+	ssize_t r;
+	off_t pos;
+	uLong head, tail;
+	void *context = NULL;
+	const char *csum, *style;
+	xar_file_t sf, tmpf;
+	xar_prop_t sp, tmpp, data;
+	int linksame;
+	int32_t ret = 1;
+
+	linksame = xar_opt_get(x, XAR_OPT_LINKSAME) != NULL;
+	if( !linksame && !xar_opt_get(x, XAR_OPT_COALESCE) )
+		return 1;
+	if( (fstat(fd, &sb) != 0) || !S_ISREG(sb.st_mode) || (sb.st_size <= 0) )
+		return 1;
+
+	bsize = get_rsize(x);
+	if( bsize < XAR_DEDUP_PREKEY_BLOCK )
+		bsize = XAR_DEDUP_PREKEY_BLOCK;
+	buf = malloc(bsize);
+	if( !buf )
+		return -1;
+
+	r = pread(fd, buf, XAR_DEDUP_PREKEY_BLOCK, 0);
+	if( r <= 0 )
+		goto DONE;
+	head = crc32(0L, (Bytef *)buf, (uInt)r);
+	pos = sb.st_size > XAR_DEDUP_PREKEY_BLOCK ? sb.st_size - XAR_DEDUP_PREKEY_BLOCK : 0;
+	r = pread(fd, buf, XAR_DEDUP_PREKEY_BLOCK, pos);
+	if( r <= 0 )
+		goto DONE;
+	tail = crc32(0L, (Bytef *)buf, (uInt)r);
+	snprintf(key, sizeof(key), "%"PRId64"/%08lx/%08lx", (int64_t)sb.st_size, (unsigned long)head, (unsigned long)tail);
+	if( !xmlHashLookup(XAR(x)->prekey_hash, BAD_CAST(key)) ) {
+		xmlHashAddEntry(XAR(x)->prekey_hash, BAD_CAST(key), XAR_FILE(f));
+		goto DONE;
+	}
+
+	/* the earlier file may still be queued */
+	xar_workers_drain(x);
+
+	sf = xar_file_new(NULL);
+	if( !sf )
+		goto DONE;
+	sp = xar_prop_pset(sf, NULL, "data", NULL);
+	for( pos = 0; sp && (pos < sb.st_size); pos += r ) {
+		r = pread(fd, buf, bsize, pos);
+		if( (r < 0) && (errno == EINTR) ) {
+			r = 0;
+			continue;
+		}
+		if( (r <= 0) || (xar_hash_unarchived_out(x, sf, sp, buf, (size_t)r, &context) < 0) )
+			break;
+	}
+	xar_hash_done(x, sf, sp, &context);
+
+	csum = style = NULL;
+	tmpf = NULL;
+	tmpp = sp && (pos == sb.st_size) ? xar_prop_pget(sp, "extracted-checksum") : NULL;
+	if( tmpp ) {
+		csum = xar_prop_getvalue(tmpp);
+		style = xar_attr_pget(sf, tmpp, "style");
+	}
+	if( csum && style )
+		tmpf = xmlHashLookup(XAR(x)->xsum_hash, BAD_CAST(csum));
+	data = NULL;
+	if( tmpf ) {
+		data = xar_prop_pfirst(tmpf);
+		if( data )
+			data = xar_prop_find(data, "data");
+		tmpp = data ? xar_prop_pget(data, "extracted-checksum") : NULL;
+		if( !tmpp || (xar_data_offset(data) < 0) || !xar_attr_pget(tmpf, tmpp, "style") ||
+		    (strcmp(xar_attr_pget(tmpf, tmpp, "style"), style) != 0) )
+			data = NULL;
+	}
+	if( data ) {
+		if( linksame )
+			xar_dedup_link(f, tmpf);
+		else
+			xar_prop_replicate_r(f, XAR_PROP(data)->children, p);
+		ret = 0;
+	}
+	xar_file_free(sf);
+DONE:
+	free(buf);
+	return ret;
+}
+
+/* Read callback replaying data already pulled from another read callback */
+struct _prefix_context {
+	char *buf;
+	size_t len;
+	size_t off;
+	read_callback rcb;
+	void *context;
+};
+
+#define PREFIX_CONTEXT(x) ((struct _prefix_context *)(x))
+
+static int32_t xar_prefix_read(xar_t x, xar_file_t f, void *inbuf, size_t bsize, void *context) {
+	size_t len = PREFIX_CONTEXT(context)->len - PREFIX_CONTEXT(context)->off;
+
+	if( len == 0 )
+		return PREFIX_CONTEXT(context)->rcb(x, f, inbuf, bsize, PREFIX_CONTEXT(context)->context);
+	if( len > bsize )
+		len = bsize;
+	memcpy(inbuf, PREFIX_CONTEXT(context)->buf + PREFIX_CONTEXT(context)->off, len);
+	PREFIX_CONTEXT(context)->off += len;
+	return (int32_t)len;
+}
+
+/* xar_prefix_fill
+ * Pulls up to max bytes from the read callback into the prefix buffer.
+ * Returns 1 if the source was exhausted, 0 if not, -1 on error.
+ */
+static int32_t xar_prefix_fill(xar_t x, xar_file_t f, struct _prefix_context *pc, size_t max) {
+	size_t bsize = get_rsize(x);
+	char *tmp;
+	int r;
+
+	while( pc->len < max ) {
+		tmp = realloc(pc->buf, pc->len + bsize);
+		if( !tmp )
+			return -1;
+		pc->buf = tmp;
+		r = pc->rcb(x, f, pc->buf + pc->len, bsize, pc->context);
+		if( r < 0 )
+			return -1;
+		if( r == 0 )
+			return 1;
+		pc->len += r;
+	}
+	return 0;
+}
+
+int32_t xar_attrcopy_to_heap(xar_t x, xar_file_t f, xar_prop_t p, read_callback rcb, void *context) {
+	struct _prefix_context pc;
+	off_t orig_heap_offset;
+	int64_t readsize, writesize;
+	int32_t r;
+
+	memset(&pc, 0, sizeof(pc));
+	pc.rcb = rcb;
+	pc.context = context;
+
+	/* Small sources are read up front and encoded by the worker pool */
+	if( xar_workers_enabled(x) ) {
+		r = xar_prefix_fill(x, f, &pc, XAR_WORKERS_MAX_JOB);
+		if( r < 0 ) {
+			free(pc.buf);
+			return -1;
+		}
+		if( (r > 0) && (xar_workers_submit_buffer(x, f, p, pc.buf, pc.len) == 0) )
+			return 0;
+	}
+
+	/* queued data must reach the heap first to keep the layout serial */
+	xar_workers_drain(x);
+
+	orig_heap_offset = XAR(x)->heap_offset;
+	r = xar_attrcopy_encode(x, f, p, xar_prefix_read, &pc, xar_heap_write, NULL, &readsize, &writesize);
+	free(pc.buf);
+	if( r < 0 )
+		return -1;
+
+	return xar_attrcopy_commit(x, f, p, orig_heap_offset, readsize, writesize);
+}
+
+/* Decoding state for data stored with XAR_CHUNKED_STYLE.  The decoding
+ * modules see each chunk as a complete stream described by sp, while
+ * the checksum module sees the data as a whole.
+ */
+struct _chunk_state {
+	xar_file_t sf;          /* scratch file owning sp */
+	xar_prop_t sp;          /* carries the encoding of the chunks */
+	int64_t *lengths;       /* encoded length of each chunk */
+	int64_t *extents;       /* heap offset of each chunk, or NULL if they
+	                         * follow each other from the data offset */
+	int count;
+	int index;              /* chunk being decoded */
+	int64_t left;           /* encoded bytes left in that chunk */
+	void *modulecontext[sizeof(xar_datamods)/sizeof(struct datamod)];
+};
+
+/* Modules that look at the data as a whole instead of decoding it */
+#define XAR_DATAMOD_WHOLE(i) (xar_datamods[i].fh_in == xar_hash_archived)
+
+static void xar_chunks_free(xar_t x, xar_file_t f, struct _chunk_state *cs) {
+	int i;
+
+	if( !cs )
+		return;
+	for( i = 0; i < (int)(sizeof(xar_datamods)/sizeof(struct datamod)); i++ ) {
+		if( xar_datamods[i].fh_done && cs->modulecontext[i] )
+			xar_datamods[i].fh_done(x, f, cs->sp, &(cs->modulecontext[i]));
+	}
+	if( cs->sf )
+		xar_file_free(cs->sf);
+	free(cs->lengths);
+	free(cs->extents);
+	free(cs);
+}
+
+/* Limits a read to the rest of the current chunk */
+static size_t xar_chunks_clamp(struct _chunk_state *cs, size_t bsize) {
+	if( cs && ((int64_t)bsize > cs->left) )
+		return (size_t)cs->left;
+	return bsize;
+}
+
+/* Accounts for len encoded bytes having been decoded, finishing the
+ * decoding modules at the end of each chunk.
+ */
+static int32_t xar_chunks_advance(xar_t x, xar_file_t f, struct _chunk_state *cs, size_t len) {
+	int i;
+
+	if( !cs )
+		return 0;
+	cs->left -= len;
+	while( (cs->left == 0) && (cs->index < cs->count) ) {
+		for( i = 0; i < (int)(sizeof(xar_datamods)/sizeof(struct datamod)); i++ ) {
+			if( xar_datamods[i].fh_done && !XAR_DATAMOD_WHOLE(i) ) {
+				if( xar_datamods[i].fh_done(x, f, cs->sp, &(cs->modulecontext[i])) < 0 )
+					return -1;
+				cs->modulecontext[i] = NULL;
+			}
+		}
+		if( ++cs->index < cs->count )
+			cs->left = cs->lengths[cs->index];
+	}
+	return 0;
+}
+
+/* Archive offset to read the encoded data of p at, inc bytes in, for an
+ * archive that can seek.  heapoff is where the data offset of p points.
+ */
+static off_t xar_chunks_pos(xar_t x, struct _chunk_state *cs, off_t heapoff, int64_t inc) {
+	if( heapoff < 0 )
+		return -1;
+	if( cs && cs->extents && (cs->index < cs->count) )
+		return (off_t)xar_get_heap_offset(x) + cs->extents[cs->index] + (cs->lengths[cs->index] - cs->left);
+	return heapoff + inc;
+}
+
+/* xar_chunks_parse
+ * opt: space separated list of numbers
+ * list, count: set to the numbers, which the caller frees
+ * Returns: 0 on success, -1 if opt is malformed
+ */
+int32_t xar_chunks_parse(const char *opt, int64_t **list, int *count) {
+	const char *s;
+	char *end;
+	int n;
+
+	*list = NULL;
+	*count = 0;
+	for( n = 1, s = opt; *s; s++ ) {
+		if( *s == ' ' )
+			n++;
+	}
+	*list = calloc(n, sizeof(int64_t));
+	if( !*list )
+		return -1;
+	while( *opt && (*count < n) ) {
+		errno = 0;
+		(*list)[*count] = strtoll(opt, &end, 10);
+		if( (errno != 0) || (end == opt) || ((*list)[*count] < 0) )
+			return -1;
+		(*count)++;
+		opt = end;
+		while( *opt == ' ' )
+			opt++;
+	}
+	return 0;
+}
+
+/* xar_chunks_open
+ * f, p: file and data property to be decoded
+ * cs: set to the decoding state, or NULL if p is not stored in chunks
+ * Returns: 0 on success, -1 if the chunk table is malformed
+ */
+static int32_t xar_chunks_open(xar_t x, xar_file_t f, xar_prop_t p, struct _chunk_state **cs) {
+	const char *opt, *style;
+	int64_t total = 0;
+	xar_prop_t tmpp;
+	struct _chunk_state *c;
+	int n;
+
+	*cs = NULL;
+	opt = NULL;
+	tmpp = xar_prop_pget(p, "encoding");
+	if( tmpp )
+		opt = xar_attr_pget(f, tmpp, "style");
+	if( !opt || strcmp(opt, XAR_CHUNKED_STYLE) != 0 )
+		return 0;
+
+	tmpp = xar_prop_pget(p, "chunks");
+	if( !tmpp )
+		return -1;
+	opt = xar_prop_getvalue(tmpp);
+	style = xar_attr_pget(f, tmpp, "style");
+	if( !opt || !style || strcmp(style, XAR_CHUNKED_STYLE) == 0 )
+		return -1;
+
+	c = calloc(1, sizeof(struct _chunk_state));
+	if( !c )
+		return -1;
+	c->sf = xar_file_new(NULL);
+	if( c->sf )
+		c->sp = xar_prop_pset(c->sf, NULL, xar_prop_getkey(p), NULL);
+	if( c->sp && (tmpp = xar_prop_pset(c->sf, c->sp, "encoding", NULL)) )
+		xar_attr_pset(c->sf, tmpp, "style", style);
+	if( !tmpp || (xar_chunks_parse(opt, &c->lengths, &c->count) < 0) )
+		goto BAD;
+	for( n = 0; n < c->count; n++ )
+		total += c->lengths[n];
+	if( (c->count == 0) || (total != get_length(p)) )
+		goto BAD;
+
+	tmpp = xar_prop_pget(p, "extents");
+	if( tmpp ) {
+		opt = xar_prop_getvalue(tmpp);
+		if( !opt || (xar_chunks_parse(opt, &c->extents, &n) < 0) || (n != c->count) )
+			goto BAD;
+		if( c->extents[0] != get_offset(x, f, p) )
+			goto BAD;
+		/* chunks that follow each other are read as one stream */
+		for( n = 1; n < c->count; n++ ) {
+			if( c->extents[n] != c->extents[n-1] + c->lengths[n-1] )
+				break;
+		}
+		if( n == c->count ) {
+			free(c->extents);
+			c->extents = NULL;
+		} else if( lseek(XAR(x)->fd, 0, SEEK_CUR) < 0 ) {
+			xar_err_new(x);
+			xar_err_set_file(x, f);
+			xar_err_set_string(x, "io: Shared chunks need a seekable archive");
+			xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+			xar_chunks_free(x, f, c);
+			return -1;
+		}
+	}
+
+	c->left = c->lengths[0];
+	if( xar_chunks_advance(x, f, c, 0) < 0 )
+		goto BAD;
+	*cs = c;
+	return 0;
+BAD:
+	xar_err_new(x);
+	xar_err_set_file(x, f);
+	xar_err_set_string(x, "io: Malformed chunk table");
+	xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+	xar_chunks_free(x, f, c);
+	return -1;
+}
+
+/* Runs the in modules over a block read from the heap */
+static int32_t xar_fromheap_in(xar_t x, xar_file_t f, xar_prop_t p, struct _chunk_state *cs, void **modulecontext, void **inbuf, size_t *bsize) {
+	int i;
+
+	for( i = 0; i < (int)(sizeof(xar_datamods)/sizeof(struct datamod)); i++ ) {
+		if( xar_datamods[i].fh_in ) {
+			int32_t ret;
+			if( cs && !XAR_DATAMOD_WHOLE(i) )
+				ret = xar_datamods[i].fh_in(x, f, cs->sp, inbuf, bsize, &(cs->modulecontext[i]));
+			else
+				ret = xar_datamods[i].fh_in(x, f, p, inbuf, bsize, &(modulecontext[i]));
+			if( ret < 0 )
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Runs the out modules over a decoded block */
+static int32_t xar_fromheap_out(xar_t x, xar_file_t f, xar_prop_t p, struct _chunk_state *cs, void **modulecontext, void *inbuf, size_t bsize) {
+	int i;
+
+	for( i = 0; i < (int)(sizeof(xar_datamods)/sizeof(struct datamod)); i++ ) {
+		if( xar_datamods[i].fh_out ) {
+			int32_t ret;
+			if( cs && !XAR_DATAMOD_WHOLE(i) )
+				ret = xar_datamods[i].fh_out(x, f, cs->sp, inbuf, bsize, &(cs->modulecontext[i]));
+			else
+				ret = xar_datamods[i].fh_out(x, f, p, inbuf, bsize, &(modulecontext[i]));
+			if( ret < 0 )
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Runs the done modules, the chunk decoders have already been finished */
+static int32_t xar_fromheap_done(xar_t x, xar_file_t f, xar_prop_t p, struct _chunk_state *cs, void **modulecontext) {
+	int i;
+
+	for( i = 0; i < (int)(sizeof(xar_datamods)/sizeof(struct datamod)); i++ ) {
+		if( xar_datamods[i].fh_done && (!cs || XAR_DATAMOD_WHOLE(i)) ) {
+			int32_t ret;
+			ret = xar_datamods[i].fh_done(x, f, p, &(modulecontext[i]));
+			if( ret < 0 )
+				return ret;
+		}
+	}
+	return 0;
+}
+
 /* xar_copy_from_heap
  * This is the arcmod extraction entry point for extracting the file's
  * data from the heap file.
@@ -404,43 +1017,40 @@ int32_t xar_attrcopy_to_heap(xar_t x, xar_file_t f, xar_prop_t p, read_callback
 int32_t xar_attrcopy_from_heap(xar_t x, xar_file_t f, xar_prop_t p, write_callback wcb, void *context) {
 	void	*modulecontext[sizeof(xar_datamods)/sizeof(struct datamod)];
 	int modulecount = (int)(sizeof(modulecontext)/sizeof(modulecontext[0]));
-	int r, i;
+	int r;
 	size_t bsize, def_bsize;
 	int64_t fsize, inc = 0, seekoff;
-	void *inbuf;
-	const char *opt;
-	xar_prop_t tmpp;
+	void *inbuf, *tmp;
+	struct _chunk_state *cs;
+	off_t heapoff;
 
 	memset(modulecontext, 0, sizeof(void*)*modulecount);
 
 	def_bsize = get_rsize(x);
 
-	opt = NULL;
-	tmpp = xar_prop_pget(p, "offset");
-	if( tmpp )
-		opt = xar_prop_getvalue(tmpp);
-	if( !opt ) {
+	if( !xar_prop_pget(p, "offset") && !xar_prop_pget(p, "extents") ) {
 		wcb(x, f, NULL, 0, context);
 		return 0;
-	} else {
-		seekoff = strtoll(opt, NULL, 0);
-		if( ((seekoff == LLONG_MAX) || (seekoff == LLONG_MIN)) && (errno == ERANGE) ) {
-			return -1;
-		}
 	}
+	seekoff = get_offset(x, f, p);
+	if( seekoff < 0 )
+		return -1;
 
 	seekoff += (int64_t)xar_get_heap_offset(x);
-	xar_io_seek(x, f, seekoff);
+	heapoff = xar_heap_locate(x, f, seekoff);
 
 	fsize = get_length(p);
 	if( fsize == 0 )
 		return 0;
 	if( fsize < 0 )
 		return -1;
+	if( xar_chunks_open(x, f, p, &cs) < 0 )
+		return -1;
 
 	bsize = def_bsize;
-	inbuf = malloc(bsize);
+	inbuf = xar_buffer_get(x, bsize);
 	if( !inbuf ) {
+		xar_chunks_free(x, f, cs);
 		return -1;
 	}
 
@@ -450,144 +1060,257 @@ int32_t xar_attrcopy_from_heap(xar_t x, xar_file_t f, xar_prop_t p, write_callba
 			break;
 		if( (fsize - inc) < (int64_t)bsize )
 			bsize = (size_t)(fsize - inc);
-		r = (int)read(XAR(x)->fd, inbuf, bsize);
+		bsize = xar_chunks_clamp(cs, bsize);
+		r = (int)xar_heap_read(x, inbuf, bsize, xar_chunks_pos(x, cs, heapoff, inc));
 		if( r == 0 )
 			break;
 		if( (r < 0) && (errno == EINTR) )
 			continue;
 		if( r < 0 ) {
-			free(inbuf);
+			xar_buffer_put(x, inbuf);
+			xar_chunks_free(x, f, cs);
 			return -1;
 		}
 
-		XAR(x)->heap_offset += r;
 		inc += r;
 		bsize = r;
 
 		/* filter the data through the in modules */
-		for( i = 0; i < modulecount; i++) {
-			if( xar_datamods[i].fh_in ) {
-				int32_t ret;
-				ret = xar_datamods[i].fh_in(x, f, p, &inbuf, &bsize, &(modulecontext[i]));
-				if( ret < 0 )
-					return -1;
-			}
+		if( xar_fromheap_in(x, f, p, cs, modulecontext, &inbuf, &bsize) < 0 ) {
+			xar_buffer_put(x, inbuf);
+			xar_chunks_free(x, f, cs);
+			return -1;
 		}
 		
 		/* Only due the write phase, if there is a write function to call */
 		if(wcb){
 		
 			/* filter the data through the out modules */
-			for( i = 0; i < modulecount; i++) {
-				if( xar_datamods[i].fh_out ) {
-					int32_t ret;
-					ret = xar_datamods[i].fh_out(x, f, p, inbuf, bsize, &(modulecontext[i]));
-					if( ret < 0 )
-						return -1;
-				}
+			if( xar_fromheap_out(x, f, p, cs, modulecontext, inbuf, bsize) < 0 ) {
+				xar_buffer_put(x, inbuf);
+				xar_chunks_free(x, f, cs);
+				return -1;
 			}
 
 			wcb(x, f, inbuf, bsize, context);
 		}
+
+		if( xar_chunks_advance(x, f, cs, (size_t)r) < 0 ) {
+			xar_buffer_put(x, inbuf);
+			xar_chunks_free(x, f, cs);
+			return -1;
+		}
 		
-		free(inbuf);
+		/* the modules may have swapped in a larger buffer, which is
+		 * just as good for the next read.
+		 */
 		bsize = def_bsize;
-		inbuf = malloc(bsize);
+		tmp = xar_buffer_grow(x, inbuf, bsize);
+		if( !tmp ) {
+			xar_buffer_put(x, inbuf);
+			xar_chunks_free(x, f, cs);
+			return -1;
+		}
+		inbuf = tmp;
 	}
 
-	free(inbuf);
+	xar_buffer_put(x, inbuf);
 	/* finish up anything that still needs doing */
-	for( i = 0; i < modulecount; i++) {
-		if( xar_datamods[i].fh_done ) {
-			int32_t ret;
-			ret = xar_datamods[i].fh_done(x, f, p, &(modulecontext[i]));
-			if( ret < 0 )
-				return ret;
+	r = xar_fromheap_done(x, f, p, cs, modulecontext);
+	xar_chunks_free(x, f, cs);
+	return r;
+}
+
+/* xar_attrcopy_from_heap_to_fd
+ * x: archive to extract from
+ * f, p: file and data property to extract
+ * fd: descriptor of the file being extracted to, positioned at its start
+ * Returns: 0 on success, -1 on error, or 1 if the data has to go through
+ * xar_attrcopy_from_heap instead.
+ * Summary: data stored without any encoding is copied straight from the
+ * archive to fd by the kernel, bypassing the datamods.  This is only done
+ * when the archived checksum need not be computed, or can be computed
+ * from the mapping of an archive opened with XAR_OPEN_MMAP.
+ */
+int32_t xar_attrcopy_from_heap_to_fd(xar_t x, xar_file_t f, xar_prop_t p, int fd) {
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SYS_SENDFILE_H)
+	const char *opt = NULL;
+	off_t seekoff, pos;
+	int64_t fsize;
+	ssize_t r;
+	size_t len;
+	xar_prop_t tmpp;
+
+	tmpp = xar_prop_pget(p, "encoding");
+	if( tmpp )
+		opt = xar_attr_pget(f, tmpp, "style");
+	if( opt && (strcmp(opt, "application/octet-stream") != 0) )
+		return 1;
+	if( !xar_prop_pget(p, "offset") )
+		return 1;
+	seekoff = get_offset(x, f, p);
+	fsize = get_length(p);
+	if( (seekoff < 0) || (fsize <= 0) )
+		return 1;
+	seekoff += (off_t)xar_get_heap_offset(x);
+	if( lseek(XAR(x)->fd, 0, SEEK_CUR) == -1 )
+		return 1;
+
+	/* the archived checksum is the one verified on extraction */
+	if( XAR(x)->map && ((uint64_t)seekoff + (uint64_t)fsize <= XAR(x)->maplen) ) {
+		if( xar_hash_check_archived(x, f, p, XAR(x)->map + seekoff, (size_t)fsize) < 0 )
+			return -1;
+	} else if( xar_hash_check_archived(x, f, p, NULL, 0) != 1 ) {
+		return 1;
+	}
+
+	pos = seekoff;
+	while( pos < seekoff + fsize ) {
+		len = (size_t)(seekoff + fsize - pos);
+		if( len > (1 << 30) )
+			len = 1 << 30;
+		r = xar_copy_range(XAR(x)->fd, &pos, fd, len);
+		if( (r < 0) && (errno == EINTR) )
+			continue;
+		if( (r < 0) && (pos == seekoff) )
+			return 1;
+		if( r <= 0 ) {
+			xar_err_new(x);
+			xar_err_set_file(x, f);
+			xar_err_set_string(x, "io: Could not copy file data");
+			xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+			return -1;
 		}
 	}
 	return 0;
+#else
+	(void)x; (void)f; (void)p; (void)fd;
+	return 1;
+#endif
 }
 
 /* xar_attrcopy_from_heap_to_heap
 * This does a simple copy of the heap data from one head (read-only) to another heap (write only). 
 * This does not set any properties or attributes of the file, so this should not be used alone.
+* Chunks shared through an extents list are gathered into one contiguous copy.
+* Seekable archives are copied in bulk once xdest is closed, see repack.c.
 */
 int32_t xar_attrcopy_from_heap_to_heap(xar_t xsource, xar_file_t fsource, xar_prop_t p, xar_t xdest, xar_file_t fdest){
-	int r, off;
+	int r, off, i;
 	size_t bsize;
-	int64_t fsize, inc = 0, seekoff, writesize=0;
-	off_t orig_heap_offset = XAR(xdest)->heap_offset;
+	int64_t fsize, inc = 0, seekoff;
+	off_t orig_heap_offset;
+	off_t heapoff;
 	void *inbuf;
 	const char *opt;
 	char *tmpstr = NULL;
 	xar_prop_t tmpp;
+	struct _chunk_state *cs;
 	
-	bsize = get_rsize(xsource);
-	
+	xar_workers_drain(xdest);
+	orig_heap_offset = XAR(xdest)->heap_offset;
+
 	seekoff = get_offset(xsource, fsource, p);
 	if( seekoff < 0 )
 		return -1;
 	
 	seekoff += (int64_t)xar_get_heap_offset(xsource);
-	xar_io_seek(xsource, fsource, seekoff);
+	heapoff = xar_heap_locate(xsource, fsource, seekoff);
 	
 	fsize = get_length(p);
 	if( fsize == 0 )
 		return 0;
 	if( fsize < 0 )
 		return -1;
-	
-	inbuf = malloc(bsize);
-	if( !inbuf ) {
+	if( xar_chunks_open(xsource, fsource, p, &cs) < 0 )
 		return -1;
-	}
 	
-	
-	while(1) {
-		/* Size has been reached */
-		if( fsize == inc )
-			break;
-		if( (fsize - inc) < (int64_t)bsize )
-			bsize = (size_t)(fsize - inc);
-		r = (int)read(XAR(xsource)->fd, inbuf, bsize);
-		if( r == 0 )
-			break;
-		if( (r < 0) && (errno == EINTR) )
-			continue;
-		if( r < 0 ) {
-			free(inbuf);
+	if( heapoff >= 0 ) {
+		if( cs && cs->extents ) {
+			for( i = 0; i < cs->count; i++ ) {
+				if( xar_repack_add(xdest, xsource, (off_t)xar_get_heap_offset(xsource) + cs->extents[i], cs->lengths[i]) != 0 )
+					break;
+			}
+			r = (i < cs->count) ? -1 : 0;
+		} else {
+			r = xar_repack_add(xdest, xsource, heapoff, fsize);
+		}
+		if( r != 0 ) {
+			xar_chunks_free(xsource, fsource, cs);
 			return -1;
 		}
-		
-		XAR(xsource)->heap_offset += r;
-		inc += r;
-		bsize = r;
-		
-		off = 0;
-		
-		do {
-			r = (int)write(XAR(xdest)->heap_fd, ((char *)inbuf)+off, r-off );
-			off += r;
-			writesize += r;
-		} while( off < r );
-		XAR(xdest)->heap_offset += off;
-		XAR(xdest)->heap_len += off;
+	} else {
+		inbuf = xar_buffer_get(xsource, get_rsize(xsource));
+		if( !inbuf ) {
+			xar_chunks_free(xsource, fsource, cs);
+			return -1;
+		}
+		while(1) {
+			/* Size has been reached */
+			if( fsize == inc )
+				break;
+			bsize = get_rsize(xsource);
+			if( (fsize - inc) < (int64_t)bsize )
+				bsize = (size_t)(fsize - inc);
+			bsize = xar_chunks_clamp(cs, bsize);
+			r = (int)xar_heap_read(xsource, inbuf, bsize, xar_chunks_pos(xsource, cs, heapoff, inc));
+			if( r == 0 )
+				break;
+			if( (r < 0) && (errno == EINTR) )
+				continue;
+			if( r < 0 ) {
+				xar_buffer_put(xsource, inbuf);
+				xar_chunks_free(xsource, fsource, cs);
+				return -1;
+			}
+			if( xar_chunks_advance(xsource, fsource, cs, (size_t)r) < 0 ) {
+				xar_buffer_put(xsource, inbuf);
+				xar_chunks_free(xsource, fsource, cs);
+				return -1;
+			}
+			
+			inc += r;
+			
+			off = 0;
+			
+			do {
+				r = (int)write(XAR(xdest)->heap_fd, ((char *)inbuf)+off, r-off );
+				off += r;
+			} while( off < r );
+			XAR(xdest)->heap_offset += off;
+			XAR(xdest)->heap_len += off;
+		}
+		xar_buffer_put(xsource, inbuf);
 	}
 	
-	if (asprintf(&tmpstr, "%"PRIu64, (uint64_t)orig_heap_offset) == -1) {
-		free(inbuf);
-		return -1;
-	}
 	opt = xar_prop_getkey(p);
 	tmpp = xar_prop_pfirst(fdest);
 	if( tmpp )
 		tmpp = xar_prop_find(tmpp, opt);
-	if( tmpp )
+	if( tmpp && cs ) {
+		/* the chunks now follow each other from orig_heap_offset */
+		tmpstr = malloc((size_t)cs->count * 21 + 1);
+		if( !tmpstr ) {
+			xar_chunks_free(xsource, fsource, cs);
+			return -1;
+		}
+		for( off = 0, i = 0; i < cs->count; i++ ) {
+			off += sprintf(tmpstr + off, "%s%"PRIu64, i ? " " : "", (uint64_t)orig_heap_offset);
+			orig_heap_offset += cs->lengths[i];
+		}
+		xar_prop_pset(fdest, tmpp, "extents", tmpstr);
+		tmpp = xar_prop_pget(tmpp, "offset");
+		if( tmpp )
+			xar_prop_punset(fdest, tmpp);
+	} else if( tmpp ) {
+		if (asprintf(&tmpstr, "%"PRIu64, (uint64_t)orig_heap_offset) == -1) {
+			xar_chunks_free(xsource, fsource, cs);
+			return -1;
+		}
 		xar_prop_pset(fdest, tmpp, "offset", tmpstr);
+	}
 	free(tmpstr);
-	
-	
-	free(inbuf);
+	xar_chunks_free(xsource, fsource, cs);
 	
 	/* It is the caller's responsibility to copy the attributes of the file, etc, this only copies the data in the heap */
 	
@@ -668,8 +1391,14 @@ int32_t xar_attrcopy_from_heap_to_stream_init(xar_t x, xar_file_t f, xar_prop_t
 		return XAR_STREAM_ERR;
 	}
 
+	if( xar_chunks_open(x, f, p, &state->chunks) < 0 ) {
+		free(state->modulecontext);
+		free(state);
+		return XAR_STREAM_ERR;
+	}
+
 	seekoff += (off_t)xar_get_heap_offset(x);
-	xar_io_seek(x, f, seekoff);
+	state->heapoff = xar_heap_locate(x, f, seekoff);
 
 	stream->total_in = 0;
 	stream->total_out = 0;
@@ -679,6 +1408,7 @@ int32_t xar_attrcopy_from_heap_to_stream_init(xar_t x, xar_file_t f, xar_prop_t
 	if(state->fsize == 0) {
 		return XAR_STREAM_OK;
 	} else if(state->fsize == -1) {
+		xar_chunks_free(x, f, state->chunks);
 		free(state->modulecontext);
 		free(state);
 		return XAR_STREAM_ERR;
@@ -696,7 +1426,7 @@ int32_t xar_attrcopy_from_heap_to_stream_init(xar_t x, xar_file_t f, xar_prop_t
 int32_t xar_attrcopy_from_heap_to_stream(xar_stream *stream) {
 	xar_stream_state_t *state = stream->state;
 
-	int r, i;
+	int r;
 	size_t bsize;
 	void *inbuf; 
 
@@ -705,76 +1435,70 @@ int32_t xar_attrcopy_from_heap_to_stream(xar_stream *stream) {
 	} 
 
 	bsize = state->bsize;
-	inbuf = malloc(bsize);
+	inbuf = xar_buffer_get(state->x, bsize);
 	if( !inbuf ) {
 		return XAR_STREAM_ERR;
 	}
         
 	/* Size has been reached */
 	if( (uint64_t)state->fsize == stream->total_in ) {
-		free(inbuf);
+		xar_buffer_put(state->x, inbuf);
 		return XAR_STREAM_END;
 	}
 	if( (state->fsize - stream->total_in) < bsize )
 		bsize = (size_t)(state->fsize - stream->total_in);
-	r = (int)read(XAR(state->x)->fd, inbuf, bsize);
+	bsize = xar_chunks_clamp(state->chunks, bsize);
+	r = (int)xar_heap_read(state->x, inbuf, bsize, xar_chunks_pos(state->x, state->chunks, state->heapoff, (int64_t)stream->total_in));
 	if( r == 0 ) {
-		free(inbuf);
+		xar_buffer_put(state->x, inbuf);
 		return XAR_STREAM_END;
 	}
 	if( (r < 0) && (errno == EINTR) ) {
-		free(inbuf);
+		xar_buffer_put(state->x, inbuf);
 		return XAR_STREAM_OK;
 	}
 	if( r < 0 ) {
-		free(inbuf);
+		xar_buffer_put(state->x, inbuf);
 		return XAR_STREAM_ERR;
 	}
 
-	XAR(state->x)->heap_offset += r;
 	stream->total_in += r;
 	bsize = r;
 	
 	/* filter the data through the in modules */
-	for( i = 0; i < state->modulecount; i++) {
-	if( xar_datamods[i].fh_in ) {
-		int32_t ret;
-		ret = xar_datamods[i].fh_in(state->x, state->f, state->p, &inbuf, &bsize, &(state->modulecontext[i]));
-		if( ret < 0 )
-			return XAR_STREAM_ERR;
-		}
+	if( xar_fromheap_in(state->x, state->f, state->p, state->chunks, state->modulecontext, &inbuf, &bsize) < 0 ) {
+		xar_buffer_put(state->x, inbuf);
+		return XAR_STREAM_ERR;
 	}
 
 	/* filter the data through the out modules */
-	for( i = 0; i < state->modulecount; i++) {
-		if( xar_datamods[i].fh_out ) {
-			int32_t ret;
-			ret = xar_datamods[i].fh_out(state->x, state->f, state->p, inbuf, bsize, &(state->modulecontext[i]));
-			if( ret < 0 )
-				return XAR_STREAM_ERR;
-		}
+	if( xar_fromheap_out(state->x, state->f, state->p, state->chunks, state->modulecontext, inbuf, bsize) < 0 ) {
+		xar_buffer_put(state->x, inbuf);
+		return XAR_STREAM_ERR;
 	}
 
 	write_to_stream(inbuf, bsize, stream);
 
-	free(inbuf);
+	if( xar_chunks_advance(state->x, state->f, state->chunks, (size_t)r) < 0 ) {
+		xar_buffer_put(state->x, inbuf);
+		return XAR_STREAM_ERR;
+	}
+
+	xar_buffer_put(state->x, inbuf);
 
 	return XAR_STREAM_OK;
 }
 
 int32_t xar_attrcopy_from_heap_to_stream_end(xar_stream *stream) {
 	xar_stream_state_t *state = (xar_stream_state_t *)stream->state;
-	int i;
+	int32_t ret;
 
 	/* finish up anything that still needs doing */
-	for( i = 0; i < state->modulecount; i++) {
-		if( xar_datamods[i].fh_done ) {
-			int32_t ret;
-			ret = xar_datamods[i].fh_done(state->x, state->f, state->p, &(state->modulecontext[i]));
-			if( ret < 0 )
-				return ret;
-		}
-	}
+	ret = xar_fromheap_done(state->x, state->f, state->p, state->chunks, state->modulecontext);
+	xar_chunks_free(state->x, state->f, state->chunks);
+	state->chunks = NULL;
+	if( ret < 0 )
+		return ret;
 
 	if( state->pending_buf ) {
 		free(state->pending_buf);
@@ -789,12 +1513,13 @@ int32_t xar_attrcopy_from_heap_to_stream_end(xar_stream *stream) {
 /* xar_heap_to_archive
  * x: archive to operate on
  * Returns 0 on success, -1 on error
- * Summary: copies the heap into the archive.
+ * Summary: copies the rest of the heap into the archive, see
+ * xar_heap_copy.
  */
 int32_t xar_heap_to_archive(xar_t x) {
 	long bsize;
-	ssize_t r;
-	int off;
+	off_t pos, end;
+	int32_t ret;
 	const char *opt;
 	char *b;
 
@@ -810,27 +1535,17 @@ int32_t xar_heap_to_archive(xar_t x) {
 			bsize = XAR_MINIMUM_BUFFER_SIZE;
 	}
 
+	pos = lseek(XAR(x)->heap_fd, 0, SEEK_CUR);
+	end = lseek(XAR(x)->heap_fd, 0, SEEK_END);
+	if( (pos == -1) || (end == -1) )
+		return -1;
+
 	b = malloc(bsize);
 	if( !b ) return -1;
 
-	while(1) {
-		r = read(XAR(x)->heap_fd, b, bsize);
-		if( r == 0 ) break;
-		if( (r < 0) && (errno == EINTR) ) continue;
-		if( r < 0 ) {
-			free(b);
-			return -1;
-		}
-
-		off = 0;
-		do {
-			r = write(XAR(x)->fd, b+off, bsize-off);
-			if( (r < 0) && (errno != EINTR) )
-				return -1;
-			off += (int)r;
-		} while( off < bsize );
-	}
-	return 0;
+	ret = xar_heap_copy(x, pos, end - pos, b, (size_t)bsize);
+	free(b);
+	return ret;
 }
 
 /* xar_prevent_recompress
@@ -860,3 +1575,216 @@ int32_t xar_prevent_recompress(xar_t x, void *in, size_t inlen) {
 
 	return 0;
 }
+
+/* xar_compression
+ * x: archive to operate on
+ * Returns: the compression the toheap modules apply to the data being
+ * encoded.  That is XAR_OPT_COMPRESSION, except in adaptive mode where it
+ * is the codec xar_compression_choose picked for the current file, and in
+ * the jobs that compress the chunks of a file, see workers.c.
+ */
+const char *xar_compression(xar_t x) {
+	if( XAR(x)->compression )
+		return XAR(x)->compression;
+	return xar_opt_get(x, XAR_OPT_COMPRESSION);
+}
+
+/* Codecs used by XAR_OPT_VAL_AUTO when no XAR_OPT_AUTOFAST or
+ * XAR_OPT_AUTOSTRONG is set, the best ones compiled in.
+ */
+static const char *xar_auto_default(int strong) {
+	if( strong ) {
+#if defined(HAVE_LIBLZMA)
+		return XAR_OPT_VAL_XZ;
+#elif defined(HAVE_LIBZSTD)
+		return XAR_OPT_VAL_ZSTD;
+#elif defined(HAVE_LIBBZ2)
+		return XAR_OPT_VAL_BZIP;
+#endif
+	} else {
+#if defined(HAVE_LIBLZ4)
+		return XAR_OPT_VAL_LZ4;
+#elif defined(HAVE_LIBZSTD)
+		return XAR_OPT_VAL_ZSTD;
+#endif
+	}
+	return XAR_OPT_VAL_GZIP;
+}
+
+/* xar_compression_length
+ * x: archive to operate on
+ * Returns: the length of the data being encoded, or 0 if it is not known
+ * before it has all been read.  Codecs may size their state to it.
+ */
+size_t xar_compression_length(xar_t x) {
+	return XAR(x)->datalen;
+}
+
+/* Returns the fast or the strong codec of XAR_OPT_VAL_AUTO */
+static const char *xar_auto_codec(xar_t x, int strong) {
+	const char *opt;
+
+	opt = xar_opt_get(x, strong ? XAR_OPT_AUTOSTRONG : XAR_OPT_AUTOFAST);
+	if( !opt )
+		opt = xar_auto_default(strong);
+	return opt;
+}
+
+/* xar_compression_arg
+ * x: archive to operate on
+ * Returns: the argument for the codec xar_compression returns, or NULL.
+ * Summary: XAR_OPT_COMPRESSIONARG belongs to the codec XAR_OPT_COMPRESSION
+ * names.  In adaptive mode that codec is XAR_OPT_VAL_AUTO, so the fast
+ * and strong codecs take theirs from XAR_OPT_AUTOFASTARG and
+ * XAR_OPT_AUTOSTRONGARG instead; a level meant for one codec means
+ * something else, or nothing, to another.
+ */
+const char *xar_compression_arg(xar_t x) {
+	const char *opt, *codec;
+
+	opt = xar_opt_get(x, XAR_OPT_COMPRESSION);
+	if( !opt || (strcmp(opt, XAR_OPT_VAL_AUTO) != 0) )
+		return xar_opt_get(x, XAR_OPT_COMPRESSIONARG);
+	codec = xar_compression(x);
+	if( !codec )
+		return NULL;
+	if( strcmp(codec, xar_auto_codec(x, 0)) == 0 )
+		return xar_opt_get(x, XAR_OPT_AUTOFASTARG);
+	if( strcmp(codec, xar_auto_codec(x, 1)) == 0 )
+		return xar_opt_get(x, XAR_OPT_AUTOSTRONGARG);
+	return NULL;
+}
+
+#ifdef __ATOMIC_RELAXED
+#define TRIALS_GET(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define TRIALS_ADD(v, n) __atomic_add_fetch(&(v), (n), __ATOMIC_RELAXED)
+#else
+#define TRIALS_GET(v) (v)
+#define TRIALS_ADD(v, n) ((v) += (n))
+#endif
+
+/* The modules that compress, as opposed to the checksum module and the
+ * ones that only look at the data.
+ */
+#define XAR_DATAMOD_CODEC(i) (xar_datamods[i].fh_in && xar_datamods[i].th_in && (xar_datamods[i].fh_in != xar_hash_archived))
+
+/* Compresses a copy of len bytes of buf with codec, exactly as the toheap
+ * modules would do it for a whole file.  Returns the compressed size, or
+ * -1 on error, and sets *usec to the time it took.
+ */
+static int64_t xar_compression_trial(xar_t x, const char *codec, const void *buf, size_t len, int64_t *usec) {
+	void *modulecontext[sizeof(xar_datamods)/sizeof(struct datamod)];
+	int modulecount = (int)(sizeof(modulecontext)/sizeof(modulecontext[0]));
+	const char *saved = XAR(x)->compression;
+	size_t savedlen = XAR(x)->datalen;
+	struct timeval start, end;
+	int64_t total = 0;
+	xar_file_t sf;
+	xar_prop_t sp;
+	void *block;
+	size_t n;
+	int i, pass;
+
+	sf = xar_file_new(NULL);
+	if( !sf )
+		return -1;
+	sp = xar_prop_pset(sf, NULL, "data", NULL);
+	block = xar_buffer_get(x, len);
+	if( !sp || !block ) {
+		xar_buffer_put(x, block);
+		xar_file_free(sf);
+		return -1;
+	}
+	memcpy(block, buf, len);
+	memset(modulecontext, 0, sizeof(void*)*modulecount);
+
+	XAR(x)->compression = codec;
+	XAR(x)->datalen = len;
+	gettimeofday(&start, NULL);
+	/* the data, then the empty block that finishes the stream */
+	for( pass = 0, n = len; pass < 2; pass++, n = 0 ) {
+		for( i = 0; i < modulecount; i++ ) {
+			if( XAR_DATAMOD_CODEC(i) && (xar_datamods[i].th_in(x, sf, sp, &block, &n, &(modulecontext[i])) < 0) )
+				total = -1;
+		}
+		if( total >= 0 )
+			total += n;
+	}
+	gettimeofday(&end, NULL);
+	for( i = 0; i < modulecount; i++ ) {
+		if( XAR_DATAMOD_CODEC(i) && xar_datamods[i].th_done )
+			xar_datamods[i].th_done(x, sf, sp, &(modulecontext[i]));
+	}
+	XAR(x)->compression = saved;
+	XAR(x)->datalen = savedlen;
+
+	xar_buffer_put(x, block);
+	xar_file_free(sf);
+	*usec = (int64_t)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+	return total;
+}
+
+/* xar_compression_choose
+ * x: archive being created, XAR_OPT_COMPRESSION is XAR_OPT_VAL_AUTO
+ * buf, len: the first block of the file's data
+ * Returns: the compression to use for the file.
+ * Summary: trial compresses up to XAR_AUTO_SAMPLE bytes of the block with
+ * the fast codec and, if that saves enough for a stronger codec to be
+ * worth trying, with the strong codec.  The strong codec is picked when
+ * it saves noticeably more than the fast one and compresses at least
+ * XAR_OPT_AUTOBUDGET MB per second; data that does not compress, such as
+ * media that is compressed already, is stored.  The strong codec's
+ * trials, setup included, are timed across the archive, and once they
+ * show it slower than the budget it is no longer tried at all.
+ */
+const char *xar_compression_choose(xar_t x, const void *buf, size_t len) {
+	struct __xar_trials_t *t = XAR(x)->trials;
+	const char *fast, *strong, *opt;
+	int64_t fsize, ssize, usec, count;
+	long long budget = 0;
+
+	fast = xar_auto_codec(x, 0);
+	strong = xar_auto_codec(x, 1);
+	opt = xar_opt_get(x, XAR_OPT_AUTOBUDGET);
+	if( opt ) {
+		errno = 0;
+		budget = strtoll(opt, NULL, 0);
+		if( errno != 0 || budget < 0 )
+			budget = 0;
+	}
+
+	if( len == 0 )
+		return fast;
+	if( len > XAR_AUTO_SAMPLE )
+		len = XAR_AUTO_SAMPLE;
+	fsize = xar_compression_trial(x, fast, buf, len, &usec);
+	if( fsize < 0 )
+		return fast;
+	if( fsize * 100 > (int64_t)len * (100 - XAR_AUTO_MIN_SAVING) )
+		return XAR_OPT_VAL_NONE;
+	if( strcmp(fast, strong) == 0 )
+		return fast;
+	if( fsize * 100 > (int64_t)len * (100 - XAR_AUTO_TRY_STRONG) )
+		return fast;
+	if( budget && t ) {
+		count = TRIALS_GET(t->count);
+		usec = TRIALS_GET(t->usec);
+		if( (count >= XAR_AUTO_TIMED) && (TRIALS_GET(t->bytes) < budget * (usec > 0 ? usec : 1)) )
+			return fast;
+	}
+
+	ssize = xar_compression_trial(x, strong, buf, len, &usec);
+	if( t ) {
+		TRIALS_ADD(t->bytes, (int64_t)len);
+		TRIALS_ADD(t->usec, usec);
+		TRIALS_ADD(t->count, 1);
+	}
+	if( ssize < 0 )
+		return fast;
+	if( (fsize - ssize) * 100 < (int64_t)len * XAR_AUTO_MIN_GAIN )
+		return fast;
+	/* bytes per microsecond is MB per second */
+	if( budget && ((int64_t)len < budget * (usec > 0 ? usec : 1)) )
+		return fast;
+	return strong;
+}
@@ -38,6 +38,19 @@
 #ifndef _XAR_IO_H_
 #define _XAR_IO_H_
 
+/* Encoding style of data stored as independently encoded chunks.  The
+ * encoded length of every chunk is listed in the "chunks" property, whose
+ * "style" and "size" attributes give the encoding and unencoded size of
+ * the chunks (all but the last one are that size).  Chunks cut by
+ * content may be shared between files and have no "size" attribute.
+ * The "extents" property lists the heap offset of every chunk and takes
+ * the place of "offset", so that versions of xar which do not know this
+ * style find no data to extract instead of the raw chunks.  Archives
+ * written before that may have an "offset" and no "extents", in which
+ * case the chunks follow each other from the data offset.
+ */
+#define XAR_CHUNKED_STYLE "application/x-xar-chunked"
+
 typedef int (*read_callback)(xar_t, xar_file_t, void *, size_t, void *context);
 typedef int (*write_callback)(xar_t, xar_file_t, void *, size_t, void *context);
 
@@ -71,10 +84,19 @@ typedef struct xar_stream_state {
         xar_t      x;
         xar_file_t f;
 	xar_prop_t p;
+	struct _chunk_state *chunks;
+	off_t      heapoff;     /* archive offset of the data, -1 for pipes */
 } xar_stream_state_t;
 
 int32_t xar_attrcopy_to_heap(xar_t x, xar_file_t f, xar_prop_t p, read_callback rcb, void *context);
+int32_t xar_attrcopy_encode(xar_t x, xar_file_t f, xar_prop_t p, read_callback rcb, void *rcontext, write_callback wcb, void *wcontext, int64_t *readsize, int64_t *writesize);
+int32_t xar_attrcopy_commit(xar_t x, xar_file_t f, xar_prop_t p, off_t orig_heap_offset, int64_t readsize, int64_t writesize);
+int32_t xar_attrcopy_record(xar_t x, xar_file_t f, xar_prop_t p, off_t offset, int64_t readsize, int64_t writesize);
+int32_t xar_attrcopy_dedup(xar_t x, xar_file_t f, xar_prop_t p, int fd);
 int32_t xar_attrcopy_from_heap(xar_t x, xar_file_t f, xar_prop_t p, write_callback wcb, void *context);
+int32_t xar_attrcopy_from_heap_to_fd(xar_t x, xar_file_t f, xar_prop_t p, int fd);
+int32_t xar_chunks_parse(const char *opt, int64_t **list, int *count);
+off_t xar_data_offset(xar_prop_t p);
 int32_t xar_attrcopy_from_heap_to_heap(xar_t xsource, xar_file_t fsource, xar_prop_t p, xar_t xdest, xar_file_t fdest);
 int32_t xar_attrcopy_from_heap_to_stream_init(xar_t x, xar_file_t f, xar_prop_t p, xar_stream *stream);
 int32_t xar_attrcopy_from_heap_to_stream(xar_stream *stream);
@@ -84,4 +106,33 @@ int32_t xar_heap_to_archive(xar_t x);
 
 int32_t xar_prevent_recompress(xar_t x, void *in, size_t inlen);
 
+/* XAR_OPT_VAL_AUTO stores data the fast codec shrinks by less than this
+ * percentage, and only uses the strong codec when it saves at least this
+ * percentage of the data more than the fast one.
+ */
+#define XAR_AUTO_MIN_SAVING 10
+#define XAR_AUTO_MIN_GAIN 3
+/* The strong codec is not tried on data the fast one shrinks by less than
+ * this percentage, as it will not save enough more to be worth its time.
+ */
+#define XAR_AUTO_TRY_STRONG 20
+/* Most bytes of the first block of a file compressed on trial */
+#define XAR_AUTO_SAMPLE 65536
+/* Trials of the strong codec timed before XAR_OPT_AUTOBUDGET is judged */
+#define XAR_AUTO_TIMED 4
+
+/* How fast the strong codec of XAR_OPT_VAL_AUTO compressed on trial,
+ * shared by an archive and the jobs of its workers.
+ */
+struct __xar_trials_t {
+	int64_t count;
+	int64_t bytes;
+	int64_t usec;
+};
+
+const char *xar_compression(xar_t x);
+const char *xar_compression_arg(xar_t x);
+size_t xar_compression_length(xar_t x);
+const char *xar_compression_choose(xar_t x, const void *buf, size_t len);
+
 #endif /* _XAR_IO_H_ */
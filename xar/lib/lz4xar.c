@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * LZ4 compression of file data in the LZ4 frame format, stored with the
+ * "application/x-lz4" encoding style.  It compresses worse than gzip but
+ * decompresses many times faster, for archives that are unpacked far
+ * more often than they are made.  XAR_OPT_COMPRESSIONARG is the level:
+ * 0 (the default) is the fast compressor, 3 to 12 select LZ4 HC.
+ */
+
+#include "config.h"
+#ifndef HAVE_ASPRINTF
+#include "asprintf.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <errno.h>
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+#include "xar.h"
+#include "filetree.h"
+#include "io.h"
+#include "buffers.h"
+#include "lz4xar.h"
+
+#define XAR_LZ4_STYLE "application/x-lz4"
+
+#ifdef HAVE_LIBLZ4
+
+struct _lz4_context{
+	uint8_t		lz4compressed;
+	uint8_t		begun;      /* frame header written */
+	uint64_t	count;
+	LZ4F_preferences_t prefs;
+	LZ4F_cctx	*cctx;
+	LZ4F_dctx	*dctx;
+};
+
+#define LZ4_CONTEXT(x) ((struct _lz4_context *)(*x))
+#endif
+
+int xar_lz4_fromheap_done(xar_t x, xar_file_t f, xar_prop_t p, void **context) {
+#ifdef HAVE_LIBLZ4
+
+	(void)x; (void)f; (void)p;
+	if( !context || !LZ4_CONTEXT(context) )
+		return 0;
+
+	if( LZ4_CONTEXT(context)->lz4compressed ){
+		LZ4F_freeDecompressionContext(LZ4_CONTEXT(context)->dctx);
+	}
+
+	/* free the context */
+	free(LZ4_CONTEXT(context));
+	*context = NULL;
+
+#else /* !HAVE_LIBLZ4 */
+	(void)x; (void)f; (void)p; (void)context;
+#endif /* !HAVE_LIBLZ4 */
+	return 0;
+}
+
+int xar_lz4_fromheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t *inlen, void **context) {
+	const char *opt;
+	xar_prop_t tmpp;
+#ifdef HAVE_LIBLZ4
+	void *out = NULL;
+	size_t outlen = 0, offset = 0, inoff = 0;
+	size_t dlen, slen, r;
+
+	/* on first run, we init the context and check the compression type */
+	if( !LZ4_CONTEXT(context) ) {
+		*context = calloc(1,sizeof(struct _lz4_context));
+
+		opt = NULL;
+		tmpp = xar_prop_pget(p, "encoding");
+		if( tmpp )
+			opt = xar_attr_pget(f, tmpp, "style");
+		if( !opt ) return 0;
+		if( strcmp(opt, XAR_LZ4_STYLE) != 0 ) return 0;
+
+		if( LZ4F_isError(LZ4F_createDecompressionContext(&LZ4_CONTEXT(context)->dctx, LZ4F_VERSION)) ) abort();
+		LZ4_CONTEXT(context)->lz4compressed = 1;
+		if( *inlen == 0 )
+			return 0;
+	}else if( !(LZ4_CONTEXT(context)->lz4compressed) ){
+		/* once the context has been initialized, then we have already
+		   checked the compression type, so we need only check if we
+		   actually are compressed */
+		return 0;
+	}
+
+	/* a full output buffer may leave decoded data behind in the context */
+	do {
+		if( offset == outlen ) {
+			out = xar_buffer_grow(x, out, outlen ? outlen * 2 : *inlen * 4 + 1024);
+			if( out == NULL ) abort();
+			outlen = xar_buffer_size(out);
+		}
+		dlen = outlen - offset;
+		slen = *inlen - inoff;
+		r = LZ4F_decompress(LZ4_CONTEXT(context)->dctx, (char *)out + offset, &dlen, (char *)*in + inoff, &slen, NULL);
+		if( LZ4F_isError(r) ) {
+			xar_err_new(x);
+			xar_err_set_file(x, f);
+			xar_err_set_string(x, "Error decompressing file");
+			xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+			xar_buffer_put(x, out);
+			return -1;
+		}
+		offset += dlen;
+		inoff += slen;
+	} while( (inoff < *inlen) || (offset == outlen) );
+
+	xar_buffer_put(x, *in);
+	*in = out;
+	*inlen = offset;
+#else
+	(void)in; (void)inlen; (void)context;
+	opt = NULL;
+	tmpp = xar_prop_pget(p, "encoding");
+	if( tmpp )
+		opt = xar_attr_pget(f, tmpp, "style");
+	if( !opt ) return 0;
+	if( strcmp(opt, XAR_LZ4_STYLE) != 0 ) return 0;
+	xar_err_new(x);
+	xar_err_set_file(x, f);
+	xar_err_set_errno(x, 0);
+	xar_err_set_string(x, "lz4 support not compiled in.");
+	xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+
+#endif /* HAVE_LIBLZ4 */
+	return 0;
+}
+
+int xar_lz4_toheap_done(xar_t x, xar_file_t f, xar_prop_t p, void **context) {
+#ifdef HAVE_LIBLZ4
+	xar_prop_t tmpp;
+
+	(void)x;
+	if( LZ4_CONTEXT(context)->lz4compressed ){
+		LZ4F_freeCompressionContext(LZ4_CONTEXT(context)->cctx);
+
+		if( LZ4_CONTEXT(context)->count ) {
+			tmpp = xar_prop_pset(f, p, "encoding", NULL);
+			if( tmpp )
+				xar_attr_pset(f, tmpp, "style", XAR_LZ4_STYLE);
+		}
+	}
+
+	/* free the context */
+	free(LZ4_CONTEXT(context));
+	*context = NULL;
+#else /* !HAVE_LIBLZ4 */
+	(void)x; (void)f; (void)p; (void)context;
+#endif /* !HAVE_LIBLZ4 */
+	return 0;
+}
+
+int32_t xar_lz4_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t *inlen, void **context) {
+	const char *opt;
+#ifdef HAVE_LIBLZ4
+	void *out;
+	size_t outlen, offset = 0, r;
+
+	(void)p;
+	/* on first run, we init the context and check the compression type */
+	if( !LZ4_CONTEXT(context) ) {
+		int level = 0;
+		*context = calloc(1,sizeof(struct _lz4_context));
+
+		opt = xar_compression(x);
+		if( !opt )
+			return 0;
+
+		if( strcmp(opt, XAR_OPT_VAL_LZ4) != 0 )
+			return 0;
+
+		if( xar_prevent_recompress(x, *in, *inlen) )
+			return 0;
+
+		opt = xar_compression_arg(x);
+		if( opt ) {
+			int tmp;
+			errno = 0;
+			tmp = (int)strtol(opt, NULL, 10);
+			if( (errno == 0) && (tmp >= 0) && (tmp <= 12) )
+				level = tmp;
+		}
+
+		if( LZ4F_isError(LZ4F_createCompressionContext(&LZ4_CONTEXT(context)->cctx, LZ4F_VERSION)) ) abort();
+		LZ4_CONTEXT(context)->prefs.compressionLevel = level;
+		LZ4_CONTEXT(context)->lz4compressed = 1;
+		if( *inlen == 0 )
+			return 0;
+	}else if( !LZ4_CONTEXT(context)->lz4compressed ){
+		/* once the context has been initialized, then we have already
+		checked the compression type, so we need only check if we
+		actually are compressed */
+		return 0;
+	}
+
+	/* the bound covers whatever the context still buffers, so one
+	 * call always fits.  An empty block marks the end of the data.
+	 */
+	outlen = LZ4F_compressBound(*inlen, &LZ4_CONTEXT(context)->prefs);
+	if( !LZ4_CONTEXT(context)->begun )
+		outlen += LZ4F_HEADER_SIZE_MAX;
+	out = xar_buffer_get(x, outlen);
+	if( out == NULL ) abort();
+	outlen = xar_buffer_size(out);
+
+	r = 0;
+	if( !LZ4_CONTEXT(context)->begun ) {
+		r = LZ4F_compressBegin(LZ4_CONTEXT(context)->cctx, out, outlen, &LZ4_CONTEXT(context)->prefs);
+		LZ4_CONTEXT(context)->begun = 1;
+	}
+	if( !LZ4F_isError(r) ) {
+		offset = r;
+		if( *inlen )
+			r = LZ4F_compressUpdate(LZ4_CONTEXT(context)->cctx, (char *)out + offset, outlen - offset, *in, *inlen, NULL);
+		else
+			r = LZ4F_compressEnd(LZ4_CONTEXT(context)->cctx, (char *)out + offset, outlen - offset, NULL);
+	}
+	if( LZ4F_isError(r) ) {
+		xar_err_new(x);
+		xar_err_set_file(x, f);
+		xar_err_set_string(x, "Error compressing file");
+		xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_CREATION);
+		xar_buffer_put(x, out);
+		return -1;
+	}
+
+	xar_buffer_put(x, *in);
+	*in = out;
+	LZ4_CONTEXT(context)->count += *inlen;
+	*inlen = offset + r;
+#else
+	(void)p; (void)in; (void)inlen; (void)context;
+	opt = xar_compression(x);
+	if( !opt )
+		return 0;
+	if( strcmp(opt, XAR_OPT_VAL_LZ4) != 0 )
+		return 0;
+	xar_err_new(x);
+	xar_err_set_file(x, f);
+	xar_err_set_errno(x, 0);
+	xar_err_set_string(x, "lz4 support not compiled in.");
+	xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_CREATION);
+#endif /* HAVE_LIBLZ4 */
+	return 0;
+}
+
+int xar_lz4_is_compressed(void *in, size_t inlen)
+{
+	if( !in || inlen < 4 )
+		return 0;
+	return memcmp(in, "\x04\x22\x4d\x18", 4) == 0;
+}
@@ -51,6 +51,7 @@
 #include "xar.h"
 #include "filetree.h"
 #include "io.h"
+#include "buffers.h"
 
 #ifdef HAVE_LIBLZMA
 
@@ -70,6 +71,8 @@ struct _lzma_context{
 #elif LZMA_VERSION < 49990060U
 	lzma_check	check;
 	lzma_filter filters[2];
+#else
+	lzma_filter filters[2];
 #endif
 #if LZMA_VERSION < 49990050U
 	lzma_options_alone options2;
@@ -179,9 +182,9 @@ int xar_lzma_fromheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t
 	LZMA_CONTEXT(context)->lzma.avail_out = 0;
 
 	while( LZMA_CONTEXT(context)->lzma.avail_in != 0 ) {
-		outlen = outlen * 2;
-		out = realloc(out, outlen);
+		out = xar_buffer_grow(x, out, outlen * 2);
 		if( out == NULL ) abort();
+		outlen = xar_buffer_size(out);
 
 		LZMA_CONTEXT(context)->lzma.next_out = ((unsigned char *)out) + offset;
 		LZMA_CONTEXT(context)->lzma.avail_out = outlen - offset;
@@ -200,7 +203,7 @@ int xar_lzma_fromheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t
 			break;
 	}
 
-	free(*in);
+	xar_buffer_put(x, *in);
 	*in = out;
 	*inlen = offset;
 #else
@@ -256,6 +259,9 @@ int xar_lzma_toheap_done(xar_t x, xar_file_t f, xar_prop_t p, void **context) {
 int32_t xar_lzma_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t *inlen, void **context) {
 	const char *opt;
 #ifdef HAVE_LIBLZMA
+#if LZMA_VERSION >= 49990070U
+	size_t datalen;
+#endif
 	uint8_t alone;
 	void *out = NULL;
 	size_t outlen, offset = 0;
@@ -267,7 +273,7 @@ int32_t xar_lzma_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		int level = preset_level;
 		*context = calloc(1,sizeof(struct _lzma_context));
 		
-		opt = xar_opt_get(x, XAR_OPT_COMPRESSION);
+		opt = xar_compression(x);
 		if( !opt )
 			return 0;
 		
@@ -281,7 +287,7 @@ int32_t xar_lzma_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		if( xar_prevent_recompress(x, *in, *inlen) )
 			return 0;
 
-		opt = xar_opt_get(x, XAR_OPT_COMPRESSIONARG);
+		opt = xar_compression_arg(x);
 		if( opt ) {
 			int tmp;
 			errno = 0;
@@ -361,14 +367,23 @@ int32_t xar_lzma_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		r = lzma_easy_encoder(&LZMA_CONTEXT(context)->lzma,
 		                      level, 0, LZMA_CHECK_CRC64);
 #else
-		if (alone){
 		lzma_lzma_preset(&(LZMA_CONTEXT(context)->options2), level);
+		/* a dictionary larger than the data is never used, but the
+		 * encoder still sets it up, which dominates on small files */
+		datalen = xar_compression_length(x);
+		if( datalen && (datalen < LZMA_CONTEXT(context)->options2.dict_size) )
+			LZMA_CONTEXT(context)->options2.dict_size = datalen < LZMA_DICT_SIZE_MIN ? LZMA_DICT_SIZE_MIN : (uint32_t)datalen;
+		if (alone){
 		r = lzma_alone_encoder(&LZMA_CONTEXT(context)->lzma,
 		                       &(LZMA_CONTEXT(context)->options2));
 		}
-		else
-		r = lzma_easy_encoder(&LZMA_CONTEXT(context)->lzma,
-		                      level, LZMA_CHECK_CRC64);
+		else {
+		LZMA_CONTEXT(context)->filters[0].id = LZMA_FILTER_LZMA2;
+		LZMA_CONTEXT(context)->filters[0].options = &(LZMA_CONTEXT(context)->options2);
+		LZMA_CONTEXT(context)->filters[1].id = LZMA_VLI_UNKNOWN;
+		r = lzma_stream_encoder(&LZMA_CONTEXT(context)->lzma,
+		                        LZMA_CONTEXT(context)->filters, LZMA_CHECK_CRC64);
+		}
 #endif
 		if( (r != LZMA_OK) ) {
 			xar_err_new(x);
@@ -398,9 +413,9 @@ int32_t xar_lzma_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 
 	if( *inlen != 0 ) {
 		do {
-			outlen *= 2;
-			out = realloc(out, outlen);
+			out = xar_buffer_grow(x, out, outlen * 2);
 			if( out == NULL ) abort();
+			outlen = xar_buffer_size(out);
 
 			LZMA_CONTEXT(context)->lzma.next_out = ((unsigned char *)out) + offset;
 			LZMA_CONTEXT(context)->lzma.avail_out = outlen - offset;
@@ -410,9 +425,9 @@ int32_t xar_lzma_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		} while( r == LZMA_OK && LZMA_CONTEXT(context)->lzma.avail_in != 0);
 	} else {
 		do {
-			outlen *= 2;
-			out = realloc(out, outlen);
+			out = xar_buffer_grow(x, out, outlen * 2);
 			if( out == NULL ) abort();
+			outlen = xar_buffer_size(out);
 
 			LZMA_CONTEXT(context)->lzma.next_out = ((unsigned char *)out) + offset;
 			LZMA_CONTEXT(context)->lzma.avail_out = outlen - offset;
@@ -431,12 +446,12 @@ int32_t xar_lzma_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		return -1;
 	}
 
-	free(*in);
+	xar_buffer_put(x, *in);
 	*in = out;
 	*inlen = offset;
 #else
 	(void)p; (void)in; (void)inlen; (void)context;
-	opt = xar_opt_get(x, XAR_OPT_COMPRESSION);
+	opt = xar_compression(x);
 	if( !opt )
 		return 0;
 	if( strcmp(opt, XAR_OPT_VAL_LZMA) != 0 &&
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Index of the file tree by parent and name.
+ *
+ * Finding a file by path used to mean walking the sibling list at every
+ * level and fetching the name property of each node on the way, so adding
+ * or locating a file in an archive with very wide directories took time
+ * proportional to the number of siblings.  The index maps a (name, parent)
+ * pair to the node, making a path lookup one hash probe per component.
+ *
+ * The index is built from the whole tree the first time a lookup is made
+ * and is kept up to date by the functions that add nodes to the tree
+ * afterwards.  Setting XAR_OPT_PATHINDEX to false makes lookups scan the
+ * sibling lists as before, for callers that only look up a few paths in
+ * a large archive and would rather not pay for building the index.
+ *
+ * Parents are keyed by an id given to each node as it is indexed, not by
+ * address, so the children of a node that has been freed are never found
+ * under a new node that happens to reuse its memory.  Lookups may run in
+ * several threads at once (xar_extract_all does so), so the index is
+ * built under a lock and published once complete; after that lookups
+ * only read it.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <libxml/hash.h>
+#include "xar.h"
+#include "filetree.h"
+#include "archive.h"
+#include "pathindex.h"
+
+#ifdef __ATOMIC_ACQUIRE
+#define INDEX_GET(x) __atomic_load_n(&XAR(x)->path_index, __ATOMIC_ACQUIRE)
+#define INDEX_PUBLISH(x, h) __atomic_store_n(&XAR(x)->path_index, (h), __ATOMIC_RELEASE)
+#else
+#define INDEX_GET(x) (XAR(x)->path_index)
+#define INDEX_PUBLISH(x, h) (XAR(x)->path_index = (h))
+#endif
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t xar_path_index_lock = PTHREAD_MUTEX_INITIALIZER;
+#define INDEX_LOCK() pthread_mutex_lock(&xar_path_index_lock)
+#define INDEX_UNLOCK() pthread_mutex_unlock(&xar_path_index_lock)
+#else
+#define INDEX_LOCK() do { } while(0)
+#define INDEX_UNLOCK() do { } while(0)
+#endif
+
+/* xar_path_index_parent
+ * parent: node the key is for, NULL for the top level
+ * buf: space for the key
+ * Returns: the second key of children of parent in the index
+ */
+static const xmlChar *xar_path_index_parent(xar_file_t parent, char *buf, size_t len) {
+	if( !parent )
+		return NULL;
+	snprintf(buf, len, "%"PRIu64, XAR_FILE(parent)->indexid);
+	return BAD_CAST(buf);
+}
+
+/* xar_path_index_insert
+ * Summary: adds f and everything below it to the index.  When several
+ * siblings share a name the first one in the sibling list is kept, which
+ * is the one a scan of the list would find.
+ */
+static void xar_path_index_insert(xar_t x, xmlHashTablePtr h, xar_file_t f) {
+	char buf[32];
+	const char *name;
+
+	for( ; f; f = XAR_FILE(f)->next ) {
+		if( !XAR_FILE(f)->indexid )
+			XAR_FILE(f)->indexid = ++XAR(x)->path_index_ids;
+		name = xar_file_cache(f)->name;
+		if( name )
+			xmlHashAddEntry2(h, BAD_CAST(name), xar_path_index_parent(XAR_FILE(f)->parent, buf, sizeof(buf)), XAR_FILE(f));
+		xar_path_index_insert(x, h, XAR_FILE(f)->children);
+	}
+}
+
+/* xar_path_index_scan
+ * Summary: finds name among the children of parent the slow way, for
+ * lookups that cannot use the index.
+ */
+static xar_file_t xar_path_index_scan(xar_t x, xar_file_t parent, const char *name) {
+	xar_file_t i;
+	const char *n;
+
+	i = parent ? XAR_FILE(parent)->children : XAR(x)->files;
+	for( ; i; i = XAR_FILE(i)->next ) {
+		n = xar_file_cache(i)->name;
+		if( n && strcmp(n, name) == 0 )
+			return i;
+	}
+	return NULL;
+}
+
+/* xar_path_index_free
+ * x: archive whose index to release
+ */
+void xar_path_index_free(xar_t x) {
+	if( XAR(x)->path_index ) {
+		xmlHashFree(XAR(x)->path_index, NULL);
+		XAR(x)->path_index = NULL;
+	}
+}
+
+/* xar_path_index_add
+ * x: archive f was added to
+ * f: node just linked into the tree and named
+ * Summary: indexes f and any children it came with.  Does nothing until
+ * the index has been built by a lookup.
+ */
+void xar_path_index_add(xar_t x, xar_file_t f) {
+	char buf[32];
+	const char *name;
+
+	if( !XAR(x)->path_index || !f )
+		return;
+	if( !XAR_FILE(f)->indexid )
+		XAR_FILE(f)->indexid = ++XAR(x)->path_index_ids;
+	name = xar_file_cache(f)->name;
+	if( name )
+		xmlHashAddEntry2(XAR(x)->path_index, BAD_CAST(name), xar_path_index_parent(XAR_FILE(f)->parent, buf, sizeof(buf)), XAR_FILE(f));
+	xar_path_index_insert(x, XAR(x)->path_index, XAR_FILE(f)->children);
+}
+
+/* xar_path_index_remove
+ * x: archive f is being removed from
+ * f: node about to be unlinked and freed
+ * Summary: drops the entry for f, if the index has one.  Nodes removed
+ * here are freshly added leaves, so their children need no attention.
+ */
+void xar_path_index_remove(xar_t x, xar_file_t f) {
+	char buf[32];
+	const xmlChar *pkey;
+	const char *name;
+
+	if( !XAR(x)->path_index || !f )
+		return;
+	name = xar_file_cache(f)->name;
+	if( !name )
+		return;
+	pkey = xar_path_index_parent(XAR_FILE(f)->parent, buf, sizeof(buf));
+	if( xmlHashLookup2(XAR(x)->path_index, BAD_CAST(name), pkey) == f )
+		xmlHashRemoveEntry2(XAR(x)->path_index, BAD_CAST(name), pkey, NULL);
+}
+
+/* xar_path_index_lookup
+ * x: archive to search
+ * parent: directory to search, NULL for the top level of the archive
+ * name: name of the child to find
+ * Returns: the first child of parent called name, or NULL
+ * Summary: builds the index on first use unless XAR_OPT_PATHINDEX is false.
+ */
+xar_file_t xar_path_index_lookup(xar_t x, xar_file_t parent, const char *name) {
+	char buf[32];
+	xmlHashTablePtr h;
+	const char *opt;
+
+	xar_toc_load(x);
+	h = INDEX_GET(x);
+	if( !h ) {
+		opt = xar_opt_get(x, XAR_OPT_PATHINDEX);
+		if( opt && strcmp(opt, XAR_OPT_VAL_FALSE) == 0 )
+			return xar_path_index_scan(x, parent, name);
+		INDEX_LOCK();
+		h = XAR(x)->path_index;
+		if( !h ) {
+			h = xmlHashCreate(0);
+			if( h ) {
+				xar_path_index_insert(x, h, XAR(x)->files);
+				INDEX_PUBLISH(x, h);
+			}
+		}
+		INDEX_UNLOCK();
+		if( !h )
+			return NULL;
+	}
+
+	/* a parent that was never indexed has no children in the index */
+	if( parent && !XAR_FILE(parent)->indexid )
+		return xar_path_index_scan(x, parent, name);
+	return xmlHashLookup2(h, BAD_CAST(name), xar_path_index_parent(parent, buf, sizeof(buf)));
+}
+
+/* xar_path_find
+ * x: archive to search
+ * path: path of the file relative to the top of the archive
+ * Returns: the file_t describing the file, or NULL if not found.
+ * Summary: the indexed counterpart of xar_file_find(XAR(x)->files, path).
+ */
+xar_file_t xar_path_find(xar_t x, const char *path) {
+	xar_file_t f = NULL;
+	char *tmp1, *tmp2, *tmp3;
+
+	tmp2 = tmp1 = strdup(path);
+	if( !tmp1 )
+		return NULL;
+	do {
+		tmp3 = strsep(&tmp2, "/");
+		f = xar_path_index_lookup(x, f, tmp3);
+	} while( f && tmp2 );
+	free(tmp1);
+	return f;
+}
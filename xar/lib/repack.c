@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Copying heap data from one archive into another in bulk.
+ *
+ * xar_add_from_archive copies the encoded data of each file it adds as
+ * it is, and merging or filtering big archives is mostly that copying.
+ * Instead of copying each file through a buffer as it is added, its data
+ * is given room in the heap file of the archive being written, which is
+ * left as a hole, and the copy is recorded.  The offsets of the data are
+ * therefore final as soon as the file is added.  The copies are made all
+ * at once when the archive is closed, before the data of another archive
+ * is copied, or when the archive copied from is closed:
+ *  - they are sorted by where they are in the archive copied from, so it
+ *    is read front to back, and copies of neighbouring data to
+ *    neighbouring room are merged;
+ *  - each copy is made by the kernel with copy_file_range, which on some
+ *    filesystems shares the blocks instead, or written from the mapping
+ *    of an archive opened with XAR_OPEN_MMAP, with pread and pwrite of
+ *    large blocks as the last resort.
+ * Archives that cannot seek, such as pipes, are still copied file by file.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "xar.h"
+#include "archive.h"
+#include "repack.h"
+
+/* how much the last resort copies at a time */
+#define XAR_REPACK_BUFFER_SIZE (1024*1024)
+
+struct __xar_repack_range_t {
+	off_t src;              /* archive offset in the archive copied from */
+	off_t dst;              /* offset in the heap file copied to */
+	off_t len;
+};
+
+struct __xar_repack_t {
+	xar_t source;           /* archive copied from */
+	struct __xar_repack_range_t *ranges;
+	size_t count;
+	size_t size;
+};
+
+static int xar_repack_cmp(const void *a, const void *b) {
+	const struct __xar_repack_range_t *ra = a, *rb = b;
+
+	if( ra->src != rb->src )
+		return (ra->src < rb->src) ? -1 : 1;
+	return 0;
+}
+
+/* xar_repack_range
+ * Returns: 0 or -1 on error
+ * Summary: copies one range from the archive copied from into the heap
+ * file, see the comment at the top of the file.
+ */
+static int32_t xar_repack_range(xar_t xdest, xar_t xsource, off_t src, off_t dst, off_t len, char **buf) {
+	ssize_t r, w;
+	size_t n;
+
+	while( len > 0 ) {
+		n = (len > XAR_REPACK_BUFFER_SIZE) ? XAR_REPACK_BUFFER_SIZE : (size_t)len;
+		if( XAR(xsource)->map ) {
+			if( (uint64_t)src + n > XAR(xsource)->maplen )
+				return -1;
+			r = pwrite(XAR(xdest)->heap_fd, XAR(xsource)->map + src, n, dst);
+			if( (r < 0) && (errno == EINTR) )
+				continue;
+			if( r <= 0 )
+				return -1;
+			src += r;
+			dst += r;
+			len -= r;
+			continue;
+		}
+#ifdef HAVE_COPY_FILE_RANGE
+		if( !*buf ) {
+			r = copy_file_range(XAR(xsource)->fd, &src, XAR(xdest)->heap_fd, &dst, (size_t)len, 0);
+			if( (r < 0) && (errno == EINTR) )
+				continue;
+			if( r > 0 ) {
+				len -= r;
+				continue;
+			}
+			if( (r < 0) && (errno != EXDEV) && (errno != ENOSYS) && (errno != EINVAL) && (errno != EOPNOTSUPP) )
+				return -1;
+			/* truncated archives are caught below */
+		}
+#endif
+		if( !*buf ) {
+			*buf = malloc(XAR_REPACK_BUFFER_SIZE);
+			if( !*buf )
+				return -1;
+		}
+		r = pread(XAR(xsource)->fd, *buf, n, src);
+		if( (r < 0) && (errno == EINTR) )
+			continue;
+		if( r <= 0 )
+			return -1;
+		for( n = 0; n < (size_t)r; n += (size_t)w ) {
+			w = pwrite(XAR(xdest)->heap_fd, *buf + n, (size_t)r - n, dst + (off_t)n);
+			if( (w < 0) && (errno == EINTR) )
+				w = 0;
+			else if( w <= 0 )
+				return -1;
+		}
+		src += r;
+		dst += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* xar_repack_flush
+ * xdest: archive being written
+ * Returns: 0 or -1 if a copy failed, which then fails xar_close
+ * Summary: makes the copies recorded by xar_repack_add.
+ */
+int32_t xar_repack_flush(xar_t xdest) {
+	struct __xar_repack_t *rp = XAR(xdest)->repack;
+	struct __xar_repack_range_t *r, *m;
+	char *buf = NULL;
+	size_t i;
+	int32_t ret = 0;
+
+	if( !rp || !rp->source )
+		return 0;
+	qsort(rp->ranges, rp->count, sizeof(*rp->ranges), xar_repack_cmp);
+	for( i = 0; (ret == 0) && (i < rp->count); ) {
+		r = &rp->ranges[i];
+		for( m = r + 1, ++i; i < rp->count; ++m, ++i ) {
+			if( (m->src != r->src + r->len) || (m->dst != r->dst + r->len) )
+				break;
+			r->len += m->len;
+		}
+		ret = xar_repack_range(xdest, rp->source, r->src, r->dst, r->len, &buf);
+	}
+	free(buf);
+	XAR(rp->source)->repack_dest = NULL;
+	rp->source = NULL;
+	rp->count = 0;
+	if( ret != 0 ) {
+		XAR(xdest)->repack_failed = 1;
+		xar_err_new(xdest);
+		xar_err_set_string(xdest, "Error copying data from another archive");
+		xar_err_callback(xdest, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_CREATION);
+	}
+	return ret;
+}
+
+/* xar_repack_add
+ * xdest: archive being written
+ * xsource: seekable archive to copy from, which must stay open until
+ * xdest is closed or this is called with another archive
+ * src, len: archive offset and length of the data to copy
+ * Returns: 0 or -1 on error
+ * Summary: makes room for the data at the end of the heap file of xdest,
+ * whose heap grows by len, and records the copy.
+ */
+int32_t xar_repack_add(xar_t xdest, xar_t xsource, off_t src, off_t len) {
+	struct __xar_repack_t *rp = XAR(xdest)->repack;
+	struct __xar_repack_range_t *r;
+	off_t dst;
+
+	if( !rp ) {
+		rp = calloc(1, sizeof(*rp));
+		if( !rp )
+			return -1;
+		XAR(xdest)->repack = rp;
+	}
+	if( rp->source && (rp->source != xsource) && (xar_repack_flush(xdest) != 0) )
+		return -1;
+	if( XAR(xsource)->repack_dest && (XAR(xsource)->repack_dest != xdest) && (xar_repack_flush(XAR(xsource)->repack_dest) != 0) )
+		return -1;
+
+	dst = lseek(XAR(xdest)->heap_fd, 0, SEEK_CUR);
+	if( (dst == -1) || (lseek(XAR(xdest)->heap_fd, len, SEEK_CUR) == -1) )
+		return -1;
+	r = rp->count ? &rp->ranges[rp->count - 1] : NULL;
+	if( r && (r->src + r->len == src) && (r->dst + r->len == dst) ) {
+		r->len += len;
+	} else {
+		if( rp->count == rp->size ) {
+			size_t size = rp->size ? rp->size * 2 : 64;
+			r = realloc(rp->ranges, size * sizeof(*r));
+			if( !r ) {
+				lseek(XAR(xdest)->heap_fd, dst, SEEK_SET);
+				return -1;
+			}
+			rp->ranges = r;
+			rp->size = size;
+		}
+		r = &rp->ranges[rp->count++];
+		r->src = src;
+		r->dst = dst;
+		r->len = len;
+	}
+	rp->source = xsource;
+	XAR(xsource)->repack_dest = xdest;
+	XAR(xdest)->heap_offset += len;
+	XAR(xdest)->heap_len += len;
+	return 0;
+}
+
+/* xar_repack_free
+ * x: archive being closed
+ * Summary: makes any copies pending into or out of x, and frees the
+ * records of those into it.
+ */
+void xar_repack_free(xar_t x) {
+	if( XAR(x)->repack_dest )
+		xar_repack_flush(XAR(x)->repack_dest);
+	if( XAR(x)->repack ) {
+		xar_repack_flush(x);
+		free(XAR(x)->repack->ranges);
+		free(XAR(x)->repack);
+		XAR(x)->repack = NULL;
+	}
+}
@@ -35,6 +35,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <libxml/xmlwriter.h>
 #include <libxml/xmlreader.h>
@@ -64,6 +65,14 @@ xar_signature_t xar_signature_new(xar_t x,const char *type, int32_t length, xar_
 		xar_err_callback(x, XAR_SEVERITY_WARNING, XAR_ERR_ARCHIVE_CREATION);
 		return NULL;
 	}
+
+	/* the heap of an archive opened with XAR_OPEN_APPEND is in use */
+	if( XAR(x)->append_path ){
+		xar_err_new(x);
+		xar_err_set_string(x, "Signatures cannot be added to an archive appended to");
+		xar_err_callback(x, XAR_SEVERITY_WARNING, XAR_ERR_ARCHIVE_CREATION);
+		return NULL;
+	}
 		
 	ret = malloc(sizeof(struct __xar_signature_t));
 	if( ! ret )
@@ -206,21 +215,20 @@ xar_signature_t xar_signature_next(xar_signature_t s)
 static int32_t _xar_signature_read_from_heap(xar_t x, off_t offset, size_t length, uint8_t *data)
 {
 	off_t seek_off = (off_t)xar_get_heap_offset(x) + offset;
-	int r = 0;
-	
-	r = (int)lseek(XAR(x)->fd, seek_off, SEEK_SET);
-	
-	/* can't seek to the proper location */
-	if( -1 == r ){
-		xar_err_new(x);
-		xar_err_set_string(x, "Unable to seek");
-		xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_EXTRACTION);		
-		return -1;
+	size_t off = 0;
+	ssize_t r = 0;
+	
+	/* read at an explicit offset, leaving the descriptor's own alone */
+	while( off < length ) {
+		r = pread(XAR(x)->fd, data + off, length - off, seek_off + (off_t)off);
+		if( (r < 0) && (errno == EINTR) )
+			continue;
+		if( r <= 0 )
+			break;
+		off += r;
 	}
-		
-	r = (int)read(XAR(x)->fd,data,length);
 	
-	if( r != (int)length ){
+	if( off != length ){
 		xar_err_new(x);
 		xar_err_set_string(x, "Unable to read");
 		xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_EXTRACTION);		
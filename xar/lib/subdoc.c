@@ -54,6 +54,7 @@ xar_subdoc_t xar_subdoc_new(xar_t x, const char *name) {
 		return NULL;
 
 	memset(XAR_SUBDOC(ret), 0, sizeof(struct __xar_subdoc_t));
+	XAR_SUBDOC(ret)->owner = XAR_OWNER_SUBDOC;
 	XAR_SUBDOC(ret)->name = strdup(name);
 	XAR_SUBDOC(ret)->next = XAR_SUBDOC(XAR(x)->subdocs);
 	XAR(x)->subdocs = ret;
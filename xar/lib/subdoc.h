@@ -42,6 +42,7 @@ struct __xar_subdoc_t {
 	struct __xar_attr_t  *attrs;
 	const char *prefix;
 	const char *ns;
+	int32_t owner; /* XAR_OWNER_SUBDOC */
 	const char *blank1; /* filler for xar_file_t compatibility */
 	const char *blank2; /* filler for xar_file_t compatibility */
 	const char blank3; /* filler for xar_file_t compatibility */
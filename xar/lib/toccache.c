@@ -0,0 +1,679 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * On-disk cache of the files of the TOC.
+ *
+ * Every xar_open of an archive inflates and parses its whole XML TOC,
+ * which dominates the cost of opening archives with many files.  When an
+ * archive is opened with XAR_OPEN_TOCCACHE, the file tree is saved after
+ * it has been parsed in a compact binary form, and later opens build the
+ * tree straight from a mapping of that file: the strings of the tree
+ * point into the mapping and the keys are interned once per cache.
+ *
+ * The cache is keyed by the checksum of the TOC.  Opening with the flag
+ * still parses the TOC up to its first file and checksums the rest as
+ * XAR_OPEN_LAZY does, so a cache is only used for the TOC it was written
+ * from.  Caches are kept next to the archive, in <archive>.toc-cache, or
+ * in the directory named by XAR_TOC_CACHE_DIR, named after the checksum.
+ * They are written to a temporary file and renamed into place, so
+ * processes opening the same archive may share them.  A cache that does
+ * not match or cannot be read is ignored and the TOC parsed instead.
+ *
+ * The trees built from a cache are trusted as much as the TOC, so caches
+ * are created mode 0600 and only read if they belong to the effective
+ * user and nobody else may write to them.
+ *
+ * After the header comes the table of the keys of properties and
+ * attributes, then the files at the top of the archive.  Counts and key
+ * indexes are 32 bit words in the byte order of the writer.  A string is
+ * its length including the terminating nul, or 0 for NULL, followed by
+ * its bytes padded to a multiple of 4.  The header holds the SHA-256 of
+ * the TOC checksum it was written from followed by everything after the
+ * header, so the body only loads for the TOC that xar_toc_check verified.
+ *
+ * file: attribute count, attributes, property count, properties,
+ *       child count, children
+ * property: key index, prefix, ns, value, attribute count, attributes,
+ *       child count, children
+ * attribute: key index, ns, value
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#include <libxml/hash.h>
+
+#ifndef HAVE_ASPRINTF
+#include "asprintf.h"
+#endif
+#include "xar.h"
+#include "filetree.h"
+#include "archive.h"
+#include "arena.h"
+#include "intern.h"
+#include "util.h"
+#include "toccache.h"
+
+/* key index of a NULL key */
+#define XAR_TOCCACHE_NOKEY 0xffffffffU
+
+struct __xar_toccache_writer_t {
+	FILE *fp;
+	EVP_MD_CTX *sum;        /* of the TOC checksum and what has been written after the header */
+	uint64_t length;        /* of what has been written */
+	xmlHashTablePtr index;  /* key to its index + 1 */
+	const char **keys;      /* keys by index */
+	uint32_t nkeys;
+	uint32_t keyssize;
+	int err;
+};
+
+struct __xar_toccache_reader_t {
+	xar_t x;
+	const char *p;
+	const char *end;
+	const char **keys;
+	uint32_t nkeys;
+	int err;
+};
+
+/* xar_toccache_path
+ * x: archive being read
+ * Returns: the name of the cache file of x, which the caller must free,
+ * or NULL if x cannot have one
+ */
+static char *xar_toccache_path(xar_t x) {
+	const char *dir = getenv(XAR_TOCCACHE_DIR_ENV);
+	char *ret = NULL;
+
+	if( !XAR(x)->docksum || !XAR(x)->toc_digest_len )
+		return NULL;
+	if( dir && *dir ) {
+		char hex[2*EVP_MAX_MD_SIZE+1];
+		unsigned int i;
+		for( i = 0; i < XAR(x)->toc_digest_len; i++ )
+			snprintf(hex + 2*i, 3, "%02x", XAR(x)->toc_digest[i]);
+		if( asprintf(&ret, "%s/%s%s", dir, hex, XAR_TOCCACHE_SUFFIX) == -1 )
+			return NULL;
+	} else {
+		if( strcmp(XAR(x)->filename, "-") == 0 )
+			return NULL;
+		if( asprintf(&ret, "%s%s", XAR(x)->filename, XAR_TOCCACHE_SUFFIX) == -1 )
+			return NULL;
+	}
+	return ret;
+}
+
+/* xar_toccache_match
+ * x: archive being read
+ * h: header of a cache file
+ * Returns: non-zero if the cache was written from the TOC of x
+ */
+static int xar_toccache_match(xar_t x, const struct __xar_toccache_header_t *h) {
+	return (memcmp(h->magic, XAR_TOCCACHE_MAGIC, sizeof(h->magic)) == 0) &&
+	       (h->order == XAR_TOCCACHE_ORDER) &&
+	       (h->version == XAR_TOCCACHE_VERSION) &&
+	       (h->toc_length_compressed == XAR(x)->header.toc_length_compressed) &&
+	       (h->toc_length_uncompressed == XAR(x)->header.toc_length_uncompressed) &&
+	       (h->digest_len == XAR(x)->toc_digest_len) &&
+	       (memcmp(h->digest, XAR(x)->toc_digest, h->digest_len) == 0);
+}
+
+/* xar_toccache_sum
+ * x: archive being read
+ * body: what follows the header of a cache file
+ * len: length of body
+ * sum: where the XAR_TOCCACHE_SUMLEN bytes of the sum are stored
+ * Returns: 0 on success, -1 on failure
+ * Summary: computes the sum a cache of the TOC of x holding body is
+ * sealed with.
+ */
+static int32_t xar_toccache_sum(xar_t x, const char *body, size_t len, unsigned char *sum) {
+	EVP_MD_CTX *ctx;
+	unsigned int slen = 0;
+	int ok;
+
+	ctx = EVP_MD_CTX_create();
+	if( !ctx )
+		return -1;
+	ok = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+	     EVP_DigestUpdate(ctx, XAR(x)->toc_digest, XAR(x)->toc_digest_len) &&
+	     EVP_DigestUpdate(ctx, body, len) &&
+	     EVP_DigestFinal_ex(ctx, sum, &slen);
+	EVP_MD_CTX_destroy(ctx);
+	return (ok && (slen == XAR_TOCCACHE_SUMLEN)) ? 0 : -1;
+}
+
+static uint32_t xar_toccache_get32(struct __xar_toccache_reader_t *r) {
+	uint32_t v;
+
+	if( r->err || (r->end - r->p < 4) ) {
+		r->err = 1;
+		return 0;
+	}
+	memcpy(&v, r->p, sizeof(v));
+	r->p += 4;
+	return v;
+}
+
+static const char *xar_toccache_getstr(struct __xar_toccache_reader_t *r) {
+	uint32_t len = xar_toccache_get32(r);
+	size_t padded = ((size_t)len + 3) & ~(size_t)3;
+	const char *ret;
+
+	if( r->err || !len )
+		return NULL;
+	if( ((size_t)(r->end - r->p) < padded) || (r->p[len-1] != '\0') ) {
+		r->err = 1;
+		return NULL;
+	}
+	ret = r->p;
+	r->p += padded;
+	return ret;
+}
+
+static const char *xar_toccache_getkey(struct __xar_toccache_reader_t *r) {
+	uint32_t i = xar_toccache_get32(r);
+
+	if( r->err || (i == XAR_TOCCACHE_NOKEY) )
+		return NULL;
+	if( i >= r->nkeys ) {
+		r->err = 1;
+		return NULL;
+	}
+	return r->keys[i];
+}
+
+/* xar_toccache_read_attrs
+ * Returns: the list of attributes the reader is on
+ */
+static xar_attr_t xar_toccache_read_attrs(struct __xar_toccache_reader_t *r) {
+	xar_attr_t ret = NULL, last = NULL, a;
+	uint32_t n = xar_toccache_get32(r);
+
+	while( n-- && !r->err ) {
+		a = xar_arena_alloc(XAR(r->x)->arena, sizeof(struct __xar_attr_t));
+		if( !a ) {
+			r->err = 1;
+			break;
+		}
+		XAR_ATTR(a)->pool = XAR_POOL_NODE | XAR_POOL_KEY | XAR_POOL_VALUE;
+		XAR_ATTR(a)->key = xar_toccache_getkey(r);
+		XAR_ATTR(a)->ns = xar_toccache_getstr(r);
+		XAR_ATTR(a)->value = xar_toccache_getstr(r);
+		if( last )
+			XAR_ATTR(last)->next = a;
+		else
+			ret = a;
+		last = a;
+	}
+	return ret;
+}
+
+/* xar_toccache_read_props
+ * f: file the properties belong to
+ * parent: property they are children of, or NULL
+ * Returns: the list of properties the reader is on
+ */
+static xar_prop_t xar_toccache_read_props(struct __xar_toccache_reader_t *r, xar_file_t f, xar_prop_t parent) {
+	xar_prop_t ret = NULL, last = NULL, p;
+	uint32_t n = xar_toccache_get32(r);
+
+	while( n-- && !r->err ) {
+		p = xar_arena_alloc(XAR(r->x)->arena, sizeof(struct __xar_prop_t));
+		if( !p ) {
+			r->err = 1;
+			break;
+		}
+		XAR_PROP(p)->pool = XAR_POOL_NODE | XAR_POOL_KEY | XAR_POOL_VALUE;
+		XAR_PROP(p)->file = f;
+		XAR_PROP(p)->parent = parent;
+		XAR_PROP(p)->key = xar_toccache_getkey(r);
+		XAR_PROP(p)->prefix = xar_toccache_getstr(r);
+		XAR_PROP(p)->ns = xar_toccache_getstr(r);
+		XAR_PROP(p)->value = xar_toccache_getstr(r);
+		XAR_PROP(p)->attrs = xar_toccache_read_attrs(r);
+		XAR_PROP(p)->children = xar_toccache_read_props(r, f, p);
+		if( last )
+			XAR_PROP(last)->next = p;
+		else
+			ret = p;
+		last = p;
+	}
+	return ret;
+}
+
+/* xar_toccache_read_files
+ * parent: directory the files are in, or NULL at the top of the archive
+ * Returns: the list of files the reader is on
+ * Summary: the counterpart of xar_file_unserialize.
+ */
+static xar_file_t xar_toccache_read_files(struct __xar_toccache_reader_t *r, xar_file_t parent) {
+	xar_file_t ret = NULL, last = NULL, f;
+	uint32_t n = xar_toccache_get32(r);
+	const char *name;
+
+	while( n-- && !r->err ) {
+		f = xar_arena_alloc(XAR(r->x)->arena, sizeof(struct __xar_file_t));
+		if( !f ) {
+			r->err = 1;
+			break;
+		}
+		XAR_FILE(f)->pool = XAR_POOL_NODE | XAR_POOL_FSPATH;
+		XAR_FILE(f)->owner = XAR_OWNER_FILE;
+		XAR_FILE(f)->parent = parent;
+		XAR_FILE(f)->attrs = xar_toccache_read_attrs(r);
+		XAR_FILE(f)->props = xar_toccache_read_props(r, f, NULL);
+		if( r->err )
+			break;
+		name = xar_file_cache(f)->name;
+		if( name ) {
+			const char *dir = parent ? XAR_FILE(parent)->fspath : NULL;
+			size_t len = (dir ? strlen(dir) + 1 : 0) + strlen(name) + 1;
+			char *path = xar_arena_alloc(XAR(r->x)->arena, len);
+			if( !path ) {
+				r->err = 1;
+				break;
+			}
+			snprintf(path, len, "%s%s%s", dir ? dir : "", dir ? "/" : "", name);
+			XAR_FILE(f)->fspath = path;
+		}
+		XAR_FILE(f)->children = xar_toccache_read_files(r, f);
+		if( last )
+			XAR_FILE(last)->next = f;
+		else
+			ret = f;
+		last = f;
+	}
+	return ret;
+}
+
+/* xar_toccache_link
+ * f: list of files
+ * Summary: xar_file_loaded for f and everything below it, once the whole
+ * tree has been read.
+ */
+static void xar_toccache_link(xar_t x, xar_file_t f) {
+	for( ; f; f = XAR_FILE(f)->next ) {
+		xar_toccache_link(x, XAR_FILE(f)->children);
+		xar_file_loaded(x, f);
+	}
+}
+
+/* xar_toccache_load
+ * x: archive whose files are to be read
+ * Returns: 0 if the files were read from the cache, -1 if there is no
+ * usable cache
+ * Summary: builds the file tree of x from its cache file.
+ */
+int32_t xar_toccache_load(xar_t x) {
+	struct __xar_toccache_reader_t r;
+	const struct __xar_toccache_header_t *h;
+	struct stat sb;
+	char *path, *map;
+	size_t len;
+	xar_file_t files;
+	unsigned char sum[XAR_TOCCACHE_SUMLEN];
+	uint32_t i;
+	int fd;
+
+	path = xar_toccache_path(x);
+	if( !path )
+		return -1;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if( fd < 0 )
+		return -1;
+	/* whoever can write the cache decides what the archive holds */
+	if( (fstat(fd, &sb) != 0) || !S_ISREG(sb.st_mode) || (sb.st_uid != geteuid()) || (sb.st_mode & (S_IWGRP|S_IWOTH)) ) {
+		close(fd);
+		return -1;
+	}
+	if( (sb.st_size < (off_t)sizeof(*h)) || ((off_t)(size_t)sb.st_size != sb.st_size) ) {
+		close(fd);
+		return -1;
+	}
+	len = (size_t)sb.st_size;
+#ifdef HAVE_MMAP
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if( map == MAP_FAILED )
+		return -1;
+#else
+	map = malloc(len);
+	if( !map || (xar_read_fd(fd, map, len) != (ssize_t)len) ) {
+		free(map);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+#endif
+
+	memset(&r, 0, sizeof(r));
+	h = (const struct __xar_toccache_header_t *)map;
+	if( !xar_toccache_match(x, h) || (h->length != len) )
+		goto BAIL;
+	if( (xar_toccache_sum(x, map + sizeof(*h), len - sizeof(*h), sum) != 0) ||
+	    (memcmp(sum, h->sum, sizeof(sum)) != 0) )
+		goto BAIL;
+	r.x = x;
+	r.p = map + sizeof(*h);
+	r.end = map + len;
+
+	r.nkeys = xar_toccache_get32(&r);
+	if( r.err || (r.nkeys > (size_t)(r.end - r.p) / 4) )
+		goto BAIL;
+	r.keys = calloc(r.nkeys ? r.nkeys : 1, sizeof(*r.keys));
+	if( !r.keys )
+		goto BAIL;
+	for( i = 0; (i < r.nkeys) && !r.err; i++ ) {
+		const char *key = xar_toccache_getstr(&r);
+		r.keys[i] = key ? xar_intern(key) : NULL;
+		if( !r.keys[i] )
+			r.err = 1;
+	}
+
+	files = xar_toccache_read_files(&r, NULL);
+	if( r.err || (r.p != r.end) )
+		goto BAIL;
+	free(r.keys);
+
+	XAR(x)->files = files;
+	xar_toccache_link(x, files);
+	XAR(x)->toccache_map = map;
+	XAR(x)->toccache_len = len;
+	return 0;
+
+BAIL:
+	/* what was read is left in the arena until the archive is closed */
+	free(r.keys);
+#ifdef HAVE_MMAP
+	munmap(map, len);
+#else
+	free(map);
+#endif
+	return -1;
+}
+
+static void xar_toccache_put(struct __xar_toccache_writer_t *w, const void *buf, size_t len) {
+	if( w->err )
+		return;
+	if( fwrite(buf, 1, len, w->fp) != len ) {
+		w->err = 1;
+		return;
+	}
+	if( !EVP_DigestUpdate(w->sum, buf, len) ) {
+		w->err = 1;
+		return;
+	}
+	w->length += len;
+}
+
+static void xar_toccache_put32(struct __xar_toccache_writer_t *w, uint32_t v) {
+	xar_toccache_put(w, &v, sizeof(v));
+}
+
+static void xar_toccache_putstr(struct __xar_toccache_writer_t *w, const char *s) {
+	static const char pad[4];
+	size_t len;
+
+	if( !s ) {
+		xar_toccache_put32(w, 0);
+		return;
+	}
+	len = strlen(s) + 1;
+	xar_toccache_put32(w, (uint32_t)len);
+	xar_toccache_put(w, s, len);
+	if( len & 3 )
+		xar_toccache_put(w, pad, 4 - (len & 3));
+}
+
+/* xar_toccache_addkey
+ * Summary: adds key to the key table unless it is there already.
+ */
+static void xar_toccache_addkey(struct __xar_toccache_writer_t *w, const char *key) {
+	if( !key || w->err || xmlHashLookup(w->index, BAD_CAST(key)) )
+		return;
+	if( w->nkeys == w->keyssize ) {
+		uint32_t size = w->keyssize ? 2 * w->keyssize : 64;
+		const char **keys = realloc(w->keys, size * sizeof(*keys));
+		if( !keys ) {
+			w->err = 1;
+			return;
+		}
+		w->keys = keys;
+		w->keyssize = size;
+	}
+	if( xmlHashAddEntry(w->index, BAD_CAST(key), (void *)(uintptr_t)(w->nkeys + 1)) != 0 ) {
+		w->err = 1;
+		return;
+	}
+	w->keys[w->nkeys++] = key;
+}
+
+static void xar_toccache_putkey(struct __xar_toccache_writer_t *w, const char *key) {
+	if( !key )
+		xar_toccache_put32(w, XAR_TOCCACHE_NOKEY);
+	else
+		xar_toccache_put32(w, (uint32_t)(uintptr_t)xmlHashLookup(w->index, BAD_CAST(key)) - 1);
+}
+
+/* xar_toccache_keys
+ * f: list of files
+ * Summary: adds the keys used by f and everything below it to the key
+ * table.
+ */
+static void xar_toccache_keys(struct __xar_toccache_writer_t *w, xar_file_t f) {
+	xar_attr_t a;
+	xar_prop_t p;
+
+	for( ; f && !w->err; f = XAR_FILE(f)->next ) {
+		for( a = XAR_FILE(f)->attrs; a; a = XAR_ATTR(a)->next )
+			xar_toccache_addkey(w, XAR_ATTR(a)->key);
+		/* properties are walked in document order, depth first */
+		for( p = XAR_FILE(f)->props; p; ) {
+			xar_toccache_addkey(w, XAR_PROP(p)->key);
+			for( a = XAR_PROP(p)->attrs; a; a = XAR_ATTR(a)->next )
+				xar_toccache_addkey(w, XAR_ATTR(a)->key);
+			if( XAR_PROP(p)->children ) {
+				p = XAR_PROP(p)->children;
+				continue;
+			}
+			while( p && !XAR_PROP(p)->next )
+				p = XAR_PROP(p)->parent;
+			if( p )
+				p = XAR_PROP(p)->next;
+		}
+		xar_toccache_keys(w, XAR_FILE(f)->children);
+	}
+}
+
+static void xar_toccache_write_attrs(struct __xar_toccache_writer_t *w, xar_attr_t a) {
+	xar_attr_t i;
+	uint32_t n = 0;
+
+	for( i = a; i; i = XAR_ATTR(i)->next )
+		n++;
+	xar_toccache_put32(w, n);
+	for( i = a; i; i = XAR_ATTR(i)->next ) {
+		xar_toccache_putkey(w, XAR_ATTR(i)->key);
+		xar_toccache_putstr(w, XAR_ATTR(i)->ns);
+		xar_toccache_putstr(w, XAR_ATTR(i)->value);
+	}
+}
+
+static void xar_toccache_write_props(struct __xar_toccache_writer_t *w, xar_prop_t p) {
+	xar_prop_t i;
+	uint32_t n = 0;
+
+	for( i = p; i; i = XAR_PROP(i)->next )
+		n++;
+	xar_toccache_put32(w, n);
+	for( i = p; i; i = XAR_PROP(i)->next ) {
+		xar_toccache_putkey(w, XAR_PROP(i)->key);
+		xar_toccache_putstr(w, XAR_PROP(i)->prefix);
+		xar_toccache_putstr(w, XAR_PROP(i)->ns);
+		xar_toccache_putstr(w, XAR_PROP(i)->value);
+		xar_toccache_write_attrs(w, XAR_PROP(i)->attrs);
+		xar_toccache_write_props(w, XAR_PROP(i)->children);
+	}
+}
+
+static void xar_toccache_write_files(struct __xar_toccache_writer_t *w, xar_file_t f) {
+	xar_file_t i;
+	uint32_t n = 0;
+
+	for( i = f; i; i = XAR_FILE(i)->next )
+		n++;
+	xar_toccache_put32(w, n);
+	for( i = f; i && !w->err; i = XAR_FILE(i)->next ) {
+		xar_toccache_write_attrs(w, XAR_FILE(i)->attrs);
+		xar_toccache_write_props(w, XAR_FILE(i)->props);
+		xar_toccache_write_files(w, XAR_FILE(i)->children);
+	}
+}
+
+/* xar_toccache_save
+ * x: archive whose files have just been read from its TOC
+ * Returns: 0 if the cache was written, -1 otherwise
+ * Summary: writes the cache file of x, replacing any cache that could not
+ * be used.
+ */
+int32_t xar_toccache_save(xar_t x) {
+	struct __xar_toccache_writer_t w;
+	struct __xar_toccache_header_t h;
+	char *path, *tmp = NULL;
+	unsigned int slen = 0;
+	uint32_t i;
+	int fd;
+
+	path = xar_toccache_path(x);
+	if( !path )
+		return -1;
+
+	if( asprintf(&tmp, "%s.XXXXXX", path) == -1 ) {
+		free(path);
+		return -1;
+	}
+	fd = mkstemp(tmp);
+	if( fd < 0 ) {
+		free(tmp);
+		free(path);
+		return -1;
+	}
+	/* older mkstemps honour the umask rather than creating files 0600 */
+	if( fchmod(fd, 0600) != 0 ) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		free(path);
+		return -1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.sum = EVP_MD_CTX_create();
+	w.fp = fdopen(fd, "w");
+	w.index = xmlHashCreate(0);
+	if( !w.sum || !w.fp || !w.index ) {
+		w.err = 1;
+		goto DONE;
+	}
+	if( !EVP_DigestInit_ex(w.sum, EVP_sha256(), NULL) ||
+	    !EVP_DigestUpdate(w.sum, XAR(x)->toc_digest, XAR(x)->toc_digest_len) ) {
+		w.err = 1;
+		goto DONE;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, XAR_TOCCACHE_MAGIC, sizeof(h.magic));
+	h.order = XAR_TOCCACHE_ORDER;
+	h.version = XAR_TOCCACHE_VERSION;
+	h.toc_length_compressed = XAR(x)->header.toc_length_compressed;
+	h.toc_length_uncompressed = XAR(x)->header.toc_length_uncompressed;
+	h.digest_len = XAR(x)->toc_digest_len;
+	memcpy(h.digest, XAR(x)->toc_digest, h.digest_len);
+	/* the header is written again below, once sum and length are known */
+	if( fwrite(&h, sizeof(h), 1, w.fp) != 1 )
+		w.err = 1;
+
+	xar_toccache_keys(&w, XAR(x)->files);
+	xar_toccache_put32(&w, w.nkeys);
+	for( i = 0; i < w.nkeys; i++ )
+		xar_toccache_putstr(&w, w.keys[i]);
+	xar_toccache_write_files(&w, XAR(x)->files);
+
+	if( !w.err && (!EVP_DigestFinal_ex(w.sum, h.sum, &slen) || (slen != XAR_TOCCACHE_SUMLEN)) )
+		w.err = 1;
+	h.length = sizeof(h) + w.length;
+	if( w.err || (fseek(w.fp, 0, SEEK_SET) != 0) || (fwrite(&h, sizeof(h), 1, w.fp) != 1) )
+		w.err = 1;
+
+DONE:
+	if( w.sum )
+		EVP_MD_CTX_destroy(w.sum);
+	if( w.index )
+		xmlHashFree(w.index, NULL);
+	free(w.keys);
+	if( w.fp ) {
+		if( fclose(w.fp) != 0 )
+			w.err = 1;
+	} else
+		close(fd);
+	if( w.err || (rename(tmp, path) != 0) ) {
+		unlink(tmp);
+		w.err = 1;
+	}
+	free(tmp);
+	free(path);
+	return w.err ? -1 : 0;
+}
+
+/* xar_toccache_close
+ * Summary: releases the cache the files of x point into, once they have
+ * been freed.
+ */
+void xar_toccache_close(xar_t x) {
+	if( !XAR(x)->toccache_map )
+		return;
+#ifdef HAVE_MMAP
+	munmap((void *)XAR(x)->toccache_map, XAR(x)->toccache_len);
+#else
+	free((void *)XAR(x)->toccache_map);
+#endif
+	XAR(x)->toccache_map = NULL;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _XAR_TOCCACHE_H_
+#define _XAR_TOCCACHE_H_
+
+/* Names the directory caches are kept in, instead of next to the archive */
+#define XAR_TOCCACHE_DIR_ENV "XAR_TOC_CACHE_DIR"
+
+/* Suffix of a cache file */
+#define XAR_TOCCACHE_SUFFIX ".toc-cache"
+
+#define XAR_TOCCACHE_MAGIC "XARTOCC"
+#define XAR_TOCCACHE_ORDER 0x01020304
+#define XAR_TOCCACHE_VERSION 2
+
+/* Length of the SHA-256 sum that seals a cache file */
+#define XAR_TOCCACHE_SUMLEN 32
+
+/* Start of a cache file, in the byte order of the writer */
+struct __xar_toccache_header_t {
+	char magic[8];                  /* XAR_TOCCACHE_MAGIC */
+	uint32_t order;                 /* XAR_TOCCACHE_ORDER */
+	uint32_t version;               /* XAR_TOCCACHE_VERSION */
+	uint64_t toc_length_compressed; /* of the archive the cache is for */
+	uint64_t toc_length_uncompressed;
+	uint32_t digest_len;
+	unsigned char digest[EVP_MAX_MD_SIZE]; /* checksum of the TOC */
+	uint64_t length;                /* of the whole cache file */
+	unsigned char sum[XAR_TOCCACHE_SUMLEN]; /* of digest and the rest of the file */
+};
+
+int32_t xar_toccache_load(xar_t x);
+int32_t xar_toccache_save(xar_t x);
+void xar_toccache_close(xar_t x);
+
+#endif /* _XAR_TOCCACHE_H_ */
@@ -0,0 +1,428 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Listing the TOC without building the file tree.
+ *
+ * xar_open normally reads the whole TOC into a tree of file, property
+ * and attribute nodes before the first file can be looked at, so listing
+ * a huge archive needs memory in proportion to the TOC and prints nothing
+ * until all of it has been parsed.  An archive opened with
+ * XAR_OPEN_TOCWALK defers reading the TOC to xar_toc_walk, which pulls
+ * the <file> elements from the reader one at a time and hands the common
+ * properties of each to a callback as soon as they have been seen.
+ * Nothing is kept once a file has been reported, other than the path of
+ * its parents and the size of the originals of hardlinks, which the
+ * links that come after them report as their own size.
+ *
+ * A file is reported when its first child file starts, or when it ends,
+ * so properties that follow the children of a directory are not seen.
+ * xar itself always writes the properties first.  Files come in the order
+ * of the TOC, so the files at the top of the archive are reported in the
+ * reverse of the order xar_file_first gives them.  For archives whose TOC
+ * has already been read, xar_toc_walk reports the files of the tree, in
+ * the same order, so a listing does not depend on how the TOC was read.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libxml/xmlreader.h>
+#include <libxml/hash.h>
+#include "xar.h"
+#include "filetree.h"
+#include "archive.h"
+#include "b64.h"
+#include "util.h"
+#include "tocwalk.h"
+
+/* Properties of the file being read, owned by the walk */
+struct __xar_walk_file_t {
+	char *name;
+	char *type;
+	char *mode;
+	char *user;
+	char *group;
+	char *uid;
+	char *gid;
+	char *mtime;
+	char *link;
+	char *id;
+	char *linkto;           /* link attribute of the type of a hardlink */
+	uint64_t size;
+	int reported;
+};
+
+void xar_walk_init(struct __xar_walk_t *w, xar_toc_callback cb, void *context) {
+	memset(w, 0, sizeof(*w));
+	w->cb = cb;
+	w->context = context;
+}
+
+static void xar_walk_link_free(void *payload, const xmlChar *name) {
+	(void)name;
+	free(payload);
+}
+
+void xar_walk_done(struct __xar_walk_t *w) {
+	free(w->path);
+	w->path = NULL;
+	if( w->links )
+		xmlHashFree(w->links, (xmlHashDeallocator)xar_walk_link_free);
+	w->links = NULL;
+}
+
+/* xar_walk_push
+ * w: the walk
+ * name: name of the file being entered
+ * Returns: 0 or -1 if out of memory
+ * Summary: appends name to the path of the walk.
+ */
+static int32_t xar_walk_push(struct __xar_walk_t *w, const char *name) {
+	size_t len = strlen(name);
+	size_t need = w->pathlen + (w->pathlen ? 1 : 0) + len + 1;
+
+	if( need > w->pathsize ) {
+		size_t size = w->pathsize ? w->pathsize : 256;
+		char *path;
+		while( size < need )
+			size *= 2;
+		path = realloc(w->path, size);
+		if( !path )
+			return -1;
+		w->path = path;
+		w->pathsize = size;
+	}
+	if( w->pathlen )
+		w->path[w->pathlen++] = '/';
+	memcpy(w->path + w->pathlen, name, len + 1);
+	w->pathlen += len;
+	return 0;
+}
+
+/* xar_walk_skip
+ * reader: positioned on an element
+ * Summary: reads past the end of the element and everything in it.
+ */
+void xar_walk_skip(xmlTextReaderPtr reader) {
+	int depth;
+
+	if( xmlTextReaderIsEmptyElement(reader) )
+		return;
+	depth = xmlTextReaderDepth(reader);
+	while( xmlTextReaderRead(reader) == 1 ) {
+		if( (xmlTextReaderNodeType(reader) == XML_READER_TYPE_END_ELEMENT) && (xmlTextReaderDepth(reader) == depth) )
+			return;
+	}
+}
+
+/* xar_walk_text
+ * reader: positioned on an element
+ * old: previous value of the property, freed
+ * Returns: the text of the element, which the caller must free
+ * Summary: reads past the end of the element, keeping its text.
+ */
+static char *xar_walk_text(xmlTextReaderPtr reader, char *old) {
+	char *ret = NULL;
+	int depth, type;
+
+	free(old);
+	if( xmlTextReaderIsEmptyElement(reader) )
+		return strdup("");
+	depth = xmlTextReaderDepth(reader);
+	while( xmlTextReaderRead(reader) == 1 ) {
+		type = xmlTextReaderNodeType(reader);
+		if( (type == XML_READER_TYPE_TEXT) || (type == XML_READER_TYPE_CDATA) ) {
+			free(ret);
+			ret = strdup((const char *)xmlTextReaderConstValue(reader));
+		} else if( (type == XML_READER_TYPE_END_ELEMENT) && (xmlTextReaderDepth(reader) == depth) )
+			break;
+	}
+	return ret ? ret : strdup("");
+}
+
+/* xar_walk_data
+ * reader: positioned on the <data> element of a file
+ * f: file the data belongs to
+ * Summary: reads past the end of the element, keeping the size.
+ */
+static void xar_walk_data(xmlTextReaderPtr reader, struct __xar_walk_file_t *f) {
+	int depth;
+
+	if( xmlTextReaderIsEmptyElement(reader) )
+		return;
+	depth = xmlTextReaderDepth(reader);
+	while( xmlTextReaderRead(reader) == 1 ) {
+		int type = xmlTextReaderNodeType(reader);
+		if( (type == XML_READER_TYPE_END_ELEMENT) && (xmlTextReaderDepth(reader) == depth) )
+			return;
+		if( type != XML_READER_TYPE_ELEMENT )
+			continue;
+		if( strcmp((const char *)xmlTextReaderConstLocalName(reader), "size") == 0 ) {
+			char *size = xar_walk_text(reader, NULL);
+			if( size )
+				f->size = strtoull(size, NULL, 10);
+			free(size);
+		} else
+			xar_walk_skip(reader);
+	}
+}
+
+/* xar_walk_report
+ * x: archive being walked
+ * w: the walk
+ * f: file to report
+ * depth: depth of the file
+ * Returns: 0, or what the callback returned
+ * Summary: enters the file in the path of the walk and passes it to the
+ * callback, once.
+ */
+static int32_t xar_walk_report(xar_t x, struct __xar_walk_t *w, struct __xar_walk_file_t *f, int32_t depth) {
+	xar_toc_entry e;
+
+	if( f->reported )
+		return w->ret;
+	f->reported = 1;
+
+	if( xar_walk_push(w, f->name ? f->name : "") != 0 )
+		return w->ret = -1;
+
+	if( f->type && (strcmp(f->type, "hardlink") == 0) && f->linkto ) {
+		if( strcmp(f->linkto, "original") == 0 ) {
+			if( f->id ) {
+				uint64_t *size = malloc(sizeof(*size));
+				if( !w->links )
+					w->links = xmlHashCreate(0);
+				if( size ) {
+					*size = f->size;
+					if( xmlHashAddEntry(w->links, BAD_CAST(f->id), size) != 0 )
+						free(size);
+				}
+			}
+		} else if( w->links ) {
+			uint64_t *size = xmlHashLookup(w->links, BAD_CAST(f->linkto));
+			if( size )
+				f->size = *size;
+		}
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.path = w->path;
+	e.name = f->name;
+	e.type = f->type;
+	e.mode = f->mode;
+	e.user = f->user;
+	e.group = f->group;
+	e.uid = f->uid;
+	e.gid = f->gid;
+	e.mtime = f->mtime;
+	e.link = f->link;
+	e.id = f->id;
+	e.size = f->size;
+	e.depth = depth;
+	w->ret = w->cb(x, &e, w->context);
+	return w->ret;
+}
+
+/* xar_file_walk
+ * x: archive being walked
+ * w: the walk
+ * reader: positioned on a <file> element
+ * depth: depth of the file, 0 at the top of the archive
+ * Returns: 0 when the file and its children have been read, or what the
+ * callback returned if it stopped the walk
+ * Summary: the streaming counterpart of xar_file_unserialize.
+ */
+int32_t xar_file_walk(xar_t x, struct __xar_walk_t *w, xmlTextReaderPtr reader, int32_t depth) {
+	struct __xar_walk_file_t f;
+	size_t pathlen = w->pathlen;
+	const char *name;
+	int type;
+
+	memset(&f, 0, sizeof(f));
+	f.id = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST("id"));
+
+	if( !xmlTextReaderIsEmptyElement(reader) ) {
+		while( (w->ret == 0) && (xmlTextReaderRead(reader) == 1) ) {
+			type = xmlTextReaderNodeType(reader);
+			name = (const char *)xmlTextReaderConstLocalName(reader);
+			if( (type == XML_READER_TYPE_END_ELEMENT) && (strcmp(name, "file") == 0) )
+				break;
+			if( type != XML_READER_TYPE_ELEMENT )
+				continue;
+
+			if( strcmp(name, "file") == 0 ) {
+				if( xar_walk_report(x, w, &f, depth) == 0 )
+					xar_file_walk(x, w, reader, depth + 1);
+			} else if( xmlTextReaderConstPrefix(reader) ) {
+				xar_walk_skip(reader);
+			} else if( strcmp(name, "name") == 0 ) {
+				char *enctype = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST("enctype"));
+				f.name = xar_walk_text(reader, f.name);
+				if( enctype && f.name && (strcmp(enctype, "base64") == 0) ) {
+					char *decoded = (char *)xar_from_base64(BAD_CAST(f.name), (unsigned)strlen(f.name), NULL);
+					free(f.name);
+					f.name = decoded;
+				}
+				xmlFree(enctype);
+			} else if( strcmp(name, "type") == 0 ) {
+				if( f.linkto )
+					xmlFree(f.linkto);
+				f.linkto = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST("link"));
+				f.type = xar_walk_text(reader, f.type);
+			} else if( strcmp(name, "data") == 0 ) {
+				xar_walk_data(reader, &f);
+			} else if( strcmp(name, "mode") == 0 ) {
+				f.mode = xar_walk_text(reader, f.mode);
+			} else if( strcmp(name, "user") == 0 ) {
+				f.user = xar_walk_text(reader, f.user);
+			} else if( strcmp(name, "group") == 0 ) {
+				f.group = xar_walk_text(reader, f.group);
+			} else if( strcmp(name, "uid") == 0 ) {
+				f.uid = xar_walk_text(reader, f.uid);
+			} else if( strcmp(name, "gid") == 0 ) {
+				f.gid = xar_walk_text(reader, f.gid);
+			} else if( strcmp(name, "mtime") == 0 ) {
+				f.mtime = xar_walk_text(reader, f.mtime);
+			} else if( strcmp(name, "link") == 0 ) {
+				f.link = xar_walk_text(reader, f.link);
+			} else {
+				xar_walk_skip(reader);
+			}
+		}
+	}
+	xar_walk_report(x, w, &f, depth);
+
+	/* leave the file */
+	w->pathlen = pathlen;
+	if( w->path )
+		w->path[pathlen] = '\0';
+
+	free(f.name);
+	free(f.type);
+	free(f.mode);
+	free(f.user);
+	free(f.group);
+	free(f.uid);
+	free(f.gid);
+	free(f.mtime);
+	free(f.link);
+	if( f.id )
+		xmlFree(f.id);
+	if( f.linkto )
+		xmlFree(f.linkto);
+	return w->ret;
+}
+
+/* Reports f the way xar_unserialize reports a file of the TOC */
+static void xar_tree_report(xar_t x, struct __xar_walk_t *w, xar_file_t f) {
+	const struct __xar_file_cache_t *c = xar_file_cache(f);
+	xar_file_t sizef = f, p;
+	xar_toc_entry e;
+	char *path;
+
+	memset(&e, 0, sizeof(e));
+	path = xar_get_path(f);
+	e.path = path;
+	e.name = c->name;
+	e.type = c->type;
+	xar_prop_get(f, "mode", &e.mode);
+	xar_prop_get(f, "user", &e.user);
+	xar_prop_get(f, "group", &e.group);
+	xar_prop_get(f, "uid", &e.uid);
+	xar_prop_get(f, "gid", &e.gid);
+	xar_prop_get(f, "mtime", &e.mtime);
+	xar_prop_get(f, "link", &e.link);
+	e.id = xar_attr_get(f, NULL, "id");
+	if( c->ftype == XAR_FTYPE_HARDLINK ) {
+		const char *link = xar_attr_get(f, "type", "link");
+		if( link && (strcmp(link, "original") != 0) ) {
+			xar_file_t orig = xmlHashLookup(XAR(x)->link_hash, BAD_CAST(link));
+			if( orig )
+				sizef = orig;
+		}
+	}
+	if( xar_file_cache(sizef)->flags & XAR_FCACHE_SIZE )
+		e.size = xar_file_cache(sizef)->size;
+	for( p = XAR_FILE(f)->parent; p; p = XAR_FILE(p)->parent )
+		e.depth++;
+	w->ret = w->cb(x, &e, w->context);
+	free(path);
+}
+
+/* Reports f and everything below it, parents before their children */
+static void xar_tree_report_all(xar_t x, struct __xar_walk_t *w, xar_file_t f) {
+	xar_file_t i;
+
+	xar_tree_report(x, w, f);
+	for( i = XAR_FILE(f)->children; i && (w->ret == 0); i = XAR_FILE(i)->next )
+		xar_tree_report_all(x, w, i);
+}
+
+/* xar_tree_walk
+ * x: archive whose TOC has been read
+ * w: the walk
+ * Returns: 0 when every file has been reported, what the callback
+ * returned if it stopped the walk, or -1 on error
+ * Summary: reports the files of the tree in the order of the TOC, as
+ * xar_unserialize would have.  Subdirectories keep the order of the TOC
+ * in the tree, but the files at the top of an archive that was read are
+ * held in the reverse order, so those are reported from the end.
+ */
+int32_t xar_tree_walk(xar_t x, struct __xar_walk_t *w) {
+	xar_file_t *top = NULL, *tmp;
+	xar_file_t f;
+	size_t n = 0, size = 0;
+
+	xar_toc_load(x);
+	/* an archive being written has its files in the order they will take */
+	if( XAR(x)->heap_fd != -1 ) {
+		for( f = XAR(x)->files; f && (w->ret == 0); f = XAR_FILE(f)->next )
+			xar_tree_report_all(x, w, f);
+		return w->ret;
+	}
+
+	for( f = XAR(x)->files; f; f = XAR_FILE(f)->next ) {
+		if( n == size ) {
+			size = size ? 2 * size : 64;
+			tmp = realloc(top, size * sizeof(xar_file_t));
+			if( !tmp ) {
+				free(top);
+				return -1;
+			}
+			top = tmp;
+		}
+		top[n++] = f;
+	}
+	while( n-- && (w->ret == 0) )
+		xar_tree_report_all(x, w, top[n]);
+	free(top);
+	return w->ret;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _XAR_TOCWALK_H_
+#define _XAR_TOCWALK_H_
+
+#include <libxml/xmlreader.h>
+#include <libxml/hash.h>
+
+/* State of a walk, shared by the files at every level */
+struct __xar_walk_t {
+	xar_toc_callback cb;
+	void *context;
+	int32_t ret;            /* what the callback returned if it stopped */
+	char *path;             /* path of the file being read */
+	size_t pathlen;
+	size_t pathsize;
+	xmlHashTablePtr links;  /* id to size of the originals of hardlinks */
+};
+
+void xar_walk_init(struct __xar_walk_t *w, xar_toc_callback cb, void *context);
+void xar_walk_done(struct __xar_walk_t *w);
+void xar_walk_skip(xmlTextReaderPtr reader);
+int32_t xar_file_walk(xar_t x, struct __xar_walk_t *w, xmlTextReaderPtr reader, int32_t depth);
+int32_t xar_tree_walk(xar_t x, struct __xar_walk_t *w);
+
+#endif /* _XAR_TOCWALK_H_ */
@@ -43,7 +43,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
 #include "config.h"
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #ifndef HAVE_ASPRINTF
 #include "asprintf.h"
 #endif
@@ -91,12 +95,12 @@ char *xar_get_path(xar_file_t f) {
 	const char *name;
 	xar_file_t i;
 
-	xar_prop_get(f, "name", &name);
+	name = xar_file_cache(f)->name;
 	ret = strdup(name);
 	for(i = XAR_FILE(f)->parent; i; i = XAR_FILE(i)->parent) {
 		int err;
 		const char *name;
-	       	xar_prop_get(i, "name", &name);
+		name = xar_file_cache(i)->name;
 		tmp = ret;
 		err = asprintf(&ret, "%s/%s", name, tmp);
 		free(tmp);
@@ -147,6 +151,27 @@ ssize_t xar_write_fd( int fd, void * buffer, size_t nbytes ) {
 	return off;
 }
 
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SYS_SENDFILE_H)
+/* Has the kernel copy up to len bytes from in at *pos to the current
+ * offset of out, advancing *pos.  Returns the number of bytes copied,
+ * or -1 with errno set.
+ */
+ssize_t xar_copy_range(int in, off_t *pos, int out, size_t len) {
+	ssize_t r = -1;
+
+	errno = ENOSYS;
+#ifdef HAVE_COPY_FILE_RANGE
+	r = copy_file_range(in, pos, out, NULL, len, 0);
+	if( (r >= 0) || ((errno != EXDEV) && (errno != ENOSYS) && (errno != EINVAL) && (errno != EOPNOTSUPP)) )
+		return r;
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+	r = sendfile(out, in, pos, len);
+#endif
+	return r;
+}
+#endif
+
 dev_t xar_makedev(uint32_t major, uint32_t minor)
 {
 #ifdef makedev
@@ -179,19 +204,18 @@ void xar_devmake(dev_t dev, uint32_t *out_major, uint32_t *out_minor)
 char *xar_get_type(xar_t x, xar_file_t f) {
 	const char *type = NULL;
 	(void)x;
-	xar_prop_get(f, "type", &type);
+	type = xar_file_cache(f)->type;
 	if( type == NULL )
 		type = "unknown";
 	return strdup(type);
 }
 
 char *xar_get_size(xar_t x, xar_file_t f) {
-	const char *size = NULL;
 	const char *type = NULL;
 
-	xar_prop_get(f, "type", &type);
+	type = xar_file_cache(f)->type;
 	if( type != NULL ) {
-		if( strcmp(type, "hardlink") == 0 ) {
+		if( xar_file_cache(f)->ftype == XAR_FTYPE_HARDLINK ) {
 			const char *link = NULL;
 			link = xar_attr_get(f, "type", "link");
 			if( link ) {
@@ -215,22 +239,26 @@ char *xar_get_size(xar_t x, xar_file_t f) {
 			}
 		}
 	}
-	xar_prop_get(f, "data/size", &size);
-	if( size == NULL )
-		size = "0";
-	return strdup(size);
+	if( xar_file_cache(f)->flags & XAR_FCACHE_SIZE ) {
+		char *ret;
+		if( asprintf(&ret, "%"PRIu64, xar_file_cache(f)->size) == -1 )
+			return NULL;
+		return ret;
+	}
+	return strdup("0");
 }
 
-char *xar_get_mode(xar_t x, xar_file_t f) {
-	const char *mode = NULL;
-	const char *type = NULL;
+/* xar_mode_string
+ * mode: permissions in octal as stored in the TOC, or NULL
+ * type: type of the file as stored in the TOC, or NULL
+ * Returns: the mode in ls -l form, which the caller must free
+ */
+static char *xar_mode_string(const char *mode, const char *type) {
 	char *ret;
 	mode_t m = 0;
 	int gotmode = 0;
 	int gottype = 0;
 
-	(void)x;
-	xar_prop_get(f, "mode", &mode);
 	if (mode) {
 		long long strmode;
 		errno = 0;
@@ -241,7 +269,6 @@ char *xar_get_mode(xar_t x, xar_file_t f) {
 		}
 	}
 
-	xar_prop_get(f, "type", &type);
 	if (type) {
 		if( strcmp(type, "file") == 0 )
 			m |= S_IFREG;
@@ -277,6 +304,20 @@ char *xar_get_mode(xar_t x, xar_file_t f) {
 	return ret;
 }
 
+char *xar_get_mode(xar_t x, xar_file_t f) {
+	const char *mode = NULL;
+	const char *type = NULL;
+
+	(void)x;
+	xar_prop_get(f, "mode", &mode);
+	xar_prop_get(f, "type", &type);
+	return xar_mode_string(mode, type);
+}
+
+char *xar_entry_mode(const xar_toc_entry *e) {
+	return xar_mode_string(e->mode, e->type);
+}
+
 char *xar_get_owner(xar_t x, xar_file_t f) {
 	const char *user = NULL;
 
@@ -297,13 +338,14 @@ char *xar_get_group(xar_t x, xar_file_t f) {
 	return strdup(group);
 }
 
-char *xar_get_mtime(xar_t x, xar_file_t f) {
-	const char *mtime = NULL;
+/* xar_mtime_string
+ * mtime: modification time as stored in the TOC, or NULL
+ * Returns: the time in listing form, which the caller must free
+ */
+static char *xar_mtime_string(const char *mtime) {
 	char *tmp;
 	struct tm tm;
 
-	(void)x;
-	xar_prop_get(f, "mtime", &mtime);
 	if( !mtime )
 		mtime = "1970-01-01T00:00:00Z";
 
@@ -312,3 +354,15 @@ char *xar_get_mtime(xar_t x, xar_file_t f) {
 	strftime(tmp, 127, "%Y-%m-%d %H:%M:%S", &tm);
 	return tmp;
 }
+
+char *xar_get_mtime(xar_t x, xar_file_t f) {
+	const char *mtime = NULL;
+
+	(void)x;
+	xar_prop_get(f, "mtime", &mtime);
+	return xar_mtime_string(mtime);
+}
+
+char *xar_entry_mtime(const xar_toc_entry *e) {
+	return xar_mtime_string(e->mtime);
+}
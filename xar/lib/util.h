@@ -46,6 +46,9 @@ uint32_t xar_swap32(uint32_t num);
 char *xar_get_path(xar_file_t f);
 ssize_t xar_read_fd(int fd, void * buffer, size_t nbytes);
 ssize_t xar_write_fd(int fd, void * buffer, size_t nbytes);
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SYS_SENDFILE_H)
+ssize_t xar_copy_range(int in, off_t *pos, int out, size_t len);
+#endif
 dev_t xar_makedev(uint32_t major, uint32_t minor);
 void xar_devmake(dev_t dev, uint32_t *major, uint32_t *minor);
 
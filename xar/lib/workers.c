@@ -0,0 +1,1509 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Parallel encoding of file data for archive creation.
+ *
+ * When XAR_OPT_THREADS asks for more than one thread, xar_data_archive
+ * hands the open file to the pool instead of encoding it inline, and
+ * xar_attrcopy_to_heap does the same with small in-memory sources.
+ * A worker runs the data through the toheap modules against a private
+ * archive handle (a snapshot of the options taken at submit time) and a
+ * scratch file node, collecting the encoded data in memory.  Jobs are
+ * committed to the heap by the thread that owns the archive, strictly in
+ * submission order, so heap offsets, coalescing and linking decisions are
+ * exactly those of a serial run.  Nothing in the real file tree is touched
+ * by the workers.
+ *
+ * Files larger than XAR_OPT_CHUNKSIZE are split into chunks that are
+ * compressed as independent streams, one job per chunk, and stored with
+ * the XAR_CHUNKED_STYLE encoding (see io.h).  The committer appends the
+ * chunks back to back and computes the whole file checksums as they go by.
+ * Chunked encoding does not depend on XAR_OPT_THREADS; with a single
+ * thread, or without pthreads, the jobs are simply run by the committer
+ * itself.
+ *
+ * With XAR_OPT_DEDUPCHUNKS files are instead cut where their contents
+ * say (see cdc.c) while they are read on the calling thread.  Chunks are
+ * looked up by codec and sha256, and only those not seen before in the
+ * archive are queued and stored.  The file's "extents" list the heap
+ * offset of each of its chunks, wherever they were stored, and take the
+ * place of its data offset.
+ *
+ * xar_extract_all uses xar_workers_extract to extract files concurrently.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <openssl/evp.h>
+#include <libxml/hash.h>
+#ifndef HAVE_ASPRINTF
+#include "asprintf.h"
+#endif
+
+#include "xar.h"
+#include "filetree.h"
+#include "archive.h"
+#include "io.h"
+#include "workers.h"
+#include "buffers.h"
+#include "cdc.h"
+
+struct __xar_joberr_t {
+	int32_t severity;
+	int32_t instance;
+	char *str;
+	int saved_errno;
+	struct __xar_joberr_t *next;
+};
+
+/* A chunk cut by content, stored once for every file that has it */
+struct __xar_cdc_chunk_t {
+	off_t offset;           /* heap offset, -1 until committed */
+	off_t filepos;          /* where it is in heap_fd */
+	uint64_t length;        /* encoded length */
+	char *style;            /* encoding */
+	int failed;
+	struct __xar_cdc_chunk_t *next;
+};
+
+/* A file stored as independently compressed chunks */
+struct __xar_chunks_t {
+	int fd;                 /* the file, read by the jobs with pread */
+	size_t chunksize;
+	int count;              /* number of chunk jobs */
+	int committed;          /* number of chunk jobs committed */
+	int failed;
+	off_t orig_heap_offset;
+	int64_t readsize;
+	int64_t writesize;
+	const EVP_MD *md;       /* checksum algorithm, NULL if none */
+	EVP_MD_CTX *archived;   /* whole file checksums, NULL if none */
+	EVP_MD_CTX *unarchived;
+	char *style;            /* encoding of the chunks */
+	char *lengths;          /* encoded length of each chunk */
+	size_t lengthslen;
+	char *extents;          /* heap offset of each chunk */
+	size_t extentslen;
+	struct __xar_cdc_chunk_t **pieces; /* chunks of a file cut by content */
+	int npieces;
+	int scanning;           /* more chunks may still be queued */
+};
+
+struct __xar_job_t {
+	struct __xar_t sx;      /* private archive handle, must be first */
+	xar_file_t f;           /* file in the archive's tree */
+	xar_prop_t p;           /* property of f receiving the data */
+	xar_file_t sf;          /* scratch file the worker encodes into */
+	xar_prop_t sp;          /* scratch counterpart of p */
+	int fd;                 /* source of the data, owned by the job */
+	char *src;              /* or in-memory source, owned by the job */
+	size_t srclen;
+	size_t srcoff;
+	struct __xar_chunks_t *chunks; /* set for jobs encoding one chunk */
+	struct __xar_cdc_chunk_t *cdc; /* set if that chunk was cut by content */
+	off_t srcpos;           /* offset of the chunk within the file */
+	char *codec;            /* compression of a chunk, see xar_compression */
+	char *buf;              /* encoded data */
+	size_t buflen;
+	size_t bufsize;
+	int64_t readsize;
+	int64_t writesize;
+	int32_t ret;
+	int done;
+	struct __xar_joberr_t *errs;  /* errors raised by the modules */
+	struct __xar_joberr_t **errtail;
+	struct __xar_job_t *qnext;    /* next job waiting for a worker */
+	struct __xar_job_t *cnext;    /* next job in commit order */
+};
+
+struct __xar_workers_t {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t work;    /* a job was queued, or shutdown */
+	pthread_cond_t done;    /* a job was finished */
+	pthread_t *threads;
+#endif
+	int nthreads;           /* always 0 without pthreads */
+	int shutdown;
+	int inflight;           /* jobs submitted but not yet committed */
+	struct __xar_job_t *qhead, *qtail;
+	struct __xar_job_t *chead, *ctail;
+	struct __xar_cdc_t cdc; /* set up on first use of XAR_OPT_DEDUPCHUNKS */
+	xmlHashTablePtr cdcchunks;     /* chunks stored so far, by codec:sha256 */
+	struct __xar_cdc_chunk_t *cdclist;
+};
+
+#define JOB(x) ((struct __xar_job_t *)(x))
+#define WORKERS(x) (XAR(x)->workers)
+
+#ifdef HAVE_PTHREAD
+#define WORKERS_LOCK(w) pthread_mutex_lock(&(w)->lock)
+#define WORKERS_UNLOCK(w) pthread_mutex_unlock(&(w)->lock)
+#else
+#define WORKERS_LOCK(w) do { } while(0)
+#define WORKERS_UNLOCK(w) do { } while(0)
+#endif
+
+/* The errctx handed to the error callback lives inside the job's private
+ * archive handle, which is the first member of the job.
+ */
+#define JOB_FROM_ERRCTX(c) JOB((char *)(c) - offsetof(struct __xar_t, errctx))
+
+/* xar_workers_nthreads
+ * n: requested number of threads, 0 for one per online cpu
+ * Returns: the number of threads to actually use, at least 1.
+ */
+int32_t xar_workers_nthreads(int32_t n) {
+#ifdef HAVE_PTHREAD
+	long cpus;
+
+	if( n == 0 ) {
+		cpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		n = cpus > XAR_WORKERS_MAX_THREADS ? XAR_WORKERS_MAX_THREADS : (int32_t)cpus;
+	}
+	if( n < 1 )
+		return 1;
+	if( n > XAR_WORKERS_MAX_THREADS )
+		n = XAR_WORKERS_MAX_THREADS;
+	return n;
+#else
+	(void)n;
+	return 1;
+#endif
+}
+
+static int get_nthreads(xar_t x) {
+	const char *opt;
+	long n;
+
+	opt = xar_opt_get(x, XAR_OPT_THREADS);
+	if( !opt )
+		return 1;
+	errno = 0;
+	n = strtol(opt, NULL, 0);
+	if( errno != 0 || n < 0 )
+		return 1;
+	if( n > XAR_WORKERS_MAX_THREADS )
+		n = XAR_WORKERS_MAX_THREADS;
+	return (int)xar_workers_nthreads((int32_t)n);
+}
+
+static int32_t job_error(int32_t severity, int32_t instance, xar_errctx_t ctx, void *usrctx) {
+	struct __xar_job_t *job = JOB_FROM_ERRCTX(ctx);
+	struct __xar_joberr_t *e;
+	const char *str;
+
+	(void)usrctx;
+	e = calloc(1, sizeof(struct __xar_joberr_t));
+	if( !e )
+		return 0;
+	e->severity = severity;
+	e->instance = instance;
+	e->saved_errno = xar_err_get_errno(ctx);
+	str = xar_err_get_string(ctx);
+	if( str )
+		e->str = strdup(str);
+	*job->errtail = e;
+	job->errtail = &e->next;
+	return 0;
+}
+
+static int job_read(xar_t x, xar_file_t f, void *inbuf, size_t bsize, void *context) {
+	struct __xar_job_t *job = JOB(context);
+	ssize_t r;
+
+	(void)x; (void)f;
+	if( job->fd < 0 ) {
+		if( bsize > job->srclen - job->srcoff )
+			bsize = job->srclen - job->srcoff;
+		memcpy(inbuf, job->src + job->srcoff, bsize);
+		job->srcoff += bsize;
+		return (int)bsize;
+	}
+	do {
+		r = read(job->fd, inbuf, bsize);
+	} while( (r < 0) && (errno == EINTR) );
+	return (int)r;
+}
+
+static int job_write(xar_t x, xar_file_t f, void *buf, size_t len, void *context) {
+	struct __xar_job_t *job = JOB(context);
+
+	(void)x; (void)f;
+	if( job->buflen + len > job->bufsize ) {
+		size_t n = job->bufsize ? job->bufsize : len;
+		char *tmp;
+
+		while( n < job->buflen + len )
+			n *= 2;
+		tmp = realloc(job->buf, n);
+		if( !tmp )
+			return -1;
+		job->buf = tmp;
+		job->bufsize = n;
+	}
+	memcpy(job->buf + job->buflen, buf, len);
+	job->buflen += len;
+	return (int)len;
+}
+
+static void chunks_free(struct __xar_chunks_t *c) {
+	if( c->fd >= 0 )
+		close(c->fd);
+	if( c->archived )
+		EVP_MD_CTX_destroy(c->archived);
+	if( c->unarchived )
+		EVP_MD_CTX_destroy(c->unarchived);
+	free(c->style);
+	free(c->lengths);
+	free(c->extents);
+	free(c->pieces);
+	free(c);
+}
+
+static void job_free(struct __xar_job_t *job) {
+	struct __xar_joberr_t *e;
+	xar_attr_t a;
+
+	while( job->errs ) {
+		e = job->errs;
+		job->errs = e->next;
+		free(e->str);
+		free(e);
+	}
+	while( job->sx.attrs ) {
+		a = job->sx.attrs;
+		job->sx.attrs = XAR_ATTR(a)->next;
+		xar_attr_free(a);
+	}
+	if( job->sf )
+		xar_file_free(job->sf);
+	if( job->fd >= 0 )
+		close(job->fd);
+	free(job->src);
+	free(job->codec);
+	free(job->buf);
+	free(job);
+}
+
+static struct __xar_job_t *job_new(xar_t x, xar_file_t f, xar_prop_t p) {
+	struct __xar_job_t *job;
+	xar_attr_t a, n, *tail;
+
+	job = calloc(1, sizeof(struct __xar_job_t));
+	if( !job )
+		return NULL;
+	job->fd = -1;
+	job->errtail = &job->errs;
+
+	/* snapshot the options, they may change before the job runs */
+	tail = &job->sx.attrs;
+	for( a = XAR(x)->attrs; a; a = XAR_ATTR(a)->next ) {
+		n = xar_attr_new();
+		if( !n ) {
+			job_free(job);
+			return NULL;
+		}
+		*tail = n;
+		tail = (xar_attr_t *)&XAR_ATTR(n)->next;
+		xar_attr_setkey(n, XAR_ATTR(a)->key);
+		XAR_ATTR(n)->value = strdup(XAR_ATTR(a)->value);
+		if( !XAR_ATTR(n)->key || !XAR_ATTR(n)->value ) {
+			job_free(job);
+			return NULL;
+		}
+	}
+	job->sx.fd = job->sx.heap_fd = -1;
+	job->sx.rfcformat = XAR(x)->rfcformat;
+	job->sx.ercallback = job_error;
+	job->sx.buffers = XAR(x)->buffers;
+	job->sx.trials = XAR(x)->trials;
+
+	job->sf = xar_file_new(NULL);
+	if( !job->sf ) {
+		job_free(job);
+		return NULL;
+	}
+	job->sp = xar_prop_pset(job->sf, NULL, xar_prop_getkey(p), NULL);
+	if( !job->sp ) {
+		job_free(job);
+		return NULL;
+	}
+	job->f = f;
+	job->p = p;
+	return job;
+}
+
+/* Reads a job's chunk into memory, it is kept for the checksums */
+static int32_t job_load_chunk(struct __xar_job_t *job) {
+	ssize_t r;
+
+	job->src = malloc(job->srclen);
+	if( !job->src )
+		return -1;
+	while( job->srcoff < job->srclen ) {
+		r = pread(job->chunks->fd, job->src + job->srcoff, job->srclen - job->srcoff, job->srcpos + (off_t)job->srcoff);
+		if( r < 0 && errno == EINTR )
+			continue;
+		if( r <= 0 )
+			return -1;
+		job->srcoff += r;
+	}
+	job->srcoff = 0;
+	return 0;
+}
+
+static void job_run(struct __xar_job_t *job) {
+	if( job->chunks && !job->src && (job_load_chunk(job) < 0) ) {
+		job->ret = -1;
+		return;
+	}
+	job->ret = xar_attrcopy_encode((xar_t)&job->sx, job->sf, job->sp, job_read, job, job_write, job, &job->readsize, &job->writesize);
+	if( job->fd >= 0 )
+		close(job->fd);
+	job->fd = -1;
+	if( !job->chunks || job->cdc ) {
+		free(job->src);
+		job->src = NULL;
+	}
+}
+
+#ifdef HAVE_PTHREAD
+static void *worker_main(void *arg) {
+	struct __xar_workers_t *w = arg;
+	struct __xar_job_t *job;
+
+	while(1) {
+		pthread_mutex_lock(&w->lock);
+		while( !w->qhead && !w->shutdown )
+			pthread_cond_wait(&w->work, &w->lock);
+		job = w->qhead;
+		if( !job ) {
+			pthread_mutex_unlock(&w->lock);
+			return NULL;
+		}
+		w->qhead = job->qnext;
+		if( !w->qhead )
+			w->qtail = NULL;
+		pthread_mutex_unlock(&w->lock);
+
+		job_run(job);
+
+		pthread_mutex_lock(&w->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&w->done);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+#endif
+
+/* Re-parent a list of scratch properties onto the archive's file */
+static void adopt_props(xar_file_t f, xar_prop_t parent, xar_prop_t list) {
+	xar_prop_t i;
+
+	for( i = list; i; i = XAR_PROP(i)->next ) {
+		XAR_PROP(i)->file = f;
+		XAR_PROP(i)->parent = parent;
+		XAR_PROP(i)->prefix = XAR_FILE(f)->prefix;
+		adopt_props(f, i, XAR_PROP(i)->children);
+	}
+}
+
+/* Move everything the modules recorded on the scratch file over to the
+ * real one.  The new children of p go in front of any it already had,
+ * which is where xar_prop_pset would have put them in a serial run.
+ */
+static void job_merge(struct __xar_job_t *job) {
+	xar_prop_t i, next, tail;
+
+	XAR_FILE(job->f)->cached = 0;
+	adopt_props(job->f, job->p, XAR_PROP(job->sp)->children);
+	if( XAR_PROP(job->sp)->children ) {
+		for( tail = XAR_PROP(job->sp)->children; XAR_PROP(tail)->next; tail = XAR_PROP(tail)->next );
+		XAR_PROP(tail)->next = XAR_PROP(job->p)->children;
+		XAR_PROP(job->p)->children = XAR_PROP(job->sp)->children;
+		XAR_PROP(job->sp)->children = NULL;
+	}
+
+	/* properties some modules set on the file itself */
+	for( i = XAR_FILE(job->sf)->props, XAR_FILE(job->sf)->props = NULL; i; i = next ) {
+		next = XAR_PROP(i)->next;
+		if( i == job->sp ) {
+			XAR_PROP(i)->next = NULL;
+			XAR_FILE(job->sf)->props = i;
+			continue;
+		}
+		XAR_PROP(i)->file = job->f;
+		XAR_PROP(i)->prefix = XAR_FILE(job->f)->prefix;
+		adopt_props(job->f, i, XAR_PROP(i)->children);
+		XAR_PROP(i)->next = XAR_FILE(job->f)->props;
+		XAR_FILE(job->f)->props = i;
+	}
+}
+
+static void job_replay_errors(xar_t x, struct __xar_job_t *job) {
+	struct __xar_joberr_t *e;
+
+	for( e = job->errs; e; e = e->next ) {
+		xar_err_new(x);
+		xar_err_set_file(x, job->f);
+		xar_err_set_string(x, e->str);
+		xar_err_set_errno(x, e->saved_errno);
+		xar_err_callback(x, e->severity, e->instance);
+	}
+}
+
+static int32_t heap_append(xar_t x, const char *buf, size_t len) {
+	size_t off = 0;
+	ssize_t r;
+
+	while( off < len ) {
+		r = write(XAR(x)->heap_fd, buf + off, len - off);
+		if( r < 0 ) {
+			if( errno == EINTR )
+				continue;
+			lseek(XAR(x)->heap_fd, -(off_t)off, SEEK_CUR);
+			return -1;
+		}
+		off += r;
+	}
+	XAR(x)->heap_offset += off;
+	return 0;
+}
+
+static void set_checksum(xar_file_t f, xar_prop_t p, const char *key, const EVP_MD *md, EVP_MD_CTX *ctx) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	char *str;
+	unsigned int len, i;
+	xar_prop_t tmpp;
+
+	EVP_DigestFinal_ex(ctx, digest, &len);
+	str = malloc(2*len + 1);
+	if( !str )
+		return;
+	for( i = 0; i < len; i++ )
+		sprintf(str + 2*i, "%02x", digest[i]);
+	str[2*len] = '\0';
+	tmpp = xar_prop_pset(f, p, key, str);
+	if( tmpp )
+		xar_attr_pset(f, tmpp, "style", OBJ_nid2ln(EVP_MD_nid(md)));
+	free(str);
+}
+
+/* Appends n to a space separated list */
+static int32_t list_append(char **list, size_t *len, uint64_t n) {
+	char *tmp;
+
+	tmp = realloc(*list, *len + 24);
+	if( !tmp )
+		return -1;
+	*list = tmp;
+	*len += sprintf(*list + *len, "%s%"PRIu64, *len ? " " : "", n);
+	return 0;
+}
+
+/* Feeds a chunk stored earlier in the heap to a checksum */
+static int32_t cdc_digest(xar_t x, EVP_MD_CTX *ctx, struct __xar_cdc_chunk_t *rec) {
+	char *buf;
+	uint64_t off = 0;
+	ssize_t r;
+	size_t len;
+
+	buf = xar_buffer_get(x, XAR_DEFAULT_BUFFER_SIZE);
+	if( !buf )
+		return -1;
+	while( off < rec->length ) {
+		len = XAR_DEFAULT_BUFFER_SIZE;
+		if( len > rec->length - off )
+			len = (size_t)(rec->length - off);
+		r = pread(XAR(x)->heap_fd, buf, len, rec->filepos + (off_t)off);
+		if( r < 0 && errno == EINTR )
+			continue;
+		if( r <= 0 ) {
+			xar_buffer_put(x, buf);
+			return -1;
+		}
+		EVP_DigestUpdate(ctx, buf, r);
+		off += r;
+	}
+	xar_buffer_put(x, buf);
+	return 0;
+}
+
+/* cdc_finish
+ * Called once a file cut by content has been read and all of its chunks
+ * are in the heap.  Records the chunk table, the extents and the whole
+ * file checksums.  The chunks may be shared with other files, so they
+ * are left in the heap even if the file could not be archived, and the
+ * file is not offered to xar_attrcopy_commit for coalescing.
+ */
+static void cdc_finish(xar_t x, xar_file_t f, xar_prop_t p, struct __xar_chunks_t *c) {
+	struct __xar_cdc_chunk_t *rec;
+	char *extents = NULL;
+	size_t extentslen = 0;
+	int64_t length = 0;
+	const char *style = NULL;
+	xar_prop_t tmpp;
+	int32_t ret = c->failed ? -1 : 0;
+	int i;
+
+	free(c->lengths);
+	c->lengths = NULL;
+	c->lengthslen = 0;
+	for( i = 0; (ret == 0) && (i < c->npieces); i++ ) {
+		rec = c->pieces[i];
+		if( !style )
+			style = rec->style;
+		if( rec->failed || (rec->offset < 0) || !style || strcmp(style, rec->style) != 0 )
+			ret = -1;
+		else if( (list_append(&c->lengths, &c->lengthslen, rec->length) < 0) ||
+		    (list_append(&extents, &extentslen, (uint64_t)rec->offset) < 0) )
+			ret = -1;
+		else if( c->archived && (cdc_digest(x, c->archived, rec) < 0) )
+			ret = -1;
+		length += rec->length;
+	}
+
+	if( (ret == 0) && (c->npieces > 0) ) {
+		if( c->unarchived )
+			set_checksum(f, p, "extracted-checksum", c->md, c->unarchived);
+		if( c->archived )
+			set_checksum(f, p, "archived-checksum", c->md, c->archived);
+		tmpp = xar_prop_pset(f, p, "chunks", c->lengths);
+		if( tmpp )
+			xar_attr_pset(f, tmpp, "style", style);
+		xar_prop_pset(f, p, "extents", extents);
+		tmpp = xar_prop_pset(f, p, "encoding", NULL);
+		if( tmpp )
+			xar_attr_pset(f, tmpp, "style", XAR_CHUNKED_STYLE);
+		ret = xar_attrcopy_record(x, f, p, c->pieces[0]->offset, c->readsize, length);
+
+		/* for xar_attrcopy_dedup */
+		tmpp = xar_prop_pget(p, "extracted-checksum");
+		if( (ret == 0) && tmpp && xar_prop_getvalue(tmpp) &&
+		    (xar_opt_get(x, XAR_OPT_COALESCE) || xar_opt_get(x, XAR_OPT_LINKSAME)) )
+			xmlHashAddEntry(XAR(x)->xsum_hash, BAD_CAST(xar_prop_getvalue(tmpp)), XAR_FILE(f));
+	} else {
+		ret = -1;
+	}
+	free(extents);
+
+	if( ret < 0 ) {
+		xar_err_new(x);
+		xar_err_set_file(x, f);
+		xar_err_set_string(x, "io: Could not archive file data");
+		xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_CREATION);
+		xar_prop_punset(f, p);
+	}
+	chunks_free(c);
+}
+
+/* chunks_finish
+ * Called once the last chunk of a file has been committed.  Records the
+ * chunk table and whole file checksums, then does the usual bookkeeping
+ * for the heap range the chunks occupy.
+ */
+static void chunks_finish(xar_t x, xar_file_t f, xar_prop_t p, struct __xar_chunks_t *c) {
+	xar_prop_t tmpp;
+	char *tmpstr;
+	int32_t ret = c->failed ? -1 : 0;
+
+	if( c->chunksize == 0 ) {
+		cdc_finish(x, f, p, c);
+		return;
+	}
+
+	if( ret == 0 ) {
+		if( c->unarchived )
+			set_checksum(f, p, "extracted-checksum", c->md, c->unarchived);
+		if( c->archived )
+			set_checksum(f, p, "archived-checksum", c->md, c->archived);
+		tmpp = xar_prop_pset(f, p, "chunks", c->lengths);
+		if( tmpp ) {
+			xar_attr_pset(f, tmpp, "style", c->style);
+			if( asprintf(&tmpstr, "%"PRIu64, (uint64_t)c->chunksize) != -1 ) {
+				xar_attr_pset(f, tmpp, "size", tmpstr);
+				free(tmpstr);
+			}
+		}
+		xar_prop_pset(f, p, "extents", c->extents);
+		tmpp = xar_prop_pset(f, p, "encoding", NULL);
+		if( tmpp )
+			xar_attr_pset(f, tmpp, "style", XAR_CHUNKED_STYLE);
+		ret = xar_attrcopy_commit(x, f, p, c->orig_heap_offset, c->readsize, c->writesize);
+	} else {
+		lseek(XAR(x)->heap_fd, c->orig_heap_offset - XAR(x)->heap_offset, SEEK_CUR);
+		XAR(x)->heap_offset = c->orig_heap_offset;
+	}
+
+	if( ret < 0 ) {
+		xar_err_new(x);
+		xar_err_set_file(x, f);
+		xar_err_set_string(x, "io: Could not archive file data");
+		xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_CREATION);
+		xar_prop_punset(f, p);
+	}
+	chunks_free(c);
+}
+
+/* Stores a chunk cut by content, which other files may share */
+static void cdc_commit(xar_t x, struct __xar_job_t *job) {
+	struct __xar_chunks_t *c = job->chunks;
+	struct __xar_cdc_chunk_t *rec = job->cdc;
+	off_t offset = XAR(x)->heap_offset;
+	const char *style = NULL;
+	xar_prop_t tmpp;
+
+	if( job->ret == 0 ) {
+		tmpp = xar_prop_pget(job->sp, "encoding");
+		if( tmpp )
+			style = xar_attr_pget(job->sf, tmpp, "style");
+		if( !style )
+			style = "application/octet-stream";
+		rec->style = strdup(style);
+		rec->filepos = lseek(XAR(x)->heap_fd, 0, SEEK_CUR);
+	}
+	if( (job->ret < 0) || !rec->style || (rec->filepos < 0) || (heap_append(x, job->buf, job->buflen) < 0) ) {
+		rec->failed = 1;
+		c->failed = 1;
+	} else {
+		rec->offset = offset;
+		rec->length = job->buflen;
+		XAR(x)->heap_len += job->buflen;
+	}
+
+	job_replay_errors(x, job);
+
+	if( (++c->committed == c->count) && !c->scanning )
+		chunks_finish(x, job->f, job->p, c);
+}
+
+static void chunk_commit(xar_t x, struct __xar_job_t *job) {
+	struct __xar_chunks_t *c = job->chunks;
+	const char *style = NULL;
+	xar_prop_t tmpp;
+
+	if( job->cdc ) {
+		cdc_commit(x, job);
+		return;
+	}
+
+	/* the chunks are committed back to back */
+	if( c->committed == 0 )
+		c->orig_heap_offset = XAR(x)->heap_offset;
+
+	if( job->ret < 0 )
+		c->failed = 1;
+	if( !c->failed ) {
+		tmpp = xar_prop_pget(job->sp, "encoding");
+		if( tmpp )
+			style = xar_attr_pget(job->sf, tmpp, "style");
+		if( !style )
+			style = "application/octet-stream";
+		if( !c->style )
+			c->style = strdup(style);
+		if( !c->style || strcmp(c->style, style) != 0 )
+			c->failed = 1;
+	}
+	if( !c->failed ) {
+		if( (list_append(&c->lengths, &c->lengthslen, (uint64_t)job->buflen) < 0) ||
+		    (list_append(&c->extents, &c->extentslen, (uint64_t)XAR(x)->heap_offset) < 0) ||
+		    (heap_append(x, job->buf, job->buflen) < 0) )
+			c->failed = 1;
+	}
+	if( !c->failed ) {
+		c->readsize += job->readsize;
+		c->writesize += job->writesize;
+		if( c->archived )
+			EVP_DigestUpdate(c->archived, job->buf, job->buflen);
+		if( c->unarchived )
+			EVP_DigestUpdate(c->unarchived, job->src, job->srclen);
+	}
+
+	job_replay_errors(x, job);
+
+	if( ++c->committed == c->count )
+		chunks_finish(x, job->f, job->p, c);
+}
+
+/* job_commit
+ * Appends the job's encoded data to the heap and does the same
+ * bookkeeping xar_attrcopy_to_heap does for inline data.
+ */
+static void job_commit(xar_t x, struct __xar_job_t *job) {
+	off_t orig_heap_offset = XAR(x)->heap_offset;
+	int32_t ret = job->ret;
+
+	if( job->chunks ) {
+		chunk_commit(x, job);
+		job_free(job);
+		return;
+	}
+
+	if( ret == 0 )
+		ret = heap_append(x, job->buf, job->buflen);
+
+	job_merge(job);
+	job_replay_errors(x, job);
+
+	if( ret == 0 )
+		ret = xar_attrcopy_commit(x, job->f, job->p, orig_heap_offset, job->readsize, job->writesize);
+
+	if( ret < 0 ) {
+		xar_err_new(x);
+		xar_err_set_file(x, job->f);
+		xar_err_set_string(x, "io: Could not archive file data");
+		xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_CREATION);
+	}
+	/* xar_data_archive drops data it could not or need not store */
+	if( (ret < 0 || job->readsize == 0) && (strcmp(xar_prop_getkey(job->p), "data") == 0) )
+		xar_prop_punset(job->f, job->p);
+
+	job_free(job);
+}
+
+/* workers_commit
+ * Commits finished jobs in submission order.  While more than keep jobs
+ * are outstanding, waits for the oldest one instead of returning.
+ */
+static void workers_commit(xar_t x, int keep) {
+	struct __xar_workers_t *w = WORKERS(x);
+	struct __xar_job_t *job;
+
+	while(1) {
+		WORKERS_LOCK(w);
+		job = w->chead;
+		if( !job || (!job->done && w->inflight <= keep) ) {
+			WORKERS_UNLOCK(w);
+			return;
+		}
+#ifdef HAVE_PTHREAD
+		while( !job->done )
+			pthread_cond_wait(&w->done, &w->lock);
+#endif
+		w->chead = job->cnext;
+		if( !w->chead )
+			w->ctail = NULL;
+		w->inflight--;
+		WORKERS_UNLOCK(w);
+
+		job_commit(x, job);
+	}
+}
+
+static struct __xar_workers_t *workers_new(int nthreads) {
+	struct __xar_workers_t *w;
+
+	w = calloc(1, sizeof(struct __xar_workers_t));
+	if( !w )
+		return NULL;
+#ifdef HAVE_PTHREAD
+	if( nthreads > 0 ) {
+		w->threads = calloc(nthreads, sizeof(pthread_t));
+		if( !w->threads ) {
+			free(w);
+			return NULL;
+		}
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+	pthread_cond_init(&w->done, NULL);
+	for( w->nthreads = 0; w->nthreads < nthreads; w->nthreads++ ) {
+		if( pthread_create(&w->threads[w->nthreads], NULL, worker_main, w) != 0 )
+			break;
+	}
+#else
+	(void)nthreads;
+#endif
+	return w;
+}
+
+/* Returns the archive's pool, starting it on first use.  A pool without
+ * threads runs its jobs on the calling thread.
+ */
+static struct __xar_workers_t *workers_get(xar_t x) {
+	int nthreads;
+
+	if( !WORKERS(x) ) {
+		nthreads = get_nthreads(x);
+		WORKERS(x) = workers_new(nthreads < 2 ? 0 : nthreads);
+	}
+	return WORKERS(x);
+}
+
+/* xar_workers_enabled
+ * x: archive being created
+ * Returns: non-zero if data should be handed to the worker pool.
+ * Summary: starts the pool on first use when XAR_OPT_THREADS asks for
+ * more than one thread.
+ */
+int32_t xar_workers_enabled(xar_t x) {
+	if( !WORKERS(x) && get_nthreads(x) < 2 )
+		return 0;
+	return workers_get(x) && (WORKERS(x)->nthreads > 0);
+}
+
+static void workers_queue(xar_t x, struct __xar_job_t *job) {
+	struct __xar_workers_t *w = WORKERS(x);
+
+	if( w->nthreads == 0 ) {
+		job_run(job);
+		job->done = 1;
+	}
+
+	WORKERS_LOCK(w);
+#ifdef HAVE_PTHREAD
+	if( !job->done ) {
+		if( w->qtail )
+			w->qtail->qnext = job;
+		else
+			w->qhead = job;
+		w->qtail = job;
+		pthread_cond_signal(&w->work);
+	}
+#endif
+	if( w->ctail )
+		w->ctail->cnext = job;
+	else
+		w->chead = job;
+	w->ctail = job;
+	w->inflight++;
+	WORKERS_UNLOCK(w);
+
+	/* keep every worker busy with one job in hand, and no more */
+	workers_commit(x, 2 * w->nthreads);
+}
+
+static int32_t job_override(struct __xar_job_t *job, const char *key, const char *value) {
+	xar_attr_t a;
+
+	a = xar_attr_new();
+	if( !a )
+		return -1;
+	xar_attr_setkey(a, key);
+	XAR_ATTR(a)->value = strdup(value);
+	XAR_ATTR(a)->next = job->sx.attrs;
+	job->sx.attrs = a;
+	if( !XAR_ATTR(a)->key || !XAR_ATTR(a)->value )
+		return -1;
+	return 0;
+}
+
+/* Has the job compress with codec.  XAR_OPT_COMPRESSION is left alone, so
+ * in adaptive mode xar_compression_arg still finds the codec's argument.
+ */
+static int32_t job_codec(struct __xar_job_t *job, const char *codec) {
+	job->codec = strdup(codec);
+	if( !job->codec )
+		return -1;
+	job->sx.compression = job->codec;
+	return 0;
+}
+
+/* Returns the chunk size to use for a file of the given size, 0 for none,
+ * and sets *codec to the compression of the chunks.
+ */
+static size_t get_chunksize(xar_t x, int fd, off_t size, const char **codec) {
+	const char *opt;
+	char *buf;
+	long long n;
+	ssize_t r;
+
+	opt = xar_opt_get(x, XAR_OPT_CHUNKSIZE);
+	if( !opt )
+		return 0;
+	errno = 0;
+	n = strtoll(opt, NULL, 0);
+	if( errno != 0 || n <= 0 )
+		return 0;
+	if( n < XAR_CHUNK_MINIMUM )
+		n = XAR_CHUNK_MINIMUM;
+	if( n > XAR_WORKERS_MAX_JOB )
+		n = XAR_WORKERS_MAX_JOB;
+	if( size <= n )
+		return 0;
+
+	/* chunking only pays off when compressing */
+	opt = xar_opt_get(x, XAR_OPT_COMPRESSION);
+	if( !opt || strcmp(opt, XAR_OPT_VAL_NONE) == 0 )
+		return 0;
+
+	/* the chunks are compressed regardless of their contents, so let
+	 * data that is already compressed take the normal path instead.
+	 * In adaptive mode the first block picks the codec for all chunks.
+	 */
+	buf = xar_buffer_get(x, XAR_DEFAULT_BUFFER_SIZE);
+	if( !buf )
+		return 0;
+	do {
+		r = pread(fd, buf, XAR_DEFAULT_BUFFER_SIZE, 0);
+	} while( r < 0 && errno == EINTR );
+	*codec = opt;
+	if( r <= 0 || xar_prevent_recompress(x, buf, r) ) {
+		n = 0;
+	} else if( strcmp(opt, XAR_OPT_VAL_AUTO) == 0 ) {
+		*codec = xar_compression_choose(x, buf, r);
+		if( strcmp(*codec, XAR_OPT_VAL_NONE) == 0 )
+			n = 0;
+	}
+	xar_buffer_put(x, buf);
+
+	return (size_t)n;
+}
+
+/* Queues one job per chunk of the file, the chunks take ownership of fd */
+static int32_t submit_chunks(xar_t x, xar_file_t f, xar_prop_t p, int fd, off_t size, size_t chunksize, const char *codec) {
+	struct __xar_chunks_t *c;
+	struct __xar_job_t *job;
+	const EVP_MD *md = NULL;
+	const char *opt;
+	off_t pos;
+	int i, count;
+
+	if( !workers_get(x) )
+		return 1;
+
+	opt = xar_opt_get(x, XAR_OPT_FILECKSUM);
+	if( opt && strcmp(opt, XAR_OPT_VAL_NONE) != 0 ) {
+		md = EVP_get_digestbyname(opt);
+		if( !md )
+			return 1;
+	}
+
+	c = calloc(1, sizeof(struct __xar_chunks_t));
+	if( !c )
+		return 1;
+	c->fd = -1;
+	c->chunksize = chunksize;
+	c->md = md;
+	if( md ) {
+		c->archived = EVP_MD_CTX_create();
+		c->unarchived = EVP_MD_CTX_create();
+		if( !c->archived || !c->unarchived ) {
+			chunks_free(c);
+			return 1;
+		}
+		EVP_DigestInit_ex(c->archived, md, NULL);
+		EVP_DigestInit_ex(c->unarchived, md, NULL);
+	}
+	count = (int)((size + chunksize - 1) / chunksize);
+	c->count = count;
+
+	for( i = 0, pos = 0; i < count; i++, pos += chunksize ) {
+		job = job_new(x, f, p);
+		if( job && ((job_override(job, XAR_OPT_FILECKSUM, XAR_OPT_VAL_NONE) < 0) ||
+		    (job_override(job, XAR_OPT_RECOMPRESS, XAR_OPT_VAL_TRUE) < 0) ||
+		    (job_codec(job, codec) < 0)) ) {
+			job_free(job);
+			job = NULL;
+		}
+		if( !job ) {
+			if( i == 0 ) {
+				chunks_free(c);
+				return 1;
+			}
+			/* finish with the chunks queued so far, as a failure */
+			c->failed = 1;
+			c->count = i;
+			if( c->committed == c->count )
+				chunks_finish(x, f, p, c);
+			return 0;
+		}
+		if( i == 0 )
+			c->fd = fd;
+		job->chunks = c;
+		job->srcpos = pos;
+		job->srclen = (size - pos) < (off_t)chunksize ? (size_t)(size - pos) : chunksize;
+		job->sx.datalen = job->srclen;
+		workers_queue(x, job);
+	}
+	return 0;
+}
+
+/* Returns the average size to cut a file of the given size into by
+ * content, 0 for none, and sets *codec to the compression of the chunks.
+ */
+static size_t get_cdcsize(xar_t x, int fd, off_t size, const char **codec) {
+	const char *opt;
+	char *buf;
+	long long n;
+	ssize_t r;
+
+	opt = xar_opt_get(x, XAR_OPT_DEDUPCHUNKS);
+	if( !opt )
+		return 0;
+	errno = 0;
+	n = strtoll(opt, NULL, 0);
+	if( errno != 0 || n <= 0 )
+		return 0;
+	if( n < XAR_CDC_MINIMUM )
+		n = XAR_CDC_MINIMUM;
+	if( n > XAR_WORKERS_MAX_JOB / XAR_CDC_SPREAD )
+		n = XAR_WORKERS_MAX_JOB / XAR_CDC_SPREAD;
+	if( size <= n )
+		return 0;
+
+	/* unlike fixed chunks, these pay off without compression too */
+	*codec = XAR_OPT_VAL_NONE;
+	opt = xar_opt_get(x, XAR_OPT_COMPRESSION);
+	if( !opt || strcmp(opt, XAR_OPT_VAL_NONE) == 0 )
+		return (size_t)n;
+
+	buf = xar_buffer_get(x, XAR_DEFAULT_BUFFER_SIZE);
+	if( !buf )
+		return 0;
+	do {
+		r = pread(fd, buf, XAR_DEFAULT_BUFFER_SIZE, 0);
+	} while( r < 0 && errno == EINTR );
+	if( r <= 0 ) {
+		n = 0;
+	} else if( !xar_prevent_recompress(x, buf, r) ) {
+		*codec = opt;
+		if( strcmp(opt, XAR_OPT_VAL_AUTO) == 0 )
+			*codec = xar_compression_choose(x, buf, r);
+	}
+	xar_buffer_put(x, buf);
+
+	return (size_t)n;
+}
+
+/* cdc_piece
+ * Adds a chunk cut by content to the file, queueing a job to store it if
+ * no chunk with the same contents and codec was stored before.
+ */
+static int32_t cdc_piece(xar_t x, xar_file_t f, xar_prop_t p, struct __xar_chunks_t *c, const char *codec, const char *data, size_t len) {
+	struct __xar_workers_t *w = WORKERS(x);
+	struct __xar_cdc_chunk_t *rec, **tmp;
+	struct __xar_job_t *job;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	char key[256];
+	unsigned int mdlen, i;
+	int n;
+
+	if( c->unarchived )
+		EVP_DigestUpdate(c->unarchived, data, len);
+	c->readsize += len;
+	if( (c->npieces % 64) == 0 ) {
+		tmp = realloc(c->pieces, (c->npieces + 64) * sizeof(*tmp));
+		if( !tmp )
+			return -1;
+		c->pieces = tmp;
+	}
+
+	if( !EVP_Digest(data, len, md, &mdlen, EVP_sha256(), NULL) )
+		return -1;
+	n = snprintf(key, sizeof(key), "%s:", codec);
+	if( (n < 0) || ((size_t)n + 2*mdlen >= sizeof(key)) )
+		return -1;
+	for( i = 0; i < mdlen; i++ )
+		n += sprintf(key + n, "%02x", md[i]);
+
+	rec = xmlHashLookup(w->cdcchunks, BAD_CAST(key));
+	if( rec ) {
+		c->pieces[c->npieces++] = rec;
+		return 0;
+	}
+
+	job = job_new(x, f, p);
+	if( job && ((job_override(job, XAR_OPT_FILECKSUM, XAR_OPT_VAL_NONE) < 0) ||
+	    (job_override(job, XAR_OPT_RECOMPRESS, XAR_OPT_VAL_TRUE) < 0) ||
+	    (job_codec(job, codec) < 0) ||
+	    !(job->src = malloc(len))) ) {
+		job_free(job);
+		job = NULL;
+	}
+	if( !job )
+		return -1;
+	memcpy(job->src, data, len);
+	job->srclen = len;
+	job->sx.datalen = len;
+
+	rec = calloc(1, sizeof(struct __xar_cdc_chunk_t));
+	if( !rec || (xmlHashAddEntry(w->cdcchunks, BAD_CAST(key), rec) != 0) ) {
+		free(rec);
+		job_free(job);
+		return -1;
+	}
+	rec->offset = -1;
+	rec->next = w->cdclist;
+	w->cdclist = rec;
+
+	job->chunks = c;
+	job->cdc = rec;
+	c->count++;
+	c->pieces[c->npieces++] = rec;
+	workers_queue(x, job);
+	return 0;
+}
+
+/* Reads the file, cutting it by content, and queues a job per chunk not
+ * stored yet.  fd is closed once read.
+ */
+static int32_t submit_cdc(xar_t x, xar_file_t f, xar_prop_t p, int fd, size_t avg, const char *codec) {
+	struct __xar_workers_t *w;
+	struct __xar_chunks_t *c;
+	const EVP_MD *md = NULL;
+	const char *opt;
+	char *buf;
+	size_t bufsize, len = 0, off, n;
+	ssize_t r;
+	int eof = 0, i;
+
+	w = workers_get(x);
+	if( !w )
+		return 1;
+	if( !w->cdcchunks ) {
+		w->cdcchunks = xmlHashCreate(0);
+		if( !w->cdcchunks )
+			return 1;
+	}
+	if( w->cdc.avg != avg )
+		xar_cdc_init(&w->cdc, avg);
+
+	opt = xar_opt_get(x, XAR_OPT_FILECKSUM);
+	if( opt && strcmp(opt, XAR_OPT_VAL_NONE) != 0 ) {
+		md = EVP_get_digestbyname(opt);
+		if( !md )
+			return 1;
+	}
+
+	c = calloc(1, sizeof(struct __xar_chunks_t));
+	if( !c )
+		return 1;
+	c->fd = -1;
+	c->md = md;
+	if( md ) {
+		c->archived = EVP_MD_CTX_create();
+		c->unarchived = EVP_MD_CTX_create();
+		if( !c->archived || !c->unarchived ) {
+			chunks_free(c);
+			return 1;
+		}
+		EVP_DigestInit_ex(c->archived, md, NULL);
+		EVP_DigestInit_ex(c->unarchived, md, NULL);
+	}
+	bufsize = XAR_CDC_SPREAD * w->cdc.max;
+	buf = malloc(bufsize);
+	if( !buf ) {
+		chunks_free(c);
+		return 1;
+	}
+
+	/* the jobs may be committed while the file is still being read */
+	c->scanning = 1;
+	while( !c->failed ) {
+		while( !eof && (len < bufsize) ) {
+			r = read(fd, buf + len, bufsize - len);
+			if( r < 0 && errno == EINTR )
+				continue;
+			if( r < 0 ) {
+				c->failed = 1;
+				break;
+			}
+			if( r == 0 )
+				eof = 1;
+			len += r;
+		}
+		for( off = 0; !c->failed && (off < len); off += n ) {
+			if( !eof && (len - off < w->cdc.max) )
+				break;
+			n = xar_cdc_cut(&w->cdc, (unsigned char *)buf + off, len - off);
+			if( cdc_piece(x, f, p, c, codec, buf + off, n) < 0 )
+				c->failed = 1;
+		}
+		if( c->failed || (eof && (off >= len)) )
+			break;
+		memmove(buf, buf + off, len - off);
+		len -= off;
+	}
+	free(buf);
+	close(fd);
+	c->scanning = 0;
+
+	if( c->committed == c->count ) {
+		/* chunks this file shares may still be on their way */
+		for( i = 0; i < c->npieces; i++ ) {
+			if( c->pieces[i]->offset < 0 && !c->pieces[i]->failed ) {
+				xar_workers_drain(x);
+				break;
+			}
+		}
+		chunks_finish(x, f, p, c);
+	}
+	return 0;
+}
+
+/* xar_workers_submit_fd
+ * x: archive being created
+ * f: file the data belongs to
+ * p: freshly created property to receive the data
+ * fd: open descriptor to read the data from
+ * Returns: 0 if the job was queued, in which case fd now belongs to the
+ * worker pool; non-zero if the caller must archive the data itself.
+ */
+int32_t xar_workers_submit_fd(xar_t x, xar_file_t f, xar_prop_t p, int fd) {
+	struct __xar_job_t *job;
+	struct stat sb;
+	size_t chunksize;
+	const char *codec = NULL;
+
+	if( fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0 )
+		return 1;
+
+	chunksize = get_cdcsize(x, fd, sb.st_size, &codec);
+	if( chunksize )
+		return submit_cdc(x, f, p, fd, chunksize, codec);
+
+	chunksize = get_chunksize(x, fd, sb.st_size, &codec);
+	if( chunksize )
+		return submit_chunks(x, f, p, fd, sb.st_size, chunksize, codec);
+
+	if( !xar_workers_enabled(x) || sb.st_size > XAR_WORKERS_MAX_JOB )
+		return 1;
+
+	job = job_new(x, f, p);
+	if( !job )
+		return 1;
+	job->fd = fd;
+	job->sx.datalen = (size_t)sb.st_size;
+	workers_queue(x, job);
+	return 0;
+}
+
+/* xar_workers_submit_buffer
+ * x: archive being created
+ * f: file the data belongs to
+ * p: property to receive the data
+ * buf, len: malloc'ed data to encode
+ * Returns: 0 if the job was queued, in which case buf now belongs to the
+ * worker pool; non-zero if the caller must archive the data itself.
+ */
+int32_t xar_workers_submit_buffer(xar_t x, xar_file_t f, xar_prop_t p, void *buf, size_t len) {
+	struct __xar_job_t *job;
+
+	if( !xar_workers_enabled(x) || len == 0 )
+		return 1;
+
+	job = job_new(x, f, p);
+	if( !job )
+		return 1;
+	job->src = buf;
+	job->srclen = len;
+	job->sx.datalen = len;
+	workers_queue(x, job);
+	return 0;
+}
+
+/* xar_workers_drain
+ * x: archive being created
+ * Returns 0
+ * Summary: waits for every queued job and commits it to the heap.  Must
+ * be called before anything else appends to the heap or reads the data
+ * properties of files added so far.
+ */
+int32_t xar_workers_drain(xar_t x) {
+	if( WORKERS(x) )
+		workers_commit(x, 0);
+	return 0;
+}
+
+/* xar_workers_free
+ * x: archive being created
+ * Summary: drains the pool and stops its threads.
+ */
+void xar_workers_free(xar_t x) {
+	struct __xar_workers_t *w = WORKERS(x);
+	struct __xar_cdc_chunk_t *rec;
+#ifdef HAVE_PTHREAD
+	int i;
+#endif
+
+	if( !w )
+		return;
+	xar_workers_drain(x);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&w->lock);
+	w->shutdown = 1;
+	pthread_cond_broadcast(&w->work);
+	pthread_mutex_unlock(&w->lock);
+	for( i = 0; i < w->nthreads; i++ )
+		pthread_join(w->threads[i], NULL);
+
+	pthread_cond_destroy(&w->done);
+	pthread_cond_destroy(&w->work);
+	pthread_mutex_destroy(&w->lock);
+	free(w->threads);
+#endif
+	if( w->cdcchunks )
+		xmlHashFree(w->cdcchunks, NULL);
+	while( w->cdclist ) {
+		rec = w->cdclist;
+		w->cdclist = rec->next;
+		free(rec->style);
+		free(rec);
+	}
+	free(w);
+	WORKERS(x) = NULL;
+}
+
+#ifdef HAVE_PTHREAD
+
+/*
+ * Parallel extraction.  Every thread extracts files through a private
+ * copy of the archive handle, so nothing the modules keep in it is
+ * shared.  Heap reads use pread() on the archive's descriptor and errors
+ * are passed on to the archive's error handler one at a time.
+ */
+struct __xar_extract_t {
+	pthread_mutex_t lock;
+	xar_t x;
+	xar_file_t *files;
+	size_t count;
+	size_t next;            /* next file to hand out */
+	int32_t extracted;
+};
+
+struct __xar_extractor_t {
+	struct __xar_t sx;      /* private archive handle, must be first */
+	struct __xar_extract_t *e;
+	pthread_t thread;
+};
+
+#define EXTRACTOR_FROM_ERRCTX(c) ((struct __xar_extractor_t *)((char *)(c) - offsetof(struct __xar_t, errctx)))
+
+static int32_t extract_error(int32_t severity, int32_t instance, xar_errctx_t ctx, void *usrctx) {
+	struct __xar_extract_t *e = EXTRACTOR_FROM_ERRCTX(ctx)->e;
+	int32_t ret = 0;
+
+	pthread_mutex_lock(&e->lock);
+	((struct errctx *)ctx)->x = e->x;
+	if( XAR(e->x)->ercallback )
+		ret = XAR(e->x)->ercallback(severity, instance, ctx, usrctx);
+	pthread_mutex_unlock(&e->lock);
+	return ret;
+}
+
+static void *extract_main(void *arg) {
+	struct __xar_extractor_t *t = arg;
+	struct __xar_extract_t *e = t->e;
+	xar_t x = (xar_t)&t->sx;
+	xar_file_t f;
+
+	while(1) {
+		pthread_mutex_lock(&e->lock);
+		f = (e->next < e->count) ? e->files[e->next++] : NULL;
+		pthread_mutex_unlock(&e->lock);
+		if( !f )
+			break;
+
+		if( xar_extract(x, f) == 0 ) {
+			pthread_mutex_lock(&e->lock);
+			e->extracted++;
+			pthread_mutex_unlock(&e->lock);
+		} else {
+			xar_err_new(x);
+			xar_err_set_file(x, f);
+			xar_err_set_string(x, "Unable to extract file");
+			xar_err_callback(x, XAR_SEVERITY_NONFATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+		}
+	}
+	return NULL;
+}
+
+/* xar_workers_extract
+ * x: archive to extract from, its descriptor must be seekable
+ * files, count: files to extract, none of them directories, whose parent
+ * directories already exist
+ * nthreads: number of threads to use, 0 for one per online cpu
+ * Returns: the number of files extracted, or -1 if no thread could be
+ * started and the caller must extract the files itself.
+ */
+int32_t xar_workers_extract(xar_t x, xar_file_t *files, size_t count, int32_t nthreads) {
+	struct __xar_extract_t e;
+	struct __xar_extractor_t *t;
+	int i, started;
+
+	nthreads = xar_workers_nthreads(nthreads);
+	if( (size_t)nthreads > count )
+		nthreads = (int32_t)count;
+	t = calloc(nthreads, sizeof(struct __xar_extractor_t));
+	if( !t )
+		return -1;
+
+	memset(&e, 0, sizeof(e));
+	pthread_mutex_init(&e.lock, NULL);
+	e.x = x;
+	e.files = files;
+	e.count = count;
+
+	for( started = 0; started < nthreads; started++ ) {
+		memcpy(&t[started].sx, XAR(x), sizeof(struct __xar_t));
+		memset(&t[started].sx.errctx, 0, sizeof(struct errctx));
+		/* the handler expects the context it was registered with */
+		t[started].sx.errctx.usrctx = XAR(x)->errctx.usrctx;
+		t[started].sx.ercallback = extract_error;
+		t[started].sx.workers = NULL;
+		t[started].e = &e;
+		if( pthread_create(&t[started].thread, NULL, extract_main, &t[started]) != 0 )
+			break;
+	}
+	for( i = 0; i < started; i++ )
+		pthread_join(t[i].thread, NULL);
+
+	pthread_mutex_destroy(&e.lock);
+	free(t);
+	return started ? e.extracted : -1;
+}
+
+#else /* HAVE_PTHREAD */
+
+int32_t xar_workers_extract(xar_t x, xar_file_t *files, size_t count, int32_t nthreads) {
+	(void)x; (void)files; (void)count; (void)nthreads;
+	return -1;
+}
+
+#endif /* HAVE_PTHREAD */
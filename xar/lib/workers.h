@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _XAR_WORKERS_H_
+#define _XAR_WORKERS_H_
+
+/* Files larger than this are encoded by the calling thread, so a queued
+ * job never holds more than about this much encoded data in memory.
+ */
+#define XAR_WORKERS_MAX_JOB (32*1024*1024)
+
+/* Smallest chunk size honoured for XAR_OPT_CHUNKSIZE */
+#define XAR_CHUNK_MINIMUM (64*1024)
+
+/* Upper bound on the number of worker threads per archive */
+#define XAR_WORKERS_MAX_THREADS 64
+
+int32_t xar_workers_enabled(xar_t x);
+int32_t xar_workers_submit_fd(xar_t x, xar_file_t f, xar_prop_t p, int fd);
+int32_t xar_workers_submit_buffer(xar_t x, xar_file_t f, xar_prop_t p, void *buf, size_t len);
+int32_t xar_workers_drain(xar_t x);
+void xar_workers_free(xar_t x);
+int32_t xar_workers_nthreads(int32_t n);
+int32_t xar_workers_extract(xar_t x, xar_file_t *files, size_t count, int32_t nthreads);
+
+#endif /* _XAR_WORKERS_H_ */
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2005-2008 Rob Braun
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Rob Braun nor the names of his contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Zstandard compression of file data, stored with the "application/zstd"
+ * encoding style.  XAR_OPT_COMPRESSIONARG is "level" or "level,threads":
+ * the level is anything libzstd accepts (default 3, negative levels are
+ * the fast modes) and a thread count above 1, or 0 for one per online
+ * cpu, has libzstd compress each file on that many threads when it was
+ * built with multithreading support.
+ */
+
+#include "config.h"
+#ifndef HAVE_ASPRINTF
+#include "asprintf.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <errno.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#include "xar.h"
+#include "filetree.h"
+#include "io.h"
+#include "buffers.h"
+#include "workers.h"
+#include "zstdxar.h"
+
+#define XAR_ZSTD_STYLE "application/zstd"
+
+#ifdef HAVE_LIBZSTD
+
+struct _zstd_context{
+	uint8_t		zstdcompressed;
+	uint64_t	count;
+	ZSTD_CCtx	*cctx;
+	ZSTD_DCtx	*dctx;
+};
+
+#define ZSTD_CONTEXT(x) ((struct _zstd_context *)(*x))
+
+/* Applies the compression argument to a new compression context */
+static void xar_zstd_params(xar_t x, ZSTD_CCtx *cctx) {
+	const char *opt;
+	char *end;
+	long level = ZSTD_CLEVEL_DEFAULT, threads = 1;
+
+	opt = xar_compression_arg(x);
+	if( opt ) {
+		errno = 0;
+		level = strtol(opt, &end, 10);
+		if( (errno != 0) || (end == opt) )
+			level = ZSTD_CLEVEL_DEFAULT;
+		else if( *end == ',' ) {
+			opt = end + 1;
+			threads = strtol(opt, &end, 10);
+			if( (errno != 0) || (end == opt) || (threads < 0) )
+				threads = 1;
+		}
+	}
+	if( level < ZSTD_minCLevel() )
+		level = ZSTD_minCLevel();
+	if( level > ZSTD_maxCLevel() )
+		level = ZSTD_maxCLevel();
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, (int)level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 0);
+
+	/* fails harmlessly when libzstd was built without threads */
+	threads = xar_workers_nthreads((int32_t)threads);
+	if( threads > 1 )
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, (int)threads);
+}
+#endif
+
+int xar_zstd_fromheap_done(xar_t x, xar_file_t f, xar_prop_t p, void **context) {
+#ifdef HAVE_LIBZSTD
+
+	(void)x; (void)f; (void)p;
+	if( !context || !ZSTD_CONTEXT(context) )
+		return 0;
+
+	if( ZSTD_CONTEXT(context)->zstdcompressed ){
+		ZSTD_freeDCtx(ZSTD_CONTEXT(context)->dctx);
+	}
+
+	/* free the context */
+	free(ZSTD_CONTEXT(context));
+	*context = NULL;
+
+#else /* !HAVE_LIBZSTD */
+	(void)x; (void)f; (void)p; (void)context;
+#endif /* !HAVE_LIBZSTD */
+	return 0;
+}
+
+int xar_zstd_fromheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t *inlen, void **context) {
+	const char *opt;
+	xar_prop_t tmpp;
+#ifdef HAVE_LIBZSTD
+	void *out = NULL;
+	ZSTD_inBuffer ib;
+	ZSTD_outBuffer ob;
+	size_t r;
+
+	/* on first run, we init the context and check the compression type */
+	if( !ZSTD_CONTEXT(context) ) {
+		*context = calloc(1,sizeof(struct _zstd_context));
+
+		opt = NULL;
+		tmpp = xar_prop_pget(p, "encoding");
+		if( tmpp )
+			opt = xar_attr_pget(f, tmpp, "style");
+		if( !opt ) return 0;
+		if( strcmp(opt, XAR_ZSTD_STYLE) != 0 ) return 0;
+
+		ZSTD_CONTEXT(context)->dctx = ZSTD_createDCtx();
+		if( !ZSTD_CONTEXT(context)->dctx ) abort();
+		ZSTD_CONTEXT(context)->zstdcompressed = 1;
+		if( *inlen == 0 )
+			return 0;
+	}else if( !(ZSTD_CONTEXT(context)->zstdcompressed) ){
+		/* once the context has been initialized, then we have already
+		   checked the compression type, so we need only check if we
+		   actually are compressed */
+		return 0;
+	}
+
+	ib.src = *in;
+	ib.size = *inlen;
+	ib.pos = 0;
+	ob.dst = NULL;
+	ob.size = ob.pos = 0;
+
+	/* a full output buffer may leave decoded data behind in the context */
+	do {
+		if( ob.pos == ob.size ) {
+			out = xar_buffer_grow(x, out, ob.size ? ob.size * 2 : ZSTD_DStreamOutSize());
+			if( out == NULL ) abort();
+			ob.dst = out;
+			ob.size = xar_buffer_size(out);
+		}
+		r = ZSTD_decompressStream(ZSTD_CONTEXT(context)->dctx, &ob, &ib);
+		if( ZSTD_isError(r) ) {
+			xar_err_new(x);
+			xar_err_set_file(x, f);
+			xar_err_set_string(x, "Error decompressing file");
+			xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+			xar_buffer_put(x, out);
+			return -1;
+		}
+	} while( (ib.pos < ib.size) || (ob.pos == ob.size) );
+
+	xar_buffer_put(x, *in);
+	*in = out;
+	*inlen = ob.pos;
+#else
+	(void)in; (void)inlen; (void)context;
+	opt = NULL;
+	tmpp = xar_prop_pget(p, "encoding");
+	if( tmpp )
+		opt = xar_attr_pget(f, tmpp, "style");
+	if( !opt ) return 0;
+	if( strcmp(opt, XAR_ZSTD_STYLE) != 0 ) return 0;
+	xar_err_new(x);
+	xar_err_set_file(x, f);
+	xar_err_set_errno(x, 0);
+	xar_err_set_string(x, "zstd support not compiled in.");
+	xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_EXTRACTION);
+
+#endif /* HAVE_LIBZSTD */
+	return 0;
+}
+
+int xar_zstd_toheap_done(xar_t x, xar_file_t f, xar_prop_t p, void **context) {
+#ifdef HAVE_LIBZSTD
+	xar_prop_t tmpp;
+
+	(void)x;
+	if( ZSTD_CONTEXT(context)->zstdcompressed ){
+		ZSTD_freeCCtx(ZSTD_CONTEXT(context)->cctx);
+
+		if( ZSTD_CONTEXT(context)->count ) {
+			tmpp = xar_prop_pset(f, p, "encoding", NULL);
+			if( tmpp )
+				xar_attr_pset(f, tmpp, "style", XAR_ZSTD_STYLE);
+		}
+	}
+
+	/* free the context */
+	free(ZSTD_CONTEXT(context));
+	*context = NULL;
+#else /* !HAVE_LIBZSTD */
+	(void)x; (void)f; (void)p; (void)context;
+#endif /* !HAVE_LIBZSTD */
+	return 0;
+}
+
+int32_t xar_zstd_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t *inlen, void **context) {
+	const char *opt;
+#ifdef HAVE_LIBZSTD
+	void *out = NULL;
+	ZSTD_inBuffer ib;
+	ZSTD_outBuffer ob;
+	ZSTD_EndDirective mode;
+	size_t r;
+
+	(void)p;
+	/* on first run, we init the context and check the compression type */
+	if( !ZSTD_CONTEXT(context) ) {
+		*context = calloc(1,sizeof(struct _zstd_context));
+
+		opt = xar_compression(x);
+		if( !opt )
+			return 0;
+
+		if( strcmp(opt, XAR_OPT_VAL_ZSTD) != 0 )
+			return 0;
+
+		if( xar_prevent_recompress(x, *in, *inlen) )
+			return 0;
+
+		ZSTD_CONTEXT(context)->cctx = ZSTD_createCCtx();
+		if( !ZSTD_CONTEXT(context)->cctx ) abort();
+		xar_zstd_params(x, ZSTD_CONTEXT(context)->cctx);
+		ZSTD_CONTEXT(context)->zstdcompressed = 1;
+		if( *inlen == 0 )
+			return 0;
+	}else if( !ZSTD_CONTEXT(context)->zstdcompressed ){
+		/* once the context has been initialized, then we have already
+		checked the compression type, so we need only check if we
+		actually are compressed */
+		return 0;
+	}
+
+	/* an empty block marks the end of the data */
+	mode = *inlen ? ZSTD_e_continue : ZSTD_e_end;
+	ib.src = *in;
+	ib.size = *inlen;
+	ib.pos = 0;
+	ob.dst = NULL;
+	ob.size = ob.pos = 0;
+
+	do {
+		if( ob.pos == ob.size ) {
+			out = xar_buffer_grow(x, out, ob.size ? ob.size * 2 : ZSTD_compressBound(*inlen));
+			if( out == NULL ) abort();
+			ob.dst = out;
+			ob.size = xar_buffer_size(out);
+		}
+		r = ZSTD_compressStream2(ZSTD_CONTEXT(context)->cctx, &ob, &ib, mode);
+		if( ZSTD_isError(r) ) {
+			xar_err_new(x);
+			xar_err_set_file(x, f);
+			xar_err_set_string(x, "Error compressing file");
+			xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_CREATION);
+			xar_buffer_put(x, out);
+			return -1;
+		}
+	} while( (mode == ZSTD_e_end) ? (r != 0) : (ib.pos < ib.size) );
+
+	xar_buffer_put(x, *in);
+	*in = out;
+	ZSTD_CONTEXT(context)->count += *inlen;
+	*inlen = ob.pos;
+#else
+	(void)p; (void)in; (void)inlen; (void)context;
+	opt = xar_compression(x);
+	if( !opt )
+		return 0;
+	if( strcmp(opt, XAR_OPT_VAL_ZSTD) != 0 )
+		return 0;
+	xar_err_new(x);
+	xar_err_set_file(x, f);
+	xar_err_set_errno(x, 0);
+	xar_err_set_string(x, "zstd support not compiled in.");
+	xar_err_callback(x, XAR_SEVERITY_FATAL, XAR_ERR_ARCHIVE_CREATION);
+#endif /* HAVE_LIBZSTD */
+	return 0;
+}
+
+int xar_zstd_is_compressed(void *in, size_t inlen)
+{
+	if( !in || inlen < 4 )
+		return 0;
+	return memcmp(in, "\x28\xb5\x2f\xfd", 4) == 0;
+}
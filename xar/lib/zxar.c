@@ -51,6 +51,7 @@
 #include "archive.h"
 #include "filetree.h"
 #include "io.h"
+#include "buffers.h"
 
 struct _gzip_context{
 	uint8_t		gzipcompressed;
@@ -114,9 +115,9 @@ int xar_gzip_fromheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t
 	GZIP_CONTEXT(context)->z.avail_out = 0;
 
 	while( GZIP_CONTEXT(context)->z.avail_in != 0 ) {
-		outlen = outlen * 2;
-		out = realloc(out, outlen);
+		out = xar_buffer_grow(x, out, outlen * 2);
 		if( out == NULL ) abort();
+		outlen = xar_buffer_size(out);
 
 		GZIP_CONTEXT(context)->z.next_out = ((unsigned char *)out) + offset;
 		GZIP_CONTEXT(context)->z.avail_out = (unsigned)(outlen - offset);
@@ -134,7 +135,7 @@ int xar_gzip_fromheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_t
 			break;
 	}
 
-	free(*in);
+	xar_buffer_put(x, *in);
 	*in = out;
 	*inlen = offset;
 	return 0;
@@ -173,7 +174,7 @@ int32_t xar_gzip_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		int level = Z_BEST_COMPRESSION;
 		*context = calloc(1,sizeof(struct _gzip_context));
 		
-		opt = xar_opt_get(x, XAR_OPT_COMPRESSION);
+		opt = xar_compression(x);
 		if( !opt )
 			return 0;
 		
@@ -183,7 +184,7 @@ int32_t xar_gzip_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		if( xar_prevent_recompress(x, *in, *inlen) )
 			return 0;
 
-		opt = xar_opt_get(x, XAR_OPT_COMPRESSIONARG);
+		opt = xar_compression_arg(x);
 		if( opt ) {
 			int tmp;
 			errno = 0;
@@ -214,9 +215,9 @@ int32_t xar_gzip_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 
 	if( *inlen != 0 ) {
 		do {
-			outlen *= 2;
-			out = realloc(out, outlen);
+			out = xar_buffer_grow(x, out, outlen * 2);
 			if( out == NULL ) abort();
+			outlen = xar_buffer_size(out);
 
 			GZIP_CONTEXT(context)->z.next_out = ((unsigned char *)out) + offset;
 			GZIP_CONTEXT(context)->z.avail_out = (unsigned)(outlen - offset);
@@ -226,9 +227,9 @@ int32_t xar_gzip_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		} while( r == Z_OK && GZIP_CONTEXT(context)->z.avail_in != 0 );
 	} else {
 		do {
-			outlen *= 2;
-			out = realloc(out, outlen);
+			out = xar_buffer_grow(x, out, outlen * 2);
 			if( out == NULL ) abort();
+			outlen = xar_buffer_size(out);
 
 			GZIP_CONTEXT(context)->z.next_out = ((unsigned char *)out) + offset;
 			GZIP_CONTEXT(context)->z.avail_out = (unsigned)(outlen - offset);
@@ -247,7 +248,7 @@ int32_t xar_gzip_toheap_in(xar_t x, xar_file_t f, xar_prop_t p, void **in, size_
 		return -1;
 	}
 
-	free(*in);
+	xar_buffer_put(x, *in);
 	*in = out;
 	GZIP_CONTEXT(context)->count += *inlen;
 	*inlen = offset;
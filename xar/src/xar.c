@@ -136,6 +136,19 @@ static char *DataToSignDumpPath = NULL;
 static char *SigOffsetDumpPath = NULL;
 static char *SignatureDumpPath = NULL;
 static char *StripComponents = NULL;
+static char *Threads = NULL;
+static char *ChunkSize = NULL;
+static char *AutoFast = NULL;
+static char *AutoStrong = NULL;
+static char *AutoBudget = NULL;
+static char *AutoFastArg = NULL;
+static char *AutoStrongArg = NULL;
+static int Mmap = 0;
+static int TocCache = 0;
+static char *TocSpace = NULL;
+static char *DedupChunks = NULL;
+static char *HeapOrder = NULL;
+static char *HeapProfile = NULL;
 
 static int Err = 0;
 static int List = 0;
@@ -193,6 +206,26 @@ static int32_t signingCallback(xar_signature_t sig, void *context, uint8_t *data
 static void insert_cert(xar_signature_t sig, const char *cert_path);
 static const struct HashType *get_hash_alg(const char *str);
 
+/* Returns non-zero if this instance of xar can compress with codec */
+static int known_compression(const char *codec) {
+	return (strcmp(codec, XAR_OPT_VAL_NONE) == 0) ||
+	       (strcmp(codec, XAR_OPT_VAL_GZIP) == 0)
+#ifdef HAVE_LIBBZ2
+	       || (strcmp(codec, XAR_OPT_VAL_BZIP) == 0)
+#endif
+#ifdef HAVE_LIBLZMA
+	       || (strcmp(codec, XAR_OPT_VAL_LZMA) == 0)
+	       || (strcmp(codec, XAR_OPT_VAL_XZ) == 0)
+#endif
+#ifdef HAVE_LIBZSTD
+	       || (strcmp(codec, XAR_OPT_VAL_ZSTD) == 0)
+#endif
+#ifdef HAVE_LIBLZ4
+	       || (strcmp(codec, XAR_OPT_VAL_LZ4) == 0)
+#endif
+	       ;
+}
+
 static void print_file(xar_t x, xar_file_t f, FILE *out) {
 	if( List && Verbose ) {
 		char *size = xar_get_size(x, f);
@@ -217,6 +250,21 @@ static void print_file(xar_t x, xar_file_t f, FILE *out) {
 	}
 }
 
+/* prints a file reported by xar_toc_walk the way print_file does */
+static void print_entry(const xar_toc_entry *e, FILE *out) {
+	if( List && Verbose ) {
+		char *mode = xar_entry_mode(e);
+		char *mtime = xar_entry_mtime(e);
+		char size[32];
+		snprintf(size, sizeof(size), "%"PRIu64, e->size);
+		fprintf(out, "%s %8s/%-8s %10s %s %s\n", mode, e->user ? e->user : "unknown", e->group ? e->group : "unknown", size, mtime, e->path);
+		free(mode);
+		free(mtime);
+	} else if( List || Verbose ) {
+		fprintf(out, "%s\n", e->path);
+	}
+}
+
 static void add_subdoc(xar_t x) {
 	xar_subdoc_t s;
 	int fd;
@@ -292,7 +340,7 @@ static void extract_data_to_sign(const char *filename) {
 	const struct HashType *hash = NULL;
 
 	/* find signature stub */
-	x = xar_open(filename, READ);
+	x = xar_open(filename, READ | XAR_OPEN_LAZY);
 	if ( x == NULL ) {
 		fprintf(stderr, "Could not open %s to extract data to sign\n", filename);
 		exit(1);
@@ -453,7 +501,7 @@ static void extract_certs(char *filename, char *cert_base_path, char *CApath) {
 	char *cert_path;
 
 	/* open xar, get signature */
-	x = xar_open(filename, READ);
+	x = xar_open(filename, READ | XAR_OPEN_LAZY);
 	if ( x == NULL ) {
 		fprintf(stderr, "Could not open %s to extract certificates\n", filename);
 		exit(1);
@@ -589,7 +637,7 @@ static void extract_signature(const char *filename, const char *sigfile) {
 	int i;
 
 	/* open xar, get signature */
-	x = xar_open(filename, READ);
+	x = xar_open(filename, READ | XAR_OPEN_LAZY);
 	if ( x == NULL ) {
 		fprintf(stderr, "Could not open %s to extract signature data\n", filename);
 		exit(1);
@@ -1069,7 +1117,7 @@ static void inject_signature(const char *xar_path, const char *sig_path) {
 	free(buffer);
 }
 
-static int archive(const char *filename, int arglen, char *args[]) {
+static int archive(const char *filename, int arglen, char *args[], int update) {
 	xar_t x;
 	FTS *fts;
 	FTSENT *ent;
@@ -1079,9 +1127,9 @@ static int archive(const char *filename, int arglen, char *args[]) {
 	int curdir = open(".", O_RDONLY);
 
 	(void)arglen;
-	x = xar_open(filename, WRITE);
+	x = xar_open(filename, update ? (WRITE | XAR_OPEN_APPEND) : WRITE);
 	if( !x ) {
-		fprintf(stderr, "Error creating archive %s\n", filename);
+		fprintf(stderr, "Error %s archive %s\n", update ? "updating" : "creating", filename);
 		exit(1);
 	}
 
@@ -1093,7 +1141,8 @@ static int archive(const char *filename, int arglen, char *args[]) {
 		}
 	}
 
-	if( Toccksum )
+	/* an updated archive keeps its TOC checksum */
+	if( Toccksum && !update )
 		if (xar_opt_set(x, XAR_OPT_TOCCKSUM, Toccksum->name) != 0) {
 			fprintf(stderr, "Unsupported TOC checksum type %s\n", Toccksum->name);
 			exit(1);
@@ -1126,6 +1175,39 @@ static int archive(const char *filename, int arglen, char *args[]) {
 	if( RFC6713 )
 		xar_opt_set(x, XAR_OPT_RFC6713FORMAT, XAR_OPT_VAL_TRUE);
 
+	if( Threads )
+		xar_opt_set(x, XAR_OPT_THREADS, Threads);
+
+	if( ChunkSize )
+		xar_opt_set(x, XAR_OPT_CHUNKSIZE, ChunkSize);
+
+	if( AutoFast )
+		xar_opt_set(x, XAR_OPT_AUTOFAST, AutoFast);
+
+	if( AutoStrong )
+		xar_opt_set(x, XAR_OPT_AUTOSTRONG, AutoStrong);
+
+	if( AutoBudget )
+		xar_opt_set(x, XAR_OPT_AUTOBUDGET, AutoBudget);
+
+	if( AutoFastArg )
+		xar_opt_set(x, XAR_OPT_AUTOFASTARG, AutoFastArg);
+
+	if( AutoStrongArg )
+		xar_opt_set(x, XAR_OPT_AUTOSTRONGARG, AutoStrongArg);
+
+	if( TocSpace )
+		xar_opt_set(x, XAR_OPT_TOCSPACE, TocSpace);
+
+	if( DedupChunks )
+		xar_opt_set(x, XAR_OPT_DEDUPCHUNKS, DedupChunks);
+
+	if( HeapOrder )
+		xar_opt_set(x, XAR_OPT_HEAPORDER, HeapOrder);
+
+	if( HeapProfile )
+		xar_opt_set(x, XAR_OPT_HEAPPROFILE, HeapProfile);
+
 	xar_register_errhandler(x, err_callback, NULL);
 
 	for( i = PropInclude; i; i=i->next ) {
@@ -1251,16 +1333,59 @@ static int archive(const char *filename, int arglen, char *args[]) {
 	return Err;
 }
 
+/* Selects the files to extract: those matching one of the patterns in
+ * context (all of them when NULL) and none of the exclusions.
+ */
+static int32_t extract_filter(xar_t x, xar_file_t f, void *context) {
+	struct lnode *i;
+	int matched = 0;
+	int exclude_match = 1;
+	const char *prop = NULL;
+	char *path = xar_get_path(f);
+
+	if( context ) {
+		for(i = (struct lnode *)context; i != NULL; i = i->next) {
+			if( !regexec(&i->reg, path, 0, NULL, 0) ) {
+				matched = 1;
+				break;
+			}
+		}
+	} else {
+		matched = 1;
+	}
+
+	for( i = Exclude; i; i=i->next ) {
+		exclude_match = regexec(&i->reg, path, 0, NULL, 0);
+		if( !exclude_match )
+			break;
+	}
+	if( !exclude_match ) {
+		if( Verbose )
+			printf("Excluding %s\n", path);
+		free(path);
+		return 0;
+	}
+
+	if( matched ) {
+		struct stat sb;
+		if( !ToStdout && NoOverwrite && (lstat(path, &sb) == 0) ) {
+			fprintf(stderr, "%s already exists, not overwriting\n", path);
+			matched = 0;
+		} else if( !ToStdout || (xar_prop_get(f, "type", &prop) != 0) || (strcmp(prop, "directory") != 0) ) {
+			print_file(x, f, stdout);
+		}
+	}
+	free(path);
+	return matched;
+}
+
 static int extract(const char *filename, int arglen, char *args[]) {
 	xar_t x;
-	xar_iter_t i;
-	xar_file_t f;
 	int files_extracted = 0;
 	int argi;
 	struct lnode *extract_files = NULL;
 	struct lnode *extract_tail = NULL;
 	struct lnode *lnodei = NULL;
-	struct lnode *dirs = NULL;
 
 	(void)arglen;
 	for(argi = 0; args[argi]; argi++) {
@@ -1307,7 +1432,7 @@ static int extract(const char *filename, int arglen, char *args[]) {
 		}
 	}
 
-	x = xar_open(filename, READ);
+	x = xar_open(filename, READ | (Mmap ? XAR_OPEN_MMAP : 0) | (TocCache ? XAR_OPEN_TOCCACHE : 0));
 	if( !x ) {
 		fprintf(stderr, "Error opening xar archive: %s\n", filename);
 		exit(1);
@@ -1341,79 +1466,11 @@ static int extract(const char *filename, int arglen, char *args[]) {
 		xar_opt_set(x, XAR_OPT_EXTRACTSTDOUT, XAR_OPT_VAL_TRUE);
 	}
 
-	i = xar_iter_new();
-	if( !i ) {
-		fprintf(stderr, "Error creating xar iterator\n");
+	files_extracted = xar_extract_all(x, Threads ? (int32_t)strtol(Threads, NULL, 0) : 1, extract_filter, args[0] ? extract_files : NULL);
+	if( files_extracted < 0 ) {
+		fprintf(stderr, "Error extracting the archive\n");
 		exit(1);
 	}
-
-	for(f = xar_file_first(x, i); f; f = xar_file_next(i)) {
-		int matched = 0;
-		int exclude_match = 1;
-		struct lnode *i;
-
-		char *path = xar_get_path(f);
-
-		if( args[0] ) {
-			for(i = extract_files; i != NULL; i = i->next) {
-				int extract_match = 1;
-
-				extract_match = regexec(&i->reg, path, 0, NULL, 0);
-				if( !extract_match ) {
-					matched = 1;
-					break;
-				}
-			}
-		} else {
-			matched = 1;
-		}
-
-		for( i = Exclude; i; i=i->next ) {
-			exclude_match = regexec(&i->reg, path, 0, NULL, 0);
-			if( !exclude_match )
-				break;
-		}
-		if( !exclude_match ) {
-			if( Verbose )
-				printf("Excluding %s\n", path);
-			free(path);
-			continue;
-		}
-		
-		if( matched ) {
-			struct stat sb;
-			if( !ToStdout && NoOverwrite && (lstat(path, &sb) == 0) ) {
-				fprintf(stderr, "%s already exists, not overwriting\n", path);
-			} else {
-				const char *prop = NULL;
-				int deferred = 0;
-				if( xar_prop_get(f, "type", &prop) == 0 ) {
-					if( strcmp(prop, "directory") == 0 ) {
-						if (!ToStdout) {
-							struct lnode *tmpl = calloc(sizeof(struct lnode),1);
-							tmpl->str = (char *)f;
-							tmpl->next = dirs;
-							dirs = tmpl;
-						}
-						deferred = 1;
-					}
-				}
-				if( ! deferred ) {
-					print_file(x, f, stdout);
-					if (xar_extract(x, f) == 0)
-						files_extracted++;
-					else if (!ToStdout)
-						fprintf(stderr, "Unable to extract file %s\n", path);
-				}
-			}
-		}
-		free(path);
-	}
-	for(lnodei = dirs; lnodei; lnodei = lnodei->next) {
-		files_extracted++;
-		print_file(x,(xar_file_t)lnodei->str, stdout);
-		xar_extract(x, (xar_file_t)lnodei->str);
-	}
 	if( args[0] && (files_extracted == 0) ) {
 		fprintf(stderr, "No files matched extraction criteria\n");
 		Err = 3;
@@ -1422,7 +1479,6 @@ static int extract(const char *filename, int arglen, char *args[]) {
 	if( Subdoc )
 		extract_subdoc(x, NULL);
 
-	xar_iter_free(i);
 	if( xar_close(x) != 0 ) {
 		fprintf(stderr, "Error extracting the archive\n");
 		if( !Err )
@@ -1444,7 +1500,7 @@ static int list_subdocs(const char *filename) {
 	xar_t x;
 	xar_subdoc_t s;
 
-	x = xar_open(filename, READ);
+	x = xar_open(filename, READ | XAR_OPEN_LAZY);
 	if( !x ) {
 		fprintf(stderr, "Error opening xar archive: %s\n", filename);
 		exit(1);
@@ -1458,10 +1514,31 @@ static int list_subdocs(const char *filename) {
 	return Err;
 }
 
+/* xar_toc_walk callback of list, context is the list of expressions */
+static int32_t list_entry(xar_t x, const xar_toc_entry *e, void *context) {
+	struct lnode *list_files = context;
+	struct lnode *lnodei;
+	int matched = 0;
+
+	(void)x;
+	if( list_files ) {
+		for(lnodei = list_files; lnodei != NULL; lnodei = lnodei->next) {
+			if( !regexec(&lnodei->reg, e->path, 0, NULL, 0) ) {
+				matched = 1;
+				break;
+			}
+		}
+	} else {
+		matched = 1;
+	}
+
+	if( matched )
+		print_entry(e, stdout);
+	return 0;
+}
+
 static int list(const char *filename, int arglen, char *args[]) {
 	xar_t x;
-	xar_iter_t i;
-	xar_file_t f;
 	int argi = 0;
 	struct lnode *list_files = NULL;
 	struct lnode *list_tail = NULL;
@@ -1490,42 +1567,18 @@ static int list(const char *filename, int arglen, char *args[]) {
 		}
 	}
 
-	x = xar_open(filename, READ);
+	/* the files are printed as the TOC is read, unless they are cached */
+	x = xar_open(filename, READ | (TocCache ? XAR_OPEN_TOCCACHE : XAR_OPEN_TOCWALK) | (Mmap ? XAR_OPEN_MMAP : 0));
 	if( !x ) {
 		fprintf(stderr, "Error opening xar archive: %s\n", filename);
 		exit(1);
 	}
 
-	i = xar_iter_new();
-	if( !i ) {
-		fprintf(stderr, "Error creating xar iterator\n");
+	if( xar_toc_walk(x, list_entry, list_files) != 0 ) {
+		fprintf(stderr, "Error reading the TOC of xar archive: %s\n", filename);
 		exit(1);
 	}
 
-	for(f = xar_file_first(x, i); f; f = xar_file_next(i)) {
-		int matched = 0;
-
-		if( args[0] ) {
-			char *path = xar_get_path(f);
-			for(lnodei = list_files; lnodei != NULL; lnodei = lnodei->next) {
-				int list_match = 1;
-
-				list_match = regexec(&lnodei->reg, path, 0, NULL, 0);
-				if( !list_match ) {
-					matched = 1;
-					break;
-				}
-			}
-			free(path);
-		} else {
-			matched = 1;
-		}
-
-		if( matched )
-			print_file(x, f, stdout);
-	}
-
-	xar_iter_free(i);
 	xar_close(x);
 
 	for(lnodei = list_files; lnodei != NULL; ) {
@@ -1742,18 +1795,21 @@ static int32_t err_callback(int32_t sev, int32_t err, xar_errctx_t ctx, void *us
 }
 
 static void _usagehint(const char *prog, FILE *helpout) {
-	fprintf(helpout, "Usage: %s -[ctx][v] -f <archive> ...\n", prog);
+	fprintf(helpout, "Usage: %s -[ctux][v] -f <archive> ...\n", prog);
 	fprintf(helpout, "(Use %s --help for extended help)\n", prog);
 }
 
 static void _usage(const char *prog, FILE *helpout) {
-	fprintf(helpout, "Usage: %s -[ctx][v] -f <archive> ...\n", prog);
+	fprintf(helpout, "Usage: %s -[ctux][v] -f <archive> ...\n", prog);
 	fprintf(helpout, "\t-c               Creates an archive\n");
 	fprintf(helpout, "\t--create         Synonym for \"-c\"\n");
 	fprintf(helpout, "\t-x               Extracts an archive\n");
 	fprintf(helpout, "\t--extract        Synonym for \"-x\"\n");
 	fprintf(helpout, "\t-t               Lists an archive\n");
 	fprintf(helpout, "\t--list           Synonym for \"-t\"\n");
+	fprintf(helpout, "\t-u               Adds files to an archive, replacing those\n");
+	fprintf(helpout, "\t                 that have changed, without rewriting its data\n");
+	fprintf(helpout, "\t--update         Synonym for \"-u\"\n");
 	fprintf(helpout, "\t--sign           Creates a placeholder signature and saves\n");
 	fprintf(helpout, "\t                 the data to sign to disk. Works with -c or -f, requires\n");
 	fprintf(helpout, "\t                 --sig-size and one or more --cert-loc to be set.\n");
@@ -1817,14 +1873,37 @@ static void _usage(const char *prog, FILE *helpout) {
 	fprintf(helpout, "\t                      header data into the specified file.\n");
 	fprintf(helpout, "\t--dump-header    Prints out the xar binary header information\n");
 	fprintf(helpout, "\t--compression    Specifies the compression type to use.\n");
-	fprintf(helpout, "\t                      Valid values: none, gzip, bzip2, lzma, xz\n");
+	fprintf(helpout, "\t                      Valid values: none, gzip, bzip2, lzma, xz, zstd, lz4, auto\n");
 	fprintf(helpout, "\t                      Default: gzip\n");
 	fprintf(helpout, "\t-a               Synonym for \"--compression=lzma\"\n");
 	fprintf(helpout, "\t-j               Synonym for \"--compression=bzip2\"\n");
 	fprintf(helpout, "\t-z               Synonym for \"--compression=gzip\"\n");
 	fprintf(helpout, "\t--compression-args=arg Specifies arguments to be passed\n");
 	fprintf(helpout, "\t                       to the compression engine.\n");
+	fprintf(helpout, "\t--auto-fast=type   Fast compression type for --compression=auto\n");
+	fprintf(helpout, "\t--auto-strong=type Strong compression type for --compression=auto\n");
+	fprintf(helpout, "\t--auto-fast-args=arg   --compression-args for the fast type\n");
+	fprintf(helpout, "\t--auto-strong-args=arg --compression-args for the strong type\n");
+	fprintf(helpout, "\t--auto-budget=n    Only use the strong compression type of\n");
+	fprintf(helpout, "\t                      --compression=auto when it compresses\n");
+	fprintf(helpout, "\t                      at least n MB per second\n");
 	fprintf(helpout, "\t--rfc6713        Always use application/zlib for gzip encoding style\n");
+	fprintf(helpout, "\t--threads=n      Number of threads compressing file data on archival\n");
+	fprintf(helpout, "\t                      or extracting files on extraction,\n");
+	fprintf(helpout, "\t                      0 means one per cpu.  Default: 1\n");
+	fprintf(helpout, "\t--chunk-size=n   Compress files larger than n bytes as\n");
+	fprintf(helpout, "\t                      independent chunks of n bytes\n");
+	fprintf(helpout, "\t--mmap           Map the archive into memory on extract and list\n");
+	fprintf(helpout, "\t--toc-cache      Keep the parsed TOC in <archive>.toc-cache, or in\n");
+	fprintf(helpout, "\t                      $XAR_TOC_CACHE_DIR, on extract and list\n");
+	fprintf(helpout, "\t--toc-space=n    Write the heap straight into the archive behind\n");
+	fprintf(helpout, "\t                      n bytes left for the header and toc on archival\n");
+	fprintf(helpout, "\t--dedup-chunks=n Store chunks of about n bytes, cut by content,\n");
+	fprintf(helpout, "\t                      only once in the heap\n");
+	fprintf(helpout, "\t--heap-order=how Lay file data out by path, size or extension\n");
+	fprintf(helpout, "\t                      on archival\n");
+	fprintf(helpout, "\t--heap-profile=file Put the data of the files listed in file\n");
+	fprintf(helpout, "\t                      first on archival\n");
 	fprintf(helpout, "\t--list-subdocs   List the subdocuments in the xml header\n");
 	fprintf(helpout, "\t--extract-subdoc=name Extracts the specified subdocument\n");
 	fprintf(helpout, "\t                      to a document in cwd named <name>.xml\n");
@@ -1950,6 +2029,7 @@ int main(int argc, char *argv[]) {
 		{"create", 0, 0, 'c'},
 		{"extract", 0, 0, 'x'},
 		{"list", 0, 0, 't'},
+		{"update", 0, 0, 'u'},
 		{"file", 1, 0, 'f'},
 		{"directory", 1, 0, 'C'},
 		{"verbose", 0, 0, 'v'},
@@ -1994,6 +2074,19 @@ int main(int argc, char *argv[]) {
 		{"recompress", 0, 0, 33},
 		{"strip-components", 1, 0, 34},
 		{"rfc6713", 0, 0, 35},
+		{"threads", 1, 0, 36},
+		{"chunk-size", 1, 0, 37},
+		{"mmap", 0, 0, 38},
+		{"auto-fast", 1, 0, 39},
+		{"auto-strong", 1, 0, 40},
+		{"auto-budget", 1, 0, 41},
+		{"toc-cache", 0, 0, 42},
+		{"toc-space", 1, 0, 43},
+		{"dedup-chunks", 1, 0, 44},
+		{"heap-order", 1, 0, 45},
+		{"heap-profile", 1, 0, 46},
+		{"auto-fast-args", 1, 0, 47},
+		{"auto-strong-args", 1, 0, 48},
 		{ 0, 0, 0, 0}
 	};
 
@@ -2011,7 +2104,7 @@ int main(int argc, char *argv[]) {
 	if (xar_lib_version < XAR_VERSION_NUM)
 		fprintf(stderr, "%s: warning: linked xar library version older than %s executable\n", argv0, argv0);
 
-	while( (c = getopt_long(argc, argv, "axcVOC:vtjzf:hpPln:s:d:k", o, &loptind)) != -1 ) {
+	while( (c = getopt_long(argc, argv, "axcuVOC:vtjzf:hpPln:s:d:k", o, &loptind)) != -1 ) {
 		switch(c) {
 		case  1 :
 		{
@@ -2045,16 +2138,8 @@ int main(int argc, char *argv[]) {
 				fprintf(stderr, "\n--compression requires an argument\n");
 		          	exit(1);
 		          }
-		          if( (strcmp(optarg, XAR_OPT_VAL_NONE) != 0) &&
-		              (strcmp(optarg, XAR_OPT_VAL_GZIP) != 0)
-#ifdef HAVE_LIBBZ2
-		              && (strcmp(optarg, XAR_OPT_VAL_BZIP) != 0)
-#endif
-#ifdef HAVE_LIBLZMA
-		              && (strcmp(optarg, XAR_OPT_VAL_LZMA) != 0)
-		              && (strcmp(optarg, XAR_OPT_VAL_XZ) != 0)
-#endif
-		          ) {
+		          if( !known_compression(optarg) &&
+		              (strcmp(optarg, XAR_OPT_VAL_AUTO) != 0) ) {
 				usagehint(argv0);
 				fprintf(stderr, "\nThis instance of xar doesn't understand compression type %s\n", optarg);
 				exit(1);
@@ -2450,6 +2535,141 @@ int main(int argc, char *argv[]) {
 		case 35 :
 			RFC6713++;
 			break;
+		case 36 :
+		{
+			long threads;
+			char *endptr;
+			if( !optarg ) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--threads requires an argument\n");
+				exit(1);
+			}
+			threads = strtol(optarg, &endptr, 0);
+			if (!*optarg || *endptr || threads < 0) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--threads requires a non-negative number argument\n");
+				exit(1);
+			}
+			Threads = optarg;
+			break;
+		}
+		case 37 :
+		{
+			long long chunksize;
+			char *endptr;
+			if( !optarg ) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--chunk-size requires an argument\n");
+				exit(1);
+			}
+			chunksize = strtoll(optarg, &endptr, 0);
+			if (!*optarg || *endptr || chunksize <= 0) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--chunk-size requires a positive number argument\n");
+				exit(1);
+			}
+			ChunkSize = optarg;
+			break;
+		}
+		case 38 :
+			Mmap++;
+			break;
+		case 39 :
+		case 40 :
+			if( !optarg || !known_compression(optarg) ) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--%s requires a compression type this instance of xar understands\n", c == 39 ? "auto-fast" : "auto-strong");
+				exit(1);
+			}
+			if( c == 39 )
+				AutoFast = optarg;
+			else
+				AutoStrong = optarg;
+			break;
+		case 41 :
+		{
+			long long budget;
+			char *endptr;
+			if( !optarg ) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--auto-budget requires an argument\n");
+				exit(1);
+			}
+			budget = strtoll(optarg, &endptr, 0);
+			if (!*optarg || *endptr || budget < 0) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--auto-budget requires a non-negative number argument\n");
+				exit(1);
+			}
+			AutoBudget = optarg;
+			break;
+		}
+		case 42 :
+			TocCache++;
+			break;
+		case 43 :
+		{
+			long long space;
+			char *endptr;
+			if( !optarg ) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--toc-space requires an argument\n");
+				exit(1);
+			}
+			space = strtoll(optarg, &endptr, 0);
+			if (!*optarg || *endptr || space <= 0) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--toc-space requires a positive number argument\n");
+				exit(1);
+			}
+			TocSpace = optarg;
+			break;
+		}
+		case 44 :
+		{
+			long long avg;
+			char *endptr;
+			if( !optarg ) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--dedup-chunks requires an argument\n");
+				exit(1);
+			}
+			avg = strtoll(optarg, &endptr, 0);
+			if (!*optarg || *endptr || avg <= 0) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--dedup-chunks requires a positive number argument\n");
+				exit(1);
+			}
+			DedupChunks = optarg;
+			break;
+		}
+		case 45 :
+			if( !optarg ) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--heap-order requires an argument\n");
+				exit(1);
+			}
+			if( (strcmp(optarg, XAR_OPT_VAL_PATH) != 0) && (strcmp(optarg, XAR_OPT_VAL_SIZE) != 0) && (strcmp(optarg, XAR_OPT_VAL_EXTENSION) != 0) ) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--heap-order requires one of \"%s\", \"%s\" or \"%s\"\n", XAR_OPT_VAL_PATH, XAR_OPT_VAL_SIZE, XAR_OPT_VAL_EXTENSION);
+				exit(1);
+			}
+			HeapOrder = optarg;
+			break;
+		case 46 :
+			if( !optarg ) {
+				usagehint(argv0);
+				fprintf(stderr, "\n--heap-profile requires an argument\n");
+				exit(1);
+			}
+			HeapProfile = optarg;
+			break;
+		case 47 :
+			AutoFastArg = optarg;
+			break;
+		case 48 :
+			AutoStrongArg = optarg;
+			break;
 		case 'C': if( !optarg ) {
 				usagehint(argv0);
 				fprintf(stderr, "\n-C requires an argument\n");
@@ -2460,6 +2680,7 @@ int main(int argc, char *argv[]) {
 		case 'c':
 		case 'x':
 		case 't':
+		case 'u':
 			if( command && (command != 's') ) {
 				usagehint(argv0);
 				fprintf(stderr, "\nConflicting commands: -%c and -%c specified\n", c, command);
@@ -2545,6 +2766,12 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, "%s: warning: The md5 hash is obsolete and should not be used anymore -- continuing anyway\n", argv0);
 	}
 
+	if (command == 'u' && (DoSign || TocSpace)) {
+		usagehint(argv0);
+		fprintf(stderr, "\nNeither --sign nor --toc-space may be used with -u\n");
+		exit(1);
+	}
+
 	if (! required_dash_f)	{
 		usagehint(argv0);
 		fprintf(stderr, "\n-f option is REQUIRED\n");
@@ -2595,7 +2822,7 @@ int main(int argc, char *argv[]) {
 			usage(argv0);
 			exit(1);
 		}
-		xar_t x = xar_open(filename, READ);
+		xar_t x = xar_open(filename, READ | XAR_OPEN_LAZY);
 		if ( x == NULL ) {
 			fprintf(stderr, "%s: Could not open archive %s!\n", argv0, filename);
 			exit(1);
@@ -2637,7 +2864,19 @@ int main(int argc, char *argv[]) {
 			for( i = 0; i < arglen; i++ )
 				args[i] = strdup(argv[optind + i]);
 
-			return archive(filename, arglen, args);
+			return archive(filename, arglen, args, 0);
+		case 'u':
+			if( optind == argc ) {
+				usagehint(argv0);
+				fprintf(stderr, "\nNo files to operate on\n");
+				exit(1);
+			}
+			arglen = argc - optind;
+			args = calloc(sizeof(char*) * (arglen+1), 1);
+			for( i = 0; i < arglen; i++ )
+				args[i] = strdup(argv[optind + i]);
+
+			return archive(filename, arglen, args, 1);
 		case 'd':
 			if( !tocfile ) {
 				usagehint(argv0);
@@ -2667,9 +2906,11 @@ int main(int argc, char *argv[]) {
 			ret = list(filename, arglen, args);
 			for( i = 0; i < arglen; i++ )
 				free(args[i]);
+			free(args);
+			exit(ret);
 		case 'S':
 		case 's':
-			x = xar_open(filename, READ);
+			x = xar_open(filename, READ | XAR_OPEN_LAZY);
 			if( !x ) {
 				fprintf(stderr, "%s: Error opening xar archive: %s\n", argv0, filename);
 				exit(1);